@@ -25,13 +25,83 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/usb.h>
+#include <linux/usb/storage.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #define STUB_BUSID_OTHER 0
 #define STUB_BUSID_REMOV 1
 #define STUB_BUSID_ADDED 2
 #define STUB_BUSID_ALLOC 3
 
+/* protocol extensions usbip-host can be asked for */
+#define STUB_FEATURES (USBIP_FEAT_STREAMS | USBIP_FEAT_CHUNKED | \
+		       USBIP_FEAT_INT_POLL | USBIP_FEAT_ISO_COMPACT | \
+		       USBIP_FEAT_HEARTBEAT | USBIP_FEAT_TIMESTAMPS | \
+		       USBIP_FEAT_COMPACT_HDR | USBIP_FEAT_COMPRESS)
+
+/*
+ * With USBIP_FEAT_CHUNKED, bulk URBs larger than this are split into
+ * sub-URBs of this size. It is a multiple of any bulk wMaxPacketSize.
+ */
+#define STUB_CHUNK_SIZE (64 * 1024)
+
+/* URBs kept submitted to a polled interrupt IN endpoint */
+#define STUB_POLL_URBS 2
+
+/* polling of an interrupt IN endpoint, see stub_poll.c */
+struct stub_poll {
+	int running;
+	int busy;
+	struct urb *urbs[STUB_POLL_URBS];
+};
+
+/* largest READ read ahead, by the default max_sectors of usb-storage */
+#define STUB_RA_MAX_LEN (120 * 1024)
+#define STUB_RA_MAX_LEN_SS (1024 * 1024)
+
+enum stub_ra_state {
+	STUB_RA_IDLE,
+	STUB_RA_CBW,	/* prefetch in flight */
+	STUB_RA_DATA,
+	STUB_RA_CSW,
+	STUB_RA_READY,	/* data and CSW of the predicted READ are held */
+	STUB_RA_SERVE,	/* answering the client from them */
+};
+
+/* read-ahead of mass storage Bulk-Only Transport, see stub_ra.c */
+struct stub_ra {
+	spinlock_t lock;
+	int enabled;
+	enum stub_ra_state state;
+
+	int ep_out;
+	int ep_in;
+
+	/* the last READ from the client, and where the next should start */
+	struct bulk_cb_wrap cbw;
+	u64 next_lba;
+	int seq;
+
+	/* prefetch, cbw_urb holds the predicted CBW */
+	struct urb *cbw_urb;
+	struct urb *data_urb;
+	struct urb *csw_urb;
+	void *buf;
+	unsigned int buf_len;
+	unsigned int data_len;
+	unsigned int served;
+	u32 tag;
+	u32 client_tag;
+
+	/* CBW from the client waiting for the prefetch in flight */
+	struct stub_priv *held;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long discards;
+};
+
 struct stub_device {
 	struct usb_device *udev;
 
@@ -58,7 +128,36 @@ struct stub_device {
 	struct list_head unlink_tx;
 	struct list_head unlink_free;
 
+	/* chunked stub_priv with IN data to send ahead, by chunk_list */
+	struct list_head priv_chunk;
+
+	/* USBIP_FEAT_INT_POLL, by endpoint number */
+	struct stub_poll poll[USB_MAXENDPOINTS / 2];
+	/* completed poll URBs to send, by urb_list */
+	struct list_head poll_tx;
+	/* endpoints to tell the client that they are not polled */
+	unsigned long poll_stopped;
+
 	wait_queue_head_t tx_waitq;
+
+	/*
+	 * Stream count requested by the peer for each bulk endpoint. The
+	 * local host controller may grant fewer than this.
+	 */
+	unsigned int num_streams[2][USB_MAXENDPOINTS / 2];
+
+	struct stub_ra ra;
+
+	/*
+	 * Special requests run by stub_tweak_work() and URBs held behind
+	 * them, by tweak_entry. tweak_busy has the endpoints of those and of
+	 * tweak_cur, the one running, see stub_tweak_ep().
+	 */
+	spinlock_t tweak_lock;
+	struct list_head tweak_list;
+	struct stub_priv *tweak_cur;
+	u32 tweak_busy;
+	struct work_struct tweak_work;
 };
 
 /* private data into urb->priv */
@@ -69,12 +168,40 @@ struct stub_priv {
 	struct urb *urb;
 
 	int unlinking;
+
+	/*
+	 * For usbip_stats_latency() and USBIP_FEAT_TIMESTAMPS, zero if not
+	 * known. Once unlinking, received is that of CMD_UNLINK.
+	 */
+	ktime_t received;
+	ktime_t submitted;
+	ktime_t completed;
+
+	/*
+	 * Sub-URBs of a chunked transfer sharing the buffer of urb, which
+	 * itself is not submitted. See stub_recv_cmd_submit_chunked().
+	 */
+	struct urb **chunks;
+	int nr_chunks;
+	int completed_chunks;
+	int chunk_status;
+	unsigned int chunk_done;
+	unsigned int chunk_sent;
+	struct list_head chunk_list;
+
+	/* in sdev->tweak_list, with the endpoints it holds back */
+	struct list_head tweak_entry;
+	u32 tweak_mask;
 };
 
 struct stub_unlink {
 	unsigned long seqnum;
 	struct list_head list;
 	__u32 status;
+
+	/* for USBIP_FEAT_TIMESTAMPS, see struct usbip_stamps */
+	ktime_t received;
+	ktime_t completed;
 };
 
 /* same as SYSFS_BUS_ID_SIZE */
@@ -92,6 +219,9 @@ struct bus_id_priv {
 /* stub_priv is allocated from stub_priv_cache */
 extern struct kmem_cache *stub_priv_cache;
 
+/* runs stub_tweak_work() of each device */
+extern struct workqueue_struct *stub_tweak_wq;
+
 /* stub_dev.c */
 extern struct usb_device_driver stub_driver;
 
@@ -102,11 +232,37 @@ void stub_device_cleanup_urbs(struct stub_device *sdev);
 
 /* stub_rx.c */
 int stub_rx_loop(void *data);
+void stub_tweak_work(struct work_struct *work);
+void stub_tweak_cleanup(struct stub_device *sdev);
+
+/* stub_poll.c */
+void stub_poll_start(struct stub_device *sdev, unsigned int pipe, int length,
+		     int interval);
+void stub_poll_stop(struct stub_device *sdev, int epnum);
+void stub_poll_stop_all(struct stub_device *sdev);
+void stub_poll_complete(struct urb *urb);
+void stub_poll_sent(struct stub_device *sdev, struct urb *urb);
+void stub_poll_cleanup(struct stub_device *sdev);
+
+/* stub_ra.c */
+int stub_ra_enable(struct stub_device *sdev, int enable);
+int stub_ra_submit(struct stub_device *sdev, struct stub_priv *priv);
+void stub_ra_complete(struct stub_device *sdev, struct urb *urb);
+void stub_ra_complete_cbw(struct urb *urb);
+void stub_ra_complete_data(struct urb *urb);
+void stub_ra_complete_csw(struct urb *urb);
+int stub_ra_unlink(struct stub_device *sdev, struct stub_priv *priv);
+void stub_ra_cleanup(struct stub_device *sdev);
+void stub_ra_free(struct stub_device *sdev);
 
 /* stub_tx.c */
 void stub_enqueue_ret_unlink(struct stub_device *sdev, __u32 seqnum,
-			     __u32 status);
+			     __u32 status, struct stub_priv *priv);
 void stub_complete(struct urb *urb);
+void stub_complete_chunk(struct urb *chunk);
+void stub_account_chunk(struct stub_priv *priv);
+void stub_unlink_chunks(struct stub_priv *priv, struct urb *chunk);
+void stub_free_chunks(struct stub_priv *priv);
 int stub_tx_loop(void *data);
 
 #endif /* __USBIP_STUB_H */
@@ -22,6 +22,7 @@
 #include <linux/file.h>
 #include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/seq_file.h>
 
 #include "usbip_common.h"
 #include "stub.h"
@@ -52,13 +53,15 @@ static DEVICE_ATTR_RO(usbip_status);
 /*
  * usbip_sockfd gets a socket descriptor of an established TCP connection that
  * is used to transfer usbip requests by kernel threads. -1 is a magic number
- * by which usbip connection is finished.
+ * by which usbip connection is finished. The descriptor may be followed by
+ * a hex mask of negotiated protocol extensions (USBIP_FEAT_*).
  */
 static ssize_t store_sockfd(struct device *dev, struct device_attribute *attr,
 			    const char *buf, size_t count)
 {
 	struct stub_device *sdev = dev_get_drvdata(dev);
 	int sockfd = 0;
+	unsigned int features = 0;
 	int rv;
 
 	if (!sdev) {
@@ -66,12 +69,18 @@ static ssize_t store_sockfd(struct device *dev, struct device_attribute *attr,
 		return -ENODEV;
 	}
 
-	rv = sscanf(buf, "%d", &sockfd);
-	if (rv != 1)
+	rv = sscanf(buf, "%d %x", &sockfd, &features);
+	if (rv < 1)
 		return -EINVAL;
 
+	if (features & ~STUB_FEATURES) {
+		dev_err(dev, "unsupported features %x\n",
+			features & ~STUB_FEATURES);
+		return -EINVAL;
+	}
+
 	if (sockfd != -1) {
-		dev_info(dev, "stub up\n");
+		dev_info(dev, "stub up, features %x\n", features);
 
 		spin_lock_irq(&sdev->ud.lock);
 
@@ -84,6 +93,11 @@ static ssize_t store_sockfd(struct device *dev, struct device_attribute *attr,
 		if (rv)
 			goto err;
 
+		sdev->ud.features = features;
+		usbip_hb_init(&sdev->ud);
+		usbip_compact_hdr_init(&sdev->ud, sdev->devid);
+		memset(sdev->num_streams, 0, sizeof(sdev->num_streams));
+
 		spin_unlock_irq(&sdev->ud.lock);
 
 		sdev->ud.tcp_rx = kthread_get_run(stub_rx_loop, &sdev->ud,
@@ -115,6 +129,107 @@ err:
 }
 static DEVICE_ATTR(usbip_sockfd, S_IWUSR, NULL, store_sockfd);
 
+/*
+ * usbip_readahead turns read-ahead of mass storage Bulk-Only Transport on
+ * (1) or off (0). It is off by default.
+ */
+static ssize_t usbip_readahead_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev) {
+		dev_err(dev, "sdev is null\n");
+		return -ENODEV;
+	}
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(sdev->ra.enabled));
+}
+
+static ssize_t usbip_readahead_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	int enable;
+	int rv;
+
+	if (!sdev) {
+		dev_err(dev, "sdev is null\n");
+		return -ENODEV;
+	}
+
+	if (kstrtoint(buf, 10, &enable))
+		return -EINVAL;
+
+	rv = stub_ra_enable(sdev, enable);
+	if (rv)
+		return rv;
+
+	return count;
+}
+static DEVICE_ATTR_RW(usbip_readahead);
+
+static ssize_t usbip_readahead_stats_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	unsigned long hits, misses, discards;
+
+	if (!sdev) {
+		dev_err(dev, "sdev is null\n");
+		return -ENODEV;
+	}
+
+	spin_lock_irq(&sdev->ra.lock);
+	hits = sdev->ra.hits;
+	misses = sdev->ra.misses;
+	discards = sdev->ra.discards;
+	spin_unlock_irq(&sdev->ra.lock);
+
+	return snprintf(buf, PAGE_SIZE, "hits %lu misses %lu discards %lu\n",
+			hits, misses, discards);
+}
+static DEVICE_ATTR_RO(usbip_readahead_stats);
+
+/*
+ * usbip_sched places the rx and tx threads, see usbip_sched.c. It is kept
+ * over connections while the device is bound.
+ */
+static ssize_t usbip_sched_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev) {
+		dev_err(dev, "sdev is null\n");
+		return -ENODEV;
+	}
+
+	return usbip_sched_print(&sdev->ud, buf, PAGE_SIZE);
+}
+
+static ssize_t usbip_sched_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	int rv;
+
+	if (!sdev) {
+		dev_err(dev, "sdev is null\n");
+		return -ENODEV;
+	}
+
+	rv = usbip_sched_set(&sdev->ud, buf);
+	if (rv)
+		return rv;
+
+	return count;
+}
+static DEVICE_ATTR_RW(usbip_sched);
+
 static int stub_add_files(struct device *dev)
 {
 	int err = 0;
@@ -131,8 +246,26 @@ static int stub_add_files(struct device *dev)
 	if (err)
 		goto err_debug;
 
+	err = device_create_file(dev, &dev_attr_usbip_readahead);
+	if (err)
+		goto err_readahead;
+
+	err = device_create_file(dev, &dev_attr_usbip_readahead_stats);
+	if (err)
+		goto err_readahead_stats;
+
+	err = device_create_file(dev, &dev_attr_usbip_sched);
+	if (err)
+		goto err_sched;
+
 	return 0;
 
+err_sched:
+	device_remove_file(dev, &dev_attr_usbip_readahead_stats);
+err_readahead_stats:
+	device_remove_file(dev, &dev_attr_usbip_readahead);
+err_readahead:
+	device_remove_file(dev, &dev_attr_usbip_debug);
 err_debug:
 	device_remove_file(dev, &dev_attr_usbip_sockfd);
 err_sockfd:
@@ -146,6 +279,9 @@ static void stub_remove_files(struct device *dev)
 	device_remove_file(dev, &dev_attr_usbip_status);
 	device_remove_file(dev, &dev_attr_usbip_sockfd);
 	device_remove_file(dev, &dev_attr_usbip_debug);
+	device_remove_file(dev, &dev_attr_usbip_readahead);
+	device_remove_file(dev, &dev_attr_usbip_readahead_stats);
+	device_remove_file(dev, &dev_attr_usbip_sched);
 }
 
 static void stub_shutdown_connection(struct usbip_device *ud)
@@ -182,7 +318,13 @@ static void stub_shutdown_connection(struct usbip_device *ud)
 	}
 
 	/* 3. free used data */
+	stub_tweak_cleanup(sdev);
+	stub_ra_cleanup(sdev);
+	stub_poll_cleanup(sdev);
 	stub_device_cleanup_urbs(sdev);
+	usbip_iso_pool_free(&ud->iso_tx);
+	usbip_iso_pool_free(&ud->iso_rx);
+	usbip_compress_free(ud);
 
 	/* 4. free stub_unlink */
 	{
@@ -232,6 +374,7 @@ static void stub_device_reset(struct usbip_device *ud)
 		dev_info(&udev->dev, "device reset\n");
 		ud->status = SDEV_ST_AVAILABLE;
 	}
+	ud->features = 0;
 	spin_unlock_irq(&ud->lock);
 }
 
@@ -242,6 +385,31 @@ static void stub_device_unusable(struct usbip_device *ud)
 	spin_unlock_irq(&ud->lock);
 }
 
+static void stub_stats_queues(struct usbip_device *ud, struct seq_file *m)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	unsigned int nr_init = 0, nr_tx = 0, nr_free = 0, nr_unlink = 0;
+	struct stub_unlink *unlink;
+	struct stub_priv *priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	list_for_each_entry(priv, &sdev->priv_init, list)
+		nr_init++;
+	list_for_each_entry(priv, &sdev->priv_tx, list)
+		nr_tx++;
+	list_for_each_entry(priv, &sdev->priv_free, list)
+		nr_free++;
+	list_for_each_entry(unlink, &sdev->unlink_tx, list)
+		nr_unlink++;
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	usbip_stats_queue(m, "priv_init", nr_init);
+	usbip_stats_queue(m, "priv_tx", nr_tx);
+	usbip_stats_queue(m, "priv_free", nr_free);
+	usbip_stats_queue(m, "unlink_tx", nr_unlink);
+}
+
 /**
  * stub_device_alloc - allocate a new stub_device struct
  * @udev: usb_device of a new device
@@ -273,13 +441,20 @@ static struct stub_device *stub_device_alloc(struct usb_device *udev)
 	sdev->ud.status		= SDEV_ST_AVAILABLE;
 	spin_lock_init(&sdev->ud.lock);
 	sdev->ud.tcp_socket	= NULL;
+	usbip_sched_init(&sdev->ud);
 
 	INIT_LIST_HEAD(&sdev->priv_init);
 	INIT_LIST_HEAD(&sdev->priv_tx);
 	INIT_LIST_HEAD(&sdev->priv_free);
 	INIT_LIST_HEAD(&sdev->unlink_free);
 	INIT_LIST_HEAD(&sdev->unlink_tx);
+	INIT_LIST_HEAD(&sdev->priv_chunk);
+	INIT_LIST_HEAD(&sdev->poll_tx);
 	spin_lock_init(&sdev->priv_lock);
+	spin_lock_init(&sdev->ra.lock);
+	spin_lock_init(&sdev->tweak_lock);
+	INIT_LIST_HEAD(&sdev->tweak_list);
+	INIT_WORK(&sdev->tweak_work, stub_tweak_work);
 
 	init_waitqueue_head(&sdev->tx_waitq);
 
@@ -287,6 +462,13 @@ static struct stub_device *stub_device_alloc(struct usb_device *udev)
 	sdev->ud.eh_ops.reset    = stub_device_reset;
 	sdev->ud.eh_ops.unusable = stub_device_unusable;
 
+	if (usbip_stats_alloc(&sdev->ud, dev_name(&udev->dev),
+			      stub_stats_queues)) {
+		usb_put_dev(udev);
+		kfree(sdev);
+		return NULL;
+	}
+
 	usbip_start_eh(&sdev->ud);
 
 	dev_dbg(&udev->dev, "register new device\n");
@@ -296,6 +478,8 @@ static struct stub_device *stub_device_alloc(struct usb_device *udev)
 
 static void stub_device_free(struct stub_device *sdev)
 {
+	stub_ra_free(sdev);
+	usbip_stats_free(&sdev->ud);
 	kfree(sdev);
 }
 
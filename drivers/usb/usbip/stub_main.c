@@ -28,6 +28,7 @@
 #define DRIVER_DESC "USB/IP Host Driver"
 
 struct kmem_cache *stub_priv_cache;
+struct workqueue_struct *stub_tweak_wq;
 /*
  * busid_tables defines matching busids that usbip can grab. A user can change
  * dynamically what device is locally used and what device is exported to a
@@ -251,6 +252,7 @@ void stub_device_cleanup_urbs(struct stub_device *sdev)
 {
 	struct stub_priv *priv;
 	struct urb *urb;
+	int i;
 
 	dev_dbg(&sdev->udev->dev, "free sdev %p\n", sdev);
 
@@ -258,6 +260,9 @@ void stub_device_cleanup_urbs(struct stub_device *sdev)
 		urb = priv->urb;
 		dev_dbg(&sdev->udev->dev, "free urb %p\n", urb);
 		usb_kill_urb(urb);
+		for (i = 0; i < priv->nr_chunks; i++)
+			usb_kill_urb(priv->chunks[i]);
+		stub_free_chunks(priv);
 
 		kmem_cache_free(stub_priv_cache, priv);
 
@@ -265,6 +270,8 @@ void stub_device_cleanup_urbs(struct stub_device *sdev)
 		kfree(urb->setup_packet);
 		usb_free_urb(urb);
 	}
+
+	INIT_LIST_HEAD(&sdev->priv_chunk);
 }
 
 static int __init usbip_host_init(void)
@@ -279,6 +286,15 @@ static int __init usbip_host_init(void)
 		return -ENOMEM;
 	}
 
+	/* unbound, so that devices run their special requests in parallel */
+	stub_tweak_wq = alloc_workqueue("usbip_stub_tweak",
+					WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!stub_tweak_wq) {
+		pr_err("alloc_workqueue failed\n");
+		ret = -ENOMEM;
+		goto err_workqueue;
+	}
+
 	ret = usb_register_device_driver(&stub_driver, THIS_MODULE);
 	if (ret) {
 		pr_err("usb_register failed %d\n", ret);
@@ -305,6 +321,8 @@ static int __init usbip_host_init(void)
 err_create_file:
 	usb_deregister_device_driver(&stub_driver);
 err_usb_register:
+	destroy_workqueue(stub_tweak_wq);
+err_workqueue:
 	kmem_cache_destroy(stub_priv_cache);
 	return ret;
 }
@@ -323,6 +341,7 @@ static void __exit usbip_host_exit(void)
 	 */
 	usb_deregister_device_driver(&stub_driver);
 
+	destroy_workqueue(stub_tweak_wq);
 	kmem_cache_destroy(stub_priv_cache);
 }
 
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Polling of interrupt IN endpoints with USBIP_FEAT_INT_POLL.
+ *
+ * Without it, every report of an interrupt IN endpoint costs a round trip:
+ * the client resubmits its URB, and the device is only polled again after
+ * the CMD_SUBMIT has arrived. Here, once the URB from the client has been
+ * submitted, the stub keeps STUB_POLL_URBS URBs of its own submitted to the
+ * endpoint. Each completion is pushed to the client as RET_POLL and the URB
+ * is resubmitted after it has been sent, so that the socket limits how many
+ * reports are buffered here.
+ *
+ * A poll URB belongs to stub_tx from its completion until it has been sent.
+ * poll->busy counts the URBs which are submitted or on their way, and the
+ * URBs of an endpoint are only replaced when none is. Every change of the
+ * polling state is made under priv_lock.
+ */
+
+#include <linux/slab.h>
+#include <linux/usb.h>
+
+#include "usbip_common.h"
+#include "stub.h"
+
+/* be in spin_lock_irqsave(&sdev->priv_lock, flags) */
+static void stub_poll_stopped(struct stub_device *sdev, int epnum)
+{
+	/* stub_tx tells the client to send its URBs again */
+	__set_bit(epnum, &sdev->poll_stopped);
+}
+
+static void stub_poll_free(struct stub_poll *poll)
+{
+	int i;
+
+	for (i = 0; i < STUB_POLL_URBS; i++) {
+		if (!poll->urbs[i])
+			continue;
+		kfree(poll->urbs[i]->transfer_buffer);
+		usb_free_urb(poll->urbs[i]);
+		poll->urbs[i] = NULL;
+	}
+}
+
+/* poll URBs get the length and the interval of the client's URB */
+static int stub_poll_alloc(struct stub_device *sdev, struct stub_poll *poll,
+			   unsigned int pipe, int length, int interval)
+{
+	struct urb *purb;
+	void *buf;
+	int i;
+
+	for (i = 0; i < STUB_POLL_URBS; i++) {
+		purb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!purb)
+			goto err;
+
+		buf = kmalloc(length, GFP_KERNEL);
+		if (!buf) {
+			usb_free_urb(purb);
+			goto err;
+		}
+
+		usb_fill_int_urb(purb, sdev->udev, pipe, buf, length,
+				 stub_poll_complete, sdev, 1);
+		/* already in (micro)frames, as given by the client */
+		purb->interval = interval;
+		poll->urbs[i] = purb;
+	}
+
+	return 0;
+
+err:
+	stub_poll_free(poll);
+	return -ENOMEM;
+}
+
+/**
+ * stub_poll_start - keep an interrupt IN endpoint polled
+ * @sdev: the stub device
+ * @pipe: the endpoint
+ * @length: transfer_buffer_length of the URB from the client
+ * @interval: interval of the URB from the client
+ *
+ * Does nothing if the endpoint is polled already. If it cannot be polled,
+ * the client is told so.
+ */
+void stub_poll_start(struct stub_device *sdev, unsigned int pipe, int length,
+		     int interval)
+{
+	int epnum = usb_pipeendpoint(pipe);
+	struct stub_poll *poll = &sdev->poll[epnum];
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (poll->running) {
+		spin_unlock_irqrestore(&sdev->priv_lock, flags);
+		return;
+	}
+	if (poll->busy) {
+		/* URBs of the last polling are still on their way */
+		goto not_polled;
+	}
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	/* no one else looks at idle poll URBs */
+	stub_poll_free(poll);
+	if (length <= 0 || stub_poll_alloc(sdev, poll, pipe, length, interval)) {
+		spin_lock_irqsave(&sdev->priv_lock, flags);
+		goto not_polled;
+	}
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	for (i = 0; i < STUB_POLL_URBS; i++) {
+		if (usb_submit_urb(poll->urbs[i], GFP_ATOMIC))
+			break;
+		poll->busy++;
+	}
+	if (!poll->busy)
+		goto not_polled;
+
+	poll->running = 1;
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	usbip_dbg_stub_rx("poll ep %d, interval %d\n", epnum, interval);
+	return;
+
+not_polled:
+	stub_poll_stopped(sdev, epnum);
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+	wake_up(&sdev->tx_waitq);
+}
+
+/**
+ * stub_poll_stop - stop polling an endpoint
+ * @sdev: the stub device
+ * @epnum: the endpoint number
+ *
+ * Called by stub_rx before requests which change the endpoints. Reports
+ * completed until now are still sent, followed by a RET_POLL telling the
+ * client that the endpoint is not polled any longer.
+ */
+void stub_poll_stop(struct stub_device *sdev, int epnum)
+{
+	struct stub_poll *poll = &sdev->poll[epnum];
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (!poll->running) {
+		spin_unlock_irqrestore(&sdev->priv_lock, flags);
+		return;
+	}
+	poll->running = 0;
+	stub_poll_stopped(sdev, epnum);
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	/* stub_tx does not resubmit them as running is cleared */
+	for (i = 0; i < STUB_POLL_URBS; i++)
+		usb_kill_urb(poll->urbs[i]);
+
+	wake_up(&sdev->tx_waitq);
+}
+
+void stub_poll_stop_all(struct stub_device *sdev)
+{
+	int epnum;
+
+	for (epnum = 1; epnum < USB_MAXENDPOINTS / 2; epnum++)
+		stub_poll_stop(sdev, epnum);
+}
+
+void stub_poll_complete(struct urb *urb)
+{
+	struct stub_device *sdev = urb->context;
+	struct stub_poll *poll = &sdev->poll[usb_pipeendpoint(urb->pipe)];
+	unsigned long flags;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (urb->status == -ENOENT || !sdev->ud.tcp_socket) {
+		/* killed by stub_poll_stop() or at cleanup */
+		poll->busy--;
+	} else {
+		/* urb_list is for the owner of a completed urb */
+		list_add_tail(&urb->urb_list, &sdev->poll_tx);
+	}
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	wake_up(&sdev->tx_waitq);
+}
+
+/**
+ * stub_poll_sent - stub_tx has sent a poll URB
+ * @sdev: the stub device
+ * @urb: the poll URB
+ *
+ * The URB is resubmitted unless polling has been stopped. An error ends
+ * polling, the client learns about it from the report just sent.
+ */
+void stub_poll_sent(struct stub_device *sdev, struct urb *urb)
+{
+	int epnum = usb_pipeendpoint(urb->pipe);
+	struct stub_poll *poll = &sdev->poll[epnum];
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (poll->running && !urb->status) {
+		ret = usb_submit_urb(urb, GFP_ATOMIC);
+		if (!ret) {
+			spin_unlock_irqrestore(&sdev->priv_lock, flags);
+			return;
+		}
+		dev_dbg(&sdev->udev->dev, "resubmit poll ep %d, %d\n", epnum,
+			ret);
+		poll->running = 0;
+		stub_poll_stopped(sdev, epnum);
+	} else if (urb->status) {
+		poll->running = 0;
+	}
+	poll->busy--;
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+}
+
+/* called when the connection is shut down, after the threads stopped */
+void stub_poll_cleanup(struct stub_device *sdev)
+{
+	unsigned long flags;
+	int epnum, i;
+
+	for (epnum = 0; epnum < USB_MAXENDPOINTS / 2; epnum++)
+		for (i = 0; i < STUB_POLL_URBS; i++)
+			usb_kill_urb(sdev->poll[epnum].urbs[i]);
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	INIT_LIST_HEAD(&sdev->poll_tx);
+	sdev->poll_stopped = 0;
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	for (epnum = 0; epnum < USB_MAXENDPOINTS / 2; epnum++) {
+		stub_poll_free(&sdev->poll[epnum]);
+		sdev->poll[epnum].running = 0;
+		sdev->poll[epnum].busy = 0;
+	}
+}
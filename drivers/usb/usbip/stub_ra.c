@@ -0,0 +1,587 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Read-ahead for USB mass storage Bulk-Only Transport.
+ *
+ * BOT runs one command at a time: CBW on bulk OUT, data, then CSW on bulk IN.
+ * When two READ(10) or READ(16) commands in a row are sequential, the stub
+ * issues the next one to the device by itself as soon as the CSW of the
+ * current one has completed. The data and the CSW are kept until the next
+ * CBW comes from the client. If it is the predicted one, the CBW, the data
+ * and the CSW are answered from what was read ahead. Otherwise the prefetched
+ * data is dropped and the CBW goes to the device. The device is idle in both
+ * cases, as the prefetched command has completed on it.
+ *
+ * A CBW arriving while a prefetch is in flight is held until it finishes.
+ * A prefetch which fails at the USB level leaves the device in an unknown
+ * BOT state, so read-ahead is turned off until it is enabled again.
+ */
+
+#include <asm/unaligned.h>
+#include <linux/usb.h>
+#include <linux/usb/storage.h>
+#include <scsi/scsi_proto.h>
+
+#include "usbip_common.h"
+#include "stub.h"
+
+/* the top bit tells tags of prefetched commands from those of the client */
+#define STUB_RA_TAG 0x80000000
+
+enum {
+	STUB_RA_PASS,	/* submit the request to the device */
+	STUB_RA_HELD,	/* held until the prefetch in flight finishes */
+	STUB_RA_DONE,	/* answered from read-ahead, complete it */
+};
+
+static struct bulk_cb_wrap *urb_to_cbw(struct urb *urb)
+{
+	struct bulk_cb_wrap *cbw = urb->transfer_buffer;
+
+	if (!usb_pipeout(urb->pipe) ||
+	    urb->transfer_buffer_length != US_BULK_CB_WRAP_LEN ||
+	    le32_to_cpu(cbw->Signature) != US_BULK_CB_SIGN)
+		return NULL;
+
+	return cbw;
+}
+
+/* returns the next LBA after a READ command, 0 for any other command */
+static u64 cbw_read_end(struct bulk_cb_wrap *cbw, u64 *lba)
+{
+	u32 blocks;
+
+	if (!(cbw->Flags & US_BULK_FLAG_IN))
+		return 0;
+
+	switch (cbw->CDB[0]) {
+	case READ_10:
+		*lba = get_unaligned_be32(&cbw->CDB[2]);
+		blocks = get_unaligned_be16(&cbw->CDB[7]);
+		break;
+	case READ_16:
+		*lba = get_unaligned_be64(&cbw->CDB[2]);
+		blocks = get_unaligned_be32(&cbw->CDB[10]);
+		break;
+	default:
+		return 0;
+	}
+
+	return blocks ? *lba + blocks : 0;
+}
+
+static void cbw_set_lba(struct bulk_cb_wrap *cbw, u64 lba)
+{
+	if (cbw->CDB[0] == READ_10)
+		put_unaligned_be32(lba, &cbw->CDB[2]);
+	else
+		put_unaligned_be64(lba, &cbw->CDB[2]);
+}
+
+/* be in spin_lock_irqsave(&ra->lock, flags) */
+static void stub_ra_track(struct stub_ra *ra, struct bulk_cb_wrap *cbw)
+{
+	u64 lba = 0;
+	u64 end = cbw_read_end(cbw, &lba);
+
+	if (!end || le32_to_cpu(cbw->DataTransferLength) > ra->buf_len) {
+		ra->seq = 0;
+		ra->next_lba = 0;
+		return;
+	}
+
+	ra->seq = (cbw->Lun == ra->cbw.Lun && lba == ra->next_lba);
+	ra->next_lba = end;
+	memcpy(&ra->cbw, cbw, US_BULK_CB_WRAP_LEN);
+}
+
+/* be in spin_lock_irqsave(&ra->lock, flags) */
+static void stub_ra_stop(struct stub_device *sdev, const char *why)
+{
+	struct stub_ra *ra = &sdev->ra;
+
+	dev_warn(&sdev->udev->dev, "read-ahead off: %s\n", why);
+	ra->enabled = 0;
+	ra->state = STUB_RA_IDLE;
+	ra->seq = 0;
+}
+
+/* be in spin_lock_irqsave(&ra->lock, flags) */
+static void stub_ra_start(struct stub_device *sdev)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct usb_device *udev = sdev->udev;
+	struct bulk_cb_wrap *pcbw = ra->cbw_urb->transfer_buffer;
+	int ret;
+
+	if (!ra->enabled || !ra->seq || ra->state != STUB_RA_IDLE ||
+	    !ra->ep_in)
+		return;
+
+	memcpy(pcbw, &ra->cbw, US_BULK_CB_WRAP_LEN);
+	pcbw->Tag = STUB_RA_TAG | ra->tag++;
+	cbw_set_lba(pcbw, ra->next_lba);
+
+	usb_fill_bulk_urb(ra->cbw_urb, udev,
+			  usb_sndbulkpipe(udev, ra->ep_out), pcbw,
+			  US_BULK_CB_WRAP_LEN, stub_ra_complete_cbw, sdev);
+	ret = usb_submit_urb(ra->cbw_urb, GFP_ATOMIC);
+	if (ret) {
+		dev_dbg(&udev->dev, "read-ahead cbw, %d\n", ret);
+		return;
+	}
+
+	ra->state = STUB_RA_CBW;
+}
+
+/*
+ * Decides on a CBW from the client.
+ * be in spin_lock_irqsave(&ra->lock, flags)
+ */
+static int stub_ra_recv_cbw(struct stub_device *sdev, struct stub_priv *priv,
+			    struct bulk_cb_wrap *cbw)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct bulk_cb_wrap *pcbw = ra->cbw_urb->transfer_buffer;
+	struct urb *urb = priv->urb;
+
+	ra->ep_out = usb_pipeendpoint(urb->pipe);
+
+	switch (ra->state) {
+	case STUB_RA_CBW:
+	case STUB_RA_DATA:
+	case STUB_RA_CSW:
+		if (ra->held)
+			break;
+		ra->held = priv;
+		return STUB_RA_HELD;
+	case STUB_RA_READY:
+		/* all but the tag must be what was read ahead */
+		if (!memcmp(&cbw->DataTransferLength,
+			    &pcbw->DataTransferLength,
+			    US_BULK_CB_WRAP_LEN -
+			    offsetof(struct bulk_cb_wrap,
+				     DataTransferLength))) {
+			ra->hits++;
+			ra->state = STUB_RA_SERVE;
+			ra->served = 0;
+			ra->client_tag = cbw->Tag;
+			stub_ra_track(ra, cbw);
+
+			urb->actual_length = US_BULK_CB_WRAP_LEN;
+			urb->status = 0;
+			return STUB_RA_DONE;
+		}
+		ra->misses++;
+		ra->state = STUB_RA_IDLE;
+		break;
+	case STUB_RA_SERVE:
+		/* the client gave up the command being served */
+		ra->discards++;
+		ra->state = STUB_RA_IDLE;
+		break;
+	default:
+		break;
+	}
+
+	stub_ra_track(ra, cbw);
+	return STUB_RA_PASS;
+}
+
+/*
+ * Gives the data, then the CSW, of a hit to IN requests of the client.
+ * be in spin_lock_irqsave(&ra->lock, flags)
+ */
+static int stub_ra_serve(struct stub_device *sdev, struct urb *urb)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct bulk_cs_wrap *csw;
+	unsigned int len;
+
+	if (ra->served < ra->data_len) {
+		len = min_t(unsigned int, urb->transfer_buffer_length,
+			    ra->data_len - ra->served);
+		memcpy(urb->transfer_buffer, ra->buf + ra->served, len);
+		ra->served += len;
+
+		urb->actual_length = len;
+		urb->status = 0;
+		return STUB_RA_DONE;
+	}
+
+	if (urb->transfer_buffer_length < US_BULK_CS_WRAP_LEN) {
+		ra->discards++;
+		ra->state = STUB_RA_IDLE;
+		return STUB_RA_PASS;
+	}
+
+	csw = urb->transfer_buffer;
+	memcpy(csw, ra->csw_urb->transfer_buffer, US_BULK_CS_WRAP_LEN);
+	csw->Tag = ra->client_tag;
+
+	urb->actual_length = US_BULK_CS_WRAP_LEN;
+	urb->status = 0;
+
+	/* the device has been idle since the prefetch, go on reading */
+	ra->state = STUB_RA_IDLE;
+	stub_ra_start(sdev);
+
+	return STUB_RA_DONE;
+}
+
+/**
+ * stub_ra_submit - let read-ahead look at a request from the client
+ * @sdev: the stub device
+ * @priv: the request ready to be submitted
+ *
+ * Returns non-zero when the request has been taken, either answered from
+ * read-ahead or held. Otherwise the caller submits it as usual.
+ */
+int stub_ra_submit(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct urb *urb = priv->urb;
+	struct bulk_cb_wrap *cbw;
+	unsigned long flags;
+	int ret = STUB_RA_PASS;
+
+	if (!usb_pipebulk(urb->pipe))
+		return 0;
+
+	/* a prefetch or a hit may still be going on after turned off */
+	if (!READ_ONCE(ra->enabled) && READ_ONCE(ra->state) == STUB_RA_IDLE)
+		return 0;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	cbw = urb_to_cbw(urb);
+	if (cbw)
+		ret = stub_ra_recv_cbw(sdev, priv, cbw);
+	else if (ra->state == STUB_RA_SERVE && usb_pipein(urb->pipe) &&
+		 usb_pipeendpoint(urb->pipe) == ra->ep_in)
+		ret = stub_ra_serve(sdev, urb);
+	spin_unlock_irqrestore(&ra->lock, flags);
+
+	if (ret == STUB_RA_DONE)
+		stub_complete(urb);
+
+	return ret != STUB_RA_PASS;
+}
+
+/*
+ * The prefetch has finished, successfully or not. Decides on the CBW held
+ * meanwhile, if any.
+ */
+static void stub_ra_finish(struct stub_device *sdev)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct stub_priv *priv;
+	unsigned long flags;
+	int ret = STUB_RA_PASS;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	priv = ra->held;
+	ra->held = NULL;
+	if (priv)
+		ret = stub_ra_recv_cbw(sdev, priv,
+				       priv->urb->transfer_buffer);
+	spin_unlock_irqrestore(&ra->lock, flags);
+
+	if (!priv)
+		return;
+
+	if (ret == STUB_RA_DONE) {
+		stub_complete(priv->urb);
+		return;
+	}
+
+	ret = usb_submit_urb(priv->urb, GFP_ATOMIC);
+	if (ret) {
+		dev_err(&sdev->udev->dev, "submit held urb, %d\n", ret);
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_SUBMIT);
+	}
+}
+
+void stub_ra_complete_cbw(struct urb *urb)
+{
+	struct stub_device *sdev = urb->context;
+	struct stub_ra *ra = &sdev->ra;
+	struct usb_device *udev = sdev->udev;
+	struct bulk_cb_wrap *pcbw = urb->transfer_buffer;
+	unsigned long flags;
+	int ret;
+
+	if (urb->status == -ENOENT)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	if (urb->status) {
+		stub_ra_stop(sdev, "cbw failed");
+		goto finish;
+	}
+
+	usb_fill_bulk_urb(ra->data_urb, udev,
+			  usb_rcvbulkpipe(udev, ra->ep_in), ra->buf,
+			  le32_to_cpu(pcbw->DataTransferLength),
+			  stub_ra_complete_data, sdev);
+	ret = usb_submit_urb(ra->data_urb, GFP_ATOMIC);
+	if (ret) {
+		stub_ra_stop(sdev, "submit data");
+		goto finish;
+	}
+	ra->state = STUB_RA_DATA;
+	spin_unlock_irqrestore(&ra->lock, flags);
+	return;
+
+finish:
+	spin_unlock_irqrestore(&ra->lock, flags);
+	stub_ra_finish(sdev);
+}
+
+void stub_ra_complete_data(struct urb *urb)
+{
+	struct stub_device *sdev = urb->context;
+	struct stub_ra *ra = &sdev->ra;
+	struct usb_device *udev = sdev->udev;
+	unsigned long flags;
+	int ret;
+
+	if (urb->status == -ENOENT)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	if (urb->status) {
+		stub_ra_stop(sdev, "data failed");
+		goto finish;
+	}
+	ra->data_len = urb->actual_length;
+
+	usb_fill_bulk_urb(ra->csw_urb, udev,
+			  usb_rcvbulkpipe(udev, ra->ep_in),
+			  ra->csw_urb->transfer_buffer, US_BULK_CS_WRAP_LEN,
+			  stub_ra_complete_csw, sdev);
+	ret = usb_submit_urb(ra->csw_urb, GFP_ATOMIC);
+	if (ret) {
+		stub_ra_stop(sdev, "submit csw");
+		goto finish;
+	}
+	ra->state = STUB_RA_CSW;
+	spin_unlock_irqrestore(&ra->lock, flags);
+	return;
+
+finish:
+	spin_unlock_irqrestore(&ra->lock, flags);
+	stub_ra_finish(sdev);
+}
+
+void stub_ra_complete_csw(struct urb *urb)
+{
+	struct stub_device *sdev = urb->context;
+	struct stub_ra *ra = &sdev->ra;
+	struct bulk_cb_wrap *pcbw = ra->cbw_urb->transfer_buffer;
+	struct bulk_cs_wrap *csw = urb->transfer_buffer;
+	unsigned long flags;
+
+	if (urb->status == -ENOENT)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	if (urb->status || urb->actual_length != US_BULK_CS_WRAP_LEN ||
+	    le32_to_cpu(csw->Signature) != US_BULK_CS_SIGN ||
+	    csw->Tag != pcbw->Tag) {
+		stub_ra_stop(sdev, "bad csw");
+	} else if (!ra->enabled || csw->Status != US_BULK_STAT_OK ||
+		   csw->Residue ||
+		   ra->data_len != le32_to_cpu(pcbw->DataTransferLength)) {
+		/* the command is over on the device, only drop the data */
+		ra->discards++;
+		ra->state = STUB_RA_IDLE;
+	} else {
+		ra->state = STUB_RA_READY;
+	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+
+	stub_ra_finish(sdev);
+}
+
+/**
+ * stub_ra_complete - look at a request completed by the device
+ * @sdev: the stub device
+ * @urb: the urb completed successfully
+ *
+ * The CSW of a sequential READ lets the next one be read ahead.
+ */
+void stub_ra_complete(struct stub_device *sdev, struct urb *urb)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct bulk_cs_wrap *csw = urb->transfer_buffer;
+	unsigned long flags;
+
+	if (!usb_pipebulk(urb->pipe) || !usb_pipein(urb->pipe) ||
+	    urb->actual_length != US_BULK_CS_WRAP_LEN ||
+	    le32_to_cpu(csw->Signature) != US_BULK_CS_SIGN)
+		return;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	if (ra->seq && csw->Tag == ra->cbw.Tag &&
+	    csw->Status == US_BULK_STAT_OK && !csw->Residue) {
+		ra->ep_in = usb_pipeendpoint(urb->pipe);
+		stub_ra_start(sdev);
+	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+/*
+ * Drops the request if it is held, so that CMD_UNLINK can answer it without
+ * the device. Returns non-zero in that case.
+ */
+int stub_ra_unlink(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_ra *ra = &sdev->ra;
+	unsigned long flags;
+	int found;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	found = (ra->held == priv);
+	if (found)
+		ra->held = NULL;
+	spin_unlock_irqrestore(&ra->lock, flags);
+
+	if (found) {
+		priv->urb->status = -ECONNRESET;
+		stub_complete(priv->urb);
+	}
+
+	return found;
+}
+
+/* called when the connection is shut down, after the threads stopped */
+void stub_ra_cleanup(struct stub_device *sdev)
+{
+	struct stub_ra *ra = &sdev->ra;
+	unsigned long flags;
+
+	if (!ra->buf)
+		return;
+
+	usb_kill_urb(ra->cbw_urb);
+	usb_kill_urb(ra->data_urb);
+	usb_kill_urb(ra->csw_urb);
+
+	spin_lock_irqsave(&ra->lock, flags);
+	/* a held request is freed in stub_device_cleanup_urbs() */
+	ra->held = NULL;
+	ra->state = STUB_RA_IDLE;
+	ra->seq = 0;
+	ra->next_lba = 0;
+	ra->ep_in = 0;
+	spin_unlock_irqrestore(&ra->lock, flags);
+}
+
+static void stub_ra_free_urb(struct urb *urb)
+{
+	if (!urb)
+		return;
+	kfree(urb->transfer_buffer);
+	usb_free_urb(urb);
+}
+
+void stub_ra_free(struct stub_device *sdev)
+{
+	struct stub_ra *ra = &sdev->ra;
+
+	stub_ra_free_urb(ra->cbw_urb);
+	stub_ra_free_urb(ra->csw_urb);
+	usb_free_urb(ra->data_urb);
+	kfree(ra->buf);
+}
+
+static struct urb *stub_ra_alloc_urb(size_t len)
+{
+	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+
+	if (!urb)
+		return NULL;
+
+	urb->transfer_buffer = kmalloc(len, GFP_KERNEL);
+	if (!urb->transfer_buffer) {
+		usb_free_urb(urb);
+		return NULL;
+	}
+
+	return urb;
+}
+
+/**
+ * stub_ra_enable - turn read-ahead on or off
+ * @sdev: the stub device
+ * @enable: non-zero to turn it on
+ *
+ * Buffers are allocated when it is turned on the first time and kept until
+ * the device is released.
+ */
+int stub_ra_enable(struct stub_device *sdev, int enable)
+{
+	struct stub_ra *ra = &sdev->ra;
+	struct stub_ra new = { 0 };
+	unsigned long flags;
+
+	if (enable && !READ_ONCE(ra->buf)) {
+		new.buf_len = (sdev->udev->speed >= USB_SPEED_SUPER) ?
+			      STUB_RA_MAX_LEN_SS : STUB_RA_MAX_LEN;
+		new.buf = kmalloc(new.buf_len, GFP_KERNEL);
+		new.cbw_urb = stub_ra_alloc_urb(US_BULK_CB_WRAP_LEN);
+		new.csw_urb = stub_ra_alloc_urb(US_BULK_CS_WRAP_LEN);
+		new.data_urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!new.buf || !new.cbw_urb || !new.csw_urb ||
+		    !new.data_urb) {
+			stub_ra_free_urb(new.cbw_urb);
+			stub_ra_free_urb(new.csw_urb);
+			usb_free_urb(new.data_urb);
+			kfree(new.buf);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irqsave(&ra->lock, flags);
+	if (new.buf && !ra->buf) {
+		ra->buf = new.buf;
+		ra->buf_len = new.buf_len;
+		ra->cbw_urb = new.cbw_urb;
+		ra->data_urb = new.data_urb;
+		ra->csw_urb = new.csw_urb;
+		new.buf = NULL;
+	}
+	ra->enabled = !!enable;
+	if (!enable && ra->state == STUB_RA_READY) {
+		ra->discards++;
+		ra->state = STUB_RA_IDLE;
+	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+
+	if (new.buf) {
+		/* lost a race with another writer */
+		stub_ra_free_urb(new.cbw_urb);
+		stub_ra_free_urb(new.csw_urb);
+		usb_free_urb(new.data_urb);
+		kfree(new.buf);
+	}
+
+	return 0;
+}
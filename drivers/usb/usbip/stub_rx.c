@@ -24,6 +24,7 @@
 #include <linux/usb/hcd.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "stub.h"
 
 static int is_clear_halt_cmd(struct urb *urb)
@@ -205,6 +206,233 @@ static void tweak_special_requests(struct urb *urb)
 		usbip_dbg_stub_rx("no need to tweak\n");
 }
 
+/*
+ * Polled interrupt IN endpoints are stopped before requests which change
+ * them. The client restarts polling with its next URB.
+ */
+static void stub_poll_tweak(struct stub_device *sdev, struct urb *urb)
+{
+	struct usb_ctrlrequest *req;
+	__u16 index;
+
+	if (!(sdev->ud.features & USBIP_FEAT_INT_POLL) || !urb->setup_packet ||
+	    usb_pipetype(urb->pipe) != PIPE_CONTROL)
+		return;
+
+	if (is_clear_halt_cmd(urb)) {
+		req = (struct usb_ctrlrequest *) urb->setup_packet;
+		index = le16_to_cpu(req->wIndex);
+		if (index & USB_DIR_IN)
+			stub_poll_stop(sdev,
+				       index & USB_ENDPOINT_NUMBER_MASK);
+	} else if (is_set_interface_cmd(urb) ||
+		   is_set_configuration_cmd(urb) ||
+		   is_reset_device_cmd(urb)) {
+		stub_poll_stop_all(sdev);
+	}
+}
+
+static int is_special_request(struct urb *urb)
+{
+	if (!urb->setup_packet || usb_pipetype(urb->pipe) != PIPE_CONTROL)
+		return 0;
+
+	return is_clear_halt_cmd(urb) || is_set_interface_cmd(urb) ||
+	       is_set_configuration_cmd(urb) || is_reset_device_cmd(urb);
+}
+
+/*
+ * Special requests wait on the device, for tens of milliseconds to seconds
+ * in the case of a reset. They are run by a work item of the device rather
+ * than stub_rx, so that the URBs of other endpoints keep being submitted
+ * meanwhile. The work item runs the requests of a device one at a time and
+ * in order.
+ *
+ * An URB to an endpoint which a queued special request changes is queued
+ * behind it, as well as any URB to an endpoint already having URBs in the
+ * queue, so that the order on each endpoint is kept. Endpoints are bits of
+ * tweak_busy, OUT in the lower and IN in the upper half.
+ */
+static u32 stub_tweak_ep(int epnum, int in)
+{
+	return BIT((epnum & USB_ENDPOINT_NUMBER_MASK) + (in ? 16 : 0));
+}
+
+static u32 stub_tweak_pipe(unsigned int pipe)
+{
+	int epnum = usb_pipeendpoint(pipe);
+
+	/* the control endpoint is one for both directions */
+	if (usb_pipecontrol(pipe))
+		return stub_tweak_ep(epnum, 0) | stub_tweak_ep(epnum, 1);
+
+	return stub_tweak_ep(epnum, usb_pipein(pipe));
+}
+
+/* endpoints held back by a special request, with sdev->tweak_lock held */
+static u32 stub_tweak_mask(struct stub_device *sdev, struct urb *urb)
+{
+	struct usb_ctrlrequest *req;
+	struct usb_host_endpoint *ep;
+	struct usb_interface *intf;
+	u32 mask = stub_tweak_pipe(urb->pipe);
+	__u16 index;
+	int i, j;
+
+	req = (struct usb_ctrlrequest *) urb->setup_packet;
+	index = le16_to_cpu(req->wIndex);
+
+	if (is_clear_halt_cmd(urb))
+		return mask | stub_tweak_ep(index, index & USB_DIR_IN);
+
+	/* the configuration may be changing, hold back everything */
+	if (!is_set_interface_cmd(urb) || sdev->tweak_busy == ~0U)
+		return ~0U;
+
+	/* the endpoints of any alternate setting of the interface */
+	intf = usb_ifnum_to_if(sdev->udev, index);
+	if (!intf)
+		return ~0U;
+
+	for (i = 0; i < intf->num_altsetting; i++) {
+		for (j = 0; j < intf->altsetting[i].desc.bNumEndpoints; j++) {
+			ep = &intf->altsetting[i].endpoint[j];
+			mask |= stub_tweak_ep(usb_endpoint_num(&ep->desc),
+					      usb_endpoint_dir_in(&ep->desc));
+		}
+	}
+
+	return mask;
+}
+
+static void stub_tweak_update(struct stub_device *sdev)
+{
+	struct stub_priv *priv;
+	u32 busy = 0;
+
+	if (sdev->tweak_cur)
+		busy = sdev->tweak_cur->tweak_mask;
+	list_for_each_entry(priv, &sdev->tweak_list, tweak_entry)
+		busy |= priv->tweak_mask;
+
+	sdev->tweak_busy = busy;
+}
+
+/*
+ * Queues a special request or an URB which has to wait for one. Returns
+ * non-zero in that case, otherwise the caller submits the URB.
+ */
+static int stub_tweak_queue(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct urb *urb = priv->urb;
+
+	spin_lock(&sdev->tweak_lock);
+
+	if (is_special_request(urb)) {
+		priv->tweak_mask = stub_tweak_mask(sdev, urb);
+	} else if (sdev->tweak_busy & stub_tweak_pipe(urb->pipe)) {
+		priv->tweak_mask = stub_tweak_pipe(urb->pipe);
+	} else {
+		spin_unlock(&sdev->tweak_lock);
+		return 0;
+	}
+
+	sdev->tweak_busy |= priv->tweak_mask;
+	list_add_tail(&priv->tweak_entry, &sdev->tweak_list);
+
+	spin_unlock(&sdev->tweak_lock);
+
+	queue_work(stub_tweak_wq, &sdev->tweak_work);
+
+	return 1;
+}
+
+/*
+ * Submission of cut-through transfers can not be deferred, as their data
+ * is still coming. stub_rx waits for the queue in front of them instead.
+ */
+static void stub_tweak_wait(struct stub_device *sdev, struct urb *urb)
+{
+	u32 busy;
+
+	spin_lock(&sdev->tweak_lock);
+	busy = sdev->tweak_busy;
+	spin_unlock(&sdev->tweak_lock);
+
+	if (busy & stub_tweak_pipe(urb->pipe))
+		flush_work(&sdev->tweak_work);
+}
+
+/*
+ * Drops the request if it is queued, so that CMD_UNLINK can answer it
+ * without the device. Returns non-zero in that case.
+ */
+static int stub_tweak_unlink(struct stub_device *sdev, struct stub_priv *priv)
+{
+	int found;
+
+	spin_lock(&sdev->tweak_lock);
+	found = !list_empty(&priv->tweak_entry);
+	if (found) {
+		list_del_init(&priv->tweak_entry);
+		stub_tweak_update(sdev);
+	}
+	spin_unlock(&sdev->tweak_lock);
+
+	if (found) {
+		priv->urb->status = -ECONNRESET;
+		stub_complete(priv->urb);
+	}
+
+	return found;
+}
+
+static void stub_submit(struct stub_device *sdev, struct stub_priv *priv);
+
+void stub_tweak_work(struct work_struct *work)
+{
+	struct stub_device *sdev = container_of(work, struct stub_device,
+						tweak_work);
+	struct stub_priv *priv;
+
+	while (!usbip_event_happened(&sdev->ud)) {
+		spin_lock(&sdev->tweak_lock);
+		priv = list_first_entry_or_null(&sdev->tweak_list,
+						struct stub_priv, tweak_entry);
+		if (priv)
+			list_del_init(&priv->tweak_entry);
+		sdev->tweak_cur = priv;
+		spin_unlock(&sdev->tweak_lock);
+
+		if (!priv)
+			break;
+
+		if (is_special_request(priv->urb))
+			tweak_special_requests(priv->urb);
+
+		/* no need to submit an intercepted request, but harmless? */
+		stub_submit(sdev, priv);
+
+		spin_lock(&sdev->tweak_lock);
+		sdev->tweak_cur = NULL;
+		stub_tweak_update(sdev);
+		spin_unlock(&sdev->tweak_lock);
+	}
+}
+
+/* called when the connection is shut down, after the threads stopped */
+void stub_tweak_cleanup(struct stub_device *sdev)
+{
+	cancel_work_sync(&sdev->tweak_work);
+
+	/* queued requests are freed in stub_device_cleanup_urbs() */
+	spin_lock(&sdev->tweak_lock);
+	INIT_LIST_HEAD(&sdev->tweak_list);
+	sdev->tweak_cur = NULL;
+	sdev->tweak_busy = 0;
+	spin_unlock(&sdev->tweak_lock);
+}
+
 /*
  * stub_recv_unlink() unlinks the URB by a call to usb_unlink_urb().
  * By unlinking the urb asynchronously, stub_rx can continuously
@@ -238,6 +466,9 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 * of the unlink request.
 		 */
 		priv->unlinking = 1;
+		usbip_stats_inc(&sdev->ud,
+				unlinked[usb_pipetype(priv->urb->pipe)]);
+		trace_usbip_stub_unlink(sdev->devid, priv->seqnum, priv->urb);
 
 		/*
 		 * In the case that unlinking flag is on, prev->seqnum
@@ -246,9 +477,31 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 * to make the result pdu of the unlink request.
 		 */
 		priv->seqnum = pdu->base.seqnum;
+		priv->received = ktime_get();
+
+		if (priv->nr_chunks) {
+			/*
+			 * Hold the request while unlinking its sub-URBs, so
+			 * that their completion cannot release it under us.
+			 */
+			priv->completed_chunks--;
+			spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+			stub_unlink_chunks(priv, NULL);
+			stub_account_chunk(priv);
+			return 0;
+		}
 
 		spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
+		/* a CBW held by read-ahead has not been submitted yet */
+		if (stub_ra_unlink(sdev, priv))
+			return 0;
+
+		/* nor a request queued for stub_tweak_work() */
+		if (stub_tweak_unlink(sdev, priv))
+			return 0;
+
 		/*
 		 * usb_unlink_urb() is now out of spinlocking to avoid
 		 * spinlock recursion since stub_complete() is
@@ -282,7 +535,7 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 	 * CMD_RET pdu. In this case, usb_unlink_urb() is not needed. We only
 	 * return the completeness of this unlink request to vhci_hcd.
 	 */
-	stub_enqueue_ret_unlink(sdev, pdu->base.seqnum, 0);
+	stub_enqueue_ret_unlink(sdev, pdu->base.seqnum, 0, NULL);
 
 	spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
@@ -325,6 +578,9 @@ static struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
 
 	priv->seqnum = pdu->base.seqnum;
 	priv->sdev = sdev;
+	priv->received = ktime_get();
+	INIT_LIST_HEAD(&priv->chunk_list);
+	INIT_LIST_HEAD(&priv->tweak_entry);
 
 	/*
 	 * After a stub_priv is linked to a list_head,
@@ -441,6 +697,202 @@ static void masking_bogus_flags(struct urb *urb)
 	urb->transfer_flags &= allowed;
 }
 
+static struct usb_interface *ep_to_interface(struct usb_device *udev,
+					     struct usb_host_endpoint *ep)
+{
+	struct usb_host_config *config = udev->actconfig;
+	struct usb_host_interface *alt;
+	int i, j;
+
+	if (!config)
+		return NULL;
+
+	for (i = 0; i < config->desc.bNumInterfaces; i++) {
+		if (!config->interface[i])
+			continue;
+		alt = config->interface[i]->cur_altsetting;
+		for (j = 0; j < alt->desc.bNumEndpoints; j++)
+			if (&alt->endpoint[j] == ep)
+				return config->interface[i];
+	}
+	return NULL;
+}
+
+/*
+ * With USBIP_FEAT_STREAMS, CMD_SUBMIT on a bulk pipe carries the stream ID in
+ * start_frame and the number of streams the peer allocated on the endpoint in
+ * number_of_packets. Streams are (re)allocated here when that number changes,
+ * so vhci does not need a round trip in its alloc_streams().
+ */
+static int stub_setup_streams(struct stub_device *sdev, struct urb *urb)
+{
+	struct usb_device *udev = sdev->udev;
+	struct usb_host_endpoint *ep;
+	struct usb_interface *intf;
+	unsigned int num_streams = urb->number_of_packets;
+	unsigned int *req;
+	int ret;
+
+	urb->stream_id = urb->start_frame;
+	urb->start_frame = 0;
+	urb->number_of_packets = 0;
+
+	ep = usb_pipe_endpoint(udev, urb->pipe);
+	if (!ep)
+		return -EINVAL;
+
+	req = &sdev->num_streams[usb_pipein(urb->pipe) ? 1 : 0]
+				[usb_pipeendpoint(urb->pipe)];
+	if (*req == num_streams)
+		goto out;
+
+	intf = ep_to_interface(udev, ep);
+	if (!intf)
+		return -EINVAL;
+
+	if (ep->streams) {
+		ret = usb_free_streams(intf, &ep, 1, GFP_KERNEL);
+		if (ret < 0) {
+			dev_err(&udev->dev, "free streams ep %d, %d\n",
+				usb_pipeendpoint(urb->pipe), ret);
+			return ret;
+		}
+	}
+	*req = 0;
+
+	if (num_streams) {
+		/* stream 0 is reserved, ask for as many usable ones as vhci */
+		ret = usb_alloc_streams(intf, &ep, 1, num_streams + 1,
+					GFP_KERNEL);
+		if (ret < 0) {
+			dev_err(&udev->dev, "alloc %u streams ep %d, %d\n",
+				num_streams, usb_pipeendpoint(urb->pipe), ret);
+			return ret;
+		}
+		if (ret < num_streams)
+			dev_warn(&udev->dev, "%d of %u streams ep %d\n", ret,
+				 num_streams, usb_pipeendpoint(urb->pipe));
+	}
+	*req = num_streams;
+
+out:
+	if (urb->stream_id > ep->streams)
+		return -EINVAL;
+	return 0;
+}
+
+static int stub_alloc_chunks(struct stub_priv *priv)
+{
+	struct urb *urb = priv->urb;
+	struct urb *chunk;
+	int len = urb->transfer_buffer_length;
+	int nr = DIV_ROUND_UP(len, STUB_CHUNK_SIZE);
+	int i;
+
+	priv->chunks = kcalloc(nr, sizeof(struct urb *), GFP_KERNEL);
+	if (!priv->chunks)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		chunk = usb_alloc_urb(0, GFP_KERNEL);
+		if (!chunk)
+			return -ENOMEM;
+		priv->chunks[i] = chunk;
+		priv->nr_chunks++;
+
+		chunk->dev = urb->dev;
+		chunk->pipe = urb->pipe;
+		chunk->stream_id = urb->stream_id;
+		chunk->transfer_buffer = urb->transfer_buffer +
+					 i * STUB_CHUNK_SIZE;
+		chunk->transfer_buffer_length = min(len - i * STUB_CHUNK_SIZE,
+						    STUB_CHUNK_SIZE);
+		chunk->context = (void *) priv;
+		chunk->complete = stub_complete_chunk;
+
+		if (i == nr - 1)
+			chunk->transfer_flags = urb->transfer_flags &
+				(URB_ZERO_PACKET | URB_SHORT_NOT_OK);
+		else if (usb_pipein(urb->pipe))
+			/* stop the queue on a short read */
+			chunk->transfer_flags = URB_SHORT_NOT_OK;
+	}
+
+	return 0;
+}
+
+/*
+ * With USBIP_FEAT_CHUNKED, a large bulk request is split into sub-URBs of
+ * STUB_CHUNK_SIZE. OUT sub-URBs are submitted as their data arrives instead
+ * of after the whole payload, and IN data of completed sub-URBs is sent ahead
+ * by stub_tx, so that network and USB transfers overlap.
+ */
+static void stub_recv_cmd_submit_chunked(struct stub_device *sdev,
+					 struct stub_priv *priv)
+{
+	struct usbip_device *ud = &sdev->ud;
+	int compress = usbip_compress_pipe(ud, priv->urb->pipe);
+	u32 stored = 0;
+	struct urb *chunk;
+	int ret;
+	int i;
+
+	/* compressed blocks must not cross chunks */
+	BUILD_BUG_ON(STUB_CHUNK_SIZE % USBIP_COMPRESS_BLOCK);
+
+	if (stub_alloc_chunks(priv)) {
+		usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
+		return;
+	}
+
+	for (i = 0; i < priv->nr_chunks; i++) {
+		chunk = priv->chunks[i];
+
+		if (usb_pipeout(chunk->pipe)) {
+			/* a stored block may span chunks */
+			if (compress)
+				ret = usbip_recv_compressed(ud,
+						chunk->transfer_buffer,
+						chunk->transfer_buffer_length,
+						&stored);
+			else
+				ret = usbip_recv(ud, chunk->transfer_buffer,
+						 chunk->transfer_buffer_length);
+			if (ret != chunk->transfer_buffer_length ||
+			    (i == priv->nr_chunks - 1 && stored)) {
+				dev_err(&sdev->udev->dev, "recv chunk, %d\n",
+					ret);
+				usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+				return;
+			}
+		}
+
+		ret = usb_submit_urb(chunk, GFP_KERNEL);
+		if (ret == -EPERM) {
+			/* blocked as an earlier one failed, see below */
+			stub_account_chunk(priv);
+			continue;
+		}
+		if (ret) {
+			dev_err(&sdev->udev->dev, "submit chunk error, %d\n",
+				ret);
+			usbip_dump_urb(chunk);
+			usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
+			return;
+		}
+	}
+
+	usbip_dbg_stub_rx("submit %d chunks ok, seqnum %lu\n",
+			  priv->nr_chunks, priv->seqnum);
+}
+
+static int stub_use_chunks(struct stub_device *sdev, struct urb *urb)
+{
+	return (sdev->ud.features & USBIP_FEAT_CHUNKED) &&
+		usb_pipebulk(urb->pipe) &&
+		urb->transfer_buffer_length > STUB_CHUNK_SIZE;
+}
+
 static void stub_recv_cmd_submit(struct stub_device *sdev,
 				 struct usbip_header *pdu)
 {
@@ -493,27 +945,97 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
 	priv->urb->complete               = stub_complete;
 
 	usbip_pack_pdu(pdu, priv->urb, USBIP_CMD_SUBMIT, 0);
+	usbip_stats_inc(ud, submitted[usb_pipetype(pipe)]);
+
+	if (stub_use_chunks(sdev, priv->urb)) {
+		stub_tweak_wait(sdev, priv->urb);
+		ret = 0;
+		if (ud->features & USBIP_FEAT_STREAMS)
+			ret = stub_setup_streams(sdev, priv->urb);
+		if (ret) {
+			/* drain the payload and fail this request only */
+			if (usbip_recv_xbuff(ud, priv->urb) >= 0) {
+				priv->urb->status = ret;
+				stub_complete(priv->urb);
+			}
+			return;
+		}
+		masking_bogus_flags(priv->urb);
+		priv->submitted = ktime_get();
+		trace_usbip_stub_rx_submit(sdev->devid, priv->seqnum,
+					   priv->urb);
+		if (stub_ra_submit(sdev, priv))
+			return;
+		stub_recv_cmd_submit_chunked(sdev, priv);
+		return;
+	}
 
+	if (ud->features & USBIP_FEAT_ISO_COMPACT) {
+		/* iso descriptors come ahead of the data */
+		if (usbip_recv_iso_compact(ud, priv->urb,
+					   USBIP_CMD_SUBMIT) < 0)
+			return;
 
-	if (usbip_recv_xbuff(ud, priv->urb) < 0)
-		return;
+		if (usbip_recv_xbuff(ud, priv->urb) < 0)
+			return;
+	} else {
+		if (usbip_recv_xbuff(ud, priv->urb) < 0)
+			return;
 
-	if (usbip_recv_iso(ud, priv->urb) < 0)
+		if (usbip_recv_iso(ud, priv->urb) < 0)
+			return;
+	}
+
+	stub_poll_tweak(sdev, priv->urb);
+
+	/* special requests, and URBs behind them, go to stub_tweak_work() */
+	if (stub_tweak_queue(sdev, priv))
 		return;
 
-	/* no need to submit an intercepted request, but harmless? */
-	tweak_special_requests(priv->urb);
+	stub_submit(sdev, priv);
+
+	usbip_dbg_stub_rx("Leave\n");
+}
+
+static void stub_submit(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct usbip_device *ud = &sdev->ud;
+	int pipe = priv->urb->pipe;
+	unsigned long seqnum = priv->seqnum;
+	int poll, length, interval;
+	int ret;
+
+	if ((ud->features & USBIP_FEAT_STREAMS) && usb_pipebulk(pipe)) {
+		ret = stub_setup_streams(sdev, priv->urb);
+		if (ret) {
+			/* fail this request only, the connection is fine */
+			priv->urb->status = ret;
+			stub_complete(priv->urb);
+			return;
+		}
+	}
 
 	masking_bogus_flags(priv->urb);
+	priv->submitted = ktime_get();
+	trace_usbip_stub_rx_submit(sdev->devid, priv->seqnum, priv->urb);
+
+	/* answered from mass storage read-ahead, or held for it */
+	if (stub_ra_submit(sdev, priv))
+		return;
+
+	/* the urb may be gone once submitted */
+	poll = (ud->features & USBIP_FEAT_INT_POLL) && usb_pipeint(pipe) &&
+	       usb_pipein(pipe);
+	length = priv->urb->transfer_buffer_length;
+	interval = priv->urb->interval;
+
 	/* urb is now ready to submit */
 	ret = usb_submit_urb(priv->urb, GFP_KERNEL);
 
 	if (ret == 0)
-		usbip_dbg_stub_rx("submit urb ok, seqnum %u\n",
-				  pdu->base.seqnum);
+		usbip_dbg_stub_rx("submit urb ok, seqnum %lu\n", seqnum);
 	else {
-		dev_err(&udev->dev, "submit_urb error, %d\n", ret);
-		usbip_dump_header(pdu);
+		dev_err(&sdev->udev->dev, "submit_urb error, %d\n", ret);
 		usbip_dump_urb(priv->urb);
 
 		/*
@@ -523,7 +1045,9 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
 		usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
 	}
 
-	usbip_dbg_stub_rx("Leave\n");
+	/* the next reports are polled ahead of the client */
+	if (ret == 0 && poll)
+		stub_poll_start(sdev, pipe, length, interval);
 }
 
 /* recv a pdu */
@@ -539,15 +1063,13 @@ static void stub_rx_pdu(struct usbip_device *ud)
 	memset(&pdu, 0, sizeof(pdu));
 
 	/* receive a pdu header */
-	ret = usbip_recv(ud, &pdu, sizeof(pdu));
+	ret = usbip_recv_header(ud, &pdu);
 	if (ret != sizeof(pdu)) {
 		dev_err(dev, "recv a header, %d\n", ret);
 		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
 		return;
 	}
 
-	usbip_header_correct_endian(&pdu, 0);
-
 	if (usbip_dbg_flag_stub_rx)
 		usbip_dump_header(&pdu);
 
@@ -566,6 +1088,11 @@ static void stub_rx_pdu(struct usbip_device *ud)
 		stub_recv_cmd_submit(sdev, &pdu);
 		break;
 
+	case USBIP_NOP:
+		usbip_hb_recv_nop(ud, &pdu);
+		wake_up(&sdev->tx_waitq);
+		break;
+
 	default:
 		/* NOTREACHED */
 		dev_err(dev, "unknown pdu\n");
@@ -577,11 +1104,13 @@ static void stub_rx_pdu(struct usbip_device *ud)
 int stub_rx_loop(void *data)
 {
 	struct usbip_device *ud = data;
+	unsigned int sched = 0;
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(ud))
 			break;
 
+		usbip_sched_thread(ud, 1, &sched);
 		stub_rx_pdu(ud);
 	}
 
@@ -22,12 +22,14 @@
 #include <linux/socket.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "stub.h"
 
 static void stub_free_priv_and_urb(struct stub_priv *priv)
 {
 	struct urb *urb = priv->urb;
 
+	stub_free_chunks(priv);
 	kfree(urb->setup_packet);
 	kfree(urb->transfer_buffer);
 	list_del(&priv->list);
@@ -35,9 +37,12 @@ static void stub_free_priv_and_urb(struct stub_priv *priv)
 	usb_free_urb(urb);
 }
 
-/* be in spin_lock_irqsave(&sdev->priv_lock, flags) */
+/*
+ * be in spin_lock_irqsave(&sdev->priv_lock, flags). @priv is the unlinked
+ * request, or NULL if it had completed before CMD_UNLINK, just received.
+ */
 void stub_enqueue_ret_unlink(struct stub_device *sdev, __u32 seqnum,
-			     __u32 status)
+			     __u32 status, struct stub_priv *priv)
 {
 	struct stub_unlink *unlink;
 
@@ -49,6 +54,12 @@ void stub_enqueue_ret_unlink(struct stub_device *sdev, __u32 seqnum,
 
 	unlink->seqnum = seqnum;
 	unlink->status = status;
+	if (priv) {
+		unlink->received = priv->received;
+		unlink->completed = priv->completed;
+	} else {
+		unlink->received = ktime_get();
+	}
 
 	list_add_tail(&unlink->list, &sdev->unlink_tx);
 }
@@ -73,6 +84,8 @@ void stub_complete(struct urb *urb)
 	switch (urb->status) {
 	case 0:
 		/* OK */
+		if (READ_ONCE(sdev->ra.enabled))
+			stub_ra_complete(sdev, urb);
 		break;
 	case -ENOENT:
 		dev_info(&urb->dev->dev,
@@ -96,13 +109,19 @@ void stub_complete(struct urb *urb)
 		break;
 	}
 
+	usbip_stats_latency(&sdev->ud, USBIP_LAT_SERVICE, priv->submitted);
+	usbip_stats_inc(&sdev->ud, completed[usb_pipetype(urb->pipe)]);
+	priv->completed = ktime_get();
+	trace_usbip_stub_complete(sdev->devid, priv->seqnum, urb);
+
 	/* link a urb to the queue of tx. */
 	spin_lock_irqsave(&sdev->priv_lock, flags);
 	if (sdev->ud.tcp_socket == NULL) {
 		usbip_dbg_stub_tx("ignore urb for closed connection %p", urb);
 		/* It will be freed in stub_device_cleanup_urbs(). */
 	} else if (priv->unlinking) {
-		stub_enqueue_ret_unlink(sdev, priv->seqnum, urb->status);
+		stub_enqueue_ret_unlink(sdev, priv->seqnum, urb->status,
+					priv);
 		stub_free_priv_and_urb(priv);
 	} else {
 		list_move_tail(&priv->list, &sdev->priv_tx);
@@ -113,6 +132,127 @@ void stub_complete(struct urb *urb)
 	wake_up(&sdev->tx_waitq);
 }
 
+/* sub-URBs point into the buffer of priv->urb, only free themselves */
+void stub_free_chunks(struct stub_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < priv->nr_chunks; i++)
+		usb_free_urb(priv->chunks[i]);
+	kfree(priv->chunks);
+	priv->chunks = NULL;
+	priv->nr_chunks = 0;
+}
+
+/*
+ * stub_unlink_chunks - stop the sub-URBs following @chunk, or all of them if
+ * @chunk is NULL. They are blocked so that stub_rx cannot submit them later.
+ */
+void stub_unlink_chunks(struct stub_priv *priv, struct urb *chunk)
+{
+	int found = !chunk;
+	int i;
+
+	for (i = 0; i < priv->nr_chunks; i++) {
+		if (!found) {
+			found = (priv->chunks[i] == chunk);
+			continue;
+		}
+		usb_block_urb(priv->chunks[i]);
+		usb_unlink_urb(priv->chunks[i]);
+	}
+}
+
+/**
+ * stub_account_chunk - count a sub-URB which will not complete any more
+ * @priv: the chunked request
+ *
+ * Called for a completed sub-URB, for one stub_rx did not submit, and for a
+ * hold taken by stub_rx while it unlinks. The last one hands the whole
+ * transfer to stub_tx the same way as stub_complete() does. Before that, IN
+ * data completed so far is queued to be sent ahead.
+ */
+void stub_account_chunk(struct stub_priv *priv)
+{
+	struct stub_device *sdev = priv->sdev;
+	struct urb *urb = priv->urb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+
+	if (++priv->completed_chunks < priv->nr_chunks) {
+		if (usb_pipein(urb->pipe) && !priv->unlinking &&
+		    priv->chunk_done > priv->chunk_sent &&
+		    list_empty(&priv->chunk_list) && sdev->ud.tcp_socket)
+			list_add_tail(&priv->chunk_list, &sdev->priv_chunk);
+		spin_unlock_irqrestore(&sdev->priv_lock, flags);
+		wake_up(&sdev->tx_waitq);
+		return;
+	}
+
+	urb->actual_length = priv->chunk_done;
+	urb->status = priv->chunk_status;
+	priv->completed = ktime_get();
+	/* a short chunk only means a short transfer unless asked otherwise */
+	if (urb->status == -EREMOTEIO &&
+	    !(urb->transfer_flags & URB_SHORT_NOT_OK))
+		urb->status = 0;
+	list_del_init(&priv->chunk_list);
+
+	if (sdev->ud.tcp_socket == NULL) {
+		usbip_dbg_stub_tx("ignore urb for closed connection %p", urb);
+		/* It will be freed in stub_device_cleanup_urbs(). */
+	} else if (priv->unlinking) {
+		stub_enqueue_ret_unlink(sdev, priv->seqnum, urb->status,
+					priv);
+		/* stub_tx may still be sending a chunk of it, let it free */
+		list_move_tail(&priv->list, &sdev->priv_free);
+	} else {
+		list_move_tail(&priv->list, &sdev->priv_tx);
+	}
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	/* wake up tx_thread */
+	wake_up(&sdev->tx_waitq);
+}
+
+/**
+ * stub_complete_chunk - completion handler of a sub-URB of a chunked request
+ * @chunk: pointer to the sub-URB completed
+ *
+ * Bulk sub-URBs of an endpoint complete in order. The first one which fails
+ * or, for IN, is short ends the transfer and the following ones are unlinked.
+ * IN sub-URBs except the last are submitted with URB_SHORT_NOT_OK so that the
+ * host controller stops the queue on a short read until this returns.
+ */
+void stub_complete_chunk(struct urb *chunk)
+{
+	struct stub_priv *priv = (struct stub_priv *) chunk->context;
+	struct stub_device *sdev = priv->sdev;
+	unsigned long flags;
+	int failed = 0;
+
+	usbip_dbg_stub_tx("complete chunk! status %d\n", chunk->status);
+
+	/* killed in stub_device_cleanup_urbs(), see stub_complete() */
+	if (chunk->status == -ENOENT)
+		return;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (!priv->chunk_status) {
+		priv->chunk_done += chunk->actual_length;
+		priv->chunk_status = chunk->status;
+		failed = (chunk->status != 0);
+	}
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	/* priv stays alive as this chunk is not counted yet */
+	if (failed)
+		stub_unlink_chunks(priv, chunk);
+
+	stub_account_chunk(priv);
+}
+
 static inline void setup_base_pdu(struct usbip_header_basic *base,
 				  __u32 command, __u32 seqnum)
 {
@@ -138,6 +278,21 @@ static void setup_ret_unlink_pdu(struct usbip_header *rpdu,
 	rpdu->u.ret_unlink.status = unlink->status;
 }
 
+static inline __be64 stub_stamp(ktime_t t)
+{
+	return cpu_to_be64(ktime_to_ns(t));
+}
+
+/* the trailer of USBIP_FEAT_TIMESTAMPS, see struct usbip_stamps */
+static void setup_stamps(struct usbip_stamps *stamps, ktime_t received,
+			 ktime_t submitted, ktime_t completed)
+{
+	stamps->received = stub_stamp(received);
+	stamps->submitted = stub_stamp(submitted);
+	stamps->completed = stub_stamp(completed);
+	stamps->sent = stub_stamp(ktime_get());
+}
+
 static struct stub_priv *dequeue_from_priv_tx(struct stub_device *sdev)
 {
 	unsigned long flags;
@@ -171,48 +326,87 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 		struct urb *urb = priv->urb;
 		struct usbip_header pdu_header;
 		struct usbip_iso_packet_descriptor *iso_buffer = NULL;
-		struct kvec *iov = NULL;
+		struct usbip_stamps stamps;
+		void *iso_desc = NULL;
+		ssize_t iso_len = 0;
+		struct kvec iov_small[4];
+		struct kvec *iov = iov_small;
 		int iovnum = 0;
+		int iso = usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS;
+		int compact = iso &&
+			      (sdev->ud.features & USBIP_FEAT_ISO_COMPACT);
+
+		usbip_stats_latency(&sdev->ud, USBIP_LAT_QUEUE,
+				    priv->completed);
+		trace_usbip_stub_tx_ret(sdev->devid, priv->seqnum, urb);
 
 		txsize = 0;
 		memset(&pdu_header, 0, sizeof(pdu_header));
 		memset(&msg, 0, sizeof(msg));
 
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS)
-			iovnum = 2 + urb->number_of_packets;
-		else
-			iovnum = 2;
-
-		iov = kcalloc(iovnum, sizeof(struct kvec), GFP_KERNEL);
-
-		if (!iov) {
-			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_MALLOC);
-			return -1;
+		if (iso) {
+			/* kept by this thread for the next ISO URBs */
+			iov = usbip_iso_pool_iov(&sdev->ud.iso_tx,
+						 3 + urb->number_of_packets);
+			if (!iov) {
+				usbip_event_add(&sdev->ud,
+						SDEV_EVENT_ERROR_MALLOC);
+				return -1;
+			}
 		}
 
-		iovnum = 0;
-
 		/* 1. setup usbip_header */
 		setup_ret_submit_pdu(&pdu_header, urb);
 		usbip_dbg_stub_tx("setup txdata seqnum: %d urb: %p\n",
 				  pdu_header.base.seqnum, urb);
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[iovnum].iov_base = &pdu_header;
-		iov[iovnum].iov_len  = sizeof(pdu_header);
+		iov[iovnum].iov_len  = usbip_header_encode(&sdev->ud,
+							   &pdu_header);
+		txsize += iov[iovnum].iov_len;
 		iovnum++;
-		txsize += sizeof(pdu_header);
 
-		/* 2. setup transfer buffer */
-		if (usb_pipein(urb->pipe) &&
-		    usb_pipetype(urb->pipe) != PIPE_ISOCHRONOUS &&
-		    urb->actual_length > 0) {
-			iov[iovnum].iov_base = urb->transfer_buffer;
-			iov[iovnum].iov_len  = urb->actual_length;
+		/* 2. setup compact iso descriptors, ahead of the data */
+		if (compact && urb->number_of_packets) {
+			iso_desc = usbip_pack_iso_compact(&sdev->ud, urb,
+							  USBIP_RET_SUBMIT,
+							  &iso_len);
+			if (!iso_desc) {
+				usbip_event_add(&sdev->ud,
+						SDEV_EVENT_ERROR_MALLOC);
+				return -1;
+			}
+
+			iov[iovnum].iov_base = iso_desc;
+			iov[iovnum].iov_len  = iso_len;
+			txsize += iso_len;
 			iovnum++;
-			txsize += urb->actual_length;
-		} else if (usb_pipein(urb->pipe) &&
-			   usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		}
+
+		/* 3. setup transfer buffer */
+		if (usb_pipein(urb->pipe) && !iso &&
+		    urb->actual_length > priv->chunk_sent &&
+		    usbip_compress_pipe(&sdev->ud, urb->pipe)) {
+			int i, n;
+
+			n = usbip_compress_iov(&sdev->ud, urb->pipe,
+					       urb->transfer_buffer +
+					       priv->chunk_sent,
+					       urb->actual_length -
+					       priv->chunk_sent,
+					       &iov[iovnum]);
+			for (i = 0; i < n; i++)
+				txsize += iov[iovnum + i].iov_len;
+			iovnum += n;
+		} else if (usb_pipein(urb->pipe) && !iso &&
+			   urb->actual_length > priv->chunk_sent) {
+			/* except what was sent ahead by RET_SUBMIT_CHUNK */
+			iov[iovnum].iov_base = urb->transfer_buffer +
+					       priv->chunk_sent;
+			iov[iovnum].iov_len  = urb->actual_length -
+					       priv->chunk_sent;
+			txsize += iov[iovnum].iov_len;
+			iovnum++;
+		} else if (usb_pipein(urb->pipe) && iso) {
 			/*
 			 * For isochronous packets: actual length is the sum of
 			 * the actual length of the individual, packets, but as
@@ -221,38 +415,33 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 			 * bandwidth the padding is not transmitted.
 			 */
 
-			int i;
+			int i, n;
+			size_t len = 0;
 
-			for (i = 0; i < urb->number_of_packets; i++) {
-				iov[iovnum].iov_base = urb->transfer_buffer +
-					urb->iso_frame_desc[i].offset;
-				iov[iovnum].iov_len =
-					urb->iso_frame_desc[i].actual_length;
-				iovnum++;
-				txsize += urb->iso_frame_desc[i].actual_length;
-			}
+			n = usbip_iso_data_iov(urb, &iov[iovnum]);
+			for (i = 0; i < n; i++)
+				len += iov[iovnum + i].iov_len;
+			iovnum += n;
+			txsize += len;
 
-			if (txsize != sizeof(pdu_header) + urb->actual_length) {
+			if (len != urb->actual_length) {
 				dev_err(&sdev->udev->dev,
 					"actual length of urb %d does not match iso packet sizes %zu\n",
-					urb->actual_length,
-					txsize-sizeof(pdu_header));
-				kfree(iov);
+					urb->actual_length, len);
 				usbip_event_add(&sdev->ud,
 						SDEV_EVENT_ERROR_TCP);
-			   return -1;
+				return -1;
 			}
 		}
 
-		/* 3. setup iso_packet_descriptor */
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		/* 4. setup iso_packet_descriptor */
+		if (iso && !compact) {
 			ssize_t len = 0;
 
 			iso_buffer = usbip_alloc_iso_desc_pdu(urb, &len);
 			if (!iso_buffer) {
 				usbip_event_add(&sdev->ud,
 						SDEV_EVENT_ERROR_MALLOC);
-				kfree(iov);
 				return -1;
 			}
 
@@ -262,19 +451,27 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 			iovnum++;
 		}
 
+		/* 5. setup timestamps */
+		if (sdev->ud.features & USBIP_FEAT_TIMESTAMPS) {
+			setup_stamps(&stamps, priv->received, priv->submitted,
+				     priv->completed);
+			iov[iovnum].iov_base = &stamps;
+			iov[iovnum].iov_len  = sizeof(stamps);
+			txsize += sizeof(stamps);
+			iovnum++;
+		}
+
 		ret = usbip_trx_ops->sendmsg(&sdev->ud, &msg,
 					     iov,  iovnum, txsize);
 		if (ret != txsize) {
 			dev_err(&sdev->udev->dev,
 				"sendmsg failed!, retval %d for %zd\n",
 				ret, txsize);
-			kfree(iov);
 			kfree(iso_buffer);
 			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
 			return -1;
 		}
 
-		kfree(iov);
 		kfree(iso_buffer);
 
 		total_size += txsize;
@@ -289,6 +486,183 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 	return total_size;
 }
 
+/*
+ * Takes the IN data of a chunked request completed but not sent yet. The
+ * request stays in priv_init, or it has been moved to priv_tx or priv_free
+ * in the meantime and is freed only by this thread.
+ */
+static struct stub_priv *dequeue_from_priv_chunk(struct stub_device *sdev,
+						 unsigned int *offset,
+						 unsigned int *len)
+{
+	unsigned long flags;
+	struct stub_priv *priv, *tmp;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+
+	list_for_each_entry_safe(priv, tmp, &sdev->priv_chunk, chunk_list) {
+		list_del_init(&priv->chunk_list);
+		*offset = priv->chunk_sent;
+		*len = priv->chunk_done - priv->chunk_sent;
+		priv->chunk_sent = priv->chunk_done;
+		spin_unlock_irqrestore(&sdev->priv_lock, flags);
+		return priv;
+	}
+
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	return NULL;
+}
+
+static int stub_send_ret_submit_chunk(struct stub_device *sdev)
+{
+	struct stub_priv *priv;
+	unsigned int offset, len;
+
+	struct msghdr msg;
+	struct kvec iov[3];
+	size_t txsize;
+
+	size_t total_size = 0;
+
+	while ((priv = dequeue_from_priv_chunk(sdev, &offset, &len)) != NULL) {
+		int ret;
+		struct usbip_header pdu_header;
+		int iovnum = 2;
+
+		memset(&pdu_header, 0, sizeof(pdu_header));
+		memset(&msg, 0, sizeof(msg));
+
+		/* 1. setup usbip_header */
+		setup_base_pdu(&pdu_header.base, USBIP_RET_SUBMIT_CHUNK,
+			       priv->seqnum);
+		pdu_header.u.ret_submit.actual_length = len;
+		usbip_dbg_stub_tx("setup chunk seqnum: %lu off %u len %u\n",
+				  priv->seqnum, offset, len);
+
+		iov[0].iov_base = &pdu_header;
+		iov[0].iov_len  = usbip_header_encode(&sdev->ud, &pdu_header);
+
+		/* 2. setup transfer buffer */
+		iov[1].iov_base = priv->urb->transfer_buffer + offset;
+		iov[1].iov_len  = len;
+		iov[2].iov_len  = 0;
+
+		if (usbip_compress_pipe(&sdev->ud, priv->urb->pipe))
+			iovnum = 1 + usbip_compress_iov(&sdev->ud,
+							priv->urb->pipe,
+							iov[1].iov_base, len,
+							&iov[1]);
+
+		txsize = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+		ret = usbip_trx_ops->sendmsg(&sdev->ud, &msg, iov, iovnum,
+					     txsize);
+		if (ret != txsize) {
+			dev_err(&sdev->udev->dev,
+				"sendmsg failed!, retval %d for %zd\n",
+				ret, txsize);
+			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
+			return -1;
+		}
+
+		total_size += txsize;
+	}
+
+	return total_size;
+}
+
+/* a completed poll URB, or NULL with *epnum of a stopped endpoint, if any */
+static struct urb *dequeue_from_poll_tx(struct stub_device *sdev, int *epnum)
+{
+	unsigned long flags;
+	struct urb *urb;
+
+	*epnum = -1;
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+
+	urb = list_first_entry_or_null(&sdev->poll_tx, struct urb, urb_list);
+	if (urb) {
+		list_del_init(&urb->urb_list);
+	} else if (sdev->poll_stopped) {
+		*epnum = __ffs(sdev->poll_stopped);
+		__clear_bit(*epnum, &sdev->poll_stopped);
+	}
+
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	return urb;
+}
+
+/*
+ * Pushes reports of polled interrupt IN endpoints. Reports completed before
+ * an endpoint was stopped precede the RET_POLL which tells it.
+ */
+static int stub_send_ret_poll(struct stub_device *sdev)
+{
+	struct urb *urb;
+	int epnum;
+
+	struct msghdr msg;
+	struct kvec iov[2];
+	size_t txsize;
+
+	size_t total_size = 0;
+
+	while ((urb = dequeue_from_poll_tx(sdev, &epnum)) != NULL ||
+	       epnum >= 0) {
+		int ret;
+		struct usbip_header pdu_header;
+
+		memset(&pdu_header, 0, sizeof(pdu_header));
+		memset(&msg, 0, sizeof(msg));
+		memset(&iov, 0, sizeof(iov));
+
+		/* 1. setup usbip_header */
+		setup_base_pdu(&pdu_header.base, USBIP_RET_POLL, 0);
+		pdu_header.base.direction = USBIP_DIR_IN;
+		if (urb) {
+			pdu_header.base.ep = usb_pipeendpoint(urb->pipe);
+			pdu_header.u.ret_submit.status = urb->status;
+			pdu_header.u.ret_submit.actual_length =
+				urb->actual_length;
+		} else {
+			pdu_header.base.ep = epnum;
+			pdu_header.u.ret_submit.status = -ENOENT;
+		}
+		usbip_dbg_stub_tx("setup poll ep %u status %d\n",
+				  pdu_header.base.ep,
+				  pdu_header.u.ret_submit.status);
+		iov[0].iov_base = &pdu_header;
+		iov[0].iov_len  = usbip_header_encode(&sdev->ud, &pdu_header);
+		txsize = iov[0].iov_len;
+
+		/* 2. setup transfer buffer */
+		if (urb && urb->actual_length > 0) {
+			iov[1].iov_base = urb->transfer_buffer;
+			iov[1].iov_len  = urb->actual_length;
+			txsize += urb->actual_length;
+		}
+
+		ret = usbip_trx_ops->sendmsg(&sdev->ud, &msg, iov, 2, txsize);
+		if (ret != txsize) {
+			dev_err(&sdev->udev->dev,
+				"sendmsg failed!, retval %d for %zd\n",
+				ret, txsize);
+			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
+			return -1;
+		}
+
+		if (urb)
+			stub_poll_sent(sdev, urb);
+
+		total_size += txsize;
+	}
+
+	return total_size;
+}
+
 static struct stub_unlink *dequeue_from_unlink_tx(struct stub_device *sdev)
 {
 	unsigned long flags;
@@ -313,7 +687,7 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 	struct stub_unlink *unlink, *tmp;
 
 	struct msghdr msg;
-	struct kvec iov[1];
+	struct kvec iov[2];
 	size_t txsize;
 
 	size_t total_size = 0;
@@ -321,6 +695,7 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 	while ((unlink = dequeue_from_unlink_tx(sdev)) != NULL) {
 		int ret;
 		struct usbip_header pdu_header;
+		struct usbip_stamps stamps;
 
 		txsize = 0;
 		memset(&pdu_header, 0, sizeof(pdu_header));
@@ -331,14 +706,21 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 
 		/* 1. setup usbip_header */
 		setup_ret_unlink_pdu(&pdu_header, unlink);
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+		iov[0].iov_len  = usbip_header_encode(&sdev->ud, &pdu_header);
+		txsize += iov[0].iov_len;
+
+		/* 2. setup timestamps */
+		if (sdev->ud.features & USBIP_FEAT_TIMESTAMPS) {
+			setup_stamps(&stamps, unlink->received, 0,
+				     unlink->completed);
+			iov[1].iov_base = &stamps;
+			iov[1].iov_len  = sizeof(stamps);
+			txsize += sizeof(stamps);
+		}
 
 		ret = usbip_trx_ops->sendmsg(&sdev->ud, &msg, iov,
-				     1, txsize);
+				     2, txsize);
 		if (ret != txsize) {
 			dev_err(&sdev->udev->dev,
 				"sendmsg failed!, retval %d for %zd\n",
@@ -367,11 +749,14 @@ int stub_tx_loop(void *data)
 {
 	struct usbip_device *ud = data;
 	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	unsigned int sched = 0;
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(ud))
 			break;
 
+		usbip_sched_thread(ud, 0, &sched);
+
 		/*
 		 * send_ret_submit comes earlier than send_ret_unlink.  stub_rx
 		 * looks at only priv_init queue. If the completion of a URB is
@@ -386,15 +771,31 @@ int stub_tx_loop(void *data)
 		 * getting the status of the given-backed URB which has the
 		 * status of usb_submit_urb().
 		 */
+		/* data sent ahead must precede its RET_SUBMIT */
+		if (stub_send_ret_submit_chunk(sdev) < 0)
+			break;
+
 		if (stub_send_ret_submit(sdev) < 0)
 			break;
 
 		if (stub_send_ret_unlink(sdev) < 0)
 			break;
 
+		if (stub_send_ret_poll(sdev) < 0)
+			break;
+
+		if (usbip_hb_send(ud, 0) < 0) {
+			usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+			break;
+		}
+
 		wait_event_interruptible(sdev->tx_waitq,
 					 (!list_empty(&sdev->priv_tx) ||
+					  !list_empty(&sdev->priv_chunk) ||
 					  !list_empty(&sdev->unlink_tx) ||
+					  !list_empty(&sdev->poll_tx) ||
+					  READ_ONCE(sdev->poll_stopped) ||
+					  usbip_hb_pending(ud) ||
 					  kthread_should_stop()));
 	}
 
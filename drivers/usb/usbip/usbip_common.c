@@ -19,6 +19,7 @@
  */
 
 #include <asm/byteorder.h>
+#include <asm/unaligned.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
@@ -30,6 +31,22 @@
 
 #include "usbip_common.h"
 
+#define CREATE_TRACE_POINTS
+#include "usbip_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vhci_urb_enqueue);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vhci_tx_submit);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vhci_rx_ret);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vhci_unlink);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_stub_rx_submit);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_stub_complete);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_stub_tx_ret);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_stub_unlink);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vudc_rx_submit);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vudc_complete);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vudc_tx_ret);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usbip_vudc_unlink);
+
 #define DRIVER_AUTHOR "Takahiro Hirofuchi <hirofuchi@users.sourceforge.net>"
 #define DRIVER_DESC "USB/IP Core"
 
@@ -39,7 +56,36 @@ unsigned long usbip_debug_flag = 0xffffffff;
 unsigned long usbip_debug_flag;
 #endif
 EXPORT_SYMBOL_GPL(usbip_debug_flag);
-module_param(usbip_debug_flag, ulong, S_IRUGO|S_IWUSR);
+
+DEFINE_STATIC_KEY_FALSE(usbip_debug_enabled);
+EXPORT_SYMBOL_GPL(usbip_debug_enabled);
+
+/* static_branch_enable() and _disable() do nothing if already so */
+static void usbip_debug_update(void)
+{
+	if (usbip_debug_flag)
+		static_branch_enable(&usbip_debug_enabled);
+	else
+		static_branch_disable(&usbip_debug_enabled);
+}
+
+static int usbip_debug_flag_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_ulong(val, kp);
+	if (!ret)
+		usbip_debug_update();
+	return ret;
+}
+
+static const struct kernel_param_ops usbip_debug_flag_ops = {
+	.set	= usbip_debug_flag_set,
+	.get	= param_get_ulong,
+};
+
+module_param_cb(usbip_debug_flag, &usbip_debug_flag_ops, &usbip_debug_flag,
+		S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(usbip_debug_flag, "debug flags (defined in usbip_common.h)");
 
 /* FIXME */
@@ -58,6 +104,7 @@ static ssize_t usbip_debug_store(struct device *dev,
 {
 	if (sscanf(buf, "%lx", &usbip_debug_flag) != 1)
 		return -EINVAL;
+	usbip_debug_update();
 	return count;
 }
 DEVICE_ATTR_RW(usbip_debug);
@@ -314,6 +361,21 @@ void usbip_dump_header(struct usbip_header *pdu)
 		pr_debug("USBIP_RET_UNLINK: status %d\n",
 			 pdu->u.ret_unlink.status);
 		break;
+	case USBIP_RET_SUBMIT_CHUNK:
+		pr_debug("USBIP_RET_SUBMIT_CHUNK: al %u\n",
+			 pdu->u.ret_submit.actual_length);
+		break;
+	case USBIP_RET_POLL:
+		pr_debug("USBIP_RET_POLL: st %d al %u\n",
+			 pdu->u.ret_submit.status,
+			 pdu->u.ret_submit.actual_length);
+		break;
+	case USBIP_NOP:
+		pr_debug("USBIP_NOP\n");
+		break;
+	case USBIP_RET_NOP:
+		pr_debug("USBIP_RET_NOP\n");
+		break;
 	default:
 		/* NOT REACHED */
 		pr_err("unknown command\n");
@@ -540,6 +602,8 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 		correct_endian_cmd_submit(&pdu->u.cmd_submit, send);
 		break;
 	case USBIP_RET_SUBMIT:
+	case USBIP_RET_SUBMIT_CHUNK:
+	case USBIP_RET_POLL:
 		correct_endian_ret_submit(&pdu->u.ret_submit, send);
 		break;
 	case USBIP_CMD_UNLINK:
@@ -548,6 +612,10 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 	case USBIP_RET_UNLINK:
 		correct_endian_ret_unlink(&pdu->u.ret_unlink, send);
 		break;
+	case USBIP_NOP:
+	case USBIP_RET_NOP:
+		/* the stamp is only read by the client which wrote it */
+		break;
 	default:
 		/* NOT REACHED */
 		pr_err("unknown command\n");
@@ -556,6 +624,214 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 }
 EXPORT_SYMBOL_GPL(usbip_header_correct_endian);
 
+/*
+ * Layout of the union in compact headers, by command: the number of __u32
+ * sent as varints, the signed ones among them and the ones which are
+ * seqnums, and the bytes sent as they are after them.
+ */
+static const struct {
+	u8 words;
+	u8 sign;
+	u8 seqnum;
+	u8 raw;
+} usbip_compact_hdr_layout[8] = {
+	[USBIP_NOP]		 = { 0, 0x00, 0x00, 8 },
+	[USBIP_CMD_SUBMIT]	 = { 5, 0x1e, 0x00, 8 },
+	[USBIP_CMD_UNLINK]	 = { 1, 0x00, 0x01, 0 },
+	[USBIP_RET_SUBMIT]	 = { 5, 0x1f, 0x00, 0 },
+	[USBIP_RET_UNLINK]	 = { 1, 0x01, 0x00, 0 },
+	[USBIP_RET_SUBMIT_CHUNK] = { 5, 0x1f, 0x00, 0 },
+	[USBIP_RET_POLL]	 = { 5, 0x1f, 0x00, 0 },
+	[USBIP_RET_NOP]		 = { 0, 0x00, 0x00, 8 },
+};
+
+#define USBIP_COMPACT_HDR_RAW	0x80
+
+static inline u32 usbip_zigzag(s32 v)
+{
+	return ((u32)v << 1) ^ (u32)(v >> 31);
+}
+
+static inline s32 usbip_unzigzag(u32 v)
+{
+	return (s32)(v >> 1) ^ -(s32)(v & 1);
+}
+
+static u8 *usbip_put_varint(u8 *p, u32 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static const u8 *usbip_get_varint(const u8 *p, const u8 *end, u32 *v)
+{
+	u32 val = 0;
+	int shift;
+
+	for (shift = 0; shift < 35 && p < end; shift += 7) {
+		val |= (u32)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = val;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/* called when a connection is set up, before tcp_rx and tcp_tx run */
+void usbip_compact_hdr_init(struct usbip_device *ud, __u32 devid)
+{
+	ud->compact_hdr.devid = devid;
+	ud->compact_hdr.tx_seqnum = 0;
+	ud->compact_hdr.rx_seqnum = 0;
+}
+EXPORT_SYMBOL_GPL(usbip_compact_hdr_init);
+
+/*
+ * Turns a header in host byte order into what is sent, in place. Returns
+ * the size to send. Only called by tcp_tx, in the order headers are sent.
+ */
+int usbip_header_encode(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	u8 buf[USBIP_COMPACT_HDR_MAX], *p = buf + 3;
+	__u32 *word = (__u32 *)&pdu->u;
+	__u8 *raw;
+	u32 cmd = pdu->base.command & 0x07;	/* all fit in 3 bits */
+	u8 present = 0;
+	u32 v, w;
+	int i;
+
+	if (!(ud->features & USBIP_FEAT_COMPACT_HDR)) {
+		usbip_header_correct_endian(pdu, 1);
+		return sizeof(*pdu);
+	}
+
+	p = usbip_put_varint(p, usbip_zigzag(pdu->base.seqnum -
+					     ud->compact_hdr.tx_seqnum));
+	ud->compact_hdr.tx_seqnum = pdu->base.seqnum;
+
+	for (i = 0; i < usbip_compact_hdr_layout[cmd].words; i++) {
+		w = get_unaligned(&word[i]);
+		if (!w)
+			continue;
+		v = w;
+		if (usbip_compact_hdr_layout[cmd].seqnum & BIT(i))
+			v = usbip_zigzag(pdu->base.seqnum - w);
+		else if (usbip_compact_hdr_layout[cmd].sign & BIT(i))
+			v = usbip_zigzag(w);
+		present |= BIT(i);
+		p = usbip_put_varint(p, v);
+	}
+
+	raw = (__u8 *)&word[usbip_compact_hdr_layout[cmd].words];
+	if (memchr_inv(raw, 0, usbip_compact_hdr_layout[cmd].raw)) {
+		present |= USBIP_COMPACT_HDR_RAW;
+		memcpy(p, raw, usbip_compact_hdr_layout[cmd].raw);
+		p += usbip_compact_hdr_layout[cmd].raw;
+	}
+
+	buf[0] = p - buf - 1;
+	buf[1] = (cmd << 5) | ((pdu->base.direction & 1) << 4) |
+		 (pdu->base.ep & 0x0f);
+	buf[2] = present;
+
+	memcpy(pdu, buf, p - buf);
+	return p - buf;
+}
+EXPORT_SYMBOL_GPL(usbip_header_encode);
+
+static int usbip_header_decode(struct usbip_device *ud,
+			       struct usbip_header *pdu, const u8 *p,
+			       const u8 *end)
+{
+	__u32 *word = (__u32 *)&pdu->u;
+	u32 cmd = p[0] >> 5;
+	u8 present = p[1];
+	u32 v;
+	int i;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = cmd;
+	pdu->base.direction = (p[0] >> 4) & 1;
+	pdu->base.ep = p[0] & 0x0f;
+	pdu->base.devid = ud->compact_hdr.devid;
+	p += 2;
+
+	p = usbip_get_varint(p, end, &v);
+	if (!p)
+		return -EPROTO;
+	pdu->base.seqnum = ud->compact_hdr.rx_seqnum + usbip_unzigzag(v);
+	ud->compact_hdr.rx_seqnum = pdu->base.seqnum;
+
+	for (i = 0; i < usbip_compact_hdr_layout[cmd].words; i++) {
+		if (!(present & BIT(i)))
+			continue;
+		p = usbip_get_varint(p, end, &v);
+		if (!p)
+			return -EPROTO;
+		if (usbip_compact_hdr_layout[cmd].seqnum & BIT(i))
+			v = pdu->base.seqnum - usbip_unzigzag(v);
+		else if (usbip_compact_hdr_layout[cmd].sign & BIT(i))
+			v = usbip_unzigzag(v);
+		put_unaligned(v, &word[i]);
+	}
+
+	if (present & USBIP_COMPACT_HDR_RAW) {
+		if (end - p < usbip_compact_hdr_layout[cmd].raw)
+			return -EPROTO;
+		memcpy(&word[usbip_compact_hdr_layout[cmd].words], p,
+		       usbip_compact_hdr_layout[cmd].raw);
+		p += usbip_compact_hdr_layout[cmd].raw;
+	}
+
+	return p == end ? 0 : -EPROTO;
+}
+
+/*
+ * Receives a header, compact or not, into host byte order. Returns
+ * sizeof(*pdu) once it is, or what usbip_recv() returned on an error.
+ */
+int usbip_recv_header(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	u8 buf[USBIP_COMPACT_HDR_MAX];
+	int ret;
+
+	if (!(ud->features & USBIP_FEAT_COMPACT_HDR)) {
+		ret = usbip_recv(ud, pdu, sizeof(*pdu));
+		if (ret == sizeof(*pdu))
+			usbip_header_correct_endian(pdu, 0);
+		return ret;
+	}
+
+	ret = usbip_recv(ud, buf, 1);
+	if (ret != 1)
+		return ret;
+
+	if (buf[0] < 3 || buf[0] >= sizeof(buf)) {
+		pr_err("invalid compact header size %u\n", buf[0]);
+		return -EPROTO;
+	}
+
+	ret = usbip_recv(ud, buf + 1, buf[0]);
+	if (ret != buf[0])
+		return ret < 0 ? ret : -EPIPE;
+
+	ret = usbip_header_decode(ud, pdu, buf + 1, buf + 1 + buf[0]);
+	if (ret) {
+		pr_err("invalid compact header\n");
+		return ret;
+	}
+
+	return sizeof(*pdu);
+}
+EXPORT_SYMBOL_GPL(usbip_recv_header);
+
 static void usbip_iso_packet_correct_endian(
 		struct usbip_iso_packet_descriptor *iso, int send)
 {
@@ -715,6 +991,311 @@ void usbip_pad_iso(struct usbip_device *ud, struct urb *urb)
 }
 EXPORT_SYMBOL_GPL(usbip_pad_iso);
 
+static void *usbip_iso_pool_desc(struct usbip_iso_pool *pool, size_t len)
+{
+	void *buf;
+
+	if (len <= pool->desc_len)
+		return pool->desc;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return NULL;
+
+	kfree(pool->desc);
+	pool->desc = buf;
+	pool->desc_len = len;
+
+	return buf;
+}
+
+struct kvec *usbip_iso_pool_iov(struct usbip_iso_pool *pool, int num)
+{
+	struct kvec *iov;
+
+	if (num <= pool->iov_num)
+		return pool->iov;
+
+	iov = kmalloc_array(num, sizeof(*iov), GFP_KERNEL);
+	if (!iov)
+		return NULL;
+
+	kfree(pool->iov);
+	pool->iov = iov;
+	pool->iov_num = num;
+
+	return iov;
+}
+EXPORT_SYMBOL_GPL(usbip_iso_pool_iov);
+
+void usbip_iso_pool_free(struct usbip_iso_pool *pool)
+{
+	kfree(pool->desc);
+	kfree(pool->iov);
+	memset(pool, 0, sizeof(*pool));
+}
+EXPORT_SYMBOL_GPL(usbip_iso_pool_free);
+
+static void usbip_iso_error(struct usbip_device *ud, struct urb *urb)
+{
+	dev_err(&urb->dev->dev, "invalid compact iso descriptors\n");
+
+	if (ud->side == USBIP_STUB || ud->side == USBIP_VUDC)
+		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
+	else
+		usbip_event_add(ud, VDEV_EVENT_ERROR_TCP);
+}
+
+/*
+ * usbip_pack_iso_compact - encode the descriptors of an ISO URB
+ * @ud: the device, whose tx pool holds the result
+ * @urb: the URB with number_of_packets > 0
+ * @cmd: USBIP_CMD_SUBMIT or USBIP_RET_SUBMIT
+ * @bufflen: the length of the result
+ *
+ * CMD_SUBMIT carries the lengths, RET_SUBMIT the actual lengths and the
+ * status of the packets. When the offsets of CMD_SUBMIT are not implicit,
+ * full descriptors are sent instead of runs. The result is valid until the
+ * next call for the device.
+ */
+void *usbip_pack_iso_compact(struct usbip_device *ud, struct urb *urb, int cmd,
+			     ssize_t *bufflen)
+{
+	struct usb_iso_packet_descriptor *uiso = urb->iso_frame_desc;
+	struct usbip_iso_packet_descriptor *iso;
+	struct usbip_iso_run *run;
+	int np = urb->number_of_packets;
+	__be32 *nr_runs;
+	u32 length, status, offset = 0;
+	int i, n = 0;
+
+	nr_runs = usbip_iso_pool_desc(&ud->iso_tx, sizeof(*nr_runs) +
+				      np * sizeof(*iso));
+	if (!nr_runs)
+		return NULL;
+
+	run = (struct usbip_iso_run *) (nr_runs + 1);
+	for (i = 0; i < np; i++) {
+		if (cmd == USBIP_CMD_SUBMIT) {
+			if (uiso[i].offset != offset)
+				goto full;
+			offset += uiso[i].length;
+			length = uiso[i].length;
+			status = 0;
+		} else {
+			length = uiso[i].actual_length;
+			status = uiso[i].status;
+		}
+
+		if (n && run[n - 1].length == length &&
+		    run[n - 1].status == status) {
+			run[n - 1].count++;
+			continue;
+		}
+
+		run[n].count = 1;
+		run[n].length = length;
+		run[n].status = status;
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		cpu_to_be32s(&run[i].count);
+		cpu_to_be32s(&run[i].length);
+		cpu_to_be32s(&run[i].status);
+	}
+
+	*nr_runs = cpu_to_be32(n);
+	*bufflen = sizeof(*nr_runs) + n * sizeof(*run);
+
+	return nr_runs;
+
+full:
+	iso = (struct usbip_iso_packet_descriptor *) (nr_runs + 1);
+	for (i = 0; i < np; i++) {
+		usbip_pack_iso(&iso[i], &uiso[i], 1);
+		usbip_iso_packet_correct_endian(&iso[i], 1);
+	}
+
+	*nr_runs = cpu_to_be32(USBIP_ISO_RUNS_FULL);
+	*bufflen = sizeof(*nr_runs) + np * sizeof(*iso);
+
+	return nr_runs;
+}
+EXPORT_SYMBOL_GPL(usbip_pack_iso_compact);
+
+/*
+ * usbip_recv_iso_compact - receive the descriptors sent by
+ * usbip_pack_iso_compact(). Some members of urb must be substituted before.
+ */
+int usbip_recv_iso_compact(struct usbip_device *ud, struct urb *urb, int cmd)
+{
+	struct usb_iso_packet_descriptor *uiso = urb->iso_frame_desc;
+	struct usbip_iso_run *run;
+	int np = urb->number_of_packets;
+	u32 count, length, status;
+	u32 offset = 0, total = 0;
+	__be32 nr_runs;
+	int i = 0, n, r;
+	int size;
+	int ret;
+
+	if (!usb_pipeisoc(urb->pipe) || np == 0)
+		return 0;
+
+	ret = usbip_recv(ud, &nr_runs, sizeof(nr_runs));
+	if (ret != sizeof(nr_runs))
+		goto err;
+
+	if (be32_to_cpu(nr_runs) == USBIP_ISO_RUNS_FULL)
+		return usbip_recv_iso(ud, urb);
+
+	n = be32_to_cpu(nr_runs);
+	if (n <= 0 || n > np)
+		goto err;
+
+	size = n * sizeof(*run);
+	run = usbip_iso_pool_desc(&ud->iso_rx, size);
+	if (!run)
+		return -ENOMEM;
+
+	ret = usbip_recv(ud, run, size);
+	if (ret != size)
+		goto err;
+
+	for (r = 0; r < n; r++) {
+		count = be32_to_cpu(run[r].count);
+		length = be32_to_cpu(run[r].length);
+		status = be32_to_cpu(run[r].status);
+
+		if (count > np - i)
+			goto err;
+
+		for (; count; count--, i++) {
+			if (cmd == USBIP_CMD_SUBMIT) {
+				if (length > urb->transfer_buffer_length -
+					     offset)
+					goto err;
+				uiso[i].offset = offset;
+				uiso[i].length = length;
+				uiso[i].actual_length = 0;
+				uiso[i].status = 0;
+				offset += length;
+			} else {
+				if (length > uiso[i].length)
+					goto err;
+				uiso[i].actual_length = length;
+				uiso[i].status = status;
+				total += length;
+			}
+		}
+	}
+
+	if (i != np || (cmd == USBIP_RET_SUBMIT && total != urb->actual_length))
+		goto err;
+
+	return 0;
+
+err:
+	usbip_iso_error(ud, urb);
+	return -EPIPE;
+}
+EXPORT_SYMBOL_GPL(usbip_recv_iso_compact);
+
+/*
+ * Sets kvecs on the data of the packets of an ISO URB, in the order they are
+ * transferred without padding. Adjacent packets share a kvec. Returns the
+ * number of kvecs, at most number_of_packets.
+ */
+int usbip_iso_data_iov(struct urb *urb, struct kvec *iov)
+{
+	struct usb_iso_packet_descriptor *uiso = urb->iso_frame_desc;
+	void *base;
+	int i, n = 0;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		if (!uiso[i].actual_length)
+			continue;
+
+		base = urb->transfer_buffer + uiso[i].offset;
+		if (n && iov[n - 1].iov_base + iov[n - 1].iov_len == base) {
+			iov[n - 1].iov_len += uiso[i].actual_length;
+			continue;
+		}
+
+		iov[n].iov_base = base;
+		iov[n].iov_len = uiso[i].actual_length;
+		n++;
+	}
+
+	return n;
+}
+EXPORT_SYMBOL_GPL(usbip_iso_data_iov);
+
+/* Receive data over TCP/IP into several buffers, the kvecs are consumed. */
+static int usbip_recvv(struct usbip_device *ud, struct kvec *iov, int num,
+		       int size)
+{
+	struct msghdr msg;
+	int result;
+	int total = 0;
+
+	while (size > 0) {
+		memset(&msg, 0, sizeof(msg));
+		result = usbip_trx_ops->recvmsg(ud, &msg, iov, num, size,
+						MSG_WAITALL);
+		if (result <= 0)
+			return result;
+
+		size -= result;
+		total += result;
+
+		while (num && result >= iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			num--;
+		}
+		if (num) {
+			iov->iov_base += result;
+			iov->iov_len -= result;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * usbip_recv_iso_data - receive ISO IN data right into the packets, after
+ * usbip_recv_iso_compact(). No padding needs to be restored.
+ */
+int usbip_recv_iso_data(struct usbip_device *ud, struct urb *urb)
+{
+	struct kvec *iov;
+	int num;
+	int ret;
+
+	if (usb_pipeout(urb->pipe) || urb->actual_length == 0)
+		return 0;
+
+	if (urb->number_of_packets == 0)
+		return usbip_recv_xbuff(ud, urb);
+
+	iov = usbip_iso_pool_iov(&ud->iso_rx, urb->number_of_packets);
+	if (!iov)
+		return -ENOMEM;
+
+	num = usbip_iso_data_iov(urb, iov);
+	ret = usbip_recvv(ud, iov, num, urb->actual_length);
+	if (ret != urb->actual_length) {
+		dev_err(&urb->dev->dev, "recv iso data, %d\n", ret);
+		usbip_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return -EPIPE;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(usbip_recv_iso_data);
+
 /* some members of urb must be substituted before. */
 int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb)
 {
@@ -750,7 +1331,7 @@ int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb)
 		}
 	}
 
-	ret = usbip_recv(ud, urb->transfer_buffer, size);
+	ret = usbip_recv_payload(ud, urb->pipe, urb->transfer_buffer, size);
 	if (ret != size) {
 		dev_err(&urb->dev->dev, "recv xbuf, %d\n", ret);
 		if (ud->side == USBIP_STUB || ud->side == USBIP_VUDC) {
@@ -768,19 +1349,29 @@ EXPORT_SYMBOL_GPL(usbip_recv_xbuff);
 static int usbip_kernel_sendmsg(struct usbip_device *udev,
 	struct msghdr *msg, struct kvec *vec, size_t num, size_t len)
 {
-	return kernel_sendmsg(udev->tcp_socket, msg, vec,  num, len);
+	int ret = kernel_sendmsg(udev->tcp_socket, msg, vec,  num, len);
+
+	if (ret > 0 && udev->stats)
+		usbip_stats_add(udev, bytes_out, ret);
+	return ret;
 }
 
 static int usbip_kernel_recvmsg(struct usbip_device *udev,
 	struct msghdr *msg, struct kvec *vec, size_t num, size_t len, int flags)
 {
+	int ret;
+
 	udev->tcp_socket->sk->sk_allocation = GFP_NOIO;
 	msg->msg_name       = NULL;
 	msg->msg_namelen    = 0;
 	msg->msg_control    = NULL;
 	msg->msg_controllen = 0;
 	msg->msg_flags      = MSG_NOSIGNAL;
-	return kernel_recvmsg(udev->tcp_socket, msg, vec, num, len, flags);
+	ret = kernel_recvmsg(udev->tcp_socket, msg, vec, num, len, flags);
+
+	if (ret > 0 && udev->stats)
+		usbip_stats_add(udev, bytes_in, ret);
+	return ret;
 }
 
 int usbip_kernel_link(struct usbip_device *udev, int sockfd)
@@ -821,15 +1412,20 @@ static int __init usbip_core_init(void)
 	int ret;
 
 	pr_info(DRIVER_DESC " v" USBIP_VERSION "\n");
+	usbip_debug_update();
+
 	ret = usbip_init_eh();
 	if (ret)
 		return ret;
 
+	usbip_stats_init();
+
 	return 0;
 }
 
 static void __exit usbip_core_exit(void)
 {
+	usbip_stats_finish();
 	usbip_finish_eh();
 	return;
 }
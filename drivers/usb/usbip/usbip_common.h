@@ -24,16 +24,23 @@
 #include <linux/compiler.h>
 #include <linux/device.h>
 #include <linux/interrupt.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
 #include <linux/net.h>
+#include <linux/percpu.h>
 #include <linux/printk.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/usb.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/sched/task.h>
 #include <uapi/linux/usbip.h>
 #include "usbip_ux.h"
 
+struct dentry;
+struct seq_file;
+
 #define USBIP_VERSION "1.0.0"
 
 #undef pr_fmt
@@ -64,22 +71,32 @@ enum {
 	usbip_debug_ux		= (1 << 13)
 };
 
-#define usbip_dbg_flag_xmit	(usbip_debug_flag & usbip_debug_xmit)
-#define usbip_dbg_flag_vhci_rh	(usbip_debug_flag & usbip_debug_vhci_rh)
-#define usbip_dbg_flag_vhci_hc	(usbip_debug_flag & usbip_debug_vhci_hc)
-#define usbip_dbg_flag_vhci_rx	(usbip_debug_flag & usbip_debug_vhci_rx)
-#define usbip_dbg_flag_vhci_tx	(usbip_debug_flag & usbip_debug_vhci_tx)
-#define usbip_dbg_flag_stub_rx	(usbip_debug_flag & usbip_debug_stub_rx)
-#define usbip_dbg_flag_stub_tx	(usbip_debug_flag & usbip_debug_stub_tx)
-#define usbip_dbg_flag_vhci_sysfs  (usbip_debug_flag & usbip_debug_vhci_sysfs)
-#define usbip_dbg_flag_ux	(usbip_debug_flag & usbip_debug_ux)
+/*
+ * usbip_debug_enabled is on while any flag is set, so that a disabled debug
+ * message costs a patched out branch and no load of usbip_debug_flag.
+ */
+DECLARE_STATIC_KEY_FALSE(usbip_debug_enabled);
+
+#define usbip_dbg_flag(flag)					\
+	(static_branch_unlikely(&usbip_debug_enabled) &&	\
+	 (usbip_debug_flag & (flag)))
+
+#define usbip_dbg_flag_xmit	usbip_dbg_flag(usbip_debug_xmit)
+#define usbip_dbg_flag_vhci_rh	usbip_dbg_flag(usbip_debug_vhci_rh)
+#define usbip_dbg_flag_vhci_hc	usbip_dbg_flag(usbip_debug_vhci_hc)
+#define usbip_dbg_flag_vhci_rx	usbip_dbg_flag(usbip_debug_vhci_rx)
+#define usbip_dbg_flag_vhci_tx	usbip_dbg_flag(usbip_debug_vhci_tx)
+#define usbip_dbg_flag_stub_rx	usbip_dbg_flag(usbip_debug_stub_rx)
+#define usbip_dbg_flag_stub_tx	usbip_dbg_flag(usbip_debug_stub_tx)
+#define usbip_dbg_flag_vhci_sysfs  usbip_dbg_flag(usbip_debug_vhci_sysfs)
+#define usbip_dbg_flag_ux	usbip_dbg_flag(usbip_debug_ux)
 
 extern unsigned long usbip_debug_flag;
 extern struct device_attribute dev_attr_usbip_debug;
 
 #define usbip_dbg_with_flag(flag, fmt, args...)		\
 	do {						\
-		if (flag & usbip_debug_flag)		\
+		if (usbip_dbg_flag(flag))		\
 			pr_debug(fmt, ##args);		\
 	} while (0)
 
@@ -117,7 +134,7 @@ extern struct device_attribute dev_attr_usbip_debug;
  *
  * Each request is transferred across the network to its counterpart, which
  * facilitates the normal USB communication. The values contained in the headers
- * are basically the same as in a URB. Currently, four request types are
+ * are basically the same as in a URB. Currently, eight request types are
  * defined:
  *
  *  - USBIP_CMD_SUBMIT: a USB request block, corresponds to usb_submit_urb()
@@ -133,11 +150,33 @@ extern struct device_attribute dev_attr_usbip_debug;
  *  - USBIP_RET_UNLINK: the result of USBIP_CMD_UNLINK
  *    (server to client)
  *
+ *  - USBIP_RET_SUBMIT_CHUNK: IN data of a pending USBIP_CMD_SUBMIT sent
+ *    ahead of its USBIP_RET_SUBMIT, only with USBIP_FEAT_CHUNKED. It has
+ *    the layout of USBIP_RET_SUBMIT, actual_length bytes of data follow.
+ *    The USBIP_RET_SUBMIT then carries only the data not sent ahead.
+ *    (server to client)
+ *
+ *  - USBIP_RET_POLL: a completion of an interrupt IN endpoint polled by the
+ *    server, only with USBIP_FEAT_INT_POLL. It has the layout of
+ *    USBIP_RET_SUBMIT with seqnum 0, actual_length bytes of data follow.
+ *    Status -ENOENT tells that the server is not polling the endpoint.
+ *    (server to client)
+ *
+ *  - USBIP_NOP: a heartbeat, only with USBIP_FEAT_HEARTBEAT
+ *    (client to server)
+ *
+ *  - USBIP_RET_NOP: the answer to USBIP_NOP, with its seqnum and stamp
+ *    (server to client)
+ *
  */
+#define USBIP_NOP		0x0000
 #define USBIP_CMD_SUBMIT	0x0001
 #define USBIP_CMD_UNLINK	0x0002
 #define USBIP_RET_SUBMIT	0x0003
 #define USBIP_RET_UNLINK	0x0004
+#define USBIP_RET_SUBMIT_CHUNK	0x0005
+#define USBIP_RET_POLL		0x0006
+#define USBIP_RET_NOP		0x0007
 
 #define USBIP_DIR_OUT	0x00
 #define USBIP_DIR_IN	0x01
@@ -213,6 +252,15 @@ struct usbip_header_ret_unlink {
 	__s32 status;
 } __packed;
 
+/**
+ * struct usbip_header_nop - USBIP_NOP and USBIP_RET_NOP packet header
+ * @stamp: when the client sent USBIP_NOP, in its own clock and byte order;
+ *	   the server gives it back as it is
+ */
+struct usbip_header_nop {
+	__u64 stamp;
+} __packed;
+
 /**
  * struct usbip_header - common header for all usbip packets
  * @base: the basic header
@@ -226,9 +274,38 @@ struct usbip_header {
 		struct usbip_header_ret_submit	ret_submit;
 		struct usbip_header_cmd_unlink	cmd_unlink;
 		struct usbip_header_ret_unlink	ret_unlink;
+		struct usbip_header_nop		nop;
 	} u;
 } __packed;
 
+/*
+ * With USBIP_FEAT_COMPACT_HDR, struct usbip_header is sent as
+ *
+ *   u8 size      bytes of the header following this one
+ *   u8 type      command in bits 5-7, direction in bit 4, ep in bits 0-3
+ *   u8 present   bit n set when the n-th __u32 of the union is not 0,
+ *                bit 7 when the trailing bytes are there
+ *   varint       seqnum, as the difference to the previous header sent
+ *                on the connection in the same direction
+ *   varint[]     the __u32 of the union which are present
+ *   u8[8]        the setup packet of CMD_SUBMIT, or the stamp of NOP and
+ *                RET_NOP, if present
+ *
+ * Varints are unsigned LEB128. Signed fields and the seqnum difference are
+ * zigzag encoded, the seqnum of CMD_UNLINK is sent as its difference to the
+ * seqnum of the header. devid is implied by the connection. Fields absent
+ * from the header are 0, so a RET_SUBMIT of a bulk transfer takes 6 or 7
+ * bytes rather than 48.
+ */
+#define USBIP_COMPACT_HDR_MAX	(3 + 5 + 5 * 5 + 8)
+
+/* USBIP_FEAT_COMPACT_HDR state of a connection */
+struct usbip_compact_hdr {
+	__u32 devid;		/* of the headers received */
+	__u32 tx_seqnum;	/* of the last header sent, by tcp_tx */
+	__u32 rx_seqnum;	/* of the last header received, by tcp_rx */
+};
+
 /*
  * This is the same as usb_iso_packet_descriptor but packed for pdu.
  */
@@ -239,6 +316,129 @@ struct usbip_iso_packet_descriptor {
 	__u32 status;
 } __packed;
 
+/*
+ * With USBIP_FEAT_ISO_COMPACT, the descriptors are sent ahead of the data as
+ * a count of runs followed by the runs of packets with the same values.
+ * Offsets are implicit, each packet follows the previous one.
+ */
+struct usbip_iso_run {
+	__u32 count;
+	__u32 length;			/* actual_length in RET_SUBMIT */
+	__u32 status;			/* 0 in CMD_SUBMIT */
+} __packed;
+
+/* in place of the count of runs, usbip_iso_packet_descriptors follow */
+#define USBIP_ISO_RUNS_FULL	0xffffffff
+
+/**
+ * struct usbip_stamps - trailer of RET_SUBMIT and RET_UNLINK
+ * @received: CMD_SUBMIT or CMD_UNLINK received
+ * @submitted: the URB given to the host controller
+ * @completed: the URB completed
+ * @sent: the answer about to be sent
+ *
+ * With USBIP_FEAT_TIMESTAMPS, it follows the data and ISO descriptors of
+ * RET_SUBMIT, and the header of RET_UNLINK. Times are nanoseconds of the
+ * monotonic clock of the server, big endian, 0 if not known. In RET_UNLINK,
+ * submitted is 0 and completed is that of the unlinked URB if it was still
+ * pending. Only differences of them make sense to the client.
+ */
+struct usbip_stamps {
+	__be64 received;
+	__be64 submitted;
+	__be64 completed;
+	__be64 sent;
+} __packed;
+
+/* ISO descriptor and kvec buffers kept by a thread, grown on demand */
+struct usbip_iso_pool {
+	void *desc;
+	size_t desc_len;
+	struct kvec *iov;
+	int iov_num;
+};
+
+/* USBIP_FEAT_COMPRESS, see usbip_compress.c */
+#define USBIP_COMPRESS_BLOCK	(64 * 1024)
+#define USBIP_COMPRESS_STORED	0x80000000
+
+/* adaptation of an endpoint the tx thread sends bulk data to */
+struct usbip_compress_ep {
+	unsigned int ratio;	/* wire per raw byte in 1/256, smoothed */
+	unsigned int skip;	/* payloads to store before trying again */
+	unsigned int backoff;
+};
+
+struct usbip_compress {
+	/* tx thread */
+	void *wrkmem;
+	void *tx_buf;
+	size_t tx_len;
+	__be32 tx_word;
+	struct usbip_compress_ep ep[16];
+
+	/* rx thread, a compressed block */
+	void *rx_buf;
+};
+
+/* log2 histograms of microseconds, see usbip_stats.c */
+#define USBIP_LAT_BUCKETS	24
+
+enum usbip_lat {
+	USBIP_LAT_QUEUE,	/* queued until sent */
+	USBIP_LAT_RET,		/* CMD_SUBMIT sent until RET_SUBMIT received */
+	USBIP_LAT_SERVICE,	/* submitted until completed */
+	USBIP_LAT_NR,
+};
+
+/* counters of a device on a CPU, all u64 */
+struct usbip_stats {
+	u64 submitted[4];	/* by usb_pipetype() */
+	u64 completed[4];
+	u64 unlinked[4];
+	u64 bytes_out;
+	u64 bytes_in;
+	u64 alloc_failures;
+	u64 compress_raw;	/* payloads compressed, before and after */
+	u64 compress_wire;
+	u64 compress_skipped;	/* payloads sent as they are */
+	u64 decompress_wire;
+	u64 decompress_raw;
+	u64 latency[USBIP_LAT_NR][USBIP_LAT_BUCKETS];
+};
+
+#define usbip_stats_inc(ud, field)	this_cpu_inc((ud)->stats->field)
+#define usbip_stats_add(ud, field, n)	this_cpu_add((ud)->stats->field, (n))
+
+/* placement of the rx and tx threads, see usbip_sched.c */
+#define USBIP_SCHED_CPU_ANY	-1
+#define USBIP_SCHED_CPU_AUTO	-2
+
+struct usbip_sched {
+	int cpu;
+	int policy;		/* SCHED_NORMAL or SCHED_FIFO */
+	int prio;		/* nice, or the real-time priority */
+	int auto_cpu;		/* found by USBIP_SCHED_CPU_AUTO, or -1 */
+	int node;
+	unsigned int gen;	/* bumped by each change */
+};
+
+/* USBIP_FEAT_HEARTBEAT, see usbip_heartbeat.c */
+struct usbip_heartbeat {
+	/* server: the last USBIP_NOP to answer */
+	int echo;
+	__u32 echo_seqnum;
+	__u64 echo_stamp;
+
+	/* client */
+	int due;		/* USBIP_NOP to send */
+	__u32 seqnum;
+	unsigned int misses;	/* intervals the server sent nothing in */
+	s64 last;		/* round trips in ns */
+	s64 srtt;
+	s64 rttvar;
+};
+
 enum usbip_side {
 	USBIP_VHCI,
 	USBIP_STUB,
@@ -250,24 +450,29 @@ enum usbip_side {
 #define USBIP_EH_BYE		(1 << 1)
 #define USBIP_EH_RESET		(1 << 2)
 #define USBIP_EH_UNUSABLE	(1 << 3)
+/* not handled, counts the event in alloc_failures of usbip_stats */
+#define USBIP_EH_MALLOC		(1 << 4)
 
 #define	SDEV_EVENT_REMOVED	(USBIP_EH_SHUTDOWN | USBIP_EH_BYE)
 #define	SDEV_EVENT_DOWN		(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 #define	SDEV_EVENT_ERROR_TCP	(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 #define	SDEV_EVENT_ERROR_SUBMIT	(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
-#define	SDEV_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE)
+#define	SDEV_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE | \
+				 USBIP_EH_MALLOC)
 
 #define VUDC_EVENT_REMOVED   (USBIP_EH_SHUTDOWN | USBIP_EH_RESET | USBIP_EH_BYE)
 #define	VUDC_EVENT_DOWN		(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 #define	VUDC_EVENT_ERROR_TCP	(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 /* catastrophic emulated usb error */
 #define	VUDC_EVENT_ERROR_USB	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE)
-#define	VUDC_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE)
+#define	VUDC_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE | \
+				 USBIP_EH_MALLOC)
 
 #define	VDEV_EVENT_REMOVED	(USBIP_EH_SHUTDOWN | USBIP_EH_BYE)
 #define	VDEV_EVENT_DOWN		(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 #define	VDEV_EVENT_ERROR_TCP	(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
-#define	VDEV_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE)
+#define	VDEV_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE | \
+				 USBIP_EH_MALLOC)
 
 /* a common structure for stub_device and vhci_device */
 struct usbip_device {
@@ -277,14 +482,39 @@ struct usbip_device {
 	/* lock for status */
 	spinlock_t lock;
 
+	/* negotiated protocol extensions, USBIP_FEAT_* */
+	unsigned long features;
+
 	struct socket *tcp_socket;
 	struct usbip_ux *ux;
 
 	struct task_struct *tcp_rx;
 	struct task_struct *tcp_tx;
 
+	/* for tcp_tx and tcp_rx, freed when the connection is shut down */
+	struct usbip_iso_pool iso_tx;
+	struct usbip_iso_pool iso_rx;
+
+	/* protected by lock */
+	struct usbip_sched sched;
+
+	/* protected by lock */
+	struct usbip_heartbeat hb;
+
+	/* reset with the connection, see usbip_compact_hdr_init() */
+	struct usbip_compact_hdr compact_hdr;
+
+	/* for tcp_tx and tcp_rx, freed by usbip_compress_free() */
+	struct usbip_compress compress;
+
+	/* per-CPU, from usbip_stats_alloc() */
+	struct usbip_stats __percpu *stats;
+	void (*stats_show)(struct usbip_device *ud, struct seq_file *m);
+	struct dentry *stats_dentry;
+
 	unsigned long event;
 	wait_queue_head_t eh_waitq;
+	struct work_struct eh_work;
 
 	struct eh_ops {
 		void (*shutdown)(struct usbip_device *);
@@ -319,6 +549,9 @@ int usbip_recv(struct usbip_device *ud, void *buf, int size);
 void usbip_pack_pdu(struct usbip_header *pdu, struct urb *urb, int cmd,
 		    int pack);
 void usbip_header_correct_endian(struct usbip_header *pdu, int send);
+void usbip_compact_hdr_init(struct usbip_device *ud, __u32 devid);
+int usbip_header_encode(struct usbip_device *ud, struct usbip_header *pdu);
+int usbip_recv_header(struct usbip_device *ud, struct usbip_header *pdu);
 
 struct usbip_iso_packet_descriptor*
 usbip_alloc_iso_desc_pdu(struct urb *urb, ssize_t *bufflen);
@@ -328,6 +561,50 @@ int usbip_recv_iso(struct usbip_device *ud, struct urb *urb);
 void usbip_pad_iso(struct usbip_device *ud, struct urb *urb);
 int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb);
 
+struct kvec *usbip_iso_pool_iov(struct usbip_iso_pool *pool, int num);
+void usbip_iso_pool_free(struct usbip_iso_pool *pool);
+void *usbip_pack_iso_compact(struct usbip_device *ud, struct urb *urb, int cmd,
+			     ssize_t *bufflen);
+int usbip_recv_iso_compact(struct usbip_device *ud, struct urb *urb, int cmd);
+int usbip_iso_data_iov(struct urb *urb, struct kvec *iov);
+int usbip_recv_iso_data(struct usbip_device *ud, struct urb *urb);
+
+/* usbip_compress.c */
+int usbip_compress_pipe(struct usbip_device *ud, unsigned int pipe);
+int usbip_compress_iov(struct usbip_device *ud, unsigned int pipe, void *buf,
+		       int len, struct kvec *iov);
+int usbip_recv_compressed(struct usbip_device *ud, void *buf, int size,
+			  u32 *stored);
+int usbip_recv_payload(struct usbip_device *ud, unsigned int pipe, void *buf,
+		       int size);
+void usbip_compress_free(struct usbip_device *ud);
+
+/* usbip_stats.c */
+void usbip_stats_init(void);
+void usbip_stats_finish(void);
+int usbip_stats_alloc(struct usbip_device *ud, const char *name,
+		      void (*show)(struct usbip_device *, struct seq_file *));
+void usbip_stats_free(struct usbip_device *ud);
+void usbip_stats_latency(struct usbip_device *ud, enum usbip_lat lat,
+			 ktime_t start);
+void usbip_stats_queue(struct seq_file *m, const char *name, unsigned int n);
+
+/* usbip_sched.c */
+void usbip_sched_init(struct usbip_device *ud);
+int usbip_sched_print(struct usbip_device *ud, char *buf, size_t size);
+int usbip_sched_set(struct usbip_device *ud, const char *buf);
+void usbip_sched_thread(struct usbip_device *ud, int rx, unsigned int *seen);
+
+/* usbip_heartbeat.c */
+void usbip_hb_init(struct usbip_device *ud);
+int usbip_hb_pending(struct usbip_device *ud);
+int usbip_hb_send(struct usbip_device *ud, __u32 devid);
+void usbip_hb_recv_nop(struct usbip_device *ud, struct usbip_header *pdu);
+void usbip_hb_recv_ret(struct usbip_device *ud, struct usbip_header *pdu);
+void usbip_hb_alive(struct usbip_device *ud);
+int usbip_hb_tick(struct usbip_device *ud, unsigned int max_misses);
+int usbip_hb_print(struct usbip_device *ud, char *buf, size_t size);
+
 /* usbip_event.c */
 int usbip_init_eh(void);
 void usbip_finish_eh(void);
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Bulk data of USBIP_FEAT_COMPRESS.
+ *
+ * The data of CMD_SUBMIT, RET_SUBMIT and RET_SUBMIT_CHUNK on bulk pipes is
+ * sent as a sequence of blocks, each starting with a big endian __be32:
+ *
+ *	USBIP_COMPRESS_STORED | n	n bytes of data follow as they are
+ *	n				n bytes of LZ4 follow, which give the
+ *					next USBIP_COMPRESS_BLOCK bytes of
+ *					data, or the rest if less
+ *
+ * Compressed blocks start at multiples of USBIP_COMPRESS_BLOCK of the data,
+ * which is STUB_CHUNK_SIZE, so that usbip-host can receive a chunked
+ * transfer chunk by chunk. The lengths of the data are those of the header.
+ *
+ * The sender keeps a smoothed ratio of wire to raw bytes for each endpoint.
+ * An endpoint whose data does not shrink enough, such as JPEG or video, is
+ * sent stored in a single block without copy for a number of payloads,
+ * doubled each time a new try fails.
+ */
+
+#include <asm/unaligned.h>
+#include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/lz4.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "usbip_common.h"
+
+/* smaller payloads are not worth a try */
+#define COMPRESS_MIN		256
+/* 90%, an endpoint above it is skipped for a while */
+#define COMPRESS_RATIO_MAX	230
+#define COMPRESS_BACKOFF_MAX	64
+
+#define COMPRESS_BOUND		LZ4_COMPRESSBOUND(USBIP_COMPRESS_BLOCK)
+
+int usbip_compress_pipe(struct usbip_device *ud, unsigned int pipe)
+{
+	return (ud->features & USBIP_FEAT_COMPRESS) && usb_pipebulk(pipe);
+}
+EXPORT_SYMBOL_GPL(usbip_compress_pipe);
+
+static int compress_alloc_tx(struct usbip_compress *c, size_t len)
+{
+	void *buf;
+
+	if (!c->wrkmem) {
+		c->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+		if (!c->wrkmem)
+			return -ENOMEM;
+	}
+
+	if (len <= c->tx_len)
+		return 0;
+
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	kvfree(c->tx_buf);
+	c->tx_buf = buf;
+	c->tx_len = len;
+
+	return 0;
+}
+
+static void compress_adapt(struct usbip_compress_ep *ep, int raw, int wire)
+{
+	unsigned int ratio = div_u64((u64) wire << 8, raw);
+
+	ep->ratio = ep->ratio ? (ep->ratio * 3 + ratio) / 4 : ratio;
+
+	if (ep->ratio > COMPRESS_RATIO_MAX) {
+		ep->backoff = ep->backoff ? min_t(unsigned int,
+				ep->backoff * 2, COMPRESS_BACKOFF_MAX) : 1;
+		ep->skip = ep->backoff;
+	} else {
+		ep->backoff = 0;
+	}
+}
+
+/*
+ * usbip_compress_iov - set up the blocks of bulk data to send
+ * @ud: the device
+ * @pipe: pipe of the URB
+ * @buf: the data
+ * @len: its length, more than 0
+ * @iov: two kvecs to fill
+ *
+ * Called by the tx thread for a pipe of usbip_compress_pipe(). Returns the
+ * number of kvecs used, which stay valid until its next call. Data which
+ * cannot be compressed, even for lack of memory, is sent stored.
+ */
+int usbip_compress_iov(struct usbip_device *ud, unsigned int pipe, void *buf,
+		       int len, struct kvec *iov)
+{
+	struct usbip_compress *c = &ud->compress;
+	struct usbip_compress_ep *ep = &c->ep[usb_pipeendpoint(pipe)];
+	int nr = DIV_ROUND_UP(len, USBIP_COMPRESS_BLOCK);
+	char *out;
+	int off, n, wire;
+
+	if (len < COMPRESS_MIN)
+		goto store;
+
+	if (ep->skip) {
+		ep->skip--;
+		goto store;
+	}
+
+	if (compress_alloc_tx(c, nr * (sizeof(__be32) + COMPRESS_BOUND))) {
+		usbip_stats_inc(ud, alloc_failures);
+		goto store;
+	}
+
+	out = c->tx_buf;
+	for (off = 0; off < len; off += n) {
+		n = min(len - off, USBIP_COMPRESS_BLOCK);
+
+		wire = LZ4_compress_default(buf + off, out + sizeof(__be32),
+					    n, COMPRESS_BOUND, c->wrkmem);
+		if (wire > 0 && wire < n) {
+			put_unaligned_be32(wire, out);
+		} else {
+			memcpy(out + sizeof(__be32), buf + off, n);
+			put_unaligned_be32(USBIP_COMPRESS_STORED | n, out);
+			wire = n;
+		}
+		out += sizeof(__be32) + wire;
+	}
+
+	wire = out - (char *) c->tx_buf;
+	compress_adapt(ep, len, wire);
+	usbip_stats_add(ud, compress_raw, len);
+	usbip_stats_add(ud, compress_wire, wire);
+
+	iov[0].iov_base = c->tx_buf;
+	iov[0].iov_len  = wire;
+	return 1;
+
+store:
+	usbip_stats_add(ud, compress_skipped, len);
+
+	c->tx_word = cpu_to_be32(USBIP_COMPRESS_STORED | len);
+	iov[0].iov_base = &c->tx_word;
+	iov[0].iov_len  = sizeof(c->tx_word);
+	iov[1].iov_base = buf;
+	iov[1].iov_len  = len;
+	return 2;
+}
+EXPORT_SYMBOL_GPL(usbip_compress_iov);
+
+/*
+ * usbip_recv_compressed - receive blocks of bulk data
+ * @ud: the device
+ * @buf: where to put the data
+ * @size: bytes of data to receive
+ * @stored: bytes of a stored block still to come, 0 to start
+ *
+ * A stored block may go on past @size, when the data is received in parts
+ * such as the chunks of usbip-host. The rest is left in @stored for the
+ * next part, and must be 0 after the last one. Returns @size, or a negative
+ * errno.
+ */
+int usbip_recv_compressed(struct usbip_device *ud, void *buf, int size,
+			  u32 *stored)
+{
+	struct usbip_compress *c = &ud->compress;
+	__be32 word;
+	int wire = 0;
+	int done = 0;
+	int n, ret;
+	u32 w;
+
+	while (done < size) {
+		if (*stored) {
+			n = min_t(u32, *stored, size - done);
+			ret = usbip_recv(ud, buf + done, n);
+			if (ret != n)
+				return ret < 0 ? ret : -EPIPE;
+
+			*stored -= n;
+			done += n;
+			wire += n;
+			continue;
+		}
+
+		ret = usbip_recv(ud, &word, sizeof(word));
+		if (ret != sizeof(word))
+			return ret < 0 ? ret : -EPIPE;
+		wire += sizeof(word);
+
+		w = be32_to_cpu(word);
+		if (w & USBIP_COMPRESS_STORED) {
+			*stored = w & ~USBIP_COMPRESS_STORED;
+			if (!*stored)
+				return -EPROTO;
+			continue;
+		}
+
+		if (!w || w > COMPRESS_BOUND)
+			return -EPROTO;
+
+		if (!c->rx_buf) {
+			c->rx_buf = kvmalloc(COMPRESS_BOUND, GFP_KERNEL);
+			if (!c->rx_buf)
+				return -ENOMEM;
+		}
+
+		ret = usbip_recv(ud, c->rx_buf, w);
+		if (ret != w)
+			return ret < 0 ? ret : -EPIPE;
+		wire += w;
+
+		/* straight into the buffer of the URB */
+		n = min(size - done, USBIP_COMPRESS_BLOCK);
+		ret = LZ4_decompress_safe(c->rx_buf, buf + done, w, n);
+		if (ret != n)
+			return -EPROTO;
+		done += n;
+	}
+
+	usbip_stats_add(ud, decompress_wire, wire);
+	usbip_stats_add(ud, decompress_raw, size);
+
+	return size;
+}
+EXPORT_SYMBOL_GPL(usbip_recv_compressed);
+
+/* usbip_recv() of the data of a pipe, received whole */
+int usbip_recv_payload(struct usbip_device *ud, unsigned int pipe, void *buf,
+		       int size)
+{
+	u32 stored = 0;
+	int ret;
+
+	if (!usbip_compress_pipe(ud, pipe))
+		return usbip_recv(ud, buf, size);
+
+	ret = usbip_recv_compressed(ud, buf, size, &stored);
+	if (ret == size && stored)
+		return -EPROTO;
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(usbip_recv_payload);
+
+/* after tcp_tx and tcp_rx are stopped */
+void usbip_compress_free(struct usbip_device *ud)
+{
+	struct usbip_compress *c = &ud->compress;
+
+	kvfree(c->wrkmem);
+	kvfree(c->tx_buf);
+	kvfree(c->rx_buf);
+	memset(c, 0, sizeof(*c));
+}
+EXPORT_SYMBOL_GPL(usbip_compress_free);
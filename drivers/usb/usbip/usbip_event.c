@@ -20,18 +20,25 @@
 
 #include <linux/kthread.h>
 #include <linux/export.h>
-#include <linux/slab.h>
 #include <linux/workqueue.h>
 
 #include "usbip_common.h"
 
-struct usbip_event {
+/*
+ * Each device has its own work item on an unbound workqueue, so that the
+ * handlers of different devices, which wait for the stop of their threads,
+ * run in parallel. A work item never runs concurrently with itself, which
+ * keeps the events of a device in order.
+ */
+
+/* a running handler, see usbip_in_eh() */
+struct usbip_eh_context {
 	struct list_head node;
-	struct usbip_device *ud;
+	struct task_struct *task;
 };
 
 static DEFINE_SPINLOCK(event_lock);
-static LIST_HEAD(event_list);
+static LIST_HEAD(eh_contexts);
 
 static void set_event(struct usbip_device *ud, unsigned long event)
 {
@@ -51,71 +58,55 @@ static void unset_event(struct usbip_device *ud, unsigned long event)
 	spin_unlock_irqrestore(&ud->lock, flags);
 }
 
-static struct usbip_device *get_event(void)
+static void event_handler(struct work_struct *work)
 {
-	struct usbip_event *ue = NULL;
-	struct usbip_device *ud = NULL;
+	struct usbip_device *ud = container_of(work, struct usbip_device,
+					       eh_work);
+	struct usbip_eh_context ctx = { .task = current };
 	unsigned long flags;
 
 	spin_lock_irqsave(&event_lock, flags);
-	if (!list_empty(&event_list)) {
-		ue = list_first_entry(&event_list, struct usbip_event, node);
-		list_del(&ue->node);
-	}
+	list_add(&ctx.node, &eh_contexts);
 	spin_unlock_irqrestore(&event_lock, flags);
 
-	if (ue) {
-		ud = ue->ud;
-		kfree(ue);
-	}
-	return ud;
-}
-
-static struct task_struct *worker_context;
-
-static void event_handler(struct work_struct *work)
-{
-	struct usbip_device *ud;
+	usbip_dbg_eh("pending event %lx\n", ud->event);
 
-	if (worker_context == NULL) {
-		worker_context = current;
+	/*
+	 * NOTE: shutdown must come first.
+	 * Shutdown the device.
+	 */
+	if (ud->event & USBIP_EH_SHUTDOWN) {
+		ud->eh_ops.shutdown(ud);
+		unset_event(ud, USBIP_EH_SHUTDOWN);
 	}
 
-	while ((ud = get_event()) != NULL) {
-		usbip_dbg_eh("pending event %lx\n", ud->event);
-
-		/*
-		 * NOTE: shutdown must come first.
-		 * Shutdown the device.
-		 */
-		if (ud->event & USBIP_EH_SHUTDOWN) {
-			ud->eh_ops.shutdown(ud);
-			unset_event(ud, USBIP_EH_SHUTDOWN);
-		}
+	/* Reset the device. */
+	if (ud->event & USBIP_EH_RESET) {
+		ud->eh_ops.reset(ud);
+		unset_event(ud, USBIP_EH_RESET);
+	}
 
-		/* Reset the device. */
-		if (ud->event & USBIP_EH_RESET) {
-			ud->eh_ops.reset(ud);
-			unset_event(ud, USBIP_EH_RESET);
-		}
+	/* Mark the device as unusable. */
+	if (ud->event & USBIP_EH_UNUSABLE) {
+		ud->eh_ops.unusable(ud);
+		unset_event(ud, USBIP_EH_UNUSABLE);
+	}
 
-		/* Mark the device as unusable. */
-		if (ud->event & USBIP_EH_UNUSABLE) {
-			ud->eh_ops.unusable(ud);
-			unset_event(ud, USBIP_EH_UNUSABLE);
-		}
+	/* Stop the error handler. */
+	if (ud->event & USBIP_EH_BYE)
+		usbip_dbg_eh("removed %p\n", ud);
 
-		/* Stop the error handler. */
-		if (ud->event & USBIP_EH_BYE)
-			usbip_dbg_eh("removed %p\n", ud);
+	spin_lock_irqsave(&event_lock, flags);
+	list_del(&ctx.node);
+	spin_unlock_irqrestore(&event_lock, flags);
 
-		wake_up(&ud->eh_waitq);
-	}
+	wake_up(&ud->eh_waitq);
 }
 
 int usbip_start_eh(struct usbip_device *ud)
 {
 	init_waitqueue_head(&ud->eh_waitq);
+	INIT_WORK(&ud->eh_work, event_handler);
 	ud->event = 0;
 	return 0;
 }
@@ -132,6 +123,10 @@ void usbip_stop_eh(struct usbip_device *ud)
 		usbip_dbg_eh("usbip_eh waiting completion %lx\n", pending);
 
 	wait_event_interruptible(ud->eh_waitq, !(ud->event & ~USBIP_EH_BYE));
+
+	/* the handler may still be on its way out */
+	if (!usbip_in_eh(current))
+		flush_work(&ud->eh_work);
 	usbip_dbg_eh("usbip_eh has stopped\n");
 }
 EXPORT_SYMBOL_GPL(usbip_stop_eh);
@@ -139,11 +134,11 @@ EXPORT_SYMBOL_GPL(usbip_stop_eh);
 #define WORK_QUEUE_NAME "usbip_event"
 
 static struct workqueue_struct *usbip_queue;
-static DECLARE_WORK(usbip_work, event_handler);
 
 int usbip_init_eh(void)
 {
-	usbip_queue = create_singlethread_workqueue(WORK_QUEUE_NAME);
+	usbip_queue = alloc_workqueue(WORK_QUEUE_NAME,
+				      WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
 	if (usbip_queue == NULL) {
 		pr_err("failed to create usbip_event\n");
 		return -ENOMEM;
@@ -160,32 +155,19 @@ void usbip_finish_eh(void)
 
 void usbip_event_add(struct usbip_device *ud, unsigned long event)
 {
-	struct usbip_event *ue;
-	unsigned long flags;
+	if (event & USBIP_EH_MALLOC) {
+		if (ud->stats)
+			usbip_stats_inc(ud, alloc_failures);
+		event &= ~USBIP_EH_MALLOC;
+	}
 
 	if (ud->event & USBIP_EH_BYE)
 		return;
 
 	set_event(ud, event);
 
-	spin_lock_irqsave(&event_lock, flags);
-
-	list_for_each_entry_reverse(ue, &event_list, node) {
-		if (ue->ud == ud)
-			goto out;
-	}
-
-	ue = kmalloc(sizeof(struct usbip_event), GFP_ATOMIC);
-	if (ue == NULL)
-		goto out;
-
-	ue->ud = ud;
-
-	list_add_tail(&ue->node, &event_list);
-	queue_work(usbip_queue, &usbip_work);
-
-out:
-	spin_unlock_irqrestore(&event_lock, flags);
+	/* a no-op while pending, the handler sees the new event too */
+	queue_work(usbip_queue, &ud->eh_work);
 }
 EXPORT_SYMBOL_GPL(usbip_event_add);
 
@@ -205,9 +187,19 @@ EXPORT_SYMBOL_GPL(usbip_event_happened);
 
 int usbip_in_eh(struct task_struct *task)
 {
-	if (task == worker_context)
-		return 1;
+	struct usbip_eh_context *ctx;
+	unsigned long flags;
+	int in_eh = 0;
 
-	return 0;
+	spin_lock_irqsave(&event_lock, flags);
+	list_for_each_entry(ctx, &eh_contexts, node) {
+		if (ctx->task == task) {
+			in_eh = 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&event_lock, flags);
+
+	return in_eh;
 }
 EXPORT_SYMBOL_GPL(usbip_in_eh);
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Heartbeat of USBIP_FEAT_HEARTBEAT.
+ *
+ * The client sends USBIP_NOP at an interval, stamped with the time it is
+ * sent. The server answers with USBIP_RET_NOP carrying the same seqnum and
+ * stamp, only the last one if several wait for its tx thread. The client
+ * takes the round trip from the stamp and smooths it as TCP does, srtt by
+ * 1/8 and rttvar by 1/4 of each sample. A server which sent nothing for a
+ * number of intervals is taken as dead by the client.
+ */
+
+#include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+
+#include "usbip_common.h"
+
+/* be in spin_lock(&ud->lock) or before the threads are started */
+void usbip_hb_init(struct usbip_device *ud)
+{
+	memset(&ud->hb, 0, sizeof(ud->hb));
+}
+EXPORT_SYMBOL_GPL(usbip_hb_init);
+
+/* whether the tx thread has something to send */
+int usbip_hb_pending(struct usbip_device *ud)
+{
+	return READ_ONCE(ud->hb.echo) || READ_ONCE(ud->hb.due);
+}
+EXPORT_SYMBOL_GPL(usbip_hb_pending);
+
+/*
+ * usbip_hb_send - send the pending USBIP_RET_NOP and USBIP_NOP
+ * @ud: the device
+ * @devid: devid of the PDUs
+ *
+ * Called by the tx thread. Returns the bytes sent, or a negative errno for
+ * which the caller raises its TCP error event.
+ */
+int usbip_hb_send(struct usbip_device *ud, __u32 devid)
+{
+	struct usbip_header pdu[2];
+	struct kvec iov[2];
+	struct msghdr msg;
+	unsigned long flags;
+	size_t txsize = 0;
+	int i, n = 0;
+	int ret;
+
+	if (!usbip_hb_pending(ud))
+		return 0;
+
+	memset(pdu, 0, sizeof(pdu));
+	memset(&msg, 0, sizeof(msg));
+
+	spin_lock_irqsave(&ud->lock, flags);
+	if (ud->hb.echo) {
+		pdu[n].base.command = USBIP_RET_NOP;
+		pdu[n].base.seqnum = ud->hb.echo_seqnum;
+		pdu[n].u.nop.stamp = ud->hb.echo_stamp;
+		ud->hb.echo = 0;
+		n++;
+	}
+	if (ud->hb.due) {
+		pdu[n].base.command = USBIP_NOP;
+		pdu[n].base.seqnum = ++ud->hb.seqnum;
+		pdu[n].u.nop.stamp = ktime_get_ns();
+		ud->hb.due = 0;
+		n++;
+	}
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	if (!n)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		pdu[i].base.devid = devid;
+		iov[i].iov_base = &pdu[i];
+		iov[i].iov_len = usbip_header_encode(ud, &pdu[i]);
+		txsize += iov[i].iov_len;
+	}
+
+	ret = usbip_trx_ops->sendmsg(ud, &msg, iov, n, txsize);
+	if (ret != txsize)
+		return ret < 0 ? ret : -EPIPE;
+
+	return txsize;
+}
+EXPORT_SYMBOL_GPL(usbip_hb_send);
+
+/* server: USBIP_NOP received, the caller wakes up its tx thread */
+void usbip_hb_recv_nop(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	ud->hb.echo = 1;
+	ud->hb.echo_seqnum = pdu->base.seqnum;
+	ud->hb.echo_stamp = pdu->u.nop.stamp;
+	spin_unlock_irqrestore(&ud->lock, flags);
+}
+EXPORT_SYMBOL_GPL(usbip_hb_recv_nop);
+
+/* client: USBIP_RET_NOP received */
+void usbip_hb_recv_ret(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	struct usbip_heartbeat *hb = &ud->hb;
+	s64 rtt = (s64)(ktime_get_ns() - pdu->u.nop.stamp);
+	unsigned long flags;
+
+	if (rtt < 0) {
+		pr_warn("bogus heartbeat stamp, seqnum %u\n",
+			pdu->base.seqnum);
+		return;
+	}
+
+	spin_lock_irqsave(&ud->lock, flags);
+	hb->last = rtt;
+	if (!hb->srtt) {
+		hb->srtt = rtt;
+		hb->rttvar = rtt / 2;
+	} else {
+		hb->rttvar += (abs(hb->srtt - rtt) - hb->rttvar) / 4;
+		hb->srtt += (rtt - hb->srtt) / 8;
+	}
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	usbip_dbg_eh("heartbeat seqnum %u rtt %lld ns\n", pdu->base.seqnum,
+		     rtt);
+}
+EXPORT_SYMBOL_GPL(usbip_hb_recv_ret);
+
+/*
+ * client: any PDU received. Not locked for each PDU, a race with
+ * usbip_hb_tick() only counts one more miss.
+ */
+void usbip_hb_alive(struct usbip_device *ud)
+{
+	if (READ_ONCE(ud->hb.misses))
+		WRITE_ONCE(ud->hb.misses, 0);
+}
+EXPORT_SYMBOL_GPL(usbip_hb_alive);
+
+/*
+ * client: an interval passed. Makes USBIP_NOP due, or returns -ETIMEDOUT if
+ * the server has sent nothing for max_misses intervals.
+ */
+int usbip_hb_tick(struct usbip_device *ud, unsigned int max_misses)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	if (max_misses && ud->hb.misses >= max_misses) {
+		ret = -ETIMEDOUT;
+	} else {
+		ud->hb.misses++;
+		ud->hb.due = 1;
+	}
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(usbip_hb_tick);
+
+/* "<srtt> <rttvar> <last> <misses>", times in microseconds */
+int usbip_hb_print(struct usbip_device *ud, char *buf, size_t size)
+{
+	struct usbip_heartbeat hb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	hb = ud->hb;
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	return scnprintf(buf, size, "%lld %lld %lld %u\n",
+			 div_s64(hb.srtt, NSEC_PER_USEC),
+			 div_s64(hb.rttvar, NSEC_PER_USEC),
+			 div_s64(hb.last, NSEC_PER_USEC), hb.misses);
+}
+EXPORT_SYMBOL_GPL(usbip_hb_print);
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * CPU affinity and scheduling policy of the rx and tx threads of a device.
+ *
+ * The settings are written as "<cpu> <policy> [<priority>]" to a sysfs
+ * attribute of each driver. cpu is a CPU number, USBIP_SCHED_CPU_ANY or
+ * USBIP_SCHED_CPU_AUTO. policy is SCHED_NORMAL, with priority as the nice
+ * value, or SCHED_FIFO with priority as the real-time priority.
+ *
+ * The threads apply the settings to themselves when they start and when the
+ * settings change, so that a thread is never touched from outside while it
+ * stops. With USBIP_SCHED_CPU_AUTO, the rx thread moves to the CPU receiving
+ * the packets of the socket as soon as that is known, and the tx thread to
+ * the NUMA node of that CPU. Transfer buffers are allocated by the rx
+ * threads, so that they come from that node too.
+ */
+
+#include <linux/cpumask.h>
+#include <linux/export.h>
+#include <linux/sched.h>
+#include <linux/sched/prio.h>
+#include <linux/topology.h>
+#include <net/sock.h>
+#include <uapi/linux/sched/types.h>
+
+#include "usbip_common.h"
+
+/* be in spin_lock(&ud->lock) or before the threads are started */
+void usbip_sched_init(struct usbip_device *ud)
+{
+	ud->sched.cpu = USBIP_SCHED_CPU_ANY;
+	ud->sched.policy = SCHED_NORMAL;
+	ud->sched.prio = 0;
+	ud->sched.auto_cpu = -1;
+	ud->sched.node = NUMA_NO_NODE;
+	ud->sched.gen++;
+}
+EXPORT_SYMBOL_GPL(usbip_sched_init);
+
+int usbip_sched_print(struct usbip_device *ud, char *buf, size_t size)
+{
+	unsigned long flags;
+	int cpu, policy, prio;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	cpu = ud->sched.cpu;
+	policy = ud->sched.policy;
+	prio = ud->sched.prio;
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	return scnprintf(buf, size, "%d %d %d\n", cpu, policy, prio);
+}
+EXPORT_SYMBOL_GPL(usbip_sched_print);
+
+int usbip_sched_set(struct usbip_device *ud, const char *buf)
+{
+	unsigned long flags;
+	int cpu, policy, prio = 0;
+
+	if (sscanf(buf, "%d %d %d", &cpu, &policy, &prio) < 2)
+		return -EINVAL;
+
+	if (cpu != USBIP_SCHED_CPU_ANY && cpu != USBIP_SCHED_CPU_AUTO &&
+	    (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu)))
+		return -EINVAL;
+
+	switch (policy) {
+	case SCHED_NORMAL:
+		if (prio < MIN_NICE || prio > MAX_NICE)
+			return -EINVAL;
+		break;
+	case SCHED_FIFO:
+		if (prio < 1 || prio >= MAX_USER_RT_PRIO)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&ud->lock, flags);
+	ud->sched.cpu = cpu;
+	ud->sched.policy = policy;
+	ud->sched.prio = prio;
+	ud->sched.auto_cpu = -1;
+	ud->sched.node = NUMA_NO_NODE;
+	ud->sched.gen++;
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	usbip_dbg_eh("sched cpu %d policy %d prio %d\n", cpu, policy, prio);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_sched_set);
+
+/* finds the CPU which receives the packets of the socket */
+static void usbip_sched_auto(struct usbip_device *ud)
+{
+	unsigned long flags;
+	int cpu;
+
+	if (READ_ONCE(ud->sched.cpu) != USBIP_SCHED_CPU_AUTO ||
+	    READ_ONCE(ud->sched.auto_cpu) >= 0 || !ud->tcp_socket)
+		return;
+
+	cpu = READ_ONCE(ud->tcp_socket->sk->sk_incoming_cpu);
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	if (ud->sched.cpu == USBIP_SCHED_CPU_AUTO) {
+		ud->sched.auto_cpu = cpu;
+		ud->sched.node = cpu_to_node(cpu);
+		ud->sched.gen++;
+	}
+	spin_unlock_irqrestore(&ud->lock, flags);
+}
+
+/*
+ * usbip_sched_thread - apply the settings of a device to the calling thread
+ * @ud: the device
+ * @rx: whether the caller is the rx thread
+ * @seen: the settings the thread has applied, 0 when it starts
+ *
+ * Called by the rx and tx threads in their loops.
+ */
+void usbip_sched_thread(struct usbip_device *ud, int rx, unsigned int *seen)
+{
+	const struct cpumask *mask = cpu_possible_mask;
+	struct sched_param param = { 0 };
+	struct usbip_sched sched;
+	unsigned long flags;
+
+	if (rx && !*seen) {
+		/* the CPU of the last connection says nothing of this one */
+		spin_lock_irqsave(&ud->lock, flags);
+		ud->sched.auto_cpu = -1;
+		ud->sched.node = NUMA_NO_NODE;
+		ud->sched.gen++;
+		spin_unlock_irqrestore(&ud->lock, flags);
+	} else if (rx) {
+		usbip_sched_auto(ud);
+	}
+
+	if (READ_ONCE(ud->sched.gen) == *seen)
+		return;
+
+	spin_lock_irqsave(&ud->lock, flags);
+	sched = ud->sched;
+	spin_unlock_irqrestore(&ud->lock, flags);
+
+	*seen = sched.gen;
+
+	if (sched.cpu >= 0)
+		mask = cpumask_of(sched.cpu);
+	else if (rx && sched.auto_cpu >= 0)
+		mask = cpumask_of(sched.auto_cpu);
+	else if (sched.node != NUMA_NO_NODE)
+		mask = cpumask_of_node(sched.node);
+
+	set_cpus_allowed_ptr(current, mask);
+
+	if (sched.policy == SCHED_FIFO) {
+		param.sched_priority = sched.prio;
+		sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+	} else {
+		sched_setscheduler_nocheck(current, SCHED_NORMAL, &param);
+		set_user_nice(current, sched.prio);
+	}
+}
+EXPORT_SYMBOL_GPL(usbip_sched_thread);
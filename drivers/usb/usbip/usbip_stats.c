@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Per-CPU counters of each device, summed up when read from
+ * <debugfs>/usbip/{stub,vhci,vudc}/<device>. The file has a line of a name
+ * and its values for each counter:
+ *
+ *	submitted <isoc> <int> <ctrl> <bulk>	URBs by transfer type
+ *	completed <isoc> <int> <ctrl> <bulk>
+ *	unlinked <isoc> <int> <ctrl> <bulk>
+ *	bytes_out <n>				data sent to the peer
+ *	bytes_in <n>				data received from the peer
+ *	alloc_failures <n>
+ *	compress <raw> <wire> <skipped>		bulk data sent, USBIP_FEAT_COMPRESS
+ *	decompress <wire> <raw>			bulk data received
+ *	queue <name> <n>			current length of a queue
+ *	endpoint <ep> <n> <net> <dev> <srv> <net_max> <dev_max>
+ *	latency_queue <b0> ... <b23>		queued until sent
+ *	latency_ret <b0> ... <b23>		CMD_SUBMIT sent until RET_SUBMIT
+ *	latency_service <b0> ... <b23>		submitted until completed
+ *
+ * The endpoint lines are those of vhci with USBIP_FEAT_TIMESTAMPS, by
+ * endpoint number and direction such as 1in, of n answers of the server.
+ * They split the round trip into the time spent by the server (srv) and on
+ * the network (net), and give the part of srv the device itself took (dev),
+ * in mean and max microseconds.
+ *
+ * Bucket 0 of a latency counts those under 1 us, bucket n those of
+ * [2^(n-1), 2^n) us, and the last one everything longer. New lines may be
+ * added, existing ones keep their meaning.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/export.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "usbip_common.h"
+
+static struct dentry *stats_root;
+static struct dentry *stats_dirs[3];
+
+static const char * const stats_side_names[] = {
+	[USBIP_VHCI] = "vhci",
+	[USBIP_STUB] = "stub",
+	[USBIP_VUDC] = "vudc",
+};
+
+static const char * const stats_lat_names[USBIP_LAT_NR] = {
+	[USBIP_LAT_QUEUE] = "latency_queue",
+	[USBIP_LAT_RET] = "latency_ret",
+	[USBIP_LAT_SERVICE] = "latency_service",
+};
+
+void usbip_stats_latency(struct usbip_device *ud, enum usbip_lat lat,
+			 ktime_t start)
+{
+	s64 us;
+
+	if (!ktime_to_ns(start))
+		return;
+
+	us = ktime_us_delta(ktime_get(), start);
+	if (us < 0)
+		us = 0;
+
+	this_cpu_inc(ud->stats->latency[lat][min_t(int, fls64(us),
+						     USBIP_LAT_BUCKETS - 1)]);
+}
+EXPORT_SYMBOL_GPL(usbip_stats_latency);
+
+void usbip_stats_queue(struct seq_file *m, const char *name, unsigned int n)
+{
+	seq_printf(m, "queue %s %u\n", name, n);
+}
+EXPORT_SYMBOL_GPL(usbip_stats_queue);
+
+static void stats_sum(struct usbip_device *ud, struct usbip_stats *sum)
+{
+	u64 *s = (u64 *) sum;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		u64 *c = (u64 *) per_cpu_ptr(ud->stats, cpu);
+
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			s[i] += c[i];
+	}
+}
+
+static void stats_show_types(struct seq_file *m, const char *name, u64 *v)
+{
+	seq_printf(m, "%s %llu %llu %llu %llu\n", name, v[PIPE_ISOCHRONOUS],
+		   v[PIPE_INTERRUPT], v[PIPE_CONTROL], v[PIPE_BULK]);
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct usbip_device *ud = m->private;
+	struct usbip_stats *sum;
+	int lat, i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	stats_sum(ud, sum);
+
+	stats_show_types(m, "submitted", sum->submitted);
+	stats_show_types(m, "completed", sum->completed);
+	stats_show_types(m, "unlinked", sum->unlinked);
+	seq_printf(m, "bytes_out %llu\n", sum->bytes_out);
+	seq_printf(m, "bytes_in %llu\n", sum->bytes_in);
+	seq_printf(m, "alloc_failures %llu\n", sum->alloc_failures);
+	seq_printf(m, "compress %llu %llu %llu\n", sum->compress_raw,
+		   sum->compress_wire, sum->compress_skipped);
+	seq_printf(m, "decompress %llu %llu\n", sum->decompress_wire,
+		   sum->decompress_raw);
+
+	if (ud->stats_show)
+		ud->stats_show(ud, m);
+
+	for (lat = 0; lat < USBIP_LAT_NR; lat++) {
+		seq_puts(m, stats_lat_names[lat]);
+		for (i = 0; i < USBIP_LAT_BUCKETS; i++)
+			seq_printf(m, " %llu", sum->latency[lat][i]);
+		seq_putc(m, '\n');
+	}
+
+	kfree(sum);
+
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * usbip_stats_alloc - allocate the counters of a device
+ * @ud: the device
+ * @name: the name of its file, unique for the side of ud
+ * @show: prints the lines of the device's own, such as queue lengths, or NULL
+ *
+ * The counters are used from any context once this succeeds. The file is
+ * not created if debugfs is not available.
+ */
+int usbip_stats_alloc(struct usbip_device *ud, const char *name,
+		      void (*show)(struct usbip_device *, struct seq_file *))
+{
+	struct dentry *dir = NULL;
+
+	ud->stats = alloc_percpu(struct usbip_stats);
+	if (!ud->stats)
+		return -ENOMEM;
+
+	ud->stats_show = show;
+
+	if (ud->side < ARRAY_SIZE(stats_dirs))
+		dir = stats_dirs[ud->side];
+	if (!IS_ERR_OR_NULL(dir))
+		ud->stats_dentry = debugfs_create_file(name, S_IRUGO, dir, ud,
+						       &stats_fops);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_stats_alloc);
+
+void usbip_stats_free(struct usbip_device *ud)
+{
+	if (!IS_ERR_OR_NULL(ud->stats_dentry))
+		debugfs_remove(ud->stats_dentry);
+	ud->stats_dentry = NULL;
+
+	free_percpu(ud->stats);
+	ud->stats = NULL;
+}
+EXPORT_SYMBOL_GPL(usbip_stats_free);
+
+void usbip_stats_init(void)
+{
+	int i;
+
+	stats_root = debugfs_create_dir("usbip", NULL);
+	if (IS_ERR_OR_NULL(stats_root))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(stats_dirs); i++)
+		stats_dirs[i] = debugfs_create_dir(stats_side_names[i],
+						   stats_root);
+}
+
+void usbip_stats_finish(void)
+{
+	debugfs_remove_recursive(stats_root);
+	stats_root = NULL;
+	memset(stats_dirs, 0, sizeof(stats_dirs));
+}
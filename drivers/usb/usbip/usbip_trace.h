@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Tracepoints of the stages of an URB. A transfer from vhci to stub goes
+ *
+ *	usbip_vhci_urb_enqueue	queued to the tx thread of vhci
+ *	usbip_vhci_tx_submit	CMD_SUBMIT about to be sent
+ *	usbip_stub_rx_submit	about to be submitted to the device
+ *	usbip_stub_complete	completed by the device
+ *	usbip_stub_tx_ret	RET_SUBMIT about to be sent
+ *	usbip_vhci_rx_ret	RET_SUBMIT received, to be given back
+ *
+ * and the usbip_vudc_* events are the stub ones of vudc. devid and seqnum
+ * are those of the PDUs, so that events of both ends can be matched. vudc
+ * does not know its devid and gives 0.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbip
+
+#if !defined(__USBIP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __USBIP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+DECLARE_EVENT_CLASS(usbip_urb,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb),
+	TP_STRUCT__entry(
+		__field(u32, devid)
+		__field(u32, seqnum)
+		__field(void *, urb)
+		__field(u8, ep)
+		__field(u8, in)
+		__field(u8, type)
+		__field(u32, length)
+		__field(u32, actual)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->devid = devid;
+		__entry->seqnum = seqnum;
+		__entry->urb = urb;
+		__entry->ep = usb_pipeendpoint(urb->pipe);
+		__entry->in = !!usb_pipein(urb->pipe);
+		__entry->type = usb_pipetype(urb->pipe);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->status = urb->status;
+	),
+	TP_printk("devid %08x seqnum %u urb %p ep%u%s %s len %u actual %u status %d",
+		  __entry->devid, __entry->seqnum, __entry->urb, __entry->ep,
+		  __entry->in ? "in" : "out",
+		  __print_symbolic(__entry->type,
+				   { PIPE_ISOCHRONOUS, "isoc" },
+				   { PIPE_INTERRUPT, "int" },
+				   { PIPE_CONTROL, "ctrl" },
+				   { PIPE_BULK, "bulk" }),
+		  __entry->length, __entry->actual, __entry->status)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vhci_urb_enqueue,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vhci_tx_submit,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vhci_rx_ret,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+/* seqnum is that of the URB to unlink */
+DEFINE_EVENT(usbip_urb, usbip_vhci_unlink,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_stub_rx_submit,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_stub_complete,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_stub_tx_ret,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+/* seqnum is that of CMD_UNLINK */
+DEFINE_EVENT(usbip_urb, usbip_stub_unlink,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vudc_rx_submit,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vudc_complete,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+DEFINE_EVENT(usbip_urb, usbip_vudc_tx_ret,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+/* seqnum is that of CMD_UNLINK */
+DEFINE_EVENT(usbip_urb, usbip_vudc_unlink,
+	TP_PROTO(u32 devid, u32 seqnum, struct urb *urb),
+	TP_ARGS(devid, seqnum, urb)
+);
+
+#endif /* __USBIP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbip_trace
+
+#include <trace/define_trace.h>
@@ -207,6 +207,8 @@ static int usbip_ux_sendmsg(struct usbip_device *ud, struct msghdr *msg,
 	}
 	usbip_ux_put(ux);
 	usbip_dbg_ux("sendmsg. ok\n");
+	if (ud->stats)
+		usbip_stats_add(ud, bytes_out, count);
 	return count;
 err_put_ux:
 	usbip_ux_put(ux);
@@ -319,6 +321,8 @@ static int usbip_ux_recvmsg(struct usbip_device *ud, struct msghdr *msg,
 	usbip_ux_put(ux);
 	usbip_dbg_ux("recvmsg ok.");
 
+	if (ud->stats)
+		usbip_stats_add(ud, bytes_in, count);
 	return count;
 err_put_ux:
 	usbip_ux_put(ux);
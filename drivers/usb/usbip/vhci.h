@@ -13,14 +13,95 @@
 #define __USBIP_VHCI_H
 
 #include <linux/device.h>
+#include <linux/hrtimer.h>
 #include <linux/list.h>
+#include <linux/platform_device.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
+#include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 #include <linux/wait.h>
 
+/*
+ * Reports of a polled interrupt IN endpoint waiting for a URB. Older ones are
+ * dropped, as input devices only care about the recent ones.
+ */
+#define VHCI_POLL_QUEUE 8
+#define VHCI_POLL_MAX_AGE (HZ / 5)
+
+/* largest report accepted */
+#define VHCI_POLL_MAX_LEN (64 * 1024)
+
+struct vhci_poll_report {
+	struct list_head list;
+	unsigned long jiffies;
+	int status;
+	int len;
+	u8 data[0];
+};
+
+/* interrupt IN endpoint polled by the server, see vhci_poll.c */
+struct vhci_poll {
+	int active;
+
+	/* vhci_priv of URBs waiting for a report */
+	struct list_head pending;
+
+	struct list_head reports;
+	int nr_reports;
+};
+
+/*
+ * Frame numbers handed to class drivers, in 1 ms frames. The server side
+ * host controllers count at least this many.
+ */
+#define VHCI_FRAME_MASK 0x3ff
+
+/* largest iso_delay, in frames */
+#define VHCI_ISO_MAX_DELAY 500
+
+/* frames without URB after which an isochronous stream starts over */
+#define VHCI_ISO_IDLE 100
+
+/* playout of an isochronous endpoint, see vhci_iso.c */
+struct vhci_iso_stream {
+	int active;
+	/* frame the next URB is given back at */
+	u64 next;
+};
+
+struct vhci_iso {
+	struct hrtimer timer;
+	int armed;
+	/* frame the timer is armed for */
+	u64 expires;
+
+	/* vhci_priv of completed URBs held back, by completion order */
+	struct list_head held;
+	int nr_held;
+
+	struct vhci_iso_stream streams[2][USB_MAXENDPOINTS / 2];
+
+	/* server frame number minus ours */
+	u32 offset;
+	int synced;
+
+	unsigned long underruns;
+	unsigned long late_packets;
+};
+
+/* USBIP_FEAT_TIMESTAMPS of an endpoint, sums and maxima in ns */
+struct vhci_ep_stamps {
+	u64 count;
+	u64 network;
+	u64 device;
+	u64 server;
+	u64 network_max;
+	u64 device_max;
+};
+
 struct vhci_device {
 	struct usb_device *udev;
 
@@ -49,9 +130,21 @@ struct vhci_device {
 	struct list_head unlink_tx;
 	struct list_head unlink_rx;
 
+	/* USBIP_FEAT_INT_POLL by endpoint number, under priv_lock */
+	struct vhci_poll poll[USB_MAXENDPOINTS / 2];
+
+	/* isochronous jitter buffer, under priv_lock */
+	struct vhci_iso iso;
+
+	/* by direction and endpoint number, under priv_lock */
+	struct vhci_ep_stamps stamps[2][USB_MAXENDPOINTS / 2];
+
 	/* vhci_tx thread sleeps for this queue */
 	wait_queue_head_t waitq_tx;
 
+	/* USBIP_FEAT_HEARTBEAT, see vhci_heartbeat.c */
+	struct timer_list hb_timer;
+
 	/* denotes port is in-use */
 	atomic_t using_port;
 };
@@ -63,6 +156,17 @@ struct vhci_priv {
 
 	struct vhci_device *vdev;
 	struct urb *urb;
+
+	/* in vhci_poll.pending, not sent */
+	int polled;
+
+	/* completed, in vhci_iso.held until frame due */
+	int held;
+	u64 due;
+
+	/* for usbip_stats */
+	ktime_t queued;
+	ktime_t sent;
 };
 
 struct vhci_unlink {
@@ -73,15 +177,24 @@ struct vhci_unlink {
 
 	/* seqnum of the unlink target */
 	unsigned long unlink_seqnum;
+
+	/* for USBIP_FEAT_TIMESTAMPS */
+	ktime_t sent;
 };
 
-/* Number of supported ports. Value has an upperbound of USB_MAXCHILDREN */
+/*
+ * Number of supported ports per root hub. Value has an upperbound of
+ * USB_MAXCHILDREN and USB_SS_MAXPORTS.
+ */
 #ifdef CONFIG_USBIP_VHCI_HC_PORTS
 #define VHCI_HC_PORTS CONFIG_USBIP_VHCI_HC_PORTS
 #else
 #define VHCI_HC_PORTS 8
 #endif
 
+/* Each controller has a USB2 root hub and a USB3 root hub. */
+#define VHCI_PORTS (VHCI_HC_PORTS * 2)
+
 #ifdef CONFIG_USBIP_VHCI_MAX_HCS
 #define VHCI_MAX_HCS CONFIG_USBIP_VHCI_MAX_HCS
 #else
@@ -94,7 +207,16 @@ struct vhci_unlink {
 #define VHCI_INIT_HCS 1
 #endif
 
-/* VHCI_FREE_HCS * VHCI_HC_PORTS: ports to keep free at unregister */
+/* protocol extensions vhci_hcd can be asked for */
+#define VHCI_FEATURES (USBIP_FEAT_STREAMS | USBIP_FEAT_CHUNKED | \
+		       USBIP_FEAT_INT_POLL | USBIP_FEAT_ISO_COMPACT | \
+		       USBIP_FEAT_HEARTBEAT | USBIP_FEAT_TIMESTAMPS | \
+		       USBIP_FEAT_COMPACT_HDR | USBIP_FEAT_COMPRESS)
+
+/* usable bulk streams per endpoint, as many as UAS asks for */
+#define VHCI_MAX_STREAMS 256
+
+/* VHCI_FREE_HCS * VHCI_PORTS: ports to keep free at unregister */
 #define VHCI_FREE_HCS 2
 
 #define MAX_STATUS_NAME 16
@@ -110,6 +232,9 @@ struct vhci_hcd {
 
 	atomic_t seqnum;
 
+	/* frame 0 of the emulated frame clock */
+	ktime_t frame_base;
+
 	unsigned int using_ports;
 
 	/*
@@ -128,7 +253,7 @@ extern struct attribute_group vhci_attr_group;
 
 /* vhci_hcd.c */
 void rh_port_connect(struct vhci_device *vdev, enum usb_device_speed speed);
-int vhci_get_device(__u32 pdev_nr, __u32 rhport,
+int vhci_get_device(__u32 pdev_nr, __u32 rhport, int ss,
 		    struct vhci_hcd **vhci, struct vhci_device **vdev);
 void vhci_put_device(struct vhci_device *vdev);
 void vhci_event_add(struct usbip_device *ud, unsigned long event);
@@ -137,13 +262,47 @@ void vhci_event_add(struct usbip_device *ud, unsigned long event);
 int vhci_init_attr_group(void);
 void vhci_finish_attr_group(void);
 
+/* vhci_poll.c */
+enum {
+	VHCI_POLL_SEND,
+	VHCI_POLL_PENDING,
+	VHCI_POLL_DONE,
+};
+
+void vhci_poll_init(struct vhci_device *vdev);
+int vhci_poll_urb(struct vhci_device *vdev, struct urb *urb);
+void vhci_poll_kick(struct vhci_device *vdev, int epnum);
+void vhci_recv_ret_poll(struct vhci_device *vdev, struct usbip_header *pdu);
+void vhci_poll_cleanup(struct vhci_device *vdev);
+
+/* vhci_iso.c */
+void vhci_iso_init(struct vhci_device *vdev);
+u64 vhci_frame(struct vhci_hcd *vhci);
+__u32 vhci_iso_start_frame(struct vhci_device *vdev, struct urb *urb);
+int vhci_iso_hold(struct vhci_device *vdev, struct urb *urb);
+void vhci_iso_cleanup(struct vhci_device *vdev);
+
+/* vhci_heartbeat.c */
+void vhci_hb_init(struct vhci_device *vdev);
+void vhci_hb_start(struct vhci_device *vdev);
+void vhci_hb_stop(struct vhci_device *vdev);
+
+/* vhci_stamps.c */
+int vhci_recv_stamps(struct vhci_device *vdev, struct urb *urb, ktime_t sent);
+void vhci_stamps_show(struct vhci_device *vdev, struct seq_file *m);
+
 /* vhci_rx.c */
-struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum);
+struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum,
+				     ktime_t *sent);
 int vhci_rx_loop(void *data);
 
 /* vhci_tx.c */
 int vhci_tx_loop(void *data);
 
+/*
+ * Port numbers seen from userspace are laid out per controller as
+ * VHCI_HC_PORTS USB2 ports followed by VHCI_HC_PORTS USB3 ports.
+ */
 static inline __u32 port_to_rhport(__u32 port)
 {
 	return port % VHCI_HC_PORTS;
@@ -151,7 +310,17 @@ static inline __u32 port_to_rhport(__u32 port)
 
 static inline int port_to_pdev_nr(__u32 port)
 {
-	return port / VHCI_HC_PORTS;
+	return port / VHCI_PORTS;
+}
+
+static inline int port_is_ss(__u32 port)
+{
+	return (port % VHCI_PORTS) >= VHCI_HC_PORTS;
+}
+
+static inline __u32 rhport_to_port(int pdev_nr, int ss, __u32 rhport)
+{
+	return (pdev_nr * VHCI_PORTS) + (ss ? VHCI_HC_PORTS : 0) + rhport;
 }
 
 static inline struct vhci_hcd *hcd_to_vhci(struct usb_hcd *hcd)
@@ -174,6 +343,22 @@ static inline struct usb_hcd *vhci_to_hcd(struct vhci_hcd *vhci)
 	return container_of((void *) vhci, struct usb_hcd, hcd_priv);
 }
 
+static inline int vhci_is_ss(struct vhci_hcd *vhci)
+{
+	return vhci_to_hcd(vhci)->speed == HCD_USB3;
+}
+
+/* the USB2 hcd is the primary one and held as platform drvdata */
+static inline struct usb_hcd *pdev_to_hcd(struct platform_device *pdev,
+					  int ss)
+{
+	struct usb_hcd *hcd = platform_get_drvdata(pdev);
+
+	if (hcd && ss)
+		hcd = hcd->shared_hcd;
+	return hcd;
+}
+
 static inline struct vhci_hcd *vdev_to_vhci(struct vhci_device *vdev)
 {
 	return container_of(
@@ -24,9 +24,11 @@
 #include <linux/kthread.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "vhci.h"
 
 #define DRIVER_AUTHOR "Takahiro Hirofuchi"
@@ -108,8 +110,45 @@ static const char * const bit_desc[] = {
 	"R31",			/*31*/
 };
 
-static void dump_port_status_diff(u32 prev_status, u32 new_status)
+/* wPortStatus of a USB3 root hub port, and its SS change bits */
+static const char * const bit_desc_ss[] = {
+	"CONNECTION",		/*0*/
+	"ENABLE",		/*1*/
+	"SUSPEND",		/*2*/
+	"OVER_CURRENT",		/*3*/
+	"RESET",		/*4*/
+	"LINK_STATE0",		/*5*/
+	"LINK_STATE1",		/*6*/
+	"LINK_STATE2",		/*7*/
+	"LINK_STATE3",		/*8*/
+	"POWER",		/*9*/
+	"SPEED0",		/*10*/
+	"SPEED1",		/*11*/
+	"SPEED2",		/*12*/
+	"R13",			/*13*/
+	"R14",			/*14*/
+	"R15",			/*15*/
+	"C_CONNECTION",		/*16*/
+	"C_ENABLE",		/*17*/
+	"C_SUSPEND",		/*18*/
+	"C_OVER_CURRENT",	/*19*/
+	"C_RESET",		/*20*/
+	"C_BH_RESET",		/*21*/
+	"C_LINK_STATE",		/*22*/
+	"C_CONFIG_ERROR",	/*23*/
+	"R24",			/*24*/
+	"R25",			/*25*/
+	"R26",			/*26*/
+	"R27",			/*27*/
+	"R28",			/*28*/
+	"R29",			/*29*/
+	"R30",			/*30*/
+	"R31",			/*31*/
+};
+
+static void dump_port_status_diff(u32 prev_status, u32 new_status, int ss)
 {
+	const char * const *desc = ss ? bit_desc_ss : bit_desc;
 	int i = 0;
 	u32 bit = 1;
 
@@ -127,10 +166,14 @@ static void dump_port_status_diff(u32 prev_status, u32 new_status)
 			change = ' ';
 
 		if (prev || new)
-			pr_debug(" %c%s\n", change, bit_desc[i]);
+			pr_debug(" %c%s\n", change, desc[i]);
 		bit <<= 1;
 		i++;
 	}
+	if (ss)
+		pr_debug(" link state %x -> %x\n",
+			 (prev_status & USB_PORT_STAT_LINK_STATE) >> 5,
+			 (new_status & USB_PORT_STAT_LINK_STATE) >> 5);
 	pr_debug("\n");
 }
 
@@ -156,6 +199,14 @@ void rh_port_connect(struct vhci_device *vdev, enum usb_device_speed speed)
 	case USB_SPEED_LOW:
 		status |= USB_PORT_STAT_LOW_SPEED;
 		break;
+	case USB_SPEED_SUPER:
+		/*
+		 * The speed of a USB3 root hub port is that of the hub, so
+		 * only the link is brought up. It reaches U0 at port reset.
+		 */
+		status = (status & ~USB_PORT_STAT_LINK_STATE) |
+			 USB_SS_PORT_LS_POLLING;
+		break;
 	default:
 		break;
 	}
@@ -183,6 +234,12 @@ static void rh_port_disconnect(struct vhci_device *vdev)
 	status &= ~USB_PORT_STAT_CONNECTION;
 	status |= (1 << USB_PORT_FEAT_C_CONNECTION);
 
+	/* the link of a USB3 port goes back to look for a device */
+	if (vhci_is_ss(vhci)) {
+		status &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_LINK_STATE);
+		status |= USB_SS_PORT_LS_RX_DETECT;
+	}
+
 	vhci->port_status[rhport] = status;
 
 	spin_unlock_irqrestore(&vhci->lock, flags);
@@ -196,6 +253,12 @@ static void rh_port_disconnect(struct vhci_device *vdev)
 	  | USB_PORT_STAT_C_OVERCURRENT		\
 	  | USB_PORT_STAT_C_RESET) << 16)
 
+#define PORT_C_MASK_SS				\
+	(PORT_C_MASK				\
+	 | ((USB_PORT_STAT_C_BH_RESET		\
+	     | USB_PORT_STAT_C_LINK_STATE	\
+	     | USB_PORT_STAT_C_CONFIG_ERROR) << 16))
+
 /*
  * Returns 0 if the status hasn't changed, or the number of bytes in buf.
  * Ports are 0-indexed from the HCD point of view,
@@ -213,12 +276,14 @@ static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
 	int		retval;
 	int		rhport;
 	int		changed = 0;
+	u32		mask;
 	unsigned long	flags;
 
 	retval = DIV_ROUND_UP(VHCI_HC_PORTS + 1, 8);
 	memset(buf, 0, retval);
 
 	vhci = hcd_to_vhci(hcd);
+	mask = vhci_is_ss(vhci) ? PORT_C_MASK_SS : PORT_C_MASK;
 
 	spin_lock_irqsave(&vhci->lock, flags);
 	if (!HCD_HW_ACCESSIBLE(hcd)) {
@@ -228,7 +293,7 @@ static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
 
 	/* check pseudo status register for each port */
 	for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++) {
-		if ((vhci->port_status[rhport] & PORT_C_MASK)) {
+		if ((vhci->port_status[rhport] & mask)) {
 			/* The status of a port has been changed, */
 			usbip_dbg_vhci_rh("port %d status changed\n", rhport);
 
@@ -257,12 +322,46 @@ static inline void hub_descriptor(struct usb_hub_descriptor *desc)
 	desc->u.hs.DeviceRemovable[1] = 0xff;
 }
 
+static inline void ss_hub_descriptor(struct usb_hub_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bDescriptorType = USB_DT_SS_HUB;
+	desc->bDescLength = USB_DT_SS_HUB_SIZE;
+	desc->wHubCharacteristics = cpu_to_le16(
+		HUB_CHAR_INDV_PORT_LPSM | HUB_CHAR_COMMON_OCPM);
+	desc->bNbrPorts = VHCI_HC_PORTS;
+	/* worst case: 0.4 micro sec */
+	desc->u.ss.bHubHdrDecLat = 0x04;
+	desc->u.ss.DeviceRemovable = cpu_to_le16(0xffff);
+}
+
+/* BOS of the USB3 root hub, only the SuperSpeed capability */
+static const struct {
+	struct usb_bos_descriptor bos;
+	struct usb_ss_cap_descriptor ss_cap;
+} __packed usb3_bos_desc = {
+	.bos = {
+		.bLength		= USB_DT_BOS_SIZE,
+		.bDescriptorType	= USB_DT_BOS,
+		.wTotalLength		= cpu_to_le16(sizeof(usb3_bos_desc)),
+		.bNumDeviceCaps		= 1,
+	},
+	.ss_cap = {
+		.bLength		= USB_DT_USB_SS_CAP_SIZE,
+		.bDescriptorType	= USB_DT_DEVICE_CAPABILITY,
+		.bDevCapabilityType	= USB_SS_CAP_TYPE,
+		.wSpeedSupported	= cpu_to_le16(USB_5GBPS_OPERATION),
+		.bFunctionalitySupport	= ilog2(USB_5GBPS_OPERATION),
+	},
+};
+
 static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 			    u16 wIndex, char *buf, u16 wLength)
 {
 	struct vhci_hcd	*dum;
 	int             retval = 0;
 	int		rhport;
+	int		ss = (hcd->speed == HCD_USB3);
 	unsigned long	flags;
 
 	u32 prev_port_status[VHCI_HC_PORTS];
@@ -297,6 +396,11 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 	case ClearPortFeature:
 		switch (wValue) {
 		case USB_PORT_FEAT_SUSPEND:
+			if (ss) {
+				pr_err(" ClearPortFeature: USB_PORT_FEAT_SUSPEND req not supported for USB 3.0 roothub\n");
+				retval = -EPIPE;
+				break;
+			}
 			if (dum->port_status[rhport] & USB_PORT_STAT_SUSPEND) {
 				/* 20msec signaling */
 				dum->resuming = 1;
@@ -310,6 +414,18 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 			dum->port_status[rhport] = 0;
 			dum->resuming = 0;
 			break;
+		case USB_PORT_FEAT_C_BH_PORT_RESET:
+			dum->port_status[rhport] &=
+				~(USB_PORT_STAT_C_BH_RESET << 16);
+			break;
+		case USB_PORT_FEAT_C_PORT_LINK_STATE:
+			dum->port_status[rhport] &=
+				~(USB_PORT_STAT_C_LINK_STATE << 16);
+			break;
+		case USB_PORT_FEAT_C_PORT_CONFIG_ERROR:
+			dum->port_status[rhport] &=
+				~(USB_PORT_STAT_C_CONFIG_ERROR << 16);
+			break;
 		case USB_PORT_FEAT_C_RESET:
 			usbip_dbg_vhci_rh(
 				" ClearPortFeature: USB_PORT_FEAT_C_RESET\n");
@@ -334,7 +450,24 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		break;
 	case GetHubDescriptor:
 		usbip_dbg_vhci_rh(" GetHubDescriptor\n");
-		hub_descriptor((struct usb_hub_descriptor *) buf);
+		if (ss && (wLength < USB_DT_SS_HUB_SIZE ||
+			   wValue != (USB_DT_SS_HUB << 8))) {
+			pr_err("wrong hub descriptor type for USB 3.0 roothub\n");
+			retval = -EPIPE;
+			break;
+		}
+		if (ss)
+			ss_hub_descriptor((struct usb_hub_descriptor *) buf);
+		else
+			hub_descriptor((struct usb_hub_descriptor *) buf);
+		break;
+	case DeviceRequest | USB_REQ_GET_DESCRIPTOR:
+		if (!ss || (wValue >> 8) != USB_DT_BOS) {
+			retval = -EPIPE;
+			break;
+		}
+		memcpy(buf, &usb3_bos_desc, sizeof(usb3_bos_desc));
+		retval = sizeof(usb3_bos_desc);
 		break;
 	case GetHubStatus:
 		usbip_dbg_vhci_rh(" GetHubStatus\n");
@@ -377,6 +510,12 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 					dum->vdev[rhport].ud.status);
 				dum->port_status[rhport] |=
 					USB_PORT_STAT_ENABLE;
+				/* a SuperSpeed link trains straight into U0 */
+				if (ss)
+					dum->port_status[rhport] =
+						(dum->port_status[rhport] &
+						 ~USB_PORT_STAT_LINK_STATE) |
+						USB_SS_PORT_LS_U0;
 			}
 		}
 		((__le16 *) buf)[0] = cpu_to_le16(dum->port_status[rhport]);
@@ -392,15 +531,70 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		break;
 	case SetPortFeature:
 		switch (wValue) {
+		case USB_PORT_FEAT_LINK_STATE:
+			usbip_dbg_vhci_rh(
+				" SetPortFeature: USB_PORT_FEAT_LINK_STATE\n");
+			if (!ss) {
+				pr_err("USB_PORT_FEAT_LINK_STATE req not supported for USB 2.0 roothub\n");
+				retval = -EPIPE;
+			}
+			/*
+			 * There is no real link behind a vhci port, so
+			 * there is nothing to do for SET_LINK_STATE.
+			 */
+			break;
+		case USB_PORT_FEAT_U1_TIMEOUT:
+		case USB_PORT_FEAT_U2_TIMEOUT:
+			usbip_dbg_vhci_rh(
+				" SetPortFeature: USB_PORT_FEAT_U1/U2_TIMEOUT\n");
+			if (!ss) {
+				pr_err("USB_PORT_FEAT_U1/U2_TIMEOUT req not supported for USB 2.0 roothub\n");
+				retval = -EPIPE;
+			}
+			break;
 		case USB_PORT_FEAT_SUSPEND:
 			usbip_dbg_vhci_rh(
 				" SetPortFeature: USB_PORT_FEAT_SUSPEND\n");
+			if (ss) {
+				pr_err("USB_PORT_FEAT_SUSPEND req not supported for USB 3.0 roothub\n");
+				retval = -EPIPE;
+			}
+			break;
+		case USB_PORT_FEAT_POWER:
+			usbip_dbg_vhci_rh(
+				" SetPortFeature: USB_PORT_FEAT_POWER\n");
+			if (ss)
+				dum->port_status[rhport] |=
+					USB_SS_PORT_STAT_POWER;
+			else
+				dum->port_status[rhport] |=
+					USB_PORT_STAT_POWER;
 			break;
+		case USB_PORT_FEAT_BH_PORT_RESET:
+			usbip_dbg_vhci_rh(
+				" SetPortFeature: USB_PORT_FEAT_BH_PORT_RESET\n");
+			if (!ss) {
+				pr_err("USB_PORT_FEAT_BH_PORT_RESET req not supported for USB 2.0 roothub\n");
+				retval = -EPIPE;
+				break;
+			}
+			/* FALLTHROUGH */
 		case USB_PORT_FEAT_RESET:
 			usbip_dbg_vhci_rh(
 				" SetPortFeature: USB_PORT_FEAT_RESET\n");
-			/* if it's already running, disconnect first */
-			if (dum->port_status[rhport] & USB_PORT_STAT_ENABLE) {
+			if (ss) {
+				/* warm or hot reset both retrain the link */
+				dum->port_status[rhport] &=
+					(USB_SS_PORT_STAT_POWER |
+					 USB_PORT_STAT_CONNECTION);
+				dum->port_status[rhport] |=
+					USB_PORT_STAT_RESET;
+				if (wValue == USB_PORT_FEAT_BH_PORT_RESET)
+					dum->port_status[rhport] |=
+						USB_PORT_STAT_C_BH_RESET << 16;
+			} else if (dum->port_status[rhport] &
+				   USB_PORT_STAT_ENABLE) {
+				/* if it's already running, disconnect first */
 				dum->port_status[rhport] &=
 					~(USB_PORT_STAT_ENABLE |
 					  USB_PORT_STAT_LOW_SPEED |
@@ -414,10 +608,29 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		default:
 			usbip_dbg_vhci_rh(" SetPortFeature: default %d\n",
 					  wValue);
+			if (ss && wValue == USB_PORT_FEAT_BH_PORT_RESET)
+				break;
 			dum->port_status[rhport] |= (1 << wValue);
 			break;
 		}
 		break;
+	case GetPortErrorCount:
+		usbip_dbg_vhci_rh(" GetPortErrorCount\n");
+		if (!ss) {
+			pr_err("GetPortErrorCount req not supported for USB 2.0 roothub\n");
+			retval = -EPIPE;
+			break;
+		}
+		/* we do not have a link, so no errors are ever counted */
+		*(__le32 *) buf = cpu_to_le32(0);
+		break;
+	case SetHubDepth:
+		usbip_dbg_vhci_rh(" SetHubDepth\n");
+		if (!ss) {
+			pr_err("SetHubDepth req not supported for USB 2.0 roothub\n");
+			retval = -EPIPE;
+		}
+		break;
 
 	default:
 		pr_err("default: no such request\n");
@@ -429,9 +642,9 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 	if (usbip_dbg_flag_vhci_rh) {
 		pr_debug("port %d\n", rhport);
 		/* Only dump valid port status */
-		if (rhport >= 0) {
+		if (rhport >= 0 && rhport < VHCI_HC_PORTS) {
 			dump_port_status_diff(prev_port_status[rhport],
-					      dum->port_status[rhport]);
+					      dum->port_status[rhport], ss);
 		}
 	}
 	usbip_dbg_vhci_rh(" bye\n");
@@ -446,7 +659,7 @@ static struct vhci_device *get_vdev(struct usb_device *udev)
 	struct platform_device *pdev;
 	struct usb_hcd *hcd;
 	struct vhci_hcd *vhci;
-	int pdev_nr, rhport;
+	int pdev_nr, ss, rhport;
 
 	if (!udev)
 		return NULL;
@@ -455,13 +668,15 @@ static struct vhci_device *get_vdev(struct usb_device *udev)
 		pdev = *(vhci_pdevs + pdev_nr);
 		if (pdev == NULL)
 			continue;
-		hcd = platform_get_drvdata(pdev);
-		if (hcd == NULL)
-			continue;
-		vhci = hcd_to_vhci(hcd);
-		for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++) {
-			if (vhci->vdev[rhport].udev == udev)
-				return &vhci->vdev[rhport];
+		for (ss = 0; ss < 2; ss++) {
+			hcd = pdev_to_hcd(pdev, ss);
+			if (hcd == NULL)
+				continue;
+			vhci = hcd_to_vhci(hcd);
+			for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++) {
+				if (vhci->vdev[rhport].udev == udev)
+					return &vhci->vdev[rhport];
+			}
 		}
 	}
 
@@ -495,10 +710,13 @@ static void vhci_tx_urb(struct urb *urb)
 
 	priv->vdev = vdev;
 	priv->urb = urb;
+	priv->queued = ktime_get();
 
 	urb->hcpriv = (void *) priv;
 
 	list_add_tail(&priv->list, &vdev->priv_tx);
+	usbip_stats_inc(&vdev->ud, submitted[usb_pipetype(urb->pipe)]);
+	trace_usbip_vhci_urb_enqueue(vdev->devid, priv->seqnum, urb);
 
 	wake_up(&vdev->waitq_tx);
 	spin_unlock_irqrestore(&vdev->priv_lock, flags);
@@ -611,6 +829,22 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb,
 
 	}
 
+	/* later URBs of a polled endpoint wait for its reports */
+	if ((vdev->ud.features & USBIP_FEAT_INT_POLL) &&
+	    usb_pipeint(urb->pipe) && usb_pipein(urb->pipe)) {
+		ret = vhci_poll_urb(vdev, urb);
+		if (ret == VHCI_POLL_DONE) {
+			ret = 0;
+			goto no_need_xmit;
+		}
+		if (ret < 0)
+			goto no_need_xmit;
+		if (ret == VHCI_POLL_PENDING) {
+			spin_unlock_irqrestore(&vhci->lock, flags);
+			return 0;
+		}
+	}
+
 out:
 	vhci_tx_urb(urb);
 	spin_unlock_irqrestore(&vhci->lock, flags);
@@ -703,6 +937,28 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 
 	 /* send unlink request here? */
 	vdev = priv->vdev;
+	usbip_stats_inc(&vdev->ud, unlinked[usb_pipetype(urb->pipe)]);
+	trace_usbip_vhci_unlink(vdev->devid, priv->seqnum, urb);
+
+	if (priv->polled || priv->held) {
+		/*
+		 * not sent, it waits for a report of a polled endpoint, or
+		 * completed and held back until its frame
+		 */
+		spin_lock(&vdev->priv_lock);
+		list_del(&priv->list);
+		if (priv->held)
+			vdev->iso.nr_held--;
+		kfree(priv);
+		urb->hcpriv = NULL;
+		spin_unlock(&vdev->priv_lock);
+
+		usb_hcd_unlink_urb_from_ep(hcd, urb);
+
+		spin_unlock_irqrestore(&vhci->lock, flags);
+		usb_hcd_giveback_urb(vhci_to_hcd(vhci), urb, urb->status);
+		return 0;
+	}
 
 	if (!vdev->ud.tcp_socket) {
 		/* tcp connection is closed */
@@ -790,7 +1046,8 @@ static void vhci_device_unlink_cleanup(struct vhci_device *vdev)
 		/* give back URB of unanswered unlink request */
 		pr_info("unlink cleanup rx %lu\n", unlink->unlink_seqnum);
 
-		urb = pickup_urb_and_free_priv(vdev, unlink->unlink_seqnum);
+		urb = pickup_urb_and_free_priv(vdev, unlink->unlink_seqnum,
+					       NULL);
 		if (!urb) {
 			pr_info("the urb (seqnum %lu) was already given back\n",
 				unlink->unlink_seqnum);
@@ -829,6 +1086,7 @@ static void vhci_shutdown_connection(struct usbip_device *ud)
 {
 	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
 
+	vhci_hb_stop(vdev);
 	usbip_trx_ops->unlink(ud);
 
 	/* kill threads related to this sdev */
@@ -852,6 +1110,11 @@ static void vhci_shutdown_connection(struct usbip_device *ud)
 	pr_info("release socket\n");
 
 	vhci_device_unlink_cleanup(vdev);
+	vhci_poll_cleanup(vdev);
+	vhci_iso_cleanup(vdev);
+	usbip_iso_pool_free(&ud->iso_tx);
+	usbip_iso_pool_free(&ud->iso_rx);
+	usbip_compress_free(ud);
 
 	/*
 	 * rh_port_disconnect() is a trigger of ...
@@ -887,6 +1150,7 @@ static void vhci_device_reset(struct usbip_device *ud)
 
 	vdev->speed  = 0;
 	vdev->devid  = 0;
+	ud->features = 0;
 
 	usb_put_dev(vdev->udev);
 	vdev->udev = NULL;
@@ -897,6 +1161,9 @@ static void vhci_device_reset(struct usbip_device *ud)
 	}
 	ud->status = VDEV_ST_NULL;
 
+	/* the next device on the port starts from the defaults */
+	usbip_sched_init(ud);
+
 	spin_unlock_irqrestore(&ud->lock, flags);
 
 	vhci_put_device(vdev);
@@ -920,6 +1187,7 @@ static void vhci_device_init(struct vhci_device *vdev)
 
 	vdev->ud.side   = USBIP_VHCI;
 	vdev->ud.status = VDEV_ST_NULL;
+	usbip_sched_init(&vdev->ud);
 	spin_lock_init(&vdev->ud.lock);
 	atomic_set(&vdev->using_port, 0);
 
@@ -927,6 +1195,9 @@ static void vhci_device_init(struct vhci_device *vdev)
 	INIT_LIST_HEAD(&vdev->priv_tx);
 	INIT_LIST_HEAD(&vdev->unlink_tx);
 	INIT_LIST_HEAD(&vdev->unlink_rx);
+	vhci_poll_init(vdev);
+	vhci_iso_init(vdev);
+	vhci_hb_init(vdev);
 	spin_lock_init(&vdev->priv_lock);
 
 	init_waitqueue_head(&vdev->waitq_tx);
@@ -955,6 +1226,76 @@ static int hcd_name_to_pdev_nr(const char *name)
 	return val;
 }
 
+/*
+ * Each platform device carries a USB2 hcd (primary) and a USB3 hcd sharing
+ * it. The usb core gives both the driver's HCD_USB3 speed, so the primary
+ * one is lowered to USB2 here, before its root hub is registered.
+ */
+static int vhci_setup(struct usb_hcd *hcd)
+{
+	if (usb_hcd_is_primary_hcd(hcd)) {
+		hcd->speed = HCD_USB2;
+		hcd->self.root_hub->speed = USB_SPEED_HIGH;
+	} else {
+		hcd->speed = HCD_USB3;
+		hcd->self.root_hub->speed = USB_SPEED_SUPER;
+	}
+	return 0;
+}
+
+static void vhci_stats_show(struct usbip_device *ud, struct seq_file *m)
+{
+	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
+	unsigned int nr_tx = 0, nr_rx = 0, nr_unlink = 0, nr_held;
+	struct vhci_unlink *unlink;
+	struct vhci_priv *priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vdev->priv_lock, flags);
+	list_for_each_entry(priv, &vdev->priv_tx, list)
+		nr_tx++;
+	list_for_each_entry(priv, &vdev->priv_rx, list)
+		nr_rx++;
+	list_for_each_entry(unlink, &vdev->unlink_tx, list)
+		nr_unlink++;
+	nr_held = vdev->iso.nr_held;
+	spin_unlock_irqrestore(&vdev->priv_lock, flags);
+
+	usbip_stats_queue(m, "priv_tx", nr_tx);
+	usbip_stats_queue(m, "priv_rx", nr_rx);
+	usbip_stats_queue(m, "unlink_tx", nr_unlink);
+	usbip_stats_queue(m, "iso_held", nr_held);
+
+	vhci_stamps_show(vdev, m);
+}
+
+static void vhci_stats_free(struct vhci_hcd *vhci)
+{
+	int rhport;
+
+	for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++)
+		usbip_stats_free(&vhci->vdev[rhport].ud);
+}
+
+/* usbip_stats of each port, named by its port number */
+static int vhci_stats_alloc(struct vhci_hcd *vhci, int pdev_nr, int ss)
+{
+	char name[16];
+	int rhport;
+
+	for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++) {
+		snprintf(name, sizeof(name), "port%u",
+			 rhport_to_port(pdev_nr, ss, rhport));
+		if (usbip_stats_alloc(&vhci->vdev[rhport].ud, name,
+				      vhci_stats_show)) {
+			vhci_stats_free(vhci);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int vhci_start(struct usb_hcd *hcd)
 {
 	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
@@ -974,6 +1315,7 @@ static int vhci_start(struct usb_hcd *hcd)
 
 	atomic_set(&vhci->seqnum, 0);
 	spin_lock_init(&vhci->lock);
+	vhci->frame_base = ktime_get();
 	vhci->using_ports = 0;
 
 	hcd->power_budget = 0; /* no limit */
@@ -985,22 +1327,35 @@ static int vhci_start(struct usb_hcd *hcd)
 		return -EINVAL;
 	}
 
+	err = vhci_stats_alloc(vhci, pdev_nr, hcd->speed == HCD_USB3);
+	if (err)
+		return err;
+
 	/* vhci_hcd is now ready to be controlled through sysfs */
-	if (pdev_nr == 0) {
+	if (pdev_nr == 0 && usb_hcd_is_primary_hcd(hcd)) {
 		err = vhci_init_attr_group();
 		if (err) {
 			pr_err("init attr group\n");
+			vhci_stats_free(vhci);
 			return err;
 		}
 		err = sysfs_create_group(&hcd_dev(hcd)->kobj, &vhci_attr_group);
 		if (err) {
 			pr_err("create sysfs files\n");
 			vhci_finish_attr_group();
+			vhci_stats_free(vhci);
 			return err;
 		}
 		pr_info("created sysfs %s\n", hcd_name(hcd));
 	}
 
+	/*
+	 * The USB3 hcd is added after the USB2 one, so the controller is
+	 * complete when the shared hcd starts.
+	 */
+	if (usb_hcd_is_primary_hcd(hcd))
+		return 0;
+
 	if (atomic_dec_and_test(&pdevs_init_count))
 		pdevs_init_completed = 1;
 	if (pdevs_init_completed)
@@ -1020,7 +1375,7 @@ static void vhci_stop(struct usb_hcd *hcd)
 
 	/* 1. remove the userland interface of vhci_hcd */
 	pdev_nr = hcd_name_to_pdev_nr(hcd_name(hcd));
-	if (pdev_nr == 0) {
+	if (pdev_nr == 0 && usb_hcd_is_primary_hcd(hcd)) {
 		sysfs_remove_group(&hcd_dev(hcd)->kobj, &vhci_attr_group);
 		vhci_finish_attr_group();
 	}
@@ -1032,14 +1387,67 @@ static void vhci_stop(struct usb_hcd *hcd)
 		vhci_event_add(&vdev->ud, VDEV_EVENT_REMOVED);
 		usbip_stop_eh(&vdev->ud);
 	}
+
+	vhci_stats_free(vhci);
 }
 
-static int vhci_get_frame_number(struct usb_hcd *hcd)
+/*
+ * Streams are only counted here, in usb_host_endpoint->streams by usbcore.
+ * Each CMD_SUBMIT carries that count and the stub allocates streams on the
+ * remote host controller when it changes, so no round trip is needed.
+ */
+static int vhci_alloc_streams(struct usb_hcd *hcd, struct usb_device *udev,
+			      struct usb_host_endpoint **eps,
+			      unsigned int num_eps, unsigned int num_streams,
+			      gfp_t mem_flags)
+{
+	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
+	struct vhci_device *vdev;
+	unsigned int i, max;
+
+	if (hcd->speed != HCD_USB3 || !udev->portnum ||
+	    udev->portnum > VHCI_HC_PORTS)
+		return -EINVAL;
+
+	vdev = &vhci->vdev[udev->portnum - 1];
+	if (!(vdev->ud.features & USBIP_FEAT_STREAMS)) {
+		dev_dbg(&udev->dev, "streams not negotiated with the peer\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_eps; i++) {
+		max = usb_ss_max_streams(&eps[i]->ss_ep_comp);
+		if (!max) {
+			dev_dbg(&udev->dev, "ep %#x does not support streams\n",
+				eps[i]->desc.bEndpointAddress);
+			return -EINVAL;
+		}
+		num_streams = min(num_streams, max);
+	}
+
+	/* stream 0 is reserved as on xHCI */
+	num_streams = min_t(unsigned int, num_streams, VHCI_MAX_STREAMS);
+	if (num_streams < 2)
+		return -EINVAL;
+
+	usbip_dbg_vhci_hc("%u streams on %u eps\n", num_streams - 1, num_eps);
+	return num_streams - 1;
+}
+
+static int vhci_free_streams(struct usb_hcd *hcd, struct usb_device *udev,
+			     struct usb_host_endpoint **eps,
+			     unsigned int num_eps, gfp_t mem_flags)
 {
-	dev_err_ratelimited(&hcd->self.root_hub->dev, "Not yet implemented\n");
+	/* the next CMD_SUBMIT carries a zero count, see vhci_alloc_streams */
 	return 0;
 }
 
+/* see vhci_iso.c */
+static int vhci_get_frame_number(struct usb_hcd *hcd)
+{
+	return vhci_frame(hcd_to_vhci(hcd)) & VHCI_FRAME_MASK;
+}
+
 #ifdef CONFIG_PM
 
 /* FIXME: suspend/resume */
@@ -1086,8 +1494,9 @@ static struct hc_driver vhci_hc_driver = {
 	.product_desc	= driver_desc,
 	.hcd_priv_size	= sizeof(struct vhci_hcd),
 
-	.flags		= HCD_USB2,
+	.flags		= HCD_USB3 | HCD_SHARED,
 
+	.reset		= vhci_setup,
 	.start		= vhci_start,
 	.stop		= vhci_stop,
 
@@ -1096,6 +1505,9 @@ static struct hc_driver vhci_hc_driver = {
 
 	.get_frame_number = vhci_get_frame_number,
 
+	.alloc_streams	= vhci_alloc_streams,
+	.free_streams	= vhci_free_streams,
+
 	.hub_status_data = vhci_hub_status,
 	.hub_control    = vhci_hub_control,
 	.bus_suspend	= vhci_bus_suspend,
@@ -1104,7 +1516,8 @@ static struct hc_driver vhci_hc_driver = {
 
 static int vhci_hcd_probe(struct platform_device *pdev)
 {
-	struct usb_hcd		*hcd;
+	struct usb_hcd		*hcd_hs;
+	struct usb_hcd		*hcd_ss;
 	int			ret;
 
 	usbip_dbg_vhci_hc("name %s id %d\n", pdev->name, pdev->id);
@@ -1113,26 +1526,48 @@ static int vhci_hcd_probe(struct platform_device *pdev)
 	 * Allocate and initialize hcd.
 	 * Our private data is also allocated automatically.
 	 */
-	hcd = usb_create_hcd(&vhci_hc_driver, &pdev->dev, dev_name(&pdev->dev));
-	if (!hcd) {
-		pr_err("create hcd failed\n");
+	hcd_hs = usb_create_hcd(&vhci_hc_driver, &pdev->dev,
+				dev_name(&pdev->dev));
+	if (!hcd_hs) {
+		pr_err("create primary hcd failed\n");
 		return -ENOMEM;
 	}
-	hcd->has_tt = 1;
+	hcd_hs->has_tt = 1;
 
 	/*
 	 * Finish generic HCD structure initialization and register.
 	 * Call the driver's reset() and start() routines.
 	 */
-	ret = usb_add_hcd(hcd, 0, 0);
+	ret = usb_add_hcd(hcd_hs, 0, 0);
 	if (ret != 0) {
-		pr_err("usb_add_hcd failed %d\n", ret);
-		usb_put_hcd(hcd);
-		return ret;
+		pr_err("usb_add_hcd hs failed %d\n", ret);
+		goto put_usb2_hcd;
+	}
+
+	hcd_ss = usb_create_shared_hcd(&vhci_hc_driver, &pdev->dev,
+				       dev_name(&pdev->dev), hcd_hs);
+	if (!hcd_ss) {
+		ret = -ENOMEM;
+		pr_err("create shared hcd failed\n");
+		goto remove_usb2_hcd;
+	}
+
+	ret = usb_add_hcd(hcd_ss, 0, 0);
+	if (ret) {
+		pr_err("usb_add_hcd ss failed %d\n", ret);
+		goto put_usb3_hcd;
 	}
 
 	usbip_dbg_vhci_hc("bye\n");
 	return 0;
+
+put_usb3_hcd:
+	usb_put_hcd(hcd_ss);
+remove_usb2_hcd:
+	usb_remove_hcd(hcd_hs);
+put_usb2_hcd:
+	usb_put_hcd(hcd_hs);
+	return ret;
 }
 
 static int vhci_hcd_remove(struct platform_device *pdev)
@@ -1147,7 +1582,12 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 	 * Disconnects the root hub,
 	 * then reverses the effects of usb_add_hcd(),
 	 * invoking the HCD's stop() methods.
+	 * The shared USB3 hcd goes first.
 	 */
+	if (hcd->shared_hcd) {
+		usb_remove_hcd(hcd->shared_hcd);
+		usb_put_hcd(hcd->shared_hcd);
+	}
 	usb_remove_hcd(hcd);
 	usb_put_hcd(hcd);
 
@@ -1161,7 +1601,7 @@ static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 {
 	struct usb_hcd *hcd;
 	struct vhci_hcd *vhci;
-	int rhport;
+	int rhport, ss;
 	int connected = 0;
 	int ret = 0;
 	unsigned long flags;
@@ -1169,15 +1609,19 @@ static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 	hcd = platform_get_drvdata(pdev);
 	if (!hcd)
 		return 0;
-	vhci = hcd_to_vhci(hcd);
 
-	spin_lock_irqsave(&vhci->lock, flags);
+	for (ss = 0; ss < 2; ss++) {
+		vhci = hcd_to_vhci(pdev_to_hcd(pdev, ss));
 
-	for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++)
-		if (vhci->port_status[rhport] & USB_PORT_STAT_CONNECTION)
-			connected += 1;
+		spin_lock_irqsave(&vhci->lock, flags);
 
-	spin_unlock_irqrestore(&vhci->lock, flags);
+		for (rhport = 0; rhport < VHCI_HC_PORTS; rhport++)
+			if (vhci->port_status[rhport] &
+			    USB_PORT_STAT_CONNECTION)
+				connected += 1;
+
+		spin_unlock_irqrestore(&vhci->lock, flags);
+	}
 
 	if (connected > 0) {
 		dev_info(&pdev->dev,
@@ -1187,6 +1631,7 @@ static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 	} else {
 		dev_info(&pdev->dev, "suspend vhci_hcd");
 		clear_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
+		clear_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->shared_hcd->flags);
 	}
 
 	return ret;
@@ -1202,7 +1647,9 @@ static int vhci_hcd_resume(struct platform_device *pdev)
 	if (!hcd)
 		return 0;
 	set_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
+	set_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->shared_hcd->flags);
 	usb_hcd_poll_rh_status(hcd);
+	usb_hcd_poll_rh_status(hcd->shared_hcd);
 
 	return 0;
 }
@@ -1270,13 +1717,14 @@ static void del_platform_devices(void)
 }
 
 static void __vhci_get_device(struct platform_device *pdev, __u32 rhport,
-			      struct vhci_hcd **vhci, struct vhci_device **vdev)
+			      int ss, struct vhci_hcd **vhci,
+			      struct vhci_device **vdev)
 {
 	struct usb_hcd *hcd;
 	unsigned long flags;
 
 	spin_lock_irqsave(&using_ports_lock, flags);
-	hcd = platform_get_drvdata(pdev);
+	hcd = pdev_to_hcd(pdev, ss);
 	*vhci = hcd_to_vhci(hcd);
 	*vdev = &((*vhci)->vdev[rhport]);
 	vhci_using_ports++;
@@ -1285,7 +1733,7 @@ static void __vhci_get_device(struct platform_device *pdev, __u32 rhport,
 	spin_unlock_irqrestore(&using_ports_lock, flags);
 }
 
-int vhci_get_device(__u32 pdev_nr, __u32 rhport,
+int vhci_get_device(__u32 pdev_nr, __u32 rhport, int ss,
 		    struct vhci_hcd **vhci, struct vhci_device **vdev)
 {
 	struct platform_device *pdev;
@@ -1299,7 +1747,7 @@ int vhci_get_device(__u32 pdev_nr, __u32 rhport,
 
 	pdev = *(vhci_pdevs + pdev_nr);
 	if (pdev) {
-		__vhci_get_device(pdev, rhport, vhci, vdev);
+		__vhci_get_device(pdev, rhport, ss, vhci, vdev);
 		spin_unlock_irqrestore(&pdevs_lock, flags);
 		return 0;
 	}
@@ -1321,7 +1769,7 @@ int vhci_get_device(__u32 pdev_nr, __u32 rhport,
 	usbip_dbg_vhci_rh("end of waiting pdev started %d\n", pdev_nr);
 
 	pdev = *(vhci_pdevs + pdev_nr);
-	__vhci_get_device(pdev, rhport, vhci, vdev);
+	__vhci_get_device(pdev, rhport, ss, vhci, vdev);
 
 	spin_unlock_irqrestore(&pdevs_lock, flags);
 
@@ -1347,14 +1795,15 @@ static int __try_del_platform_device(void)
 {
 	int pdev_nr;
 	struct platform_device *pdev;
-	struct vhci_hcd *vhci;
+	struct vhci_hcd *vhci_hs, *vhci_ss;
 
 	for (pdev_nr = (vhci_max_controllers - 1); pdev_nr > 0; pdev_nr--) {
 		pdev = *(vhci_pdevs + pdev_nr);
 		if (!pdev)
 			continue;
-		vhci = hcd_to_vhci(platform_get_drvdata(pdev));
-		if (!vhci->using_ports) {
+		vhci_hs = hcd_to_vhci(pdev_to_hcd(pdev, 0));
+		vhci_ss = hcd_to_vhci(pdev_to_hcd(pdev, 1));
+		if (!vhci_hs->using_ports && !vhci_ss->using_ports) {
 			__del_platform_device(pdev_nr);
 			return 1;
 		}
@@ -1374,12 +1823,12 @@ static void try_del_platform_device(void)
 	usbip_dbg_vhci_rh("trying del pdev\n");
 
 	if (vhci_num_controllers > vhci_init_controllers) {
-		free_ports = (vhci_num_controllers * VHCI_HC_PORTS)
+		free_ports = (vhci_num_controllers * VHCI_PORTS)
 				- vhci_using_ports;
 		usbip_dbg_vhci_rh("%d free ports in %d hcs\n",
 				  free_ports, vhci_num_controllers);
 		/* free_pots will be decremented with this event */
-		if (free_ports >=  (VHCI_HC_PORTS * VHCI_FREE_HCS))
+		if (free_ports >=  (VHCI_PORTS * VHCI_FREE_HCS))
 			__try_del_platform_device();
 	}
 
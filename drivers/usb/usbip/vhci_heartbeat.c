@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Heartbeat timer of a port with USBIP_FEAT_HEARTBEAT, see
+ * usbip_heartbeat.c. Each tick makes a USBIP_NOP due for vhci_tx, and
+ * closes the connection if the server has sent nothing since
+ * heartbeat_misses ticks. The interval is read at each tick, 0 stops the
+ * timer until the next attach.
+ */
+
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/timer.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+static unsigned int heartbeat_interval = 1000;
+module_param(heartbeat_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(heartbeat_interval,
+		 "ms between heartbeats of a connection, 0 to disable");
+
+static unsigned int heartbeat_misses = 5;
+module_param(heartbeat_misses, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(heartbeat_misses,
+		 "heartbeats without an answer to drop a connection after, 0 never");
+
+static void vhci_hb_arm(struct vhci_device *vdev)
+{
+	unsigned int interval = READ_ONCE(heartbeat_interval);
+
+	if (interval)
+		mod_timer(&vdev->hb_timer,
+			  jiffies + msecs_to_jiffies(interval));
+}
+
+static void vhci_hb_timer(unsigned long data)
+{
+	struct vhci_device *vdev = (struct vhci_device *)data;
+
+	if (usbip_hb_tick(&vdev->ud, READ_ONCE(heartbeat_misses))) {
+		pr_info("no heartbeat from devid %u, closing\n", vdev->devid);
+		vhci_event_add(&vdev->ud, VDEV_EVENT_ERROR_TCP);
+		return;
+	}
+
+	wake_up(&vdev->waitq_tx);
+	vhci_hb_arm(vdev);
+}
+
+void vhci_hb_init(struct vhci_device *vdev)
+{
+	setup_timer(&vdev->hb_timer, vhci_hb_timer, (unsigned long)vdev);
+}
+
+/* the threads are running */
+void vhci_hb_start(struct vhci_device *vdev)
+{
+	if (vdev->ud.features & USBIP_FEAT_HEARTBEAT)
+		vhci_hb_arm(vdev);
+}
+
+void vhci_hb_stop(struct vhci_device *vdev)
+{
+	del_timer_sync(&vdev->hb_timer);
+}
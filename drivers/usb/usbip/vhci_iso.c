@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Frame clock and jitter buffer of isochronous URBs.
+ *
+ * vhci counts 1 ms frames from the start of the controller. The offset of the
+ * server frame numbers to this clock is estimated from the start_frame of the
+ * URBs the server returns, so that start_frame means the same frame to class
+ * drivers as to the server.
+ *
+ * With iso_delay, completed isochronous URBs are not given back as they come
+ * from the network. The first URB of a stream is held iso_delay frames, and
+ * each next one is due as many frames after the previous one as its packets
+ * take, on a frame boundary. A URB coming after it is due means the class
+ * driver saw a gap: it is counted as an underrun and the stream fills the
+ * delay again. A stream held longer than the delay is pulled back a frame at a
+ * time, so the buffer follows the clock of the server.
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+static unsigned int iso_delay;
+module_param(iso_delay, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(iso_delay,
+		 "frames isochronous URBs are held back by, 0 to disable");
+
+u64 vhci_frame(struct vhci_hcd *vhci)
+{
+	return ktime_ms_delta(ktime_get(), vhci->frame_base);
+}
+
+static ktime_t vhci_frame_time(struct vhci_hcd *vhci, u64 frame)
+{
+	return ktime_add_ms(vhci->frame_base, frame);
+}
+
+/* frames taken by the packets of urb */
+static unsigned int vhci_iso_span(struct urb *urb)
+{
+	unsigned int span = urb->number_of_packets * urb->interval;
+
+	/* interval is in microframes */
+	if (urb->dev->speed >= USB_SPEED_HIGH)
+		span = DIV_ROUND_UP(span, 8);
+
+	return max(span, 1U);
+}
+
+static void vhci_iso_giveback(struct usb_hcd *hcd, struct list_head *list)
+{
+	struct vhci_priv *priv, *tmp;
+
+	list_for_each_entry_safe(priv, tmp, list, list) {
+		struct urb *urb = priv->urb;
+
+		list_del(&priv->list);
+		kfree(priv);
+
+		usb_hcd_giveback_urb(hcd, urb, urb->status);
+	}
+}
+
+/* be in spin_lock(&vdev->priv_lock) */
+static void vhci_iso_arm(struct vhci_device *vdev)
+{
+	struct vhci_iso *iso = &vdev->iso;
+	struct vhci_priv *priv;
+	u64 due = U64_MAX;
+
+	list_for_each_entry(priv, &iso->held, list)
+		due = min(due, priv->due);
+
+	if (due == U64_MAX || (iso->armed && iso->expires <= due))
+		return;
+
+	iso->armed = 1;
+	iso->expires = due;
+	hrtimer_start(&iso->timer, vhci_frame_time(vdev_to_vhci(vdev), due),
+		      HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart vhci_iso_timer(struct hrtimer *timer)
+{
+	struct vhci_device *vdev = container_of(timer, struct vhci_device,
+						iso.timer);
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct usb_hcd *hcd = vhci_to_hcd(vhci);
+	struct vhci_priv *priv, *tmp;
+	unsigned long flags;
+	LIST_HEAD(due);
+	u64 now;
+
+	spin_lock_irqsave(&vhci->lock, flags);
+	spin_lock(&vdev->priv_lock);
+
+	vdev->iso.armed = 0;
+	now = vhci_frame(vhci);
+
+	list_for_each_entry_safe(priv, tmp, &vdev->iso.held, list) {
+		if (priv->due > now)
+			continue;
+
+		list_move_tail(&priv->list, &due);
+		vdev->iso.nr_held--;
+		priv->urb->hcpriv = NULL;
+		usb_hcd_unlink_urb_from_ep(hcd, priv->urb);
+	}
+
+	vhci_iso_arm(vdev);
+
+	spin_unlock(&vdev->priv_lock);
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	vhci_iso_giveback(hcd, &due);
+
+	return HRTIMER_NORESTART;
+}
+
+void vhci_iso_init(struct vhci_device *vdev)
+{
+	hrtimer_init(&vdev->iso.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vdev->iso.timer.function = vhci_iso_timer;
+	INIT_LIST_HEAD(&vdev->iso.held);
+}
+
+/*
+ * Moves the offset to the server frame numbers by a completed URB, and gives
+ * its start_frame in ours.
+ * be in spin_lock(&vdev->priv_lock)
+ */
+static void vhci_iso_sync(struct vhci_device *vdev, struct urb *urb, u64 now)
+{
+	struct vhci_iso *iso = &vdev->iso;
+	u32 offset = (urb->start_frame - (u32)now) & VHCI_FRAME_MASK;
+	int diff = sign_extend32((offset - iso->offset) & VHCI_FRAME_MASK, 9);
+
+	/*
+	 * The URB which came the fastest tells the offset best. Slower ones
+	 * only drag it for the drift of the clocks.
+	 */
+	if (!iso->synced || diff > 0)
+		iso->offset = offset;
+	else
+		iso->offset = (iso->offset + diff / 8) & VHCI_FRAME_MASK;
+	iso->synced = 1;
+
+	urb->start_frame = (urb->start_frame - iso->offset) & VHCI_FRAME_MASK;
+}
+
+/* start_frame of CMD_SUBMIT, in server frame numbers */
+__u32 vhci_iso_start_frame(struct vhci_device *vdev, struct urb *urb)
+{
+	if ((urb->transfer_flags & URB_ISO_ASAP) ||
+	    !READ_ONCE(vdev->iso.synced))
+		return urb->start_frame;
+
+	return (urb->start_frame + READ_ONCE(vdev->iso.offset)) &
+		VHCI_FRAME_MASK;
+}
+
+/*
+ * Takes a completed isochronous URB from vhci_rx. Returns 1 if it is held
+ * until its frame, 0 if the caller gives it back now.
+ */
+int vhci_iso_hold(struct vhci_device *vdev, struct urb *urb)
+{
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct vhci_iso_stream *stream;
+	struct vhci_priv *priv = NULL;
+	unsigned int delay, span;
+	unsigned long flags;
+	u64 now;
+	int i;
+
+	delay = min_t(unsigned int, READ_ONCE(iso_delay), VHCI_ISO_MAX_DELAY);
+	if (delay)
+		priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+
+	stream = &vdev->iso.streams[!!usb_pipein(urb->pipe)]
+				   [usb_pipeendpoint(urb->pipe)];
+	span = vhci_iso_span(urb);
+
+	spin_lock_irqsave(&vhci->lock, flags);
+	spin_lock(&vdev->priv_lock);
+
+	now = vhci_frame(vhci);
+
+	if (!urb->status)
+		vhci_iso_sync(vdev, urb, now);
+
+	/* packets the server missed the frame of */
+	for (i = 0; i < urb->number_of_packets; i++)
+		if (urb->iso_frame_desc[i].status == -EXDEV)
+			vdev->iso.late_packets++;
+
+	if (!priv) {
+		stream->active = 0;
+		spin_unlock(&vdev->priv_lock);
+		spin_unlock_irqrestore(&vhci->lock, flags);
+		return 0;
+	}
+
+	if (!stream->active || now > stream->next + VHCI_ISO_IDLE) {
+		stream->next = now + delay;
+		stream->active = 1;
+	} else if (now > stream->next) {
+		vdev->iso.underruns++;
+		stream->next = now + delay;
+	} else if (stream->next > now + delay + span) {
+		stream->next--;
+	}
+
+	priv->due = stream->next;
+	stream->next += span;
+
+	priv->vdev = vdev;
+	priv->urb = urb;
+	priv->held = 1;
+	urb->hcpriv = priv;
+
+	usbip_dbg_vhci_rx("hold urb %p until frame %llu\n", urb, priv->due);
+
+	list_add_tail(&priv->list, &vdev->iso.held);
+	vdev->iso.nr_held++;
+	vhci_iso_arm(vdev);
+
+	spin_unlock(&vdev->priv_lock);
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	return 1;
+}
+
+/* gives back the held URBs, the rx thread has stopped */
+void vhci_iso_cleanup(struct vhci_device *vdev)
+{
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct usb_hcd *hcd = vhci_to_hcd(vhci);
+	struct vhci_priv *priv, *tmp;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	hrtimer_cancel(&vdev->iso.timer);
+
+	spin_lock_irqsave(&vhci->lock, flags);
+	spin_lock(&vdev->priv_lock);
+
+	list_for_each_entry_safe(priv, tmp, &vdev->iso.held, list) {
+		list_move_tail(&priv->list, &list);
+		priv->urb->hcpriv = NULL;
+		usb_hcd_unlink_urb_from_ep(hcd, priv->urb);
+	}
+
+	vdev->iso.nr_held = 0;
+	vdev->iso.armed = 0;
+	vdev->iso.synced = 0;
+	vdev->iso.underruns = 0;
+	vdev->iso.late_packets = 0;
+	memset(vdev->iso.streams, 0, sizeof(vdev->iso.streams));
+
+	spin_unlock(&vdev->priv_lock);
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	vhci_iso_giveback(hcd, &list);
+}
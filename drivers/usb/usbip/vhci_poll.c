@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Interrupt IN endpoints polled by the server, with USBIP_FEAT_INT_POLL.
+ *
+ * The first interrupt IN URB of an endpoint is sent as usual and makes the
+ * server poll the endpoint on its own. Until the server tells that it has
+ * stopped, later URBs are not sent: they wait in vhci_poll.pending for the
+ * reports pushed by RET_POLL, and reports arriving while no URB waits are
+ * queued for a while. A report is not given while a URB sent to the server
+ * is outstanding on the endpoint, as that one completes first.
+ */
+
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+void vhci_poll_init(struct vhci_device *vdev)
+{
+	int i;
+
+	for (i = 0; i < USB_MAXENDPOINTS / 2; i++) {
+		INIT_LIST_HEAD(&vdev->poll[i].pending);
+		INIT_LIST_HEAD(&vdev->poll[i].reports);
+	}
+}
+
+static int vhci_poll_match(struct urb *urb, int epnum)
+{
+	return usb_pipeint(urb->pipe) && usb_pipein(urb->pipe) &&
+		usb_pipeendpoint(urb->pipe) == epnum;
+}
+
+/* be in spin_lock(&vdev->priv_lock) */
+static int vhci_poll_sent(struct vhci_device *vdev, int epnum)
+{
+	struct vhci_priv *priv;
+
+	list_for_each_entry(priv, &vdev->priv_tx, list)
+		if (vhci_poll_match(priv->urb, epnum))
+			return 1;
+
+	list_for_each_entry(priv, &vdev->priv_rx, list)
+		if (vhci_poll_match(priv->urb, epnum))
+			return 1;
+
+	return 0;
+}
+
+/* be in spin_lock(&vdev->priv_lock) */
+static void vhci_poll_drop(struct vhci_poll *poll,
+			   struct vhci_poll_report *report)
+{
+	list_del(&report->list);
+	poll->nr_reports--;
+	kfree(report);
+}
+
+/*
+ * Returns the oldest report which is not stale, or NULL.
+ * be in spin_lock(&vdev->priv_lock)
+ */
+static struct vhci_poll_report *vhci_poll_report(struct vhci_poll *poll)
+{
+	struct vhci_poll_report *report, *tmp;
+
+	list_for_each_entry_safe(report, tmp, &poll->reports, list) {
+		if (time_before(jiffies, report->jiffies + VHCI_POLL_MAX_AGE))
+			return report;
+		usbip_dbg_vhci_rx("drop stale report of %d\n", report->len);
+		vhci_poll_drop(poll, report);
+	}
+
+	return NULL;
+}
+
+/*
+ * Gives the report to the URB and frees it, returns the status of the URB.
+ * be in spin_lock(&vdev->priv_lock)
+ */
+static int vhci_poll_give(struct vhci_poll *poll, struct urb *urb,
+			  struct vhci_poll_report *report)
+{
+	int len = min_t(int, report->len, urb->transfer_buffer_length);
+
+	memcpy(urb->transfer_buffer, report->data, len);
+	urb->actual_length = len;
+	urb->status = report->status;
+
+	/* as a host controller does when the device babbles */
+	if (report->len > urb->transfer_buffer_length)
+		urb->status = -EOVERFLOW;
+
+	vhci_poll_drop(poll, report);
+
+	return urb->status;
+}
+
+/**
+ * vhci_poll_urb - look at an interrupt IN URB to be enqueued
+ * @vdev: the virtual device
+ * @urb: the URB
+ *
+ * Returns VHCI_POLL_SEND to send the URB to the server as usual, which
+ * starts polling there, VHCI_POLL_PENDING when it waits for a report, or
+ * VHCI_POLL_DONE when a queued report has been given and the URB is to be
+ * given back. A negative error code is returned on failure.
+ *
+ * be in spin_lock_irqsave(&vhci->lock, flags)
+ */
+int vhci_poll_urb(struct vhci_device *vdev, struct urb *urb)
+{
+	int epnum = usb_pipeendpoint(urb->pipe);
+	struct vhci_poll *poll = &vdev->poll[epnum];
+	struct vhci_poll_report *report;
+	struct vhci_priv *priv;
+	int ret;
+
+	spin_lock(&vdev->priv_lock);
+
+	report = vhci_poll_report(poll);
+	if (report && list_empty(&poll->pending) &&
+	    !vhci_poll_sent(vdev, epnum)) {
+		vhci_poll_give(poll, urb, report);
+		ret = VHCI_POLL_DONE;
+	} else if (poll->active || report) {
+		priv = kzalloc(sizeof(struct vhci_priv), GFP_ATOMIC);
+		if (!priv) {
+			spin_unlock(&vdev->priv_lock);
+			vhci_event_add(&vdev->ud, VDEV_EVENT_ERROR_MALLOC);
+			return -ENOMEM;
+		}
+
+		priv->vdev = vdev;
+		priv->urb = urb;
+		priv->polled = 1;
+		urb->hcpriv = (void *) priv;
+
+		list_add_tail(&priv->list, &poll->pending);
+		ret = VHCI_POLL_PENDING;
+	} else {
+		poll->active = 1;
+		ret = VHCI_POLL_SEND;
+	}
+
+	spin_unlock(&vdev->priv_lock);
+
+	return ret;
+}
+
+/*
+ * The server does not poll the endpoint. The next waiting URB is sent to
+ * restart polling, the others keep waiting for its reports.
+ * be in spin_lock(&vdev->priv_lock)
+ */
+static void vhci_poll_resume(struct vhci_device *vdev, int epnum)
+{
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct vhci_poll *poll = &vdev->poll[epnum];
+	struct vhci_priv *priv;
+
+	if (poll->active || list_empty(&poll->pending) ||
+	    !list_empty(&poll->reports))
+		return;
+
+	priv = list_first_entry(&poll->pending, struct vhci_priv, list);
+	priv->polled = 0;
+	priv->seqnum = atomic_inc_return(&vhci->seqnum);
+	list_move_tail(&priv->list, &vdev->priv_tx);
+	poll->active = 1;
+
+	wake_up(&vdev->waitq_tx);
+}
+
+/**
+ * vhci_poll_kick - give queued reports to waiting URBs
+ * @vdev: the virtual device
+ * @epnum: the endpoint number
+ *
+ * Called when a report has been queued or a URB sent to the endpoint has
+ * been given back.
+ */
+void vhci_poll_kick(struct vhci_device *vdev, int epnum)
+{
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct usb_hcd *hcd = vhci_to_hcd(vhci);
+	struct vhci_poll *poll = &vdev->poll[epnum];
+	struct vhci_poll_report *report;
+	struct vhci_priv *priv;
+	struct urb *urb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vhci->lock, flags);
+	spin_lock(&vdev->priv_lock);
+
+	while (!list_empty(&poll->pending) && !vhci_poll_sent(vdev, epnum)) {
+		report = vhci_poll_report(poll);
+		if (!report)
+			break;
+
+		priv = list_first_entry(&poll->pending, struct vhci_priv,
+					list);
+		urb = priv->urb;
+		list_del(&priv->list);
+		kfree(priv);
+		urb->hcpriv = NULL;
+
+		vhci_poll_give(poll, urb, report);
+		usb_hcd_unlink_urb_from_ep(hcd, urb);
+
+		spin_unlock(&vdev->priv_lock);
+		spin_unlock_irqrestore(&vhci->lock, flags);
+
+		usb_hcd_giveback_urb(hcd, urb, urb->status);
+
+		spin_lock_irqsave(&vhci->lock, flags);
+		spin_lock(&vdev->priv_lock);
+	}
+
+	vhci_poll_resume(vdev, epnum);
+
+	spin_unlock(&vdev->priv_lock);
+	spin_unlock_irqrestore(&vhci->lock, flags);
+}
+
+/* a report of an interrupt IN endpoint polled by the server */
+void vhci_recv_ret_poll(struct vhci_device *vdev, struct usbip_header *pdu)
+{
+	struct vhci_hcd *vhci = vdev_to_vhci(vdev);
+	struct usbip_device *ud = &vdev->ud;
+	int epnum = pdu->base.ep;
+	int status = pdu->u.ret_submit.status;
+	int len = pdu->u.ret_submit.actual_length;
+	struct vhci_poll_report *report, *old, *tmp;
+	struct vhci_poll *poll;
+	unsigned long flags;
+	int ret;
+
+	if (!(ud->features & USBIP_FEAT_INT_POLL) || epnum <= 0 ||
+	    epnum >= USB_MAXENDPOINTS / 2 ||
+	    pdu->base.direction != USBIP_DIR_IN ||
+	    len < 0 || len > VHCI_POLL_MAX_LEN) {
+		pr_err("invalid poll report of %d for ep %d\n", len, epnum);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return;
+	}
+	poll = &vdev->poll[epnum];
+
+	report = kmalloc(sizeof(*report) + len, GFP_KERNEL);
+	if (!report) {
+		vhci_event_add(ud, VDEV_EVENT_ERROR_MALLOC);
+		return;
+	}
+	report->jiffies = jiffies;
+	report->status = status;
+	report->len = len;
+
+	if (len) {
+		ret = usbip_recv(ud, report->data, len);
+		if (ret != len) {
+			pr_err("recv poll report, %d\n", ret);
+			kfree(report);
+			vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+			return;
+		}
+	}
+
+	spin_lock_irqsave(&vhci->lock, flags);
+	spin_lock(&vdev->priv_lock);
+
+	if (status == -ENOENT) {
+		/* not polled any more, the reports are of the old setting */
+		list_for_each_entry_safe(old, tmp, &poll->reports, list)
+			vhci_poll_drop(poll, old);
+		kfree(report);
+		poll->active = 0;
+	} else {
+		if (poll->nr_reports >= VHCI_POLL_QUEUE) {
+			usbip_dbg_vhci_rx("poll queue of ep %d full\n", epnum);
+			vhci_poll_drop(poll, list_first_entry(&poll->reports,
+					struct vhci_poll_report, list));
+		}
+		list_add_tail(&report->list, &poll->reports);
+		poll->nr_reports++;
+
+		/* an error ends polling on the server */
+		if (status)
+			poll->active = 0;
+	}
+
+	spin_unlock(&vdev->priv_lock);
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	vhci_poll_kick(vdev, epnum);
+}
+
+/*
+ * Called when the connection is shut down. Waiting URBs are given back by
+ * vhci_urb_dequeue() when the device is disconnected.
+ */
+void vhci_poll_cleanup(struct vhci_device *vdev)
+{
+	struct vhci_poll_report *report, *tmp;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&vdev->priv_lock, flags);
+
+	for (i = 0; i < USB_MAXENDPOINTS / 2; i++) {
+		list_for_each_entry_safe(report, tmp, &vdev->poll[i].reports,
+					 list)
+			vhci_poll_drop(&vdev->poll[i], report);
+		vdev->poll[i].active = 0;
+	}
+
+	spin_unlock_irqrestore(&vdev->priv_lock, flags);
+}
@@ -22,10 +22,15 @@
 #include <linux/slab.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "vhci.h"
 
-/* get URB from transmitted urb queue. caller must hold vdev->priv_lock */
-struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum)
+/*
+ * get URB from transmitted urb queue. caller must hold vdev->priv_lock.
+ * @sent, if not NULL, is given when its CMD_SUBMIT was sent.
+ */
+struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum,
+				     ktime_t *sent)
 {
 	struct vhci_priv *priv, *tmp;
 	struct urb *urb = NULL;
@@ -58,6 +63,10 @@ struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum)
 				 status);
 		}
 
+		usbip_stats_latency(&vdev->ud, USBIP_LAT_RET, priv->sent);
+		if (sent)
+			*sent = priv->sent;
+
 		list_del(&priv->list);
 		kfree(priv);
 		urb->hcpriv = NULL;
@@ -68,6 +77,33 @@ struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum)
 	return urb;
 }
 
+/* recv IN data which was not sent ahead by RET_SUBMIT_CHUNK */
+static int vhci_recv_xbuff_tail(struct usbip_device *ud, struct urb *urb,
+				int offset)
+{
+	int size = urb->actual_length - offset;
+	int ret;
+
+	if (size < 0 || urb->actual_length > urb->transfer_buffer_length) {
+		pr_err("invalid tail %d of %d\n", offset, urb->actual_length);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return -EPIPE;
+	}
+
+	if (!size)
+		return 0;
+
+	ret = usbip_recv_payload(ud, urb->pipe, urb->transfer_buffer + offset,
+				 size);
+	if (ret != size) {
+		dev_err(&urb->dev->dev, "recv xbuf tail, %d\n", ret);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return -EPIPE;
+	}
+
+	return ret;
+}
+
 static void vhci_recv_ret_submit(struct vhci_device *vdev,
 				 struct usbip_header *pdu)
 {
@@ -75,9 +111,12 @@ static void vhci_recv_ret_submit(struct vhci_device *vdev,
 	struct usbip_device *ud = &vdev->ud;
 	struct urb *urb;
 	unsigned long flags;
+	unsigned int pipe;
+	ktime_t sent = 0;
+	int offset;
 
 	spin_lock_irqsave(&vdev->priv_lock, flags);
-	urb = pickup_urb_and_free_priv(vdev, pdu->base.seqnum);
+	urb = pickup_urb_and_free_priv(vdev, pdu->base.seqnum, &sent);
 	spin_unlock_irqrestore(&vdev->priv_lock, flags);
 
 	if (!urb) {
@@ -88,34 +127,117 @@ static void vhci_recv_ret_submit(struct vhci_device *vdev,
 		return;
 	}
 
+	/* data already received by vhci_recv_ret_submit_chunk() */
+	offset = urb->actual_length;
+
 	/* unpack the pdu to a urb */
 	usbip_pack_pdu(pdu, urb, USBIP_RET_SUBMIT, 0);
 
-	/* recv transfer buffer */
-	if (usbip_recv_xbuff(ud, urb) < 0)
-		return;
+	if (usb_pipeisoc(urb->pipe) &&
+	    (ud->features & USBIP_FEAT_ISO_COMPACT)) {
+		/* descriptors first, then the data right into the packets */
+		if (usbip_recv_iso_compact(ud, urb, USBIP_RET_SUBMIT) < 0)
+			return;
 
-	/* recv iso_packet_descriptor */
-	if (usbip_recv_iso(ud, urb) < 0)
-		return;
+		if (usbip_recv_iso_data(ud, urb) < 0)
+			return;
+	} else {
+		/* recv transfer buffer */
+		if (offset) {
+			if (vhci_recv_xbuff_tail(ud, urb, offset) < 0)
+				return;
+		} else if (usbip_recv_xbuff(ud, urb) < 0)
+			return;
+
+		/* recv iso_packet_descriptor */
+		if (usbip_recv_iso(ud, urb) < 0)
+			return;
 
-	/* restore the padding in iso packets */
-	usbip_pad_iso(ud, urb);
+		/* restore the padding in iso packets */
+		usbip_pad_iso(ud, urb);
+	}
+
+	if (vhci_recv_stamps(vdev, urb, sent) < 0)
+		return;
 
 	if (usbip_dbg_flag_vhci_rx)
 		usbip_dump_urb(urb);
 
 	usbip_dbg_vhci_rx("now giveback urb %p\n", urb);
 
+	pipe = urb->pipe;
+	usbip_stats_inc(ud, completed[usb_pipetype(pipe)]);
+	trace_usbip_vhci_rx_ret(vdev->devid, pdu->base.seqnum, urb);
+
+	/* given back on a frame boundary by the jitter buffer */
+	if (usb_pipeisoc(pipe) && vhci_iso_hold(vdev, urb))
+		return;
+
 	spin_lock_irqsave(&vhci->lock, flags);
 	usb_hcd_unlink_urb_from_ep(vhci_to_hcd(vhci), urb);
 	spin_unlock_irqrestore(&vhci->lock, flags);
 
 	usb_hcd_giveback_urb(vhci_to_hcd(vhci), urb, urb->status);
 
+	/* reports of a polled endpoint may wait for this one */
+	if ((ud->features & USBIP_FEAT_INT_POLL) && usb_pipeint(pipe) &&
+	    usb_pipein(pipe))
+		vhci_poll_kick(vdev, usb_pipeendpoint(pipe));
+
 	usbip_dbg_vhci_rx("Leave\n");
 }
 
+/*
+ * IN data of a pending bulk URB sent ahead with USBIP_FEAT_CHUNKED. It is
+ * appended to the transfer buffer and the URB stays in priv_rx until its
+ * RET_SUBMIT, or RET_UNLINK, comes.
+ */
+static void vhci_recv_ret_submit_chunk(struct vhci_device *vdev,
+				       struct usbip_header *pdu)
+{
+	struct usbip_device *ud = &vdev->ud;
+	struct vhci_priv *priv;
+	struct urb *urb = NULL;
+	int len = pdu->u.ret_submit.actual_length;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&vdev->priv_lock, flags);
+	list_for_each_entry(priv, &vdev->priv_rx, list) {
+		if (priv->seqnum == pdu->base.seqnum) {
+			urb = priv->urb;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vdev->priv_lock, flags);
+
+	if (!urb) {
+		pr_err("cannot find a urb of chunk seqnum %u\n",
+		       pdu->base.seqnum);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return;
+	}
+
+	if (!(ud->features & USBIP_FEAT_CHUNKED) ||
+	    !usb_pipebulk(urb->pipe) || !usb_pipein(urb->pipe) || len <= 0 ||
+	    len > urb->transfer_buffer_length - urb->actual_length) {
+		pr_err("invalid chunk of %d for seqnum %u\n", len,
+		       pdu->base.seqnum);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return;
+	}
+
+	ret = usbip_recv_payload(ud, urb->pipe,
+				 urb->transfer_buffer + urb->actual_length, len);
+	if (ret != len) {
+		dev_err(&urb->dev->dev, "recv chunk, %d\n", ret);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return;
+	}
+
+	urb->actual_length += len;
+}
+
 static struct vhci_unlink *dequeue_pending_unlink(struct vhci_device *vdev,
 						  struct usbip_header *pdu)
 {
@@ -148,6 +270,7 @@ static void vhci_recv_ret_unlink(struct vhci_device *vdev,
 	struct vhci_unlink *unlink;
 	struct urb *urb;
 	unsigned long flags;
+	unsigned int pipe;
 
 	usbip_dump_header(pdu);
 
@@ -155,13 +278,17 @@ static void vhci_recv_ret_unlink(struct vhci_device *vdev,
 	if (!unlink) {
 		pr_info("cannot find the pending unlink %u\n",
 			pdu->base.seqnum);
+		vhci_recv_stamps(vdev, NULL, 0);
 		return;
 	}
 
 	spin_lock_irqsave(&vdev->priv_lock, flags);
-	urb = pickup_urb_and_free_priv(vdev, unlink->unlink_seqnum);
+	urb = pickup_urb_and_free_priv(vdev, unlink->unlink_seqnum, NULL);
 	spin_unlock_irqrestore(&vdev->priv_lock, flags);
 
+	/* on an error, the URB is still given back before the shutdown */
+	vhci_recv_stamps(vdev, urb, unlink->sent);
+
 	if (!urb) {
 		/*
 		 * I get the result of a unlink request. But, it seems that I
@@ -177,11 +304,17 @@ static void vhci_recv_ret_unlink(struct vhci_device *vdev,
 		urb->status = pdu->u.ret_unlink.status;
 		pr_info("urb->status %d\n", urb->status);
 
+		pipe = urb->pipe;
+
 		spin_lock_irqsave(&vhci->lock, flags);
 		usb_hcd_unlink_urb_from_ep(vhci_to_hcd(vhci), urb);
 		spin_unlock_irqrestore(&vhci->lock, flags);
 
 		usb_hcd_giveback_urb(vhci_to_hcd(vhci), urb, urb->status);
+
+		if ((vdev->ud.features & USBIP_FEAT_INT_POLL) &&
+		    usb_pipeint(pipe) && usb_pipein(pipe))
+			vhci_poll_kick(vdev, usb_pipeendpoint(pipe));
 	}
 
 	kfree(unlink);
@@ -211,7 +344,7 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 	memset(&pdu, 0, sizeof(pdu));
 
 	/* receive a pdu header */
-	ret = usbip_recv(ud, &pdu, sizeof(pdu));
+	ret = usbip_recv_header(ud, &pdu);
 	if (ret < 0) {
 		if (ret == -ECONNRESET)
 			pr_info("connection reset by peer\n");
@@ -238,18 +371,27 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 		return;
 	}
 
-	usbip_header_correct_endian(&pdu, 0);
-
 	if (usbip_dbg_flag_vhci_rx)
 		usbip_dump_header(&pdu);
 
+	usbip_hb_alive(ud);
+
 	switch (pdu.base.command) {
 	case USBIP_RET_SUBMIT:
 		vhci_recv_ret_submit(vdev, &pdu);
 		break;
+	case USBIP_RET_SUBMIT_CHUNK:
+		vhci_recv_ret_submit_chunk(vdev, &pdu);
+		break;
 	case USBIP_RET_UNLINK:
 		vhci_recv_ret_unlink(vdev, &pdu);
 		break;
+	case USBIP_RET_POLL:
+		vhci_recv_ret_poll(vdev, &pdu);
+		break;
+	case USBIP_RET_NOP:
+		usbip_hb_recv_ret(ud, &pdu);
+		break;
 	default:
 		/* NOT REACHED */
 		pr_err("unknown pdu %u\n", pdu.base.command);
@@ -262,11 +404,13 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 int vhci_rx_loop(void *data)
 {
 	struct usbip_device *ud = data;
+	unsigned int sched = 0;
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(ud))
 			break;
 
+		usbip_sched_thread(ud, 1, &sched);
 		vhci_rx_pdu(ud);
 	}
 
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2015 Nobuo Iwata
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+/*
+ * Latency breakdown of USBIP_FEAT_TIMESTAMPS.
+ *
+ * The clocks of both ends are not comparable, so only intervals taken on a
+ * single end are used. The round trip from sending CMD_SUBMIT or CMD_UNLINK
+ * to receiving the answer, taken by vhci, is split into the time the server
+ * held the request, from its receive to the send of the answer, and the rest
+ * spent on the network and in the socket buffers. Of the server time, the
+ * time from submit to completion is that of the device and its host
+ * controller. They are summed by endpoint and shown in usbip_stats.
+ */
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+/* end - start of the server clock, or -1 if either is not known */
+static s64 stamps_delta(__be64 end, __be64 start)
+{
+	u64 e = be64_to_cpu(end);
+	u64 s = be64_to_cpu(start);
+
+	if (!e || !s || e < s)
+		return -1;
+
+	return e - s;
+}
+
+/*
+ * vhci_recv_stamps - receive the trailer of RET_SUBMIT or RET_UNLINK
+ * @vdev: the port
+ * @urb: the URB answered, NULL to only receive the trailer
+ * @sent: when the command was sent, 0 if not known
+ *
+ * Does nothing without USBIP_FEAT_TIMESTAMPS. Returns a negative errno with
+ * VDEV_EVENT_ERROR_TCP raised if the trailer cannot be received.
+ */
+int vhci_recv_stamps(struct vhci_device *vdev, struct urb *urb, ktime_t sent)
+{
+	struct usbip_device *ud = &vdev->ud;
+	struct usbip_stamps stamps;
+	struct vhci_ep_stamps *st;
+	s64 rtt, server, device, network;
+	unsigned long flags;
+	int ret;
+
+	if (!(ud->features & USBIP_FEAT_TIMESTAMPS))
+		return 0;
+
+	ret = usbip_recv(ud, &stamps, sizeof(stamps));
+	if (ret != sizeof(stamps)) {
+		pr_err("recv timestamps, %d\n", ret);
+		vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+		return -EPIPE;
+	}
+
+	if (!urb || !ktime_to_ns(sent))
+		return 0;
+
+	server = stamps_delta(stamps.sent, stamps.received);
+	if (server < 0)
+		return 0;
+
+	device = stamps_delta(stamps.completed, stamps.submitted ?
+					       stamps.submitted :
+					       stamps.received);
+	if (device < 0)
+		device = 0;
+
+	rtt = ktime_to_ns(ktime_sub(ktime_get(), sent));
+	network = max_t(s64, rtt - server, 0);
+
+	st = &vdev->stamps[usb_pipein(urb->pipe) ? 1 : 0]
+			  [usb_pipeendpoint(urb->pipe)];
+
+	spin_lock_irqsave(&vdev->priv_lock, flags);
+	st->count++;
+	st->network += network;
+	st->device += device;
+	st->server += server;
+	st->network_max = max_t(u64, st->network_max, network);
+	st->device_max = max_t(u64, st->device_max, device);
+	spin_unlock_irqrestore(&vdev->priv_lock, flags);
+
+	return 0;
+}
+
+/* the endpoint lines of usbip_stats, see usbip_stats.c */
+void vhci_stamps_show(struct vhci_device *vdev, struct seq_file *m)
+{
+	struct vhci_ep_stamps st;
+	unsigned long flags;
+	u64 div;
+	int dir, ep;
+
+	for (ep = 0; ep < USB_MAXENDPOINTS / 2; ep++) {
+		for (dir = 0; dir < 2; dir++) {
+			spin_lock_irqsave(&vdev->priv_lock, flags);
+			st = vdev->stamps[dir][ep];
+			spin_unlock_irqrestore(&vdev->priv_lock, flags);
+
+			if (!st.count)
+				continue;
+
+			div = st.count * NSEC_PER_USEC;
+			seq_printf(m, "endpoint %d%s %llu %llu %llu %llu %llu %llu\n",
+				   ep, dir ? "in" : "out", st.count,
+				   div64_u64(st.network, div),
+				   div64_u64(st.device, div),
+				   div64_u64(st.server, div),
+				   div_u64(st.network_max, NSEC_PER_USEC),
+				   div_u64(st.device_max, NSEC_PER_USEC));
+		}
+	}
+}
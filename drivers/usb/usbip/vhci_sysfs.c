@@ -31,7 +31,7 @@
 
 /* Sysfs entry to show port status */
 static ssize_t status_show_vhci(int pdev_nr, struct platform_device *pdev,
-				char *out)
+				int ss, char *out)
 {
 	struct vhci_hcd *vhci;
 	char *s = out;
@@ -43,15 +43,15 @@ static ssize_t status_show_vhci(int pdev_nr, struct platform_device *pdev,
 		return 0;
 	}
 
-	vhci = hcd_to_vhci(platform_get_drvdata(pdev));
+	vhci = hcd_to_vhci(pdev_to_hcd(pdev, ss));
 
 	spin_lock_irqsave(&vhci->lock, flags);
 
 	/*
 	 * output example:
-	 * port sta spd dev      socket           local_busid
-	 * 0000 004 000 00000000         c5a7bb80 1-2.3
-	 * 0001 004 000 00000000         d8cee980 2-3.4
+	 * hub port sta spd dev      socket           local_busid
+	 * hs  0000 004 000 00000000         c5a7bb80 1-2.3
+	 * ss  0008 004 000 00000000         d8cee980 2-3.4
 	 *
 	 * IP address can be retrieved from a socket pointer address by looking
 	 * up /proc/net/{tcp,tcp6}. Also, a userland program may remember a
@@ -61,8 +61,8 @@ static ssize_t status_show_vhci(int pdev_nr, struct platform_device *pdev,
 		struct vhci_device *vdev = &vhci->vdev[i];
 
 		spin_lock(&vdev->ud.lock);
-		out += sprintf(out, "%04u %03u ",
-				    (pdev_nr * VHCI_HC_PORTS) + i,
+		out += sprintf(out, "%s  %04u %03u ", ss ? "ss" : "hs",
+				    rhport_to_port(pdev_nr, ss, i),
 				    vdev->ud.status);
 
 		if (vdev->ud.status == VDEV_ST_USED) {
@@ -86,14 +86,14 @@ static ssize_t status_show_vhci(int pdev_nr, struct platform_device *pdev,
 	return out - s;
 }
 
-static ssize_t status_show_idle(int pdev_nr, char *out)
+static ssize_t status_show_idle(int pdev_nr, int ss, char *out)
 {
 	char *s = out;
 	int i = 0;
 
 	for (i = 0; i < VHCI_HC_PORTS; i++) {
-		out += sprintf(out, "%04u %03u ",
-				    (pdev_nr * VHCI_HC_PORTS) + i,
+		out += sprintf(out, "%s  %04u %03u ", ss ? "ss" : "hs",
+				    rhport_to_port(pdev_nr, ss, i),
 				    VDEV_ST_NULL);
 		out += sprintf(out, "000 00000000 0000000000000000 0-0");
 		out += sprintf(out, "\n");
@@ -122,21 +122,23 @@ static ssize_t status_show(struct device *dev,
 			   struct device_attribute *attr, char *out)
 {
 	char *s = out;
-	int pdev_nr;
+	int pdev_nr, ss;
 	struct platform_device *pdev = NULL;
 
 	out += sprintf(out,
-		       "port sta spd dev      socket           local_busid\n");
+		       "hub port sta spd dev      socket           local_busid\n");
 
 	pdev_nr = status_name_to_id(attr->attr.name);
 	if (pdev_nr < 0)
 		return 0;
 
 	pdev = *(vhci_pdevs + pdev_nr);
-	if (pdev)
-		out += status_show_vhci(pdev_nr, pdev, out);
-	else
-		out += status_show_idle(pdev_nr, out);
+	for (ss = 0; ss < 2; ss++) {
+		if (pdev)
+			out += status_show_vhci(pdev_nr, pdev, ss, out);
+		else
+			out += status_show_idle(pdev_nr, ss, out);
+	}
 
 	return out - s;
 }
@@ -146,11 +148,79 @@ static ssize_t nports_show(struct device *dev, struct device_attribute *attr,
 {
 	char *s = out;
 
-	out += sprintf(out, "%d\n", VHCI_HC_PORTS * vhci_max_controllers);
+	out += sprintf(out, "%d\n", VHCI_PORTS * vhci_max_controllers);
 	return out - s;
 }
 static DEVICE_ATTR_RO(nports);
 
+/* Sysfs entry to show the isochronous jitter buffers, see vhci_iso.c */
+static ssize_t iso_stats_show_vhci(int pdev_nr, struct vhci_hcd *vhci,
+				   int ss, char *out, size_t size)
+{
+	char *s = out;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&vhci->lock, flags);
+
+	for (i = 0; i < VHCI_HC_PORTS; i++) {
+		struct vhci_device *vdev = &vhci->vdev[i];
+
+		if (vdev->ud.status != VDEV_ST_USED)
+			continue;
+
+		spin_lock(&vdev->priv_lock);
+		out += scnprintf(out, size - (out - s),
+				 "%04u %04d %08lu %08lu\n",
+				 rhport_to_port(pdev_nr, ss, i),
+				 vdev->iso.nr_held, vdev->iso.underruns,
+				 vdev->iso.late_packets);
+		spin_unlock(&vdev->priv_lock);
+
+		/* the buffer is full */
+		if (out - s >= size - 1)
+			break;
+	}
+
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	return out - s;
+}
+
+static ssize_t iso_stats_show(struct device *dev,
+			      struct device_attribute *attr, char *out)
+{
+	char *s = out;
+	int pdev_nr, ss;
+
+	/*
+	 * output example:
+	 * port held underrun late
+	 * 0002 0004 00000001 00000012
+	 */
+	out += sprintf(out, "port held underrun late\n");
+
+	for (pdev_nr = 0; pdev_nr < vhci_max_controllers; pdev_nr++) {
+		struct platform_device *pdev = *(vhci_pdevs + pdev_nr);
+
+		if (!pdev)
+			continue;
+
+		for (ss = 0; ss < 2; ss++) {
+			struct usb_hcd *hcd = pdev_to_hcd(pdev, ss);
+
+			if (hcd)
+				out += iso_stats_show_vhci(pdev_nr,
+							   hcd_to_vhci(hcd),
+							   ss, out,
+							   PAGE_SIZE - (out - s));
+		}
+	}
+
+	return out - s;
+}
+static DEVICE_ATTR_RO(iso_stats);
+
 /* Sysfs entry to shutdown a virtual connection */
 static int vhci_port_disconnect(struct vhci_hcd *vhci, __u32 rhport)
 {
@@ -211,7 +281,11 @@ static ssize_t store_detach(struct device *dev, struct device_attribute *attr,
 	if (!valid_port(pdev_nr, rhport))
 		return -EINVAL;
 
-	hcd = platform_get_drvdata(*(vhci_pdevs + pdev_nr));
+	if (*(vhci_pdevs + pdev_nr) == NULL) {
+		dev_err(dev, "port is not ready %u\n", port);
+		return -EAGAIN;
+	}
+	hcd = pdev_to_hcd(*(vhci_pdevs + pdev_nr), port_is_ss(port));
 	if (hcd == NULL) {
 		dev_err(dev, "port is not ready %u\n", port);
 		return -EAGAIN;
@@ -227,9 +301,181 @@ static ssize_t store_detach(struct device *dev, struct device_attribute *attr,
 }
 static DEVICE_ATTR(detach, S_IWUSR, NULL, store_detach);
 
-static int valid_args(__u32 pdev_nr, __u32 rhport, enum usb_device_speed speed)
+/*
+ * Sysfs entry to place the rx and tx threads of a port, see usbip_sched.c.
+ * The settings of a port are reset when its device is detached, only the
+ * ports in use are shown.
+ */
+static ssize_t sched_show_vhci(int pdev_nr, struct vhci_hcd *vhci,
+			       int ss, char *out, size_t size)
+{
+	char *s = out;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&vhci->lock, flags);
+
+	for (i = 0; i < VHCI_HC_PORTS; i++) {
+		struct vhci_device *vdev = &vhci->vdev[i];
+
+		if (vdev->ud.status != VDEV_ST_USED)
+			continue;
+
+		out += scnprintf(out, size - (out - s), "%04u ",
+				 rhport_to_port(pdev_nr, ss, i));
+		out += usbip_sched_print(&vdev->ud, out, size - (out - s));
+
+		/* the buffer is full */
+		if (out - s >= size - 1)
+			break;
+	}
+
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	return out - s;
+}
+
+static ssize_t sched_show(struct device *dev, struct device_attribute *attr,
+			  char *out)
+{
+	char *s = out;
+	int pdev_nr, ss;
+
+	/*
+	 * output example:
+	 * port cpu policy prio
+	 * 0000 -1 0 0
+	 * 0001 -2 1 50
+	 */
+	out += sprintf(out, "port cpu policy prio\n");
+
+	for (pdev_nr = 0; pdev_nr < vhci_max_controllers; pdev_nr++) {
+		struct platform_device *pdev = *(vhci_pdevs + pdev_nr);
+
+		if (!pdev)
+			continue;
+
+		for (ss = 0; ss < 2; ss++) {
+			struct usb_hcd *hcd = pdev_to_hcd(pdev, ss);
+
+			if (hcd)
+				out += sched_show_vhci(pdev_nr,
+						       hcd_to_vhci(hcd),
+						       ss, out,
+						       PAGE_SIZE - (out - s));
+		}
+	}
+
+	return out - s;
+}
+
+/* "<port> <cpu> <policy> [<priority>]" */
+static ssize_t sched_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	__u32 port = 0, pdev_nr = 0, rhport = 0;
+	struct usb_hcd *hcd;
+	int offset = 0;
+	int ret;
+
+	if (sscanf(buf, "%u %n", &port, &offset) != 1 || !offset)
+		return -EINVAL;
+
+	pdev_nr = port_to_pdev_nr(port);
+	rhport = port_to_rhport(port);
+
+	if (!valid_port(pdev_nr, rhport))
+		return -EINVAL;
+
+	if (*(vhci_pdevs + pdev_nr) == NULL) {
+		dev_err(dev, "port is not ready %u\n", port);
+		return -EAGAIN;
+	}
+	hcd = pdev_to_hcd(*(vhci_pdevs + pdev_nr), port_is_ss(port));
+	if (hcd == NULL) {
+		dev_err(dev, "port is not ready %u\n", port);
+		return -EAGAIN;
+	}
+
+	ret = usbip_sched_set(&hcd_to_vhci(hcd)->vdev[rhport].ud,
+			      buf + offset);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static DEVICE_ATTR_RW(sched);
+
+/*
+ * Sysfs entry of the round trip times measured by the heartbeat of the
+ * ports in use, see usbip_heartbeat.c.
+ */
+static ssize_t rtt_show_vhci(int pdev_nr, struct vhci_hcd *vhci, int ss,
+			     char *out, size_t size)
 {
-	if (!valid_port(pdev_nr, rhport)) {
+	char *s = out;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&vhci->lock, flags);
+
+	for (i = 0; i < VHCI_HC_PORTS; i++) {
+		struct vhci_device *vdev = &vhci->vdev[i];
+
+		if (vdev->ud.status != VDEV_ST_USED ||
+		    !(vdev->ud.features & USBIP_FEAT_HEARTBEAT))
+			continue;
+
+		out += scnprintf(out, size - (out - s), "%04u ",
+				 rhport_to_port(pdev_nr, ss, i));
+		out += usbip_hb_print(&vdev->ud, out, size - (out - s));
+
+		/* the buffer is full */
+		if (out - s >= size - 1)
+			break;
+	}
+
+	spin_unlock_irqrestore(&vhci->lock, flags);
+
+	return out - s;
+}
+
+static ssize_t rtt_show(struct device *dev, struct device_attribute *attr,
+			char *out)
+{
+	char *s = out;
+	int pdev_nr, ss;
+
+	/*
+	 * output example, times in microseconds:
+	 * port srtt rttvar last misses
+	 * 0000 412 95 380 0
+	 */
+	out += sprintf(out, "port srtt rttvar last misses\n");
+
+	for (pdev_nr = 0; pdev_nr < vhci_max_controllers; pdev_nr++) {
+		struct platform_device *pdev = *(vhci_pdevs + pdev_nr);
+
+		if (!pdev)
+			continue;
+
+		for (ss = 0; ss < 2; ss++) {
+			struct usb_hcd *hcd = pdev_to_hcd(pdev, ss);
+
+			if (hcd)
+				out += rtt_show_vhci(pdev_nr, hcd_to_vhci(hcd),
+						     ss, out,
+						     PAGE_SIZE - (out - s));
+		}
+	}
+
+	return out - s;
+}
+static DEVICE_ATTR_RO(rtt);
+
+static int valid_args(__u32 port, enum usb_device_speed speed)
+{
+	if (!valid_port(port_to_pdev_nr(port), port_to_rhport(port))) {
 		return 0;
 	}
 
@@ -238,6 +484,16 @@ static int valid_args(__u32 pdev_nr, __u32 rhport, enum usb_device_speed speed)
 	case USB_SPEED_FULL:
 	case USB_SPEED_HIGH:
 	case USB_SPEED_WIRELESS:
+		if (port_is_ss(port)) {
+			pr_err("USB2 device on USB3 port %u\n", port);
+			return 0;
+		}
+		break;
+	case USB_SPEED_SUPER:
+		if (!port_is_ss(port)) {
+			pr_err("USB3 device on USB2 port %u\n", port);
+			return 0;
+		}
 		break;
 	default:
 		pr_err("Failed attach request for unsupported USB speed: %s\n",
@@ -256,7 +512,10 @@ static int valid_args(__u32 pdev_nr, __u32 rhport, enum usb_device_speed speed)
  *
  * A remote device is virtually attached to the root-hub port of @rhport with
  * @speed. @devid is embedded into a request to specify the remote device in a
- * server host.
+ * server host. SuperSpeed devices must be given a port of the USB3 root hub
+ * and the others a port of the USB2 root hub; see the hub column of status.
+ * An optional fifth field gives the negotiated protocol extensions
+ * (USBIP_FEAT_*) in hex.
  *
  * write() returns 0 on success, else negative errno.
  */
@@ -265,6 +524,7 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 {
 	int sockfd = 0;
 	__u32 port = 0, pdev_nr = 0, rhport = 0, devid = 0, speed = 0;
+	__u32 features = 0;
 	struct vhci_hcd *vhci;
 	struct vhci_device *vdev;
 	int err;
@@ -275,8 +535,15 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 	 * @sockfd: socket descriptor of an established TCP connection
 	 * @devid: unique device identifier in a remote host
 	 * @speed: usb device speed in a remote host
+	 * @features: negotiated protocol extensions, optional
 	 */
-	if (sscanf(buf, "%u %u %u %u", &port, &sockfd, &devid, &speed) != 4) {
+	if (sscanf(buf, "%u %u %u %u %x", &port, &sockfd, &devid, &speed,
+		   &features) < 4) {
+		err = -EINVAL;
+		goto err_out;
+	}
+	if (features & ~VHCI_FEATURES) {
+		pr_err("unsupported features %x\n", features & ~VHCI_FEATURES);
 		err = -EINVAL;
 		goto err_out;
 	}
@@ -289,12 +556,12 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 			     sockfd, devid, speed);
 
 	/* check received parameters */
-	if (!valid_args(pdev_nr, rhport, speed)) {
+	if (!valid_args(port, speed)) {
 		err = -EINVAL;
 		goto err_out;
 	}
 
-	if (vhci_get_device(pdev_nr, rhport, &vhci, &vdev)) {
+	if (vhci_get_device(pdev_nr, rhport, port_is_ss(port), &vhci, &vdev)) {
 		err = -EAGAIN;
 		goto err_out;
 	}
@@ -329,7 +596,10 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 
 	vdev->devid         = devid;
 	vdev->speed         = speed;
+	vdev->ud.features   = features;
 	vdev->ud.status     = VDEV_ST_NOTASSIGNED;
+	usbip_hb_init(&vdev->ud);
+	usbip_compact_hdr_init(&vdev->ud, devid);
 
 	spin_unlock(&vdev->ud.lock);
 	spin_unlock_irqrestore(&vhci->lock, flags);
@@ -337,6 +607,7 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 
 	vdev->ud.tcp_rx = kthread_get_run(vhci_rx_loop, &vdev->ud, "vhci_rx");
 	vdev->ud.tcp_tx = kthread_get_run(vhci_tx_loop, &vdev->ud, "vhci_tx");
+	vhci_hb_start(vdev);
 
 	rh_port_connect(vdev, speed);
 
@@ -405,7 +676,7 @@ int vhci_init_attr_group(void)
 	struct attribute **attrs;
 	int ret, i;
 
-	attrs = kcalloc((vhci_max_controllers + 5), sizeof(struct attribute *),
+	attrs = kcalloc((vhci_max_controllers + 8), sizeof(struct attribute *),
 			GFP_KERNEL);
 	if (attrs == NULL)
 		return -ENOMEM;
@@ -419,8 +690,11 @@ int vhci_init_attr_group(void)
 	*(attrs + 1) = &dev_attr_detach.attr;
 	*(attrs + 2) = &dev_attr_attach.attr;
 	*(attrs + 3) = &dev_attr_usbip_debug.attr;
+	*(attrs + 4) = &dev_attr_iso_stats.attr;
+	*(attrs + 5) = &dev_attr_sched.attr;
+	*(attrs + 6) = &dev_attr_rtt.attr;
 	for (i = 0; i < vhci_max_controllers; i++)
-		*(attrs + i + 4) = &((status_attrs + i)->attr.attr);
+		*(attrs + i + 7) = &((status_attrs + i)->attr.attr);
 	vhci_attr_group.attrs = attrs;
 	return 0;
 }
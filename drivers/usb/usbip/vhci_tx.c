@@ -21,6 +21,7 @@
 #include <linux/slab.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "vhci.h"
 
 static void setup_cmd_submit_pdu(struct usbip_header *pdup,  struct urb *urb)
@@ -40,6 +41,18 @@ static void setup_cmd_submit_pdu(struct usbip_header *pdup,  struct urb *urb)
 
 	usbip_pack_pdu(pdup, urb, USBIP_CMD_SUBMIT, 1);
 
+	/* see stub_setup_streams() */
+	if ((vdev->ud.features & USBIP_FEAT_STREAMS) &&
+	    usb_pipebulk(urb->pipe)) {
+		pdup->u.cmd_submit.start_frame = urb->stream_id;
+		pdup->u.cmd_submit.number_of_packets = urb->ep->streams;
+	}
+
+	/* see vhci_iso.c */
+	if (usb_pipeisoc(urb->pipe))
+		pdup->u.cmd_submit.start_frame =
+			vhci_iso_start_frame(vdev, urb);
+
 	if (urb->setup_packet)
 		memcpy(pdup->u.cmd_submit.setup, urb->setup_packet, 8);
 }
@@ -77,6 +90,8 @@ static int vhci_send_cmd_submit(struct vhci_device *vdev)
 		struct urb *urb = priv->urb;
 		struct usbip_header pdu_header;
 		struct usbip_iso_packet_descriptor *iso_buffer = NULL;
+		int compact = usb_pipeisoc(urb->pipe) &&
+			      (vdev->ud.features & USBIP_FEAT_ISO_COMPACT);
 
 		txsize = 0;
 		memset(&pdu_header, 0, sizeof(pdu_header));
@@ -87,21 +102,42 @@ static int vhci_send_cmd_submit(struct vhci_device *vdev)
 
 		/* 1. setup usbip_header */
 		setup_cmd_submit_pdu(&pdu_header, urb);
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+		iov[0].iov_len  = usbip_header_encode(&vdev->ud, &pdu_header);
+		txsize += iov[0].iov_len;
 
 		/* 2. setup transfer buffer */
-		if (!usb_pipein(urb->pipe) && urb->transfer_buffer_length > 0) {
+		if (!usb_pipein(urb->pipe) && urb->transfer_buffer_length > 0 &&
+		    usbip_compress_pipe(&vdev->ud, urb->pipe)) {
+			/* bulk, iov[2] is free of iso descriptors */
+			usbip_compress_iov(&vdev->ud, urb->pipe,
+					   urb->transfer_buffer,
+					   urb->transfer_buffer_length,
+					   &iov[1]);
+			txsize += iov[1].iov_len + iov[2].iov_len;
+		} else if (!usb_pipein(urb->pipe) &&
+			   urb->transfer_buffer_length > 0) {
 			iov[1].iov_base = urb->transfer_buffer;
 			iov[1].iov_len  = urb->transfer_buffer_length;
 			txsize += urb->transfer_buffer_length;
 		}
 
-		/* 3. setup iso_packet_descriptor */
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		/* 3. setup iso descriptors, compact ones ahead of the data */
+		if (compact && urb->number_of_packets) {
+			ssize_t len = 0;
+
+			iov[2] = iov[1];
+			iov[1].iov_base = usbip_pack_iso_compact(&vdev->ud, urb,
+							USBIP_CMD_SUBMIT, &len);
+			if (!iov[1].iov_base) {
+				vhci_event_add(&vdev->ud,
+					       VDEV_EVENT_ERROR_MALLOC);
+				return -1;
+			}
+			iov[1].iov_len = len;
+			txsize += len;
+		} else if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS &&
+			   !compact) {
 			ssize_t len = 0;
 
 			iso_buffer = usbip_alloc_iso_desc_pdu(urb, &len);
@@ -116,6 +152,11 @@ static int vhci_send_cmd_submit(struct vhci_device *vdev)
 			txsize += len;
 		}
 
+		/* before the send, RET_SUBMIT may free priv right after it */
+		usbip_stats_latency(&vdev->ud, USBIP_LAT_QUEUE, priv->queued);
+		priv->sent = ktime_get();
+		trace_usbip_vhci_tx_submit(vdev->devid, priv->seqnum, urb);
+
 		ret = usbip_trx_ops->sendmsg(&vdev->ud, &msg, iov, 3, txsize);
 		if (ret != txsize) {
 			pr_err("sendmsg failed!, ret=%d for %zd\n", ret,
@@ -180,11 +221,12 @@ static int vhci_send_cmd_unlink(struct vhci_device *vdev)
 		pdu_header.base.ep	= 0;
 		pdu_header.u.cmd_unlink.seqnum = unlink->unlink_seqnum;
 
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+		iov[0].iov_len  = usbip_header_encode(&vdev->ud, &pdu_header);
+		txsize += iov[0].iov_len;
+
+		/* before the send, RET_UNLINK may free unlink right after it */
+		unlink->sent = ktime_get();
 
 		ret = usbip_trx_ops->sendmsg(&vdev->ud, &msg, iov, 1, txsize);
 		if (ret != txsize) {
@@ -206,17 +248,26 @@ int vhci_tx_loop(void *data)
 {
 	struct usbip_device *ud = data;
 	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
+	unsigned int sched = 0;
 
 	while (!kthread_should_stop()) {
+		usbip_sched_thread(ud, 0, &sched);
+
 		if (vhci_send_cmd_submit(vdev) < 0)
 			break;
 
 		if (vhci_send_cmd_unlink(vdev) < 0)
 			break;
 
+		if (usbip_hb_send(ud, vdev->devid) < 0) {
+			vhci_event_add(ud, VDEV_EVENT_ERROR_TCP);
+			break;
+		}
+
 		wait_event_interruptible(vdev->waitq_tx,
 					 (!list_empty(&vdev->priv_tx) ||
 					  !list_empty(&vdev->unlink_tx) ||
+					  usbip_hb_pending(ud) ||
 					  kthread_should_stop()));
 
 		usbip_dbg_vhci_tx("pending urbs ?, now wake up\n");
@@ -26,7 +26,8 @@
 #include <linux/usb/gadget.h>
 #include <linux/usb/ch9.h>
 #include <linux/list.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 #include <linux/time.h>
 #include <linux/sysfs.h>
 
@@ -34,6 +35,21 @@
 
 #define GADGET_NAME "usbip-vudc"
 
+#define VIRTUAL_ENDPOINTS (1 /* ep0 */ + 15 /* in eps */ + 15 /* out eps */)
+
+/* urbp kept for reuse, and the largest buffer kept with one */
+#define VUDC_URBP_POOL 32
+#define VUDC_URBP_POOL_BUF (64 * 1024)
+
+/* most packets of an isochronous URB taken from the client */
+#define VUDC_ISO_MAX_PACKETS 1024
+
+/* microframes an isochronous endpoint may lag before it starts over */
+#define VUDC_ISO_SLACK (16 * 8)
+
+/* frames of periodic bandwidth a late timer may catch up with */
+#define VUDC_ISO_CATCHUP 16
+
 struct vep {
 	struct usb_ep ep;
 	unsigned type:2; /* type, as USB_ENDPOINT_XFER_* */
@@ -42,10 +58,13 @@ struct vep {
 	const struct usb_endpoint_descriptor *desc;
 	struct usb_gadget *gadget;
 	struct list_head req_queue; /* Request queue */
+	struct list_head urb_queue; /* urbp from the host, in order */
 	unsigned halted:1;
 	unsigned wedged:1;
-	unsigned already_seen:1;
 	unsigned setup_stage:1;
+
+	/* first free microframe of an isochronous endpoint */
+	unsigned long iso_next;
 };
 
 struct vrequest {
@@ -54,32 +73,37 @@ struct vrequest {
 	struct list_head req_entry; /* Request queue */
 };
 
+enum tx_type {
+	TX_UNLINK,
+	TX_SUBMIT,
+};
+
 struct urbp {
 	struct urb *urb;
 	struct vep *ep;
-	struct list_head urb_entry; /* urb queue */
+	struct list_head urb_entry; /* urb queue, or the pool */
 	unsigned long seqnum;
 	unsigned type:2; /* for tx, since ep type can change after */
 	unsigned new:1;
-};
+	unsigned iso_started:1;
 
-struct v_unlink {
-	unsigned long seqnum;
-	__u32 status;
-};
-
-enum tx_type {
-	TX_UNLINK,
-	TX_SUBMIT,
-};
+	/* isochronous: microframe of the first packet, next packet */
+	unsigned long iso_uframe;
+	int iso_packet;
 
-struct tx_item {
+	/* tx queue, for RET_SUBMIT or RET_UNLINK with unlink_status */
 	struct list_head tx_entry;
-	enum tx_type type;
-	union {
-		struct urbp *s;
-		struct v_unlink *u;
-	};
+	enum tx_type tx_type;
+	__u32 unlink_status;
+
+	/* for usbip_stats_latency(), zero if not known */
+	ktime_t queued;
+	ktime_t done;
+
+	/* urb->setup_packet, and what urb was allocated for */
+	u8 setup[8];
+	unsigned int buf_len;
+	int nr_iso;
 };
 
 enum tr_state {
@@ -89,10 +113,19 @@ enum tr_state {
 };
 
 struct transfer_timer {
-	struct timer_list timer;
+	/* fires on frame boundaries and schedules the tasklet */
+	struct hrtimer timer;
+	/* runs v_timer() in softirq context, it calls back the gadget */
+	struct tasklet_struct tasklet;
 	enum tr_state state;
-	unsigned long frame_start;
+	/* asked to run again while running */
+	unsigned kicked:1;
+
+	/* frame 0, frames since then, bytes left in the current one */
+	ktime_t start;
+	unsigned long frame;
 	int frame_limit;
+	int periodic_limit;
 };
 
 struct vudc {
@@ -106,12 +139,15 @@ struct vudc {
 	struct transfer_timer tr_timer;
 	struct timeval start_time;
 
-	struct list_head urb_queue;
-
 	spinlock_t lock_tx;
 	struct list_head tx_queue;
 	wait_queue_head_t tx_waitq;
 
+	/* free urbp, see get_urbp() */
+	spinlock_t lock_pool;
+	struct list_head urbp_pool;
+	int nr_pool;
+
 	spinlock_t lock;
 	struct vep *ep;
 	int address;
@@ -160,7 +196,8 @@ int get_gadget_descs(struct vudc *udc);
 /* vudc_tx.c */
 
 int v_tx_loop(void *data);
-void v_enqueue_ret_unlink(struct vudc *udc, __u32 seqnum, __u32 status);
+void v_enqueue_ret_unlink(struct vudc *udc, struct urbp *urb_p,
+			  __u32 status);
 void v_enqueue_ret_submit(struct vudc *udc, struct urbp *urb_p);
 
 /* vudc_rx.c */
@@ -171,13 +208,14 @@ int v_rx_loop(void *data);
 
 void v_init_timer(struct vudc *udc);
 void v_start_timer(struct vudc *udc);
-void v_kick_timer(struct vudc *udc, unsigned long time);
+void v_kick_timer(struct vudc *udc);
 void v_stop_timer(struct vudc *udc);
 
 /* vudc_dev.c */
 
-struct urbp *alloc_urbp(void);
-void free_urbp_and_urb(struct urbp *urb_p);
+struct urbp *get_urbp(struct vudc *udc);
+void put_urbp(struct vudc *udc, struct urbp *urb_p);
+int alloc_urbp_urb(struct urbp *urb_p, int np, unsigned int len);
 
 struct vep *vudc_find_endpoint(struct vudc *udc, u8 address);
 
@@ -22,6 +22,7 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/usb.h>
 #include <linux/usb/gadget.h>
 #include <linux/usb/hcd.h>
@@ -32,7 +33,6 @@
 #include "usbip_common.h"
 #include "vudc.h"
 
-#define VIRTUAL_ENDPOINTS (1 /* ep0 */ + 15 /* in eps */ + 15 /* out eps */)
 
 /* urb-related structures alloc / free */
 
@@ -42,7 +42,7 @@ static void free_urb(struct urb *urb)
 	if (!urb)
 		return;
 
-	kfree(urb->setup_packet);
+	/* setup_packet is in urbp */
 	urb->setup_packet = NULL;
 
 	kfree(urb->transfer_buffer);
@@ -51,31 +51,137 @@ static void free_urb(struct urb *urb)
 	usb_free_urb(urb);
 }
 
-struct urbp *alloc_urbp(void)
+static void free_urbp(struct urbp *urb_p)
 {
-	struct urbp *urb_p;
+	kfree(urb_p);
+}
 
-	urb_p = kzalloc(sizeof(*urb_p), GFP_KERNEL);
+static void free_urbp_and_urb(struct urbp *urb_p)
+{
 	if (!urb_p)
-		return urb_p;
+		return;
+	free_urb(urb_p->urb);
+	free_urbp(urb_p);
+}
+
+/*
+ * urbp come from a pool of each vudc, with the URB and the buffer they had,
+ * so that CMD_SUBMIT does not allocate once the pool is warm and
+ * completions never do.
+ */
+struct urbp *get_urbp(struct vudc *udc)
+{
+	struct urbp *urb_p = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&udc->lock_pool, flags);
+	if (!list_empty(&udc->urbp_pool)) {
+		urb_p = list_first_entry(&udc->urbp_pool, struct urbp,
+					 urb_entry);
+		list_del(&urb_p->urb_entry);
+		udc->nr_pool--;
+	}
+	spin_unlock_irqrestore(&udc->lock_pool, flags);
+
+	if (!urb_p) {
+		urb_p = kzalloc(sizeof(*urb_p), GFP_KERNEL);
+		if (!urb_p)
+			return urb_p;
+	}
 
-	urb_p->urb = NULL;
 	urb_p->ep = NULL;
+	urb_p->seqnum = 0;
+	urb_p->type = 0;
+	urb_p->new = 0;
+	urb_p->iso_started = 0;
+	urb_p->iso_packet = 0;
+	urb_p->tx_type = TX_SUBMIT;
+	urb_p->unlink_status = 0;
+	urb_p->queued = 0;
+	urb_p->done = 0;
 	INIT_LIST_HEAD(&urb_p->urb_entry);
+	INIT_LIST_HEAD(&urb_p->tx_entry);
 	return urb_p;
 }
 
-static void free_urbp(struct urbp *urb_p)
+void put_urbp(struct vudc *udc, struct urbp *urb_p)
 {
-	kfree(urb_p);
-}
+	unsigned long flags;
 
-void free_urbp_and_urb(struct urbp *urb_p)
-{
 	if (!urb_p)
 		return;
-	free_urb(urb_p->urb);
-	free_urbp(urb_p);
+
+	/* do not sit on large buffers */
+	if (urb_p->buf_len > VUDC_URBP_POOL_BUF) {
+		free_urb(urb_p->urb);
+		urb_p->urb = NULL;
+		urb_p->buf_len = 0;
+		urb_p->nr_iso = 0;
+	}
+
+	spin_lock_irqsave(&udc->lock_pool, flags);
+	if (udc->nr_pool < VUDC_URBP_POOL) {
+		list_add(&urb_p->urb_entry, &udc->urbp_pool);
+		udc->nr_pool++;
+		urb_p = NULL;
+	}
+	spin_unlock_irqrestore(&udc->lock_pool, flags);
+
+	free_urbp_and_urb(urb_p);
+}
+
+static void free_urbp_pool(struct vudc *udc)
+{
+	struct urbp *urb_p, *tmp;
+
+	list_for_each_entry_safe(urb_p, tmp, &udc->urbp_pool, urb_entry) {
+		list_del(&urb_p->urb_entry);
+		free_urbp_and_urb(urb_p);
+	}
+	udc->nr_pool = 0;
+}
+
+/*
+ * Gives urb_p a clean URB with room for np isochronous packets and len bytes,
+ * the one it has if it is large enough.
+ */
+int alloc_urbp_urb(struct urbp *urb_p, int np, unsigned int len)
+{
+	struct urb *urb = urb_p->urb;
+	void *buf;
+
+	if (urb && (np > urb_p->nr_iso || len > urb_p->buf_len)) {
+		free_urb(urb);
+		urb = urb_p->urb = NULL;
+	}
+
+	if (!urb) {
+		urb_p->buf_len = 0;
+		urb_p->nr_iso = 0;
+
+		urb = usb_alloc_urb(np, GFP_KERNEL);
+		if (!urb)
+			return -ENOMEM;
+
+		if (len > 0) {
+			urb->transfer_buffer = kzalloc(len, GFP_KERNEL);
+			if (!urb->transfer_buffer) {
+				usb_free_urb(urb);
+				return -ENOMEM;
+			}
+		}
+
+		urb_p->urb = urb;
+		urb_p->buf_len = len;
+		urb_p->nr_iso = np;
+	}
+
+	buf = urb->transfer_buffer;
+	usb_init_urb(urb);
+	urb->transfer_buffer = buf;
+	urb->setup_packet = urb_p->setup;
+
+	return 0;
 }
 
 
@@ -106,12 +212,16 @@ static void stop_activity(struct vudc *udc)
 
 	udc->address = 0;
 
-	for (i = 0; i < VIRTUAL_ENDPOINTS; i++)
-		nuke(udc, &udc->ep[i]);
+	for (i = 0; i < VIRTUAL_ENDPOINTS; i++) {
+		struct vep *ep = &udc->ep[i];
 
-	list_for_each_entry_safe(urb_p, tmp, &udc->urb_queue, urb_entry) {
-		list_del(&urb_p->urb_entry);
-		free_urbp_and_urb(urb_p);
+		nuke(udc, ep);
+
+		list_for_each_entry_safe(urb_p, tmp, &ep->urb_queue,
+					 urb_entry) {
+			list_del(&urb_p->urb_entry);
+			put_urbp(udc, urb_p);
+		}
 	}
 }
 
@@ -339,6 +449,10 @@ static int vep_queue(struct usb_ep *_ep, struct usb_request *_req,
 	_req->status = -EINPROGRESS;
 
 	list_add_tail(&req->req_entry, &ep->req_queue);
+
+	/* URBs of the endpoint may wait for it */
+	if (udc->connected && !list_empty(&ep->urb_queue))
+		v_kick_timer(udc);
 	spin_unlock_irqrestore(&udc->lock, flags);
 
 	return 0;
@@ -397,9 +511,11 @@ vep_set_halt_and_wedge(struct usb_ep *_ep, int value, int wedged)
 		return -ESHUTDOWN;
 
 	spin_lock_irqsave(&udc->lock, flags);
-	if (!value)
+	if (!value) {
 		ep->halted = ep->wedged = 0;
-	else if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
+		if (udc->connected && !list_empty(&ep->urb_queue))
+			v_kick_timer(udc);
+	} else if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
 			!list_empty(&ep->req_queue))
 		ret = -EAGAIN;
 	else {
@@ -443,6 +559,7 @@ static const struct usb_ep_ops vep_ops = {
 static void vudc_shutdown(struct usbip_device *ud)
 {
 	struct vudc *udc = container_of(ud, struct vudc, ud);
+	struct urbp *urb_p, *tmp;
 	int call_disconnect = 0;
 	unsigned long flags;
 
@@ -467,6 +584,15 @@ static void vudc_shutdown(struct usbip_device *ud)
 		ud->tcp_socket = NULL;
 	}
 
+	/* results the tx thread did not send */
+	spin_lock_irqsave(&udc->lock_tx, flags);
+	list_for_each_entry_safe(urb_p, tmp, &udc->tx_queue, tx_entry) {
+		list_del(&urb_p->tx_entry);
+		put_urbp(udc, urb_p);
+	}
+	spin_unlock_irqrestore(&udc->lock_tx, flags);
+	usbip_iso_pool_free(&ud->iso_tx);
+
 	spin_lock_irqsave(&udc->lock, flags);
 	stop_activity(udc);
 	if (udc->connected && udc->driver->disconnect)
@@ -530,6 +656,28 @@ void put_vudc_device(struct vudc_device *udc_dev)
 	kfree(udc_dev);
 }
 
+static void vudc_stats_queues(struct usbip_device *ud, struct seq_file *m)
+{
+	struct vudc *udc = container_of(ud, struct vudc, ud);
+	unsigned int nr_urb = 0, nr_tx = 0;
+	struct urbp *urb_p;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&udc->lock, flags);
+	for (i = 0; i < VIRTUAL_ENDPOINTS; i++)
+		list_for_each_entry(urb_p, &udc->ep[i].urb_queue, urb_entry)
+			nr_urb++;
+	spin_lock(&udc->lock_tx);
+	list_for_each_entry(urb_p, &udc->tx_queue, tx_entry)
+		nr_tx++;
+	spin_unlock(&udc->lock_tx);
+	spin_unlock_irqrestore(&udc->lock, flags);
+
+	usbip_stats_queue(m, "urb", nr_urb);
+	usbip_stats_queue(m, "tx", nr_tx);
+}
+
 static int init_vudc_hw(struct vudc *udc)
 {
 	int i;
@@ -559,6 +707,7 @@ static int init_vudc_hw(struct vudc *udc)
 		ep->ep.max_streams = 16;
 		ep->gadget = &udc->gadget;
 		INIT_LIST_HEAD(&ep->req_queue);
+		INIT_LIST_HEAD(&ep->urb_queue);
 
 		if (i == 0) {
 			/* ep0 */
@@ -584,27 +733,39 @@ static int init_vudc_hw(struct vudc *udc)
 
 	spin_lock_init(&udc->lock);
 	spin_lock_init(&udc->lock_tx);
-	INIT_LIST_HEAD(&udc->urb_queue);
+	spin_lock_init(&udc->lock_pool);
+	INIT_LIST_HEAD(&udc->urbp_pool);
 	INIT_LIST_HEAD(&udc->tx_queue);
 	init_waitqueue_head(&udc->tx_waitq);
 
 	spin_lock_init(&ud->lock);
 	ud->status = SDEV_ST_AVAILABLE;
 	ud->side = USBIP_VUDC;
+	usbip_sched_init(ud);
 
 	ud->eh_ops.shutdown = vudc_shutdown;
 	ud->eh_ops.reset    = vudc_device_reset;
 	ud->eh_ops.unusable = vudc_device_unusable;
 
+	if (usbip_stats_alloc(ud, dev_name(&udc->pdev->dev),
+			      vudc_stats_queues))
+		goto nomem_stats;
+
 	v_init_timer(udc);
 	return 0;
 
+nomem_stats:
+	kfree(udc->ep);
 nomem_ep:
 		return -ENOMEM;
 }
 
 static void cleanup_vudc_hw(struct vudc *udc)
 {
+	hrtimer_cancel(&udc->tr_timer.timer);
+	tasklet_kill(&udc->tr_timer.tasklet);
+	free_urbp_pool(udc);
+	usbip_stats_free(&udc->ud);
 	kfree(udc->ep);
 }
 
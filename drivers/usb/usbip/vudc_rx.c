@@ -22,35 +22,26 @@
 #include <linux/kthread.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "vudc.h"
 
-static int alloc_urb_from_cmd(struct urb **urbp,
+static int alloc_urb_from_cmd(struct urbp *urb_p,
 			      struct usbip_header *pdu, u8 type)
 {
 	struct urb *urb;
+	int np = 0;
 
 	if (type == USB_ENDPOINT_XFER_ISOC)
-		urb = usb_alloc_urb(pdu->u.cmd_submit.number_of_packets,
-					  GFP_KERNEL);
-	else
-		urb = usb_alloc_urb(0, GFP_KERNEL);
+		np = pdu->u.cmd_submit.number_of_packets;
 
-	if (!urb)
-		goto err;
+	/* from the pool, see get_urbp() */
+	if (alloc_urbp_urb(urb_p, np, pdu->u.cmd_submit.transfer_buffer_length))
+		return -ENOMEM;
 
+	urb = urb_p->urb;
 	usbip_pack_pdu(pdu, urb, USBIP_CMD_SUBMIT, 0);
 
-	if (urb->transfer_buffer_length > 0) {
-		urb->transfer_buffer = kzalloc(urb->transfer_buffer_length,
-			GFP_KERNEL);
-		if (!urb->transfer_buffer)
-			goto free_urb;
-	}
-
-	urb->setup_packet = kmemdup(&pdu->u.cmd_submit.setup, 8,
-			    GFP_KERNEL);
-	if (!urb->setup_packet)
-		goto free_buffer;
+	memcpy(urb_p->setup, &pdu->u.cmd_submit.setup, 8);
 
 	/*
 	 * FIXME - we only setup pipe enough for usbip functions
@@ -59,37 +50,59 @@ static int alloc_urb_from_cmd(struct urb **urbp,
 	urb->pipe |= pdu->base.direction == USBIP_DIR_IN ?
 			USB_DIR_IN : USB_DIR_OUT;
 
-	*urbp = urb;
 	return 0;
+}
+
+/* packets of an isochronous URB must lie in its buffer */
+static int v_check_iso(struct urb *urb)
+{
+	struct usb_iso_packet_descriptor *desc;
+	int i;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		desc = &urb->iso_frame_desc[i];
+		if (desc->offset > urb->transfer_buffer_length ||
+		    desc->length > urb->transfer_buffer_length - desc->offset)
+			return -EINVAL;
+	}
 
-free_buffer:
-	kfree(urb->transfer_buffer);
-	urb->transfer_buffer = NULL;
-free_urb:
-	usb_free_urb(urb);
-err:
-	return -ENOMEM;
+	return 0;
 }
 
 static int v_recv_cmd_unlink(struct vudc *udc,
 				struct usbip_header *pdu)
 {
 	unsigned long flags;
-	struct urbp *urb_p;
+	struct urbp *urb_p, *unlink;
+	int i;
+
+	/* RET_UNLINK in case the URB is not here */
+	unlink = get_urbp(udc);
+	if (!unlink) {
+		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_MALLOC);
+		return -ENOMEM;
+	}
 
 	spin_lock_irqsave(&udc->lock, flags);
-	list_for_each_entry(urb_p, &udc->urb_queue, urb_entry) {
-		if (urb_p->seqnum != pdu->u.cmd_unlink.seqnum)
-			continue;
-		urb_p->urb->unlinked = -ECONNRESET;
-		urb_p->seqnum = pdu->base.seqnum;
-		v_kick_timer(udc, jiffies);
-		spin_unlock_irqrestore(&udc->lock, flags);
-		return 0;
+	for (i = 0; i < VIRTUAL_ENDPOINTS; i++) {
+		list_for_each_entry(urb_p, &udc->ep[i].urb_queue, urb_entry) {
+			if (urb_p->seqnum != pdu->u.cmd_unlink.seqnum)
+				continue;
+			urb_p->urb->unlinked = -ECONNRESET;
+			urb_p->seqnum = pdu->base.seqnum;
+			usbip_stats_inc(&udc->ud,
+				unlinked[usb_pipetype(urb_p->urb->pipe)]);
+			trace_usbip_vudc_unlink(0, urb_p->seqnum, urb_p->urb);
+			v_kick_timer(udc);
+			spin_unlock_irqrestore(&udc->lock, flags);
+			put_urbp(udc, unlink);
+			return 0;
+		}
 	}
 	/* Not found, completed / not queued */
+	unlink->seqnum = pdu->base.seqnum;
 	spin_lock(&udc->lock_tx);
-	v_enqueue_ret_unlink(udc, pdu->base.seqnum, 0);
+	v_enqueue_ret_unlink(udc, unlink, 0);
 	wake_up(&udc->tx_waitq);
 	spin_unlock(&udc->lock_tx);
 	spin_unlock_irqrestore(&udc->lock, flags);
@@ -105,7 +118,7 @@ static int v_recv_cmd_submit(struct vudc *udc,
 	u8 address;
 	unsigned long flags;
 
-	urb_p = alloc_urbp();
+	urb_p = get_urbp(udc);
 	if (!urb_p) {
 		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_MALLOC);
 		return -ENOMEM;
@@ -129,10 +142,20 @@ static int v_recv_cmd_submit(struct vudc *udc,
 	urb_p->type = urb_p->ep->type;
 	spin_unlock_irq(&udc->lock);
 
+	if (urb_p->type == USB_ENDPOINT_XFER_ISOC &&
+	    (pdu->u.cmd_submit.number_of_packets < 0 ||
+	     pdu->u.cmd_submit.number_of_packets > VUDC_ISO_MAX_PACKETS)) {
+		dev_err(&udc->pdev->dev, "invalid number of iso packets %d",
+			pdu->u.cmd_submit.number_of_packets);
+		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_TCP);
+		ret = -EPIPE;
+		goto free_urbp;
+	}
+
 	urb_p->new = 1;
 	urb_p->seqnum = pdu->base.seqnum;
 
-	ret = alloc_urb_from_cmd(&urb_p->urb, pdu, urb_p->ep->type);
+	ret = alloc_urb_from_cmd(urb_p, pdu, urb_p->ep->type);
 	if (ret) {
 		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_MALLOC);
 		ret = -ENOMEM;
@@ -165,15 +188,26 @@ static int v_recv_cmd_submit(struct vudc *udc,
 	if (ret < 0)
 		goto free_urbp;
 
+	if (urb_p->type == USB_ENDPOINT_XFER_ISOC && v_check_iso(urb_p->urb)) {
+		dev_err(&udc->pdev->dev, "iso packet out of buffer");
+		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_TCP);
+		ret = -EPIPE;
+		goto free_urbp;
+	}
+
+	usbip_stats_inc(&udc->ud, submitted[usb_pipetype(urb_p->urb->pipe)]);
+	urb_p->queued = ktime_get();
+	trace_usbip_vudc_rx_submit(0, urb_p->seqnum, urb_p->urb);
+
 	spin_lock_irqsave(&udc->lock, flags);
-	v_kick_timer(udc, jiffies);
-	list_add_tail(&urb_p->urb_entry, &udc->urb_queue);
+	list_add_tail(&urb_p->urb_entry, &urb_p->ep->urb_queue);
+	v_kick_timer(udc);
 	spin_unlock_irqrestore(&udc->lock, flags);
 
 	return 0;
 
 free_urbp:
-	free_urbp_and_urb(urb_p);
+	put_urbp(udc, urb_p);
 	return ret;
 }
 
@@ -208,6 +242,11 @@ static int v_rx_pdu(struct usbip_device *ud)
 	case USBIP_CMD_SUBMIT:
 		ret = v_recv_cmd_submit(udc, &pdu);
 		break;
+	case USBIP_NOP:
+		usbip_hb_recv_nop(&udc->ud, &pdu);
+		wake_up(&udc->tx_waitq);
+		ret = 0;
+		break;
 	default:
 		ret = -EPIPE;
 		pr_err("rx: unknown command");
@@ -219,11 +258,13 @@ static int v_rx_pdu(struct usbip_device *ud)
 int v_rx_loop(void *data)
 {
 	struct usbip_device *ud = data;
+	unsigned int sched = 0;
 	int ret = 0;
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(ud))
 			break;
+		usbip_sched_thread(ud, 1, &sched);
 		ret = v_rx_pdu(ud);
 		if (ret < 0) {
 			pr_warn("v_rx exit with error %d", ret);
@@ -154,6 +154,7 @@ static ssize_t store_sockfd(struct device *dev, struct device_attribute *attr,
 			ret = -ENOENT;
 			goto unlock_ud;
 		}
+		usbip_hb_init(&udc->ud);
 
 		spin_unlock_irq(&udc->ud.lock);
 		spin_unlock_irqrestore(&udc->lock, flags);
@@ -219,9 +220,44 @@ static ssize_t usbip_status_show(struct device *dev,
 }
 static DEVICE_ATTR_RO(usbip_status);
 
+/* placement of the rx and tx threads, see usbip_sched.c */
+static ssize_t usbip_sched_show(struct device *dev,
+				struct device_attribute *attr, char *out)
+{
+	struct vudc *udc = (struct vudc *) dev_get_drvdata(dev);
+
+	if (!udc) {
+		dev_err(dev, "no device");
+		return -ENODEV;
+	}
+
+	return usbip_sched_print(&udc->ud, out, PAGE_SIZE);
+}
+
+static ssize_t usbip_sched_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *in, size_t count)
+{
+	struct vudc *udc = (struct vudc *) dev_get_drvdata(dev);
+	int ret;
+
+	if (!udc) {
+		dev_err(dev, "no device");
+		return -ENODEV;
+	}
+
+	ret = usbip_sched_set(&udc->ud, in);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static DEVICE_ATTR_RW(usbip_sched);
+
 static struct attribute *dev_attrs[] = {
 	&dev_attr_usbip_sockfd.attr,
 	&dev_attr_usbip_status.attr,
+	&dev_attr_usbip_sched.attr,
 	NULL,
 };
 
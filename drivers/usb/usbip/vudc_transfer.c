@@ -21,10 +21,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
 #include <linux/usb.h>
-#include <linux/timer.h>
 #include <linux/usb/ch9.h>
 
+#include "usbip_trace.h"
 #include "vudc.h"
 
 #define DEV_REQUEST	(USB_TYPE_STANDARD | USB_RECIP_DEVICE)
@@ -34,23 +38,43 @@
 #define EP_REQUEST	(USB_TYPE_STANDARD | USB_RECIP_ENDPOINT)
 #define EP_INREQUEST	(EP_REQUEST | USB_DIR_IN)
 
-static int get_frame_limit(enum usb_device_speed speed)
+static bool emulate_bandwidth;
+module_param(emulate_bandwidth, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emulate_bandwidth,
+		 "limit transfers to what the bus moves in a frame");
+
+/*
+ * Bytes moved in a frame. With periodic, the part of them isochronous
+ * transfers may take: 90% of a full speed frame, 80% of a high speed one.
+ */
+static int get_frame_limit(enum usb_device_speed speed, int periodic)
 {
+	int limit;
+
 	switch (speed) {
 	case USB_SPEED_LOW:
-		return 8 /*bytes*/ * 12 /*packets*/;
+		limit = 8 /*bytes*/ * 12 /*packets*/;
+		break;
 	case USB_SPEED_FULL:
-		return 64 /*bytes*/ * 19 /*packets*/;
+		limit = 64 /*bytes*/ * 19 /*packets*/;
+		break;
 	case USB_SPEED_HIGH:
-		return 512 /*bytes*/ * 13 /*packets*/ * 8 /*uframes*/;
+		limit = 512 /*bytes*/ * 13 /*packets*/ * 8 /*uframes*/;
+		break;
 	case USB_SPEED_SUPER:
 		/* Bus speed is 500000 bytes/ms, so use a little less */
-		return 490000;
+		limit = 490000;
+		break;
 	default:
 		/* error */
 		return -1;
 	}
 
+	if (!periodic)
+		return limit;
+	if (speed <= USB_SPEED_FULL)
+		return limit * 9 / 10;
+	return limit * 8 / 10;
 }
 
 /*
@@ -311,63 +335,174 @@ top:
 	return sent;
 }
 
-static void v_timer(unsigned long _vudc)
+/* microframes between the packets of an isochronous endpoint */
+static unsigned int iso_interval(struct vudc *udc, struct vep *ep)
 {
-	struct vudc *udc = (struct vudc *) _vudc;
-	struct transfer_timer *timer = &udc->tr_timer;
-	struct urbp *urb_p, *tmp;
-	unsigned long flags;
-	struct usb_ep *_ep;
-	struct vep *ep;
-	int ret = 0;
-	int total, limit;
+	unsigned int exp = 0;
 
-	spin_lock_irqsave(&udc->lock, flags);
+	if (ep->desc)
+		exp = clamp_t(unsigned int, ep->desc->bInterval, 1, 16) - 1;
 
-	total = get_frame_limit(udc->gadget.speed);
-	if (total < 0) {	/* unknown speed, or not set yet */
-		timer->state = VUDC_TR_IDLE;
-		spin_unlock_irqrestore(&udc->lock, flags);
-		return;
+	if (udc->gadget.speed == USB_SPEED_HIGH)
+		return 1 << exp;
+	return 8 << exp;
+}
+
+/*
+ * Moves an isochronous packet to or from the first queued request, which
+ * is given back at once. With no request, IN packets are zero length and
+ * OUT data is lost, as with a device not keeping up. caller must hold lock
+ */
+static int transfer_iso_packet(struct vudc *udc, struct urb *urb,
+			       struct vep *ep,
+			       struct usb_iso_packet_descriptor *desc)
+{
+	struct vrequest *req;
+	void *ubuf_pos = urb->transfer_buffer + desc->offset;
+	unsigned int len;
+
+	desc->status = 0;
+
+	if (list_empty(&ep->req_queue)) {
+		desc->actual_length = usb_pipein(urb->pipe) ? 0 : desc->length;
+		return 0;
 	}
-	/* is it next frame now? */
-	if (time_after(jiffies, timer->frame_start + msecs_to_jiffies(1))) {
-		timer->frame_limit = total;
-		/* FIXME: how to make it accurate? */
-		timer->frame_start = jiffies;
+
+	req = list_first_entry(&ep->req_queue, struct vrequest, req_entry);
+	len = min(desc->length, req->req.length - req->req.actual);
+
+	if (usb_pipein(urb->pipe)) {
+		memcpy(ubuf_pos, req->req.buf + req->req.actual, len);
+		req->req.status = 0;
 	} else {
-		total = timer->frame_limit;
+		memcpy(req->req.buf + req->req.actual, ubuf_pos, len);
+		req->req.status = desc->length > len ? -EOVERFLOW : 0;
 	}
 
-	/* We have to clear ep0 flags separately as it's not on the list */
-	udc->ep[0].already_seen = 0;
-	list_for_each_entry(_ep, &udc->gadget.ep_list, ep_list) {
-		ep = to_vep(_ep);
-		ep->already_seen = 0;
+	req->req.actual += len;
+	desc->actual_length = len;
+
+	list_del_init(&req->req_entry);
+	spin_unlock(&udc->lock);
+	usb_gadget_giveback_request(&ep->ep, &req->req);
+	spin_lock(&udc->lock);
+
+	return len;
+}
+
+/*
+ * Transfers the packets of an isochronous URB due by the end of the current
+ * frame, one interval after another from where the previous URB of the
+ * endpoint ended. Packets beyond the periodic bandwidth of the frame are
+ * missed with -EXDEV. caller must hold lock
+ */
+static int transfer_iso(struct vudc *udc, struct urbp *urb_p, struct vep *ep)
+{
+	struct transfer_timer *timer = &udc->tr_timer;
+	struct urb *urb = urb_p->urb;
+	unsigned long now = timer->frame * 8;
+	unsigned int interval = iso_interval(udc, ep);
+	int sent = 0;
+
+	if (!urb_p->iso_started) {
+		/* as URB_ISO_ASAP */
+		if (time_before(ep->iso_next, now - VUDC_ISO_SLACK) ||
+		    time_after(ep->iso_next, now + VUDC_ISO_SLACK))
+			ep->iso_next = now;
+
+		urb_p->iso_started = 1;
+		urb_p->iso_uframe = ep->iso_next;
+		urb_p->iso_packet = 0;
+		ep->iso_next += urb->number_of_packets * interval;
+
+		urb->start_frame = urb_p->iso_uframe >> 3;
+		urb->actual_length = 0;
+		urb->error_count = 0;
 	}
 
-restart:
-	list_for_each_entry_safe(urb_p, tmp, &udc->urb_queue, urb_entry) {
-		struct urb *urb = urb_p->urb;
+	while (urb_p->iso_packet < urb->number_of_packets) {
+		struct usb_iso_packet_descriptor *desc =
+			&urb->iso_frame_desc[urb_p->iso_packet];
 
-		ep = urb_p->ep;
-		if (urb->unlinked)
-			goto return_urb;
-		if (timer->state != VUDC_TR_RUNNING)
-			continue;
+		if (!time_before(urb_p->iso_uframe +
+				 urb_p->iso_packet * interval, now + 8))
+			break;
 
-		if (!ep) {
-			urb->status = -EPROTO;
-			goto return_urb;
+		if (desc->length > timer->periodic_limit) {
+			desc->actual_length = 0;
+			desc->status = -EXDEV;
+			urb->error_count++;
+		} else {
+			timer->periodic_limit -= desc->length;
+			sent += transfer_iso_packet(udc, urb, ep, desc);
 		}
 
-		/* Used up bandwidth? */
-		if (total <= 0 && ep->type == USB_ENDPOINT_XFER_BULK)
-			continue;
+		urb->actual_length += desc->actual_length;
+		urb_p->iso_packet++;
+	}
+
+	if (urb_p->iso_packet == urb->number_of_packets)
+		urb->status = 0;
+
+	return sent;
+}
+
+/* caller must hold lock */
+static void v_return_urb(struct vudc *udc, struct urbp *urb_p)
+{
+	struct urb *urb = urb_p->urb;
+
+	usbip_stats_latency(&udc->ud, USBIP_LAT_SERVICE, urb_p->queued);
+	urb_p->done = ktime_get();
+	trace_usbip_vudc_complete(0, urb_p->seqnum, urb);
+
+	spin_lock(&udc->lock_tx);
+	list_del(&urb_p->urb_entry);
+	if (!urb->unlinked) {
+		usbip_stats_inc(&udc->ud,
+				completed[usb_pipetype(urb->pipe)]);
+		v_enqueue_ret_submit(udc, urb_p);
+	} else {
+		v_enqueue_ret_unlink(udc, urb_p, urb->unlinked);
+	}
+	wake_up(&udc->tx_waitq);
+	spin_unlock(&udc->lock_tx);
+}
 
-		if (ep->already_seen)
+/* caller must hold lock */
+static void v_return_unlinked(struct vudc *udc, struct vep *ep)
+{
+	struct urbp *urb_p, *tmp;
+
+	list_for_each_entry_safe(urb_p, tmp, &ep->urb_queue, urb_entry) {
+		if (!urb_p->urb->unlinked)
 			continue;
-		ep->already_seen = 1;
+
+		ep->setup_stage = 0;
+		v_return_urb(udc, urb_p);
+	}
+}
+
+/*
+ * Matches the URBs of an endpoint with its requests, in order, until one of
+ * them has to wait. caller must hold lock
+ */
+static void v_transfer_ep(struct vudc *udc, struct vep *ep, int *total)
+{
+	struct urbp *urb_p;
+	int ret, limit;
+
+	while (!list_empty(&ep->urb_queue)) {
+		struct urb *urb;
+
+		urb_p = list_first_entry(&ep->urb_queue, struct urbp,
+					 urb_entry);
+		urb = urb_p->urb;
+
+		/* Used up bandwidth? */
+		if (*total <= 0 && ep->type == USB_ENDPOINT_XFER_BULK)
+			return;
+
 		if (ep == &udc->ep[0] && urb_p->new) {
 			ep->setup_stage = 1;
 			urb_p->new = 0;
@@ -403,11 +538,10 @@ restart:
 			}
 		}
 
-		limit = total;
+		limit = *total;
 		switch (ep->type) {
 		case USB_ENDPOINT_XFER_ISOC:
-			/* TODO: support */
-			urb->status = -EXDEV;
+			*total -= transfer_iso(udc, urb_p, ep);
 			break;
 
 		case USB_ENDPOINT_XFER_INT:
@@ -419,47 +553,113 @@ restart:
 			/* fallthrough */
 		default:
 treat_control_like_bulk:
-			total -= transfer(udc, urb, ep, limit);
+			*total -= transfer(udc, urb, ep, limit);
 		}
 		if (urb->status == -EINPROGRESS)
-			continue;
+			return;
 
 return_urb:
-		if (ep)
-			ep->already_seen = ep->setup_stage = 0;
+		ep->setup_stage = 0;
+		v_return_urb(udc, urb_p);
+	}
+}
 
-		spin_lock(&udc->lock_tx);
-		list_del(&urb_p->urb_entry);
-		if (!urb->unlinked) {
-			v_enqueue_ret_submit(udc, urb_p);
-		} else {
-			v_enqueue_ret_unlink(udc, urb_p->seqnum,
-					     urb->unlinked);
-			free_urbp_and_urb(urb_p);
-		}
-		wake_up(&udc->tx_waitq);
-		spin_unlock(&udc->lock_tx);
+/*
+ * Runs as soon as URBs or requests are queued, and on frame boundaries while
+ * isochronous URBs are pending or the bandwidth is emulated. Without
+ * emulation, a run still moves at most a frame worth of bulk data and the
+ * next one follows at once, so that the copies and completions are done in
+ * bounded slices of softirq time.
+ */
+static void v_timer(unsigned long _vudc)
+{
+	struct vudc *udc = (struct vudc *) _vudc;
+	struct transfer_timer *timer = &udc->tr_timer;
+	int pending = 0, periodic = 0;
+	unsigned long flags, frame;
+	int total, i;
 
-		goto restart;
+	spin_lock_irqsave(&udc->lock, flags);
+
+	timer->kicked = 0;
+
+	total = get_frame_limit(udc->gadget.speed, 0);
+	if (total < 0) {	/* unknown speed, or not set yet */
+		if (timer->state == VUDC_TR_RUNNING)
+			timer->state = VUDC_TR_IDLE;
+		spin_unlock_irqrestore(&udc->lock, flags);
+		return;
+	}
+	/* is it next frame now? */
+	frame = ktime_ms_delta(ktime_get(), timer->start);
+	if (frame != timer->frame) {
+		/* isochronous packets of the frames we slept through */
+		timer->periodic_limit = get_frame_limit(udc->gadget.speed, 1) *
+			min_t(unsigned long, frame - timer->frame,
+			      VUDC_ISO_CATCHUP);
+		timer->frame_limit = total;
+		timer->frame = frame;
 	}
 
-	/* TODO - also wait on empty usb_request queues? */
-	if (list_empty(&udc->urb_queue))
-		timer->state = VUDC_TR_IDLE;
+	if (emulate_bandwidth)
+		total = timer->frame_limit;
 	else
-		mod_timer(&timer->timer,
-			  timer->frame_start + msecs_to_jiffies(1));
+		timer->periodic_limit = INT_MAX;
+
+	for (i = 0; i < VIRTUAL_ENDPOINTS; i++) {
+		struct vep *ep = &udc->ep[i];
+
+		v_return_unlinked(udc, ep);
+		if (timer->state == VUDC_TR_RUNNING)
+			v_transfer_ep(udc, ep, &total);
+
+		if (list_empty(&ep->urb_queue))
+			continue;
+		pending = 1;
+		if (ep->type == USB_ENDPOINT_XFER_ISOC)
+			periodic = 1;
+	}
+
+	timer->frame_limit = total;
+
+	/* TODO - also wait on empty usb_request queues? */
+	if (!pending) {
+		if (timer->state == VUDC_TR_RUNNING)
+			timer->state = VUDC_TR_IDLE;
+	} else if (timer->kicked || (!emulate_bandwidth && total <= 0)) {
+		/* asked again, or more data than a run moves */
+		tasklet_hi_schedule(&timer->tasklet);
+	} else if (timer->state == VUDC_TR_RUNNING &&
+		   (periodic || emulate_bandwidth)) {
+		hrtimer_start(&timer->timer,
+			      ktime_add_ms(timer->start, frame + 1),
+			      HRTIMER_MODE_ABS);
+	}
+	/* else the next URB or request kicks the timer */
 
 	spin_unlock_irqrestore(&udc->lock, flags);
 }
 
+/* runs in hardirq context, leaves the transfers to the tasklet */
+static enum hrtimer_restart v_timer_fire(struct hrtimer *_timer)
+{
+	struct transfer_timer *timer = container_of(_timer,
+						    struct transfer_timer,
+						    timer);
+
+	tasklet_hi_schedule(&timer->tasklet);
+	return HRTIMER_NORESTART;
+}
+
 /* All timer functions are run with udc->lock held */
 
 void v_init_timer(struct vudc *udc)
 {
 	struct transfer_timer *t = &udc->tr_timer;
 
-	setup_timer(&t->timer, v_timer, (unsigned long) udc);
+	hrtimer_init(&t->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	t->timer.function = v_timer_fire;
+	tasklet_init(&t->tasklet, v_timer, (unsigned long) udc);
 	t->state = VUDC_TR_STOPPED;
 }
 
@@ -472,29 +672,32 @@ void v_start_timer(struct vudc *udc)
 	case VUDC_TR_RUNNING:
 		return;
 	case VUDC_TR_IDLE:
-		return v_kick_timer(udc, jiffies);
+		return v_kick_timer(udc);
 	case VUDC_TR_STOPPED:
 		t->state = VUDC_TR_IDLE;
-		t->frame_start = jiffies;
-		t->frame_limit = get_frame_limit(udc->gadget.speed);
-		return v_kick_timer(udc, jiffies);
+		t->start = ktime_get();
+		t->frame = 0;
+		t->frame_limit = get_frame_limit(udc->gadget.speed, 0);
+		t->periodic_limit = get_frame_limit(udc->gadget.speed, 1);
+		return v_kick_timer(udc);
 	}
 }
 
-void v_kick_timer(struct vudc *udc, unsigned long time)
+/* runs the timer now, rather than on the next frame */
+void v_kick_timer(struct vudc *udc)
 {
 	struct transfer_timer *t = &udc->tr_timer;
 
 	dev_dbg(&udc->pdev->dev, "timer kick");
 	switch (t->state) {
-	case VUDC_TR_RUNNING:
-		return;
 	case VUDC_TR_IDLE:
 		t->state = VUDC_TR_RUNNING;
 		/* fallthrough */
+	case VUDC_TR_RUNNING:
 	case VUDC_TR_STOPPED:
 		/* we may want to kick timer to unqueue urbs */
-		mod_timer(&t->timer, time);
+		t->kicked = 1;
+		tasklet_hi_schedule(&t->tasklet);
 	}
 }
 
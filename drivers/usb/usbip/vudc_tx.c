@@ -22,6 +22,7 @@
 #include <linux/kthread.h>
 
 #include "usbip_common.h"
+#include "usbip_trace.h"
 #include "vudc.h"
 
 static inline void setup_base_pdu(struct usbip_header_basic *base,
@@ -41,13 +42,13 @@ static void setup_ret_submit_pdu(struct usbip_header *rpdu, struct urbp *urb_p)
 }
 
 static void setup_ret_unlink_pdu(struct usbip_header *rpdu,
-				 struct v_unlink *unlink)
+				 struct urbp *urb_p)
 {
-	setup_base_pdu(&rpdu->base, USBIP_RET_UNLINK, unlink->seqnum);
-	rpdu->u.ret_unlink.status = unlink->status;
+	setup_base_pdu(&rpdu->base, USBIP_RET_UNLINK, urb_p->seqnum);
+	rpdu->u.ret_unlink.status = urb_p->unlink_status;
 }
 
-static int v_send_ret_unlink(struct vudc *udc, struct v_unlink *unlink)
+static int v_send_ret_unlink(struct vudc *udc, struct urbp *urb_p)
 {
 	struct msghdr msg;
 	struct kvec iov[1];
@@ -62,7 +63,7 @@ static int v_send_ret_unlink(struct vudc *udc, struct v_unlink *unlink)
 	memset(&iov, 0, sizeof(iov));
 
 	/* 1. setup usbip_header */
-	setup_ret_unlink_pdu(&pdu_header, unlink);
+	setup_ret_unlink_pdu(&pdu_header, urb_p);
 	usbip_header_correct_endian(&pdu_header, 1);
 
 	iov[0].iov_base = &pdu_header;
@@ -76,7 +77,6 @@ static int v_send_ret_unlink(struct vudc *udc, struct v_unlink *unlink)
 			return -EPIPE;
 		return ret;
 	}
-	kfree(unlink);
 
 	return txsize;
 }
@@ -86,28 +86,29 @@ static int v_send_ret_submit(struct vudc *udc, struct urbp *urb_p)
 	struct urb *urb = urb_p->urb;
 	struct usbip_header pdu_header;
 	struct usbip_iso_packet_descriptor *iso_buffer = NULL;
-	struct kvec *iov = NULL;
+	struct kvec iov_small[2];
+	struct kvec *iov = iov_small;
 	int iovnum = 0;
 	int ret = 0;
 	size_t txsize;
 	struct msghdr msg;
 
+	usbip_stats_latency(&udc->ud, USBIP_LAT_QUEUE, urb_p->done);
+	trace_usbip_vudc_tx_ret(0, urb_p->seqnum, urb);
+
 	txsize = 0;
 	memset(&pdu_header, 0, sizeof(pdu_header));
 	memset(&msg, 0, sizeof(msg));
 
-	if (urb_p->type == USB_ENDPOINT_XFER_ISOC)
-		iovnum = 2 + urb->number_of_packets;
-	else
-		iovnum = 2;
-
-	iov = kcalloc(iovnum, sizeof(*iov), GFP_KERNEL);
-	if (!iov) {
-		usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_MALLOC);
-		ret = -ENOMEM;
-		goto out;
+	/* only isochronous URBs need more than the header and the buffer */
+	if (urb_p->type == USB_ENDPOINT_XFER_ISOC) {
+		iov = usbip_iso_pool_iov(&udc->ud.iso_tx,
+					 2 + urb->number_of_packets);
+		if (!iov) {
+			usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_MALLOC);
+			return -ENOMEM;
+		}
 	}
-	iovnum = 0;
 
 	/* 1. setup usbip_header */
 	setup_ret_submit_pdu(&pdu_header, urb_p);
@@ -129,17 +130,13 @@ static int v_send_ret_submit(struct vudc *udc, struct urbp *urb_p)
 		txsize += urb->actual_length;
 	} else if (urb_p->type == USB_ENDPOINT_XFER_ISOC &&
 		usb_pipein(urb->pipe)) {
-		/* FIXME - copypasted from stub_tx, refactor */
-		int i;
-
-		for (i = 0; i < urb->number_of_packets; i++) {
-			iov[iovnum].iov_base = urb->transfer_buffer +
-				urb->iso_frame_desc[i].offset;
-			iov[iovnum].iov_len =
-				urb->iso_frame_desc[i].actual_length;
-			iovnum++;
-			txsize += urb->iso_frame_desc[i].actual_length;
-		}
+		/* packets without padding, as stub_tx */
+		int i, n;
+
+		n = usbip_iso_data_iov(urb, &iov[iovnum]);
+		for (i = 0; i < n; i++)
+			txsize += iov[iovnum + i].iov_len;
+		iovnum += n;
 
 		if (txsize != sizeof(pdu_header) + urb->actual_length) {
 			usbip_event_add(&udc->ud, VUDC_EVENT_ERROR_TCP);
@@ -176,9 +173,7 @@ static int v_send_ret_submit(struct vudc *udc, struct urbp *urb_p)
 	}
 
 out:
-	kfree(iov);
 	kfree(iso_buffer);
-	free_urbp_and_urb(urb_p);
 	if (ret < 0)
 		return ret;
 	return txsize;
@@ -187,26 +182,26 @@ out:
 static int v_send_ret(struct vudc *udc)
 {
 	unsigned long flags;
-	struct tx_item *txi;
+	struct urbp *urb_p;
 	size_t total_size = 0;
 	int ret = 0;
 
 	spin_lock_irqsave(&udc->lock_tx, flags);
 	while (!list_empty(&udc->tx_queue)) {
-		txi = list_first_entry(&udc->tx_queue, struct tx_item,
-				       tx_entry);
-		list_del(&txi->tx_entry);
+		urb_p = list_first_entry(&udc->tx_queue, struct urbp,
+					 tx_entry);
+		list_del(&urb_p->tx_entry);
 		spin_unlock_irqrestore(&udc->lock_tx, flags);
 
-		switch (txi->type) {
+		switch (urb_p->tx_type) {
 		case TX_SUBMIT:
-			ret = v_send_ret_submit(udc, txi->s);
+			ret = v_send_ret_submit(udc, urb_p);
 			break;
 		case TX_UNLINK:
-			ret = v_send_ret_unlink(udc, txi->u);
+			ret = v_send_ret_unlink(udc, urb_p);
 			break;
 		}
-		kfree(txi);
+		put_urbp(udc, urb_p);
 
 		if (ret < 0)
 			return ret;
@@ -225,63 +220,49 @@ int v_tx_loop(void *data)
 {
 	struct usbip_device *ud = (struct usbip_device *) data;
 	struct vudc *udc = container_of(ud, struct vudc, ud);
+	unsigned int sched = 0;
 	int ret;
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(&udc->ud))
 			break;
+		usbip_sched_thread(ud, 0, &sched);
 		ret = v_send_ret(udc);
 		if (ret < 0) {
 			pr_warn("v_tx exit with error %d", ret);
 			break;
 		}
+		ret = usbip_hb_send(ud, 0);
+		if (ret < 0) {
+			usbip_event_add(ud, VUDC_EVENT_ERROR_TCP);
+			pr_warn("v_tx exit with error %d", ret);
+			break;
+		}
 		wait_event_interruptible(udc->tx_waitq,
 					 (!list_empty(&udc->tx_queue) ||
+					 usbip_hb_pending(ud) ||
 					 kthread_should_stop()));
 	}
 
 	return 0;
 }
 
-/* called with spinlocks held */
-void v_enqueue_ret_unlink(struct vudc *udc, __u32 seqnum, __u32 status)
+/*
+ * The urbp itself is queued, so that neither of these can fail.
+ * called with spinlocks held
+ */
+void v_enqueue_ret_unlink(struct vudc *udc, struct urbp *urb_p, __u32 status)
 {
-	struct tx_item *txi;
-	struct v_unlink *unlink;
-
-	txi = kzalloc(sizeof(*txi), GFP_ATOMIC);
-	if (!txi) {
-		usbip_event_add(&udc->ud, VDEV_EVENT_ERROR_MALLOC);
-		return;
-	}
-	unlink = kzalloc(sizeof(*unlink), GFP_ATOMIC);
-	if (!unlink) {
-		kfree(txi);
-		usbip_event_add(&udc->ud, VDEV_EVENT_ERROR_MALLOC);
-		return;
-	}
-
-	unlink->seqnum = seqnum;
-	unlink->status = status;
-	txi->type = TX_UNLINK;
-	txi->u = unlink;
+	urb_p->tx_type = TX_UNLINK;
+	urb_p->unlink_status = status;
 
-	list_add_tail(&txi->tx_entry, &udc->tx_queue);
+	list_add_tail(&urb_p->tx_entry, &udc->tx_queue);
 }
 
 /* called with spinlocks held */
 void v_enqueue_ret_submit(struct vudc *udc, struct urbp *urb_p)
 {
-	struct tx_item *txi;
-
-	txi = kzalloc(sizeof(*txi), GFP_ATOMIC);
-	if (!txi) {
-		usbip_event_add(&udc->ud, VDEV_EVENT_ERROR_MALLOC);
-		return;
-	}
-
-	txi->type = TX_SUBMIT;
-	txi->s = urb_p;
+	urb_p->tx_type = TX_SUBMIT;
 
-	list_add_tail(&txi->tx_entry, &udc->tx_queue);
+	list_add_tail(&urb_p->tx_entry, &udc->tx_queue);
 }
@@ -23,4 +23,25 @@ enum usbip_device_status {
 	VDEV_ST_USED,
 	VDEV_ST_ERROR
 };
+
+/*
+ * USB/IP protocol extensions. They are negotiated by userspace when a device
+ * is imported and handed to the drivers with the socket descriptor.
+ */
+/* CMD_SUBMIT on bulk pipes carries a stream ID and the stream count */
+#define USBIP_FEAT_STREAMS	0x00000001
+/* large bulk IN data may come ahead in RET_SUBMIT_CHUNK */
+#define USBIP_FEAT_CHUNKED	0x00000002
+/* interrupt IN endpoints are polled by the server and pushed by RET_POLL */
+#define USBIP_FEAT_INT_POLL	0x00000004
+/* ISO descriptors are run-length encoded and sent ahead of the data */
+#define USBIP_FEAT_ISO_COMPACT	0x00000008
+/* the client sends USBIP_NOP at an interval, answered by USBIP_RET_NOP */
+#define USBIP_FEAT_HEARTBEAT	0x00000010
+/* RET_SUBMIT and RET_UNLINK end with times taken by the server */
+#define USBIP_FEAT_TIMESTAMPS	0x00000020
+/* headers are sent in a compact form of variable length */
+#define USBIP_FEAT_COMPACT_HDR	0x00000040
+/* bulk data is sent in LZ4 blocks, asked for by the client only */
+#define USBIP_FEAT_COMPRESS	0x00000080
 #endif /* _UAPI_LINUX_USBIP_H */
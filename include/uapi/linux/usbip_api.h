@@ -37,6 +37,8 @@ struct usbip_sock {
 	int (*send)(void *arg, void *buf, int len);
 	int (*recv)(void *arg, void *buf, int len, int wait_all);
 	void (*shutdown)(void *arg);
+	/* protocol extensions agreed with the peer, USBIP_FEAT_* */
+	unsigned int features;
 };
 
 void usbip_sock_init(struct usbip_sock *sock, int fd, void *arg,
@@ -0,0 +1,279 @@
+#!/bin/bash
+#
+# Benchmark of the kernel path of USB/IP on a single machine.
+#
+# A SourceSink gadget (Gadget Zero) is exported and imported back through
+# vhci_hcd over localhost, and driven by usbtest with testusb:
+#
+#   host: gadget on dummy_hcd, bound to usbip-host, exported by usbipd
+#   vudc: gadget on usbip-vudc, exported by usbipd -e
+#
+# Tests 27 and 28 of usbtest keep <depth> bulk URBs of <size> bytes in
+# flight, OUT and IN, <count> times. Each run prints a line of
+#
+#   scenario=..#test=..#dir=..#size=..#depth=..#count=..#sec=..
+#   #mbps=..#urbps=..#cpu_per_gb=..#wire_out=..#wire_in=..
+#
+# (on one line) to stdout. mbps is MB/s of payload, cpu_per_gb the CPU
+# seconds of the whole machine spent per GB of payload. wire_* are the
+# bytes vhci_hcd sent and received with headers, from
+# <debugfs>/usbip/vhci/port<N>, and 0 without debugfs.
+#
+# Requires root, dummy_hcd, libcomposite, usb_f_ss_lb, usbtest and the
+# modules of this tree installed (see install.sh), and testusb of the
+# kernel's tools/usb.
+#
+
+CMD=`basename $0`
+DIR=$( cd "$( dirname "$0" )" && pwd )
+
+SCENARIOS="host vudc"
+SIZES="512 4096 16384 65536"
+DEPTHS="1 4 16 32"
+COUNT=256
+TESTUSB=${TESTUSB:-testusb}
+USBIP=${USBIP:-usbip}
+USBIPD=${USBIPD:-usbipd}
+DEBUGFS=/sys/kernel/debug
+CONFIGFS=/sys/kernel/config
+GADGET=$CONFIGFS/usb_gadget/usbip_kbench
+PID_FILE=/var/run/usbip_kbench.pid
+VID=0525
+PID=a4a0
+
+usage() {
+	echo "usage: $CMD [-m \"host vudc\"] [-s \"sizes\"] [-q \"depths\"]" \
+	     "[-c count]" >&2
+	echo "    environment TESTUSB, USBIP and USBIPD give the commands" >&2
+	exit 1
+}
+
+log() {
+	echo "$CMD: $*" >&2
+}
+
+while getopts "m:s:q:c:h" opt; do
+	case $opt in
+	m) SCENARIOS=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	q) DEPTHS=$OPTARG ;;
+	c) COUNT=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+if [ `id -u` -ne 0 ]; then
+	log "must be run as root"
+	exit 1
+fi
+
+# prefer the commands built in this tree
+if [ "$USBIP" = usbip -a -x $DIR/../src/usbip ]; then
+	USBIP=$DIR/../src/usbip
+	USBIPD=$DIR/../src/usbipd
+fi
+
+if ! type $TESTUSB > /dev/null 2>&1; then
+	log "testusb not found, build tools/usb/testusb.c of the kernel" \
+	    "and give it by TESTUSB"
+	exit 1
+fi
+
+mount | grep -q " $DEBUGFS " || mount -t debugfs none $DEBUGFS 2> /dev/null
+mount | grep -q " $CONFIGFS " || mount -t configfs none $CONFIGFS
+
+# busy jiffies of all the CPUs
+cpu_busy() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 + $9 }' /proc/stat
+}
+
+now() {
+	date +%s.%N
+}
+
+# a usb device of the gadget under the driver matched by $1
+find_device() {
+	local d
+
+	for d in /sys/bus/usb/devices/*; do
+		[ -r $d/idVendor ] || continue
+		[ "`cat $d/idVendor`" = $VID ] || continue
+		[ "`cat $d/idProduct`" = $PID ] || continue
+		readlink -f $d | grep -q "$1" || continue
+		echo $d
+		return 0
+	done
+	return 1
+}
+
+wait_device() {
+	local i
+
+	for i in `seq 50`; do
+		find_device $1 && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+gadget_up() {
+	mkdir -p $GADGET || return 1
+	echo 0x$VID > $GADGET/idVendor
+	echo 0x$PID > $GADGET/idProduct
+	mkdir -p $GADGET/strings/0x409
+	echo usbip > $GADGET/strings/0x409/manufacturer
+	echo kbench > $GADGET/strings/0x409/product
+	mkdir -p $GADGET/configs/c.1
+	mkdir -p $GADGET/functions/SourceSink.0
+	echo 65536 > $GADGET/functions/SourceSink.0/bulk_buflen
+	ln -s $GADGET/functions/SourceSink.0 $GADGET/configs/c.1/
+	echo $1 > $GADGET/UDC
+}
+
+gadget_down() {
+	[ -d $GADGET ] || return 0
+	echo "" > $GADGET/UDC 2> /dev/null
+	rm -f $GADGET/configs/c.1/SourceSink.0
+	rmdir $GADGET/configs/c.1 $GADGET/functions/SourceSink.0 \
+	      $GADGET/strings/0x409 $GADGET
+}
+
+usbipd_up() {
+	$USBIPD -D -P$PID_FILE $1
+	sleep 0.5
+}
+
+usbipd_down() {
+	[ -r $PID_FILE ] && kill `cat $PID_FILE` 2> /dev/null
+	rm -f $PID_FILE
+}
+
+detach_all() {
+	local p
+
+	for p in `$USBIP port 2> /dev/null | sed -n 's/^Port \([0-9]*\):.*/\1/p'`
+	do
+		$USBIP detach -p $((10#$p)) > /dev/null
+	done
+}
+
+# prints the name of the stats file of the only attached port
+port_stats() {
+	local p
+
+	p=`$USBIP port 2> /dev/null | sed -n 's/^Port \([0-9]*\):.*/\1/p'`
+	echo $DEBUGFS/usbip/vhci/port$((10#$p))
+}
+
+# wire bytes, out and in
+wire_bytes() {
+	if [ -r $1 ]; then
+		awk '/^bytes_out/ { o = $2 } /^bytes_in/ { i = $2 }
+		     END { print o, i }' $1
+	else
+		echo 0 0
+	fi
+}
+
+run_tests() {
+	local scenario=$1 dev=$2 stats
+	local node test dir size depth
+	local c0 c1 t0 t1 w0 w1 tck
+
+	node=$(printf "/dev/bus/usb/%03d/%03d" `cat $dev/busnum` \
+		`cat $dev/devnum`)
+	stats=`port_stats`
+	tck=`getconf CLK_TCK`
+
+	for test in 27 28; do
+		[ $test = 27 ] && dir=out || dir=in
+		for size in $SIZES; do
+			for depth in $DEPTHS; do
+				w0=`wire_bytes $stats`
+				c0=`cpu_busy`
+				t0=`now`
+				if ! $TESTUSB -D $node -t $test -c $COUNT \
+				     -s $size -g $depth > /dev/null; then
+					log "test $test size $size depth" \
+					    "$depth failed"
+					continue
+				fi
+				t1=`now`
+				c1=`cpu_busy`
+				w1=`wire_bytes $stats`
+				echo "$scenario $test $dir $size $depth $COUNT" \
+				     "$t0 $t1 $c0 $c1 $tck $w0 $w1" | awk '{
+					sec = $8 - $7;
+					urbs = $6 * $5;
+					bytes = urbs * $4;
+					printf("scenario=%s#test=%s#dir=%s#" \
+					       "size=%s#depth=%s#count=%s#" \
+					       "sec=%.6f#mbps=%.2f#urbps=%.0f#" \
+					       "cpu_per_gb=%.3f#" \
+					       "wire_out=%.0f#wire_in=%.0f\n",
+					       $1, $2, $3, $4, $5, $6, sec,
+					       bytes / sec / 1e6, urbs / sec,
+					       ($10 - $9) / $11 / (bytes / 1e9),
+					       $14 - $12, $15 - $13);
+				}'
+			done
+		done
+	done
+}
+
+cleanup() {
+	detach_all
+	[ -n "$BUSID" ] && $USBIP unbind -b $BUSID > /dev/null 2>&1
+	BUSID=
+	usbipd_down
+	gadget_down
+}
+
+trap "cleanup; exit 1" INT TERM
+
+scenario_host() {
+	local dev
+
+	modprobe dummy_hcd || return 1
+	gadget_up dummy_udc.0 || return 1
+	dev=`wait_device dummy_hcd` || { log "no gadget on dummy_hcd"; return 1; }
+	BUSID=`basename $dev`
+
+	usbipd_up
+	$USBIP bind -b $BUSID || return 1
+	$USBIP attach -r localhost -b $BUSID || return 1
+	dev=`wait_device vhci_hcd` || { log "not attached"; return 1; }
+
+	run_tests host $dev
+}
+
+scenario_vudc() {
+	local dev
+
+	if ! modprobe usbip-vudc; then
+		log "usbip-vudc not available, vudc skipped"
+		return 0
+	fi
+	gadget_up usbip-vudc.0 || return 1
+
+	usbipd_up -e
+	$USBIP attach -r localhost -d usbip-vudc.0 || return 1
+	dev=`wait_device vhci_hcd` || { log "not attached"; return 1; }
+
+	run_tests vudc $dev
+}
+
+modprobe libcomposite && modprobe usb_f_ss_lb && modprobe usbtest &&
+modprobe usbip-host && modprobe vhci-hcd || exit 1
+
+rc=0
+for s in $SCENARIOS; do
+	case $s in
+	host) scenario_host || rc=1 ;;
+	vudc) scenario_vudc || rc=1 ;;
+	*) usage ;;
+	esac
+	cleanup
+done
+
+exit $rc
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Capture of the bytes sent and received on usbip_sock.
+ *
+ * Each send or recv which moved data is written as a record with the time,
+ * the connection and the direction, through a large stdio buffer flushed
+ * at most each second. Connections whose URBs are transferred by the kernel
+ * are only captured up to the import, the rest is seen with usbip-ux or by
+ * the libusb stub.
+ *
+ * usbipd forks a process for each connection. A child writes its own file,
+ * named after the one opened with its pid appended. The stream is flushed
+ * before the fork, so that the child inherits no buffered bytes to write
+ * into the file of the parent at exit.
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbip_common.h"
+#include "usbip_capture.h"
+
+#define CAPTURE_BUF	(1024 * 1024)
+#define CAPTURE_FLUSH	1000000000ULL /* ns */
+#define NSEC_PER_SEC	1000000000ULL
+
+int usbip_capture_enabled;
+
+static struct {
+	pthread_mutex_t lock;
+	FILE *fp;
+	char path[PATH_MAX];
+	uint64_t start;
+	uint64_t flushed;
+#ifndef USBIP_OS_NO_FORK
+	pid_t pid;
+#endif
+} capture = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t capture_htonll(uint64_t v)
+{
+	return ((uint64_t)htonl(v & 0xffffffff) << 32) | htonl(v >> 32);
+}
+
+static int capture_create(const char *path)
+{
+	struct usbip_capture_header hdr;
+
+	capture.fp = fopen(path, "wb");
+	if (!capture.fp) {
+		err("open capture %s", path);
+		return -1;
+	}
+	setvbuf(capture.fp, NULL, _IOFBF, CAPTURE_BUF);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, USBIP_CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htonl(USBIP_CAPTURE_VERSION);
+	if (fwrite(&hdr, sizeof(hdr), 1, capture.fp) != 1) {
+		err("write capture %s", path);
+		fclose(capture.fp);
+		capture.fp = NULL;
+		return -1;
+	}
+
+	capture.start = capture_now();
+	capture.flushed = capture.start;
+#ifndef USBIP_OS_NO_FORK
+	capture.pid = getpid();
+#endif
+	return 0;
+}
+
+int usbip_capture_open(const char *path)
+{
+	int ret;
+
+	if (strlen(path) >= sizeof(capture.path) - 16) {
+		err("too long capture path %s", path);
+		return -1;
+	}
+
+	pthread_mutex_lock(&capture.lock);
+	strcpy(capture.path, path);
+	ret = capture_create(path);
+	usbip_capture_enabled = !ret;
+	pthread_mutex_unlock(&capture.lock);
+
+	return ret;
+}
+
+void usbip_capture_close(void)
+{
+	pthread_mutex_lock(&capture.lock);
+	usbip_capture_enabled = 0;
+	if (capture.fp)
+		fclose(capture.fp);
+	capture.fp = NULL;
+	pthread_mutex_unlock(&capture.lock);
+}
+
+/* before fork(), see usbip_capture.h */
+void usbip_capture_flush(void)
+{
+	pthread_mutex_lock(&capture.lock);
+	if (capture.fp)
+		fflush(capture.fp);
+	pthread_mutex_unlock(&capture.lock);
+}
+
+#ifndef USBIP_OS_NO_FORK
+/*
+ * The first record of a forked child. The inherited stream was flushed
+ * before the fork, so closing it writes nothing into the file of the
+ * parent.
+ */
+static int capture_reopen(void)
+{
+	/* room for any capture.path and ".<pid>" */
+	char path[sizeof(capture.path) + 16];
+	int len;
+
+	fclose(capture.fp);
+	capture.fp = NULL;
+
+	len = snprintf(path, sizeof(path), "%s.%d", capture.path,
+		       (int)getpid());
+	if (len < 0 || (size_t)len >= sizeof(path)) {
+		err("too long capture path %s.%d", capture.path, (int)getpid());
+		return -1;
+	}
+	return capture_create(path);
+}
+#endif
+
+void __usbip_capture(struct usbip_sock *sock, unsigned int flags,
+		     const void *buf, size_t len)
+{
+	struct usbip_capture_record rec;
+	uint64_t now = capture_now();
+
+	pthread_mutex_lock(&capture.lock);
+
+	if (!usbip_capture_enabled)
+		goto out;
+
+#ifndef USBIP_OS_NO_FORK
+	if (capture.pid != getpid() && capture_reopen())
+		goto err;
+#endif
+
+	rec.stamp = capture_htonll(now - capture.start);
+	rec.conn = htonl(sock->fd);
+	rec.flags = htonl(flags);
+	rec.len = htonl(len);
+
+	if (fwrite(&rec, sizeof(rec), 1, capture.fp) != 1 ||
+	    fwrite(buf, len, 1, capture.fp) != 1)
+		goto err;
+
+	if (now - capture.flushed >= CAPTURE_FLUSH) {
+		fflush(capture.fp);
+		capture.flushed = now;
+	}
+out:
+	pthread_mutex_unlock(&capture.lock);
+	return;
+err:
+	err("write capture, stopped");
+	usbip_capture_enabled = 0;
+	pthread_mutex_unlock(&capture.lock);
+}
+
+/* 0 if fp starts with a capture header of a known version */
+int usbip_capture_read_header(FILE *fp)
+{
+	struct usbip_capture_header hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, USBIP_CAPTURE_MAGIC, sizeof(hdr.magic)) ||
+	    ntohl(hdr.version) != USBIP_CAPTURE_VERSION)
+		return -1;
+
+	return 0;
+}
+
+/* the next record in host byte order, 1 at the end of the file */
+int usbip_capture_read_record(FILE *fp, struct usbip_capture_record *rec)
+{
+	if (fread(rec, sizeof(*rec), 1, fp) != 1)
+		return feof(fp) ? 1 : -1;
+
+	rec->stamp = capture_htonll(rec->stamp);
+	rec->conn = ntohl(rec->conn);
+	rec->flags = ntohl(rec->flags);
+	rec->len = ntohl(rec->len);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Capture of the bytes sent and received on usbip_sock.
+ */
+
+#ifndef __USBIP_CAPTURE_H
+#define __USBIP_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define USBIP_CAPTURE_MAGIC	"USBIPCAP"
+#define USBIP_CAPTURE_VERSION	1
+
+/* the file starts with the header, followed by records and their data */
+PACK(
+struct usbip_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+});
+
+/* all in network byte order in the file */
+PACK(
+struct usbip_capture_record {
+	uint64_t stamp;		/* ns from the opening of the file */
+	uint32_t conn;		/* socket descriptor of the connection */
+	uint32_t flags;
+	uint32_t len;		/* bytes of data following */
+});
+
+#define USBIP_CAPTURE_SENT	0x00000001
+
+struct usbip_sock;
+
+extern int usbip_capture_enabled;
+
+int usbip_capture_open(const char *path);
+void usbip_capture_close(void);
+/*
+ * To be called before fork(). A child must not inherit buffered records,
+ * its exit() would write them again into the file of the parent.
+ */
+void usbip_capture_flush(void);
+void __usbip_capture(struct usbip_sock *sock, unsigned int flags,
+		     const void *buf, size_t len);
+
+/* called with what a send or recv on sock has moved */
+static inline void usbip_capture(struct usbip_sock *sock, unsigned int flags,
+				 const void *buf, long len)
+{
+	if (usbip_capture_enabled && len > 0)
+		__usbip_capture(sock, flags, buf, len);
+}
+
+int usbip_capture_read_header(FILE *fp);
+int usbip_capture_read_record(FILE *fp, struct usbip_capture_record *rec);
+
+#endif /* !__USBIP_CAPTURE_H */
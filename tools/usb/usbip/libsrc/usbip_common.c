@@ -6,6 +6,10 @@
 #include "usbip_common.h"
 #include "names.h"
 
+#ifndef USBIP_WITH_LIBUSB
+#include <sched.h>
+#endif
+
 #undef  PROGNAME
 #define PROGNAME "libusbip"
 
@@ -69,6 +73,76 @@ const char *usbip_speed_string(int num)
 	return "Unknown Speed";
 }
 
+#ifndef USBIP_WITH_LIBUSB
+/*
+ * Takes --cpu=<cpu|auto|any> as 'c', --fifo=<priority> as 'f' and
+ * --nice=<nice> as 'n'. sched must be zeroed before the first option.
+ */
+int usbip_sched_parse(struct usbip_sched *sched, int opt, const char *arg)
+{
+	char *end;
+	long val;
+
+	if (!sched->set) {
+		sched->cpu = USBIP_SCHED_CPU_ANY;
+		sched->policy = SCHED_OTHER;
+		sched->prio = 0;
+		sched->set = 1;
+	}
+
+	if (opt == 'c' && !strcmp(arg, "auto")) {
+		sched->cpu = USBIP_SCHED_CPU_AUTO;
+		return 0;
+	} else if (opt == 'c' && !strcmp(arg, "any")) {
+		sched->cpu = USBIP_SCHED_CPU_ANY;
+		return 0;
+	}
+
+	val = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0') {
+		err("invalid value %s", arg);
+		return -1;
+	}
+
+	switch (opt) {
+	case 'c':
+		if (val < 0)
+			goto err_range;
+		sched->cpu = val;
+		break;
+	case 'f':
+		if (val < sched_get_priority_min(SCHED_FIFO) ||
+		    val > sched_get_priority_max(SCHED_FIFO))
+			goto err_range;
+		sched->policy = SCHED_FIFO;
+		sched->prio = val;
+		break;
+	case 'n':
+		if (val < -20 || val > 19)
+			goto err_range;
+		sched->policy = SCHED_OTHER;
+		sched->prio = val;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+
+err_range:
+	err("value out of range %s", arg);
+	return -1;
+}
+
+/* "<cpu> <policy> <priority>" as the usbip_sched attributes take it */
+int usbip_sched_string(const struct usbip_sched *sched, char *buf,
+		       size_t size)
+{
+	return snprintf(buf, size, "%d %d %d", sched->cpu, sched->policy,
+			sched->prio);
+}
+#endif
+
 
 #define DBG_UDEV_INTEGER(name)\
 	dbg("%-20s = %x", to_string(name), (int) udev->name)
@@ -306,6 +380,7 @@ void usbip_sock_init(struct usbip_sock *sock, int fd, void *arg,
 	sock->send = send;
 	sock->recv = recv;
 	sock->shutdown = shutdown;
+	sock->features = 0;
 }
 
 struct usbip_connection_operations usbip_conn_ops = {NULL, NULL, NULL};
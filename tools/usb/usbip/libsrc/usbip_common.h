@@ -165,6 +165,23 @@ int read_usb_interface(struct usbip_usb_device *udev, int i,
 const char *usbip_speed_string(int num);
 const char *usbip_status_string(int32_t status);
 
+#ifndef USBIP_WITH_LIBUSB
+/* placement of the kernel threads of a connection */
+#define USBIP_SCHED_CPU_ANY	-1
+#define USBIP_SCHED_CPU_AUTO	-2
+
+struct usbip_sched {
+	int set;
+	int cpu;
+	int policy;	/* SCHED_OTHER or SCHED_FIFO */
+	int prio;	/* nice, or the real-time priority */
+};
+
+int usbip_sched_parse(struct usbip_sched *sched, int opt, const char *arg);
+int usbip_sched_string(const struct usbip_sched *sched, char *buf,
+		       size_t size);
+#endif
+
 int usbip_names_init(char *);
 void usbip_names_free(void);
 void usbip_names_get_product(char *buff, size_t size, uint16_t vendor,
@@ -536,6 +536,28 @@ err_close_udev:
 	return ret;
 }
 
+int usbip_generic_set_sched(const char *busid, const char *sched)
+{
+	char attr_name[] = "usbip_sched";
+	char sched_attr_path[SYSFS_PATH_MAX];
+	int rc;
+
+	snprintf(sched_attr_path, sizeof(sched_attr_path), "%s/%s/%s/%s/%s/%s",
+		 SYSFS_MNT_PATH, SYSFS_BUS_NAME, SYSFS_BUS_TYPE, "devices",
+		 busid, attr_name);
+
+	rc = write_sysfs_attribute(sched_attr_path, sched, strlen(sched));
+	if (rc < 0) {
+		err("error setting %s of %s: %s", sched, busid,
+		    strerror(errno));
+		return -1;
+	}
+
+	info("sched of busid %s: %s", busid, sched);
+
+	return 0;
+}
+
 int usbip_generic_export_device(struct usbip_exported_device *edev,
 				struct usbip_sock *sock)
 {
@@ -563,7 +585,11 @@ int usbip_generic_export_device(struct usbip_exported_device *edev,
 	snprintf(sockfd_attr_path, sizeof(sockfd_attr_path), "%s/%s",
 		 edev->udev.path, attr_name);
 
-	snprintf(sockfd_buff, sizeof(sockfd_buff), "%d\n", sock->fd);
+	if (sock->features)
+		snprintf(sockfd_buff, sizeof(sockfd_buff), "%d %x\n",
+			 sock->fd, sock->features);
+	else
+		snprintf(sockfd_buff, sizeof(sockfd_buff), "%d\n", sock->fd);
 
 	ret = write_sysfs_attribute(sockfd_attr_path, sockfd_buff,
 				    strlen(sockfd_buff));
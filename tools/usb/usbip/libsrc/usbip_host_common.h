@@ -56,6 +56,7 @@ struct usbip_host_driver_ops {
 	int (*list_devices)(struct usbip_usb_device **udevs);
 	int (*bind_device)(const char *busid);
 	int (*unbind_device)(const char *busid);
+	int (*set_sched)(const char *busid, const char *sched);
 	int (*export_device)(struct usbip_exported_device *edev,
 			struct usbip_sock *sock);
 	int (*try_transfer)(struct usbip_exported_device *edev,
@@ -72,6 +73,8 @@ struct usbip_host_driver_ops {
 struct usbip_host_driver {
 	const char *udev_subsystem;
 	struct usbip_host_driver_ops ops;
+	/* protocol extensions the kernel driver accepts */
+	uint32_t features;
 };
 
 extern struct usbip_host_driver *usbip_hdriver;
@@ -137,6 +140,14 @@ static inline int usbip_list_devices(struct usbip_usb_device **udevs)
 	return usbip_hdriver->ops.list_devices(udevs);
 }
 
+/* places the kernel threads of a bound device, see usbip_sched_string() */
+static inline int usbip_set_sched(const char *busid, const char *sched)
+{
+	if (!usbip_hdriver->ops.set_sched)
+		return -EOPNOTSUPP;
+	return usbip_hdriver->ops.set_sched(busid, sched);
+}
+
 static inline int usbip_export_device(struct usbip_exported_device *edev,
 				      struct usbip_sock *sock)
 {
@@ -171,6 +182,7 @@ struct usbip_exported_device *usbip_generic_get_device(
 int usbip_generic_list_devices(struct usbip_usb_device **udevs);
 int usbip_generic_bind_device(const char *busid);
 int usbip_generic_unbind_device(const char *busid);
+int usbip_generic_set_sched(const char *busid, const char *sched);
 int usbip_generic_export_device(
 			struct usbip_exported_device *edev,
 			struct usbip_sock *sock);
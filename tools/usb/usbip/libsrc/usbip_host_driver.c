@@ -58,6 +58,7 @@ struct usbip_host_driver host_driver = {
 		.list_devices = usbip_generic_list_devices,
 		.bind_device = usbip_generic_bind_device,
 		.unbind_device = usbip_generic_unbind_device,
+		.set_sched = usbip_generic_set_sched,
 		.export_device = usbip_generic_export_device,
 		.try_transfer = usbip_generic_try_transfer,
 		.has_transferred = usbip_generic_has_transferred,
@@ -65,6 +66,10 @@ struct usbip_host_driver host_driver = {
 		.read_interface = read_usb_interface,
 		.is_my_device = is_my_device,
 	},
+	.features = USBIP_FEAT_STREAMS | USBIP_FEAT_CHUNKED |
+		    USBIP_FEAT_INT_POLL | USBIP_FEAT_ISO_COMPACT |
+		    USBIP_FEAT_HEARTBEAT | USBIP_FEAT_TIMESTAMPS |
+		    USBIP_FEAT_COMPACT_HDR | USBIP_FEAT_COMPRESS,
 };
 
 struct usbip_host_driver *usbip_hdriver = &host_driver;
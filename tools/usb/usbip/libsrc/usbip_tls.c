@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Encryption of connections by kernel TLS.
+ *
+ * OpenSSL makes the handshake and, asked by SSL_OP_ENABLE_KTLS, installs
+ * the keys of both directions on the socket with TCP_ULP "tls". From then
+ * the kernel encrypts what is written to the socket and decrypts what is
+ * read from it, so the rest of the requests and the transfers of
+ * usbip-host and vhci-hcd go over it as on a plain socket. The SSL object
+ * is dropped after the handshake, without close_notify which the drivers
+ * would not understand.
+ *
+ * Only TLS 1.2 with AES-GCM is offered, which the kernel takes in both
+ * directions and runs with AES-NI where available. Without kernel TLS on
+ * the socket, the connection is refused rather than left to a userspace
+ * relay.
+ */
+
+#include "usbip_common.h"
+#include "usbip_tls.h"
+
+#ifdef HAVE_KTLS
+#include <arpa/inet.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#define TLS_CIPHERS	"ECDHE+AESGCM"
+
+static struct {
+	int enabled;
+	int server;
+	SSL_CTX *ctx;
+} tls;
+
+static void tls_err(const char *what)
+{
+	unsigned long e;
+	char buf[256];
+
+	e = ERR_get_error();
+	if (e) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		err("%s: %s", what, buf);
+	} else {
+		err("%s", what);
+	}
+	ERR_clear_error();
+}
+
+static int tls_ctx_setup(const char *ca, const char *cert, const char *key)
+{
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(tls.server ? TLS_server_method() :
+				       TLS_client_method());
+	if (!ctx) {
+		tls_err("tls context");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_COMPRESSION |
+				 SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET);
+	if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS)) {
+		tls_err("tls ciphers");
+		goto err_out;
+	}
+
+	if (cert) {
+		if (!SSL_CTX_use_certificate_chain_file(ctx, cert) ||
+		    !SSL_CTX_use_PrivateKey_file(ctx, key ? key : cert,
+						 SSL_FILETYPE_PEM) ||
+		    !SSL_CTX_check_private_key(ctx)) {
+			tls_err(cert);
+			goto err_out;
+		}
+	} else if (tls.server) {
+		err("tls needs cert= on the server");
+		goto err_out;
+	}
+
+	if (ca) {
+		if (!SSL_CTX_load_verify_locations(ctx, ca, NULL)) {
+			tls_err(ca);
+			goto err_out;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER |
+				   SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	} else if (!tls.server) {
+		if (!SSL_CTX_set_default_verify_paths(ctx)) {
+			tls_err("tls trust store");
+			goto err_out;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	tls.ctx = ctx;
+	return 0;
+
+err_out:
+	SSL_CTX_free(ctx);
+	return -1;
+}
+
+int usbip_tls_setup(const char *spec, int server)
+{
+	char *buf, *tok, *val, *save = NULL;
+	char *ca = NULL, *cert = NULL, *key = NULL;
+	int ret = -1;
+
+	buf = strdup(spec);
+	if (!buf) {
+		err("alloc");
+		return -1;
+	}
+
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "default"))
+			continue;
+
+		val = strchr(tok, '=');
+		if (!val || !val[1])
+			goto err_spec;
+		*val++ = '\0';
+
+		if (!strcmp(tok, "ca"))
+			ca = val;
+		else if (!strcmp(tok, "cert"))
+			cert = val;
+		else if (!strcmp(tok, "key"))
+			key = val;
+		else
+			goto err_spec;
+	}
+
+	tls.server = server;
+	ret = tls_ctx_setup(ca, cert, key);
+	if (!ret) {
+		tls.enabled = 1;
+		dbg("tls ca %s cert %s key %s", ca ? ca : "(system)",
+		    cert ? cert : "(none)", key ? key : "(cert)");
+	}
+	free(buf);
+	return ret;
+
+err_spec:
+	free(buf);
+	err("invalid tls setting %s", spec);
+	return -1;
+}
+
+int usbip_tls_enabled(void)
+{
+	return tls.enabled;
+}
+
+static int tls_handshake(int fd, const char *host)
+{
+	unsigned char addr[16];
+	SSL *ssl;
+	int ret = -1;
+
+	ssl = SSL_new(tls.ctx);
+	if (!ssl) {
+		tls_err("tls session");
+		return -1;
+	}
+
+	if (!SSL_set_fd(ssl, fd)) {
+		tls_err("tls socket");
+		goto out;
+	}
+
+	if (host) {
+		if (inet_pton(AF_INET, host, addr) == 1 ||
+		    inet_pton(AF_INET6, host, addr) == 1) {
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+						      host);
+		} else {
+			SSL_set_tlsext_host_name(ssl, host);
+			SSL_set1_host(ssl, host);
+		}
+		if (SSL_connect(ssl) != 1) {
+			tls_err("tls handshake");
+			goto out;
+		}
+	} else if (SSL_accept(ssl) != 1) {
+		tls_err("tls handshake");
+		goto out;
+	}
+
+	/* the drivers can only be given a socket the kernel decrypts */
+	if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+	    !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		err("kernel tls not available for %s, is the tls module loaded?",
+		    SSL_get_cipher(ssl));
+		goto out;
+	}
+
+	dbg("tls %s %s on %d", SSL_get_version(ssl), SSL_get_cipher(ssl), fd);
+	ret = 0;
+out:
+	SSL_free(ssl);
+	return ret;
+}
+
+int usbip_tls_connect(int fd, const char *host)
+{
+	return tls_handshake(fd, host);
+}
+
+int usbip_tls_accept(int fd)
+{
+	return tls_handshake(fd, NULL);
+}
+#else
+int usbip_tls_setup(const char *spec UNUSED, int server UNUSED)
+{
+	err("not built with kernel tls, see configure --with-tls");
+	return -1;
+}
+
+int usbip_tls_enabled(void)
+{
+	return 0;
+}
+
+int usbip_tls_connect(int fd UNUSED, const char *host UNUSED)
+{
+	return -1;
+}
+
+int usbip_tls_accept(int fd UNUSED)
+{
+	return -1;
+}
+#endif /* !HAVE_KTLS */
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Encryption of connections by kernel TLS.
+ */
+
+#ifndef __USBIP_TLS_H
+#define __USBIP_TLS_H
+
+/*
+ * spec is "default" or a comma separated list of
+ *   ca=<file>    certificates to verify the peer with, PEM
+ *   cert=<file>  certificate chain of this side, PEM
+ *   key=<file>   its private key, PEM, cert by default
+ *
+ * The server needs cert, and asks clients for a certificate when ca is
+ * given. The client always verifies the server, by the default trust
+ * store of the system without ca.
+ */
+int usbip_tls_setup(const char *spec, int server);
+int usbip_tls_enabled(void);
+
+/*
+ * Handshake on a TCP socket and hand the keys to the kernel, so that the
+ * socket reads and writes plaintext, also from usbip-host and vhci-hcd.
+ * host is the name the certificate of the server must match.
+ */
+int usbip_tls_connect(int fd, const char *host);
+int usbip_tls_accept(int fd);
+
+#endif /* !__USBIP_TLS_H */
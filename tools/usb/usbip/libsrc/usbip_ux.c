@@ -25,6 +25,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include "usbip_common.h"
+#include "usbip_capture.h"
 #include "usbip_ux.h"
 
 #undef  PROGNAME
@@ -84,6 +85,7 @@ static void *usbip_ux_rx(void *arg)
 			break;
 		}
 		dump_buff(buf, received, "ux received");
+		usbip_capture(ux->sock, 0, buf, received);
 		written = 0;
 		while (written < received) {
 			ret = write(ux->devfd, buf+written, received-written);
@@ -127,7 +129,9 @@ static void *usbip_ux_tx(void *arg)
 		if (sent < 0) {
 			dbg("connection closed on sock:%s", ux->kaddr.sock);
 			break;
-		} else if (sent < reads) {
+		}
+		usbip_capture(ux->sock, USBIP_CAPTURE_SENT, buf, sent);
+		if (sent < reads) {
 			dbg("send error on sock:%s %zd < %zd", ux->kaddr.sock,
 				sent, reads);
 			break;
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Emulation of a wide area network on connections.
+ *
+ * A connection is relayed through a socketpair whose other end is handed
+ * to the caller, so the emulation also applies when the descriptor is
+ * transferred to the kernel. The relay runs in a process of its own which
+ * outlives usbip attach and the usbipd child, or in a thread when fork is
+ * not available.
+ *
+ * Data read from one side is queued with the time it is due on the other.
+ * Queued data is released in order: a delayed or stalled chunk holds back
+ * the ones behind it, as a lost segment does on TCP.
+ */
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbip_common.h"
+#include "usbip_wan.h"
+
+#define WAN_CHUNK	16384
+#define WAN_QUEUE_MAX	(4 * 1024 * 1024)
+#define WAN_SEGMENT	1448
+#define WAN_STALL	200 /* ms */
+
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+static struct {
+	int enabled;
+	uint64_t delay;		/* ns */
+	uint64_t jitter;	/* ns */
+	uint64_t stall;		/* ns */
+	uint64_t rate;		/* bit/s, 0 for unlimited */
+	double loss;		/* probability for a segment */
+} wan = {
+	.stall = WAN_STALL * NSEC_PER_MSEC,
+};
+
+struct wan_chunk {
+	struct wan_chunk *next;
+	uint64_t due;
+	size_t len;
+	size_t off;
+	char data[];
+};
+
+struct wan_dir {
+	int src;
+	int dst;
+	struct wan_chunk *head, *tail;
+	size_t queued;
+	/* when the emulated link has sent what is queued */
+	uint64_t link_free;
+	uint64_t last_due;
+	int eof;
+	int done;
+};
+
+int usbip_wan_setup(const char *spec)
+{
+	char *buf, *tok, *val, *end, *save = NULL;
+	double v;
+
+	buf = strdup(spec);
+	if (!buf) {
+		err("alloc");
+		return -1;
+	}
+
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val)
+			goto err_out;
+		*val++ = '\0';
+		v = strtod(val, &end);
+		if (end == val || *end || v < 0)
+			goto err_out;
+
+		if (!strcmp(tok, "delay"))
+			wan.delay = v * NSEC_PER_MSEC;
+		else if (!strcmp(tok, "rtt"))
+			wan.delay = v * NSEC_PER_MSEC / 2;
+		else if (!strcmp(tok, "jitter"))
+			wan.jitter = v * NSEC_PER_MSEC;
+		else if (!strcmp(tok, "rate"))
+			wan.rate = v * 1000;
+		else if (!strcmp(tok, "loss") && v <= 100)
+			wan.loss = v / 100;
+		else if (!strcmp(tok, "stall"))
+			wan.stall = v * NSEC_PER_MSEC;
+		else
+			goto err_out;
+	}
+
+	free(buf);
+	wan.enabled = 1;
+	dbg("wan delay %lluns jitter %lluns rate %llubps loss %f stall %lluns",
+	    (unsigned long long)wan.delay, (unsigned long long)wan.jitter,
+	    (unsigned long long)wan.rate, wan.loss,
+	    (unsigned long long)wan.stall);
+	return 0;
+
+err_out:
+	free(buf);
+	err("invalid wan emulation %s", spec);
+	return -1;
+}
+
+static uint64_t wan_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t wan_due(struct wan_dir *d, size_t len, unsigned int *seed)
+{
+	uint64_t now = wan_now(), due;
+	size_t seg;
+
+	if (wan.rate) {
+		if (d->link_free < now)
+			d->link_free = now;
+		d->link_free += len * 8 * NSEC_PER_SEC / wan.rate;
+		due = d->link_free;
+	} else {
+		due = now;
+	}
+
+	due += wan.delay;
+	if (wan.jitter)
+		due += (double)rand_r(seed) / RAND_MAX * 2 * wan.jitter;
+	due -= wan.jitter;
+
+	for (seg = 0; wan.loss > 0 && seg < len; seg += WAN_SEGMENT) {
+		if (rand_r(seed) < wan.loss * RAND_MAX) {
+			due += wan.stall;
+			break;
+		}
+	}
+
+	if (due < d->last_due)
+		due = d->last_due;
+	d->last_due = due;
+
+	return due;
+}
+
+static void wan_read(struct wan_dir *d, unsigned int *seed)
+{
+	char buf[WAN_CHUNK];
+	struct wan_chunk *c;
+	ssize_t n;
+
+	n = read(d->src, buf, sizeof(buf));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		d->eof = 1;
+		return;
+	}
+
+	c = (struct wan_chunk *)malloc(sizeof(*c) + n);
+	if (!c) {
+		err("alloc");
+		d->eof = 1;
+		return;
+	}
+	memcpy(c->data, buf, n);
+	c->next = NULL;
+	c->len = n;
+	c->off = 0;
+	c->due = wan_due(d, n, seed);
+
+	if (d->tail)
+		d->tail->next = c;
+	else
+		d->head = c;
+	d->tail = c;
+	d->queued += n;
+}
+
+static int wan_write(struct wan_dir *d)
+{
+	struct wan_chunk *c;
+	uint64_t now = wan_now();
+	ssize_t n;
+
+	while ((c = d->head) && c->due <= now) {
+		n = send(d->dst, c->data + c->off, c->len - c->off,
+			 MSG_NOSIGNAL);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+		c->off += n;
+		if (c->off < c->len)
+			return 0;
+
+		d->head = c->next;
+		if (!d->head)
+			d->tail = NULL;
+		d->queued -= c->len;
+		free(c);
+	}
+
+	return 0;
+}
+
+static void wan_relay(int net, int local)
+{
+	struct wan_dir dirs[2], *d;
+	struct pollfd pfd[4];
+	struct wan_chunk *c;
+	unsigned int seed = time(NULL) ^ getpid();
+	uint64_t now, ms;
+	int timeout, i;
+
+	memset(dirs, 0, sizeof(dirs));
+	dirs[0].src = net;
+	dirs[0].dst = local;
+	dirs[1].src = local;
+	dirs[1].dst = net;
+
+	fcntl(net, F_SETFL, fcntl(net, F_GETFL) | O_NONBLOCK);
+	fcntl(local, F_SETFL, fcntl(local, F_GETFL) | O_NONBLOCK);
+
+	for (;;) {
+		now = wan_now();
+		timeout = -1;
+
+		for (i = 0; i < 2; i++) {
+			d = dirs + i;
+
+			pfd[i * 2].fd = -1;
+			pfd[i * 2].events = POLLIN;
+			pfd[i * 2 + 1].fd = -1;
+			pfd[i * 2 + 1].events = POLLOUT;
+
+			if (!d->eof && d->queued < WAN_QUEUE_MAX)
+				pfd[i * 2].fd = d->src;
+
+			if (d->head && d->head->due <= now) {
+				pfd[i * 2 + 1].fd = d->dst;
+			} else if (d->head) {
+				ms = (d->head->due - now + NSEC_PER_MSEC - 1) /
+				     NSEC_PER_MSEC;
+				if (timeout < 0 || ms < (uint64_t)timeout)
+					timeout = ms;
+			} else if (d->eof && !d->done) {
+				/* pass the end of the stream on */
+				shutdown(d->dst, SHUT_WR);
+				d->done = 1;
+			}
+		}
+
+		if (dirs[0].done && dirs[1].done)
+			break;
+
+		if (poll(pfd, 4, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err("poll wan relay");
+			break;
+		}
+
+		for (i = 0; i < 2; i++) {
+			d = dirs + i;
+
+			if (pfd[i * 2].fd >= 0 && pfd[i * 2].revents)
+				wan_read(d, &seed);
+			if (pfd[i * 2 + 1].fd >= 0 && pfd[i * 2 + 1].revents &&
+			    wan_write(d))
+				goto out;
+		}
+	}
+out:
+	for (i = 0; i < 2; i++) {
+		while ((c = dirs[i].head)) {
+			dirs[i].head = c->next;
+			free(c);
+		}
+	}
+	close(net);
+	close(local);
+}
+
+#ifdef USBIP_OS_NO_FORK
+struct wan_relay_args {
+	int net;
+	int local;
+};
+
+static void *wan_relay_thread(void *arg)
+{
+	struct wan_relay_args *args = (struct wan_relay_args *)arg;
+
+	wan_relay(args->net, args->local);
+	free(args);
+	return NULL;
+}
+
+static int wan_start_relay(int net, int local, int caller UNUSED)
+{
+	struct wan_relay_args *args;
+	pthread_t thread;
+
+	args = (struct wan_relay_args *)malloc(sizeof(*args));
+	if (!args) {
+		err("alloc");
+		return -1;
+	}
+	args->net = net;
+	args->local = local;
+
+	if (pthread_create(&thread, NULL, wan_relay_thread, args)) {
+		err("create wan relay thread");
+		free(args);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+#else
+static int wan_start_relay(int net, int local, int caller)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err("fork wan relay");
+		return -1;
+	}
+	if (pid == 0) {
+		/* the end of the stream is seen once the caller has closed */
+		close(caller);
+		wan_relay(net, local);
+		_exit(0);
+	}
+	close(net);
+	close(local);
+	return 0;
+}
+#endif /* !USBIP_OS_NO_FORK */
+
+int usbip_wan_wrap(int fd)
+{
+	int sv[2];
+
+	if (!wan.enabled)
+		return fd;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		err("socketpair for wan relay");
+		return -1;
+	}
+
+	if (wan_start_relay(fd, sv[1], sv[0])) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	return sv[0];
+}
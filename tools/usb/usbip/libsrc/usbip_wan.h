@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Emulation of a wide area network on connections.
+ */
+
+#ifndef __USBIP_WAN_H
+#define __USBIP_WAN_H
+
+/*
+ * spec is a comma separated list of
+ *   delay=<ms>   one way delay, in each direction
+ *   rtt=<ms>     round trip time, delay of half of it
+ *   jitter=<ms>  random variation of the delay, up to +-ms
+ *   rate=<kbps>  bandwidth in each direction, kbit/s
+ *   loss=<%>     loss rate of 1448 bytes segments
+ *   stall=<ms>   time to retransmit a lost segment, 200 by default
+ */
+int usbip_wan_setup(const char *spec);
+
+/*
+ * Returns a descriptor to be used in place of fd, whose traffic goes
+ * through the emulated network, or fd itself if it is not set up.
+ */
+int usbip_wan_wrap(int fd);
+
+#endif /* !__USBIP_WAN_H */
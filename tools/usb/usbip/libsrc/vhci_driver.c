@@ -19,7 +19,13 @@ static struct udev_device *vhci_hc_device;
 static struct udev *udev_context;
 static int vhci_nports;
 
+enum hub_speed {
+	HUB_SPEED_HIGH = 0,
+	HUB_SPEED_SUPER,
+};
+
 struct usbip_vhci_device {
+	enum hub_speed hub;
 	int port;
 	uint32_t status;
 
@@ -107,6 +113,7 @@ static int parse_status_line(struct status_context *ctx,
 {
 	int port, status, speed, devid;
 	unsigned long socket;
+	char hub[3];
 	char lbusid[SYSFS_BUS_ID_SIZE];
 	int ret;
 
@@ -120,17 +127,22 @@ static int parse_status_line(struct status_context *ctx,
 		return -1;
 	}
 
-	ret = sscanf(ctx->c, "%d %d %d %x %lx %31s\n",
-				&port, &status, &speed,
+	ret = sscanf(ctx->c, "%2s  %d %d %d %x %lx %31s\n",
+				hub, &port, &status, &speed,
 				&devid, &socket, lbusid);
-	if (ret < 6) {
+	if (ret < 7) {
 		dbg("sscanf failed: %d", ret);
 		return -1;
 	}
 
-	dbg("port %d status %d speed %d devid %x", port, status, speed, devid);
+	dbg("hub %s port %d status %d speed %d devid %x",
+	    hub, port, status, speed, devid);
 	dbg("socket %lx lbusid %s", socket, lbusid);
 
+	if (!strncmp(hub, "ss", 2))
+		vdev->hub = HUB_SPEED_SUPER;
+	else
+		vdev->hub = HUB_SPEED_HIGH;
 	vdev->port	= port;
 	vdev->status	= status;
 	vdev->devid	= devid;
@@ -302,15 +314,21 @@ void usbip_vhci_driver_close(void)
 		udev_unref(udev_context);
 }
 
-int usbip_vhci_get_free_port(void)
+int usbip_vhci_get_free_port(uint32_t speed)
 {
 	struct status_context context;
 	struct usbip_vhci_device vdev;
+	enum hub_speed hub;
+
+	/* SuperSpeed devices go to the USB3 root hub, others to USB2 */
+	hub = (speed == USB_SPEED_SUPER) ? HUB_SPEED_SUPER : HUB_SPEED_HIGH;
 
 	if (open_status(&context, OPEN_MODE_FIRST))
 		return -1;
 
 	while (!parse_status_line(&context, &vdev)) {
+		if (vdev.hub != hub)
+			continue;
 		if (vdev.status == VDEV_ST_NULL) {
 			dbg("found free port %d", vdev.port);
 			close_status(&context);
@@ -352,7 +370,7 @@ int usbip_vhci_find_device(const char *host, const char *busid)
 }
 
 int usbip_vhci_attach_device2(int port, int sockfd, uint32_t devid,
-		uint32_t speed)
+		uint32_t speed, uint32_t features)
 {
 	char buff[200]; /* what size should be ? */
 	char attach_attr_path[SYSFS_PATH_MAX];
@@ -360,8 +378,12 @@ int usbip_vhci_attach_device2(int port, int sockfd, uint32_t devid,
 	const char *path;
 	int ret;
 
-	snprintf(buff, sizeof(buff), "%u %d %u %u",
-			port, sockfd, devid, speed);
+	if (features)
+		snprintf(buff, sizeof(buff), "%u %d %u %u %x",
+				port, sockfd, devid, speed, features);
+	else
+		snprintf(buff, sizeof(buff), "%u %d %u %u",
+				port, sockfd, devid, speed);
 	dbg("writing: %s", buff);
 
 	path = udev_device_get_syspath(vhci_hc_device);
@@ -387,11 +409,72 @@ static unsigned long get_devid(uint8_t busnum, uint8_t devnum)
 
 /* will be removed */
 int usbip_vhci_attach_device(int port, int sockfd, uint8_t busnum,
-		uint8_t devnum, uint32_t speed)
+		uint8_t devnum, uint32_t speed, uint32_t features)
 {
 	int devid = get_devid(busnum, devnum);
 
-	return usbip_vhci_attach_device2(port, sockfd, devid, speed);
+	return usbip_vhci_attach_device2(port, sockfd, devid, speed,
+					 features);
+}
+
+int usbip_vhci_set_sched(int port, const char *sched)
+{
+	char sched_attr_path[SYSFS_PATH_MAX];
+	char attr_sched[] = "sched";
+	char buff[200]; /* what size should be ? */
+	const char *path;
+	int ret;
+
+	snprintf(buff, sizeof(buff), "%u %s", port, sched);
+	dbg("writing: %s", buff);
+
+	path = udev_device_get_syspath(vhci_hc_device);
+	snprintf(sched_attr_path, sizeof(sched_attr_path), "%s/%s",
+		 path, attr_sched);
+
+	ret = write_sysfs_attribute(sched_attr_path, buff, strlen(buff));
+	if (ret < 0) {
+		dbg("write_sysfs_attribute failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* returns -1 if the port is not in use or has no heartbeat */
+int usbip_vhci_get_rtt(int port, struct usbip_vhci_rtt *rtt)
+{
+	char rtt_attr_path[SYSFS_PATH_MAX];
+	char attr_rtt[] = "rtt";
+	char buff[200];
+	const char *path;
+	FILE *fp;
+	int p, ret = -1;
+
+	/* read at each call, udev caches attribute values */
+	path = udev_device_get_syspath(vhci_hc_device);
+	snprintf(rtt_attr_path, sizeof(rtt_attr_path), "%s/%s",
+		 path, attr_rtt);
+
+	fp = fopen(rtt_attr_path, "r");
+	if (!fp) {
+		dbg("open %s: %s", rtt_attr_path, strerror(errno));
+		return -1;
+	}
+
+	/* the first line is a header */
+	while (fgets(buff, sizeof(buff), fp)) {
+		if (sscanf(buff, "%d %lld %lld %lld %u", &p, &rtt->srtt,
+			   &rtt->rttvar, &rtt->last, &rtt->misses) != 5)
+			continue;
+		if (p == port) {
+			ret = 0;
+			break;
+		}
+	}
+
+	fclose(fp);
+	return ret;
 }
 
 int usbip_vhci_detach_device(int port)
@@ -12,16 +12,32 @@
 
 #define USBIP_VHCI_BUS_TYPE "platform"
 
+/* protocol extensions vhci_hcd accepts at attach */
+#define USBIP_VHCI_FEATURES (USBIP_FEAT_STREAMS | USBIP_FEAT_CHUNKED | \
+			     USBIP_FEAT_INT_POLL | USBIP_FEAT_ISO_COMPACT | \
+			     USBIP_FEAT_HEARTBEAT | USBIP_FEAT_TIMESTAMPS | \
+			     USBIP_FEAT_COMPACT_HDR | USBIP_FEAT_COMPRESS)
+
+/* round trip times of the heartbeat of a port, in microseconds */
+struct usbip_vhci_rtt {
+	long long srtt;
+	long long rttvar;
+	long long last;
+	unsigned int misses;
+};
+
 int usbip_vhci_driver_open(void);
 void usbip_vhci_driver_close(void);
 
-int usbip_vhci_get_free_port(void);
+int usbip_vhci_get_free_port(uint32_t speed);
 int usbip_vhci_find_device(const char *host, const char *busid);
 
 /* will be removed */
 int usbip_vhci_attach_device(int port, int sockfd, uint8_t busnum,
-			     uint8_t devnum, uint32_t speed);
+			     uint8_t devnum, uint32_t speed, uint32_t features);
 int usbip_vhci_detach_device(int port);
+int usbip_vhci_set_sched(int port, const char *sched);
+int usbip_vhci_get_rtt(int port, struct usbip_vhci_rtt *rtt);
 
 int usbip_vhci_create_record(const char *host, const char *port,
 			     const char *busid, int rhport);
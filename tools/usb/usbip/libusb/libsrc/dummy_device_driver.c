@@ -72,6 +72,7 @@ struct usbip_host_driver device_driver = {
 		dummy_list_devices,
 		NULL, /* bind */
 		NULL, /* unbind */
+		NULL, /* set_sched */
 		dummy_export_device,
 		NULL, /* transfer */
 		NULL, /* has_transferred */
@@ -176,6 +176,10 @@ enum usbip_device_status {
 	VDEV_ST_ERROR
 };
 
+/* protocol extensions answered by stub-libusb, see USBIP_FEAT_* */
+#define USBIP_FEAT_HEARTBEAT	0x00000010
+#define USBIP_FEAT_COMPACT_HDR	0x00000040
+
 #define socket_start() \
 	do { \
 		WSADATA wsa; \
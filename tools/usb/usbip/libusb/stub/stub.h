@@ -79,9 +79,26 @@ struct stub_device {
 	struct list_head unlink_tx;
 	struct list_head unlink_free;
 
+	/* last USBIP_NOP to answer, also locked by priv_lock */
+	int nop_echo;
+	uint32_t nop_seqnum;
+	uint64_t nop_stamp;
+
 	pthread_mutex_t tx_waitq;
 	int should_stop;
 
+	/*
+	 * Special requests run by stub_tweak_loop() and transfers held
+	 * behind them, by tweak_entry, also locked by priv_lock. tweak_busy
+	 * has the endpoints of those and of tweak_cur, the one running, see
+	 * stub_tweak_ep().
+	 */
+	struct list_head tweak_list;
+	struct stub_priv *tweak_cur;
+	uint32_t tweak_busy;
+	pthread_cond_t tweak_cond;
+	pthread_t tweak;
+
 	struct stub_interface ifs[];
 };
 
@@ -94,6 +111,11 @@ struct stub_priv {
 
 	uint8_t dir;
 	uint8_t unlinking;
+
+	/* in sdev->tweak_list, with the endpoints it holds back */
+	uint8_t tweak_queued;
+	uint32_t tweak_mask;
+	struct list_head tweak_entry;
 };
 
 struct stub_unlink {
@@ -122,6 +144,7 @@ struct stub_edev_data {
 
 /* stub_rx.c */
 void *stub_rx_loop(void *data);
+void *stub_tweak_loop(void *data);
 
 /* stub_tx.c */
 void stub_enqueue_ret_unlink(struct stub_device *sdev, uint32_t seqnum,
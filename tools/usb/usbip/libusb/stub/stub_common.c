@@ -26,6 +26,7 @@
 #include <errno.h>
 
 #include "stub.h"
+#include "usbip_capture.h"
 
 #ifdef CONFIG_USBIP_DEBUG
 unsigned long usbip_debug_flag = 0xffffffff;
@@ -367,6 +368,9 @@ void usbip_dump_header(struct usbip_header *pdu)
 	case USBIP_NOP:
 		pr_debug("USBIP_NOP\n");
 		break;
+	case USBIP_RET_NOP:
+		pr_debug("USBIP_RET_NOP\n");
+		break;
 	default:
 		/* NOT REACHED */
 		pr_err("unknown command\n");
@@ -410,6 +414,8 @@ int usbip_sendmsg(struct usbip_device *ud, struct kvec *vec, size_t num)
 				result, total);
 			return total;
 		}
+		usbip_capture(ud->sock, USBIP_CAPTURE_SENT, iov->iov_base,
+			      result);
 		total += result;
 	}
 	return total;
@@ -448,6 +454,7 @@ int usbip_recv(struct usbip_device *ud, void *buf, int size)
 				result, total);
 			goto err;
 		}
+		usbip_capture(ud->sock, 0, bp, result);
 
 		size -= result;
 		bp += result;
@@ -626,6 +633,8 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 		correct_endian_ret_unlink(&pdu->u.ret_unlink, send);
 		break;
 	case USBIP_NOP:
+	case USBIP_RET_NOP:
+		/* the stamp is opaque, echoed as received */
 		break;
 	default:
 		/* NOT REACHED */
@@ -634,6 +643,221 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send)
 	}
 }
 
+/*
+ * Layout of the union in compact headers, by command: the number of
+ * uint32_t sent as varints, the signed ones among them and the ones which
+ * are seqnums, and the bytes sent as they are after them.
+ */
+static const struct {
+	uint8_t words;
+	uint8_t sign;
+	uint8_t seqnum;
+	uint8_t raw;
+} usbip_compact_hdr_layout[8] = {
+	{ 0, 0x00, 0x00, 8 },	/* USBIP_NOP */
+	{ 5, 0x1e, 0x00, 8 },	/* USBIP_CMD_SUBMIT */
+	{ 1, 0x00, 0x01, 0 },	/* USBIP_CMD_UNLINK */
+	{ 5, 0x1f, 0x00, 0 },	/* USBIP_RET_SUBMIT */
+	{ 1, 0x01, 0x00, 0 },	/* USBIP_RET_UNLINK */
+	{ 5, 0x1f, 0x00, 0 },	/* USBIP_RET_SUBMIT_CHUNK */
+	{ 5, 0x1f, 0x00, 0 },	/* USBIP_RET_POLL */
+	{ 0, 0x00, 0x00, 8 },	/* USBIP_RET_NOP */
+};
+
+#define USBIP_COMPACT_HDR_RAW	0x80
+
+static uint32_t usbip_zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t usbip_unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static uint8_t *usbip_put_varint(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+
+	return p;
+}
+
+static const uint8_t *usbip_get_varint(const uint8_t *p, const uint8_t *end,
+				       uint32_t *v)
+{
+	uint32_t val = 0;
+	int shift;
+
+	for (shift = 0; shift < 35 && p < end; shift += 7) {
+		val |= (uint32_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = val;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+static int usbip_compact_hdr_enabled(struct usbip_device *ud)
+{
+	return ud->sock && (ud->sock->features & USBIP_FEAT_COMPACT_HDR);
+}
+
+/* called when a connection is set up, before the rx and tx threads run */
+void usbip_compact_hdr_init(struct usbip_device *ud, uint32_t devid)
+{
+	ud->compact_hdr.devid = devid;
+	ud->compact_hdr.tx_seqnum = 0;
+	ud->compact_hdr.rx_seqnum = 0;
+}
+
+/*
+ * Turns a header in host byte order into what is sent, in place. Returns
+ * the size to send. Only called by the tx thread, in the order headers are
+ * sent.
+ */
+int usbip_header_encode(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	uint8_t buf[USBIP_COMPACT_HDR_MAX], *p = buf + 3;
+	uint32_t *word = (uint32_t *)&pdu->u;
+	uint8_t *raw;
+	uint32_t cmd = pdu->base.command & 0x07; /* all fit in 3 bits */
+	uint8_t present = 0;
+	uint32_t v;
+	int i, n;
+
+	if (!usbip_compact_hdr_enabled(ud)) {
+		usbip_header_correct_endian(pdu, 1);
+		return sizeof(*pdu);
+	}
+
+	p = usbip_put_varint(p, usbip_zigzag(pdu->base.seqnum -
+					     ud->compact_hdr.tx_seqnum));
+	ud->compact_hdr.tx_seqnum = pdu->base.seqnum;
+
+	for (i = 0; i < usbip_compact_hdr_layout[cmd].words; i++) {
+		if (!word[i])
+			continue;
+		v = word[i];
+		if (usbip_compact_hdr_layout[cmd].seqnum & (1 << i))
+			v = usbip_zigzag(pdu->base.seqnum - word[i]);
+		else if (usbip_compact_hdr_layout[cmd].sign & (1 << i))
+			v = usbip_zigzag(word[i]);
+		present |= 1 << i;
+		p = usbip_put_varint(p, v);
+	}
+
+	raw = (uint8_t *)&word[usbip_compact_hdr_layout[cmd].words];
+	for (n = 0; n < usbip_compact_hdr_layout[cmd].raw; n++)
+		if (raw[n])
+			break;
+	if (n < usbip_compact_hdr_layout[cmd].raw) {
+		present |= USBIP_COMPACT_HDR_RAW;
+		memcpy(p, raw, usbip_compact_hdr_layout[cmd].raw);
+		p += usbip_compact_hdr_layout[cmd].raw;
+	}
+
+	buf[0] = (uint8_t)(p - buf - 1);
+	buf[1] = (uint8_t)((cmd << 5) | ((pdu->base.direction & 1) << 4) |
+			   (pdu->base.ep & 0x0f));
+	buf[2] = present;
+
+	memcpy(pdu, buf, p - buf);
+	return (int)(p - buf);
+}
+
+static int usbip_header_decode(struct usbip_device *ud,
+			       struct usbip_header *pdu, const uint8_t *p,
+			       const uint8_t *end)
+{
+	uint32_t *word = (uint32_t *)&pdu->u;
+	uint32_t cmd = p[0] >> 5;
+	uint8_t present = p[1];
+	uint32_t v;
+	int i;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = cmd;
+	pdu->base.direction = (p[0] >> 4) & 1;
+	pdu->base.ep = p[0] & 0x0f;
+	pdu->base.devid = ud->compact_hdr.devid;
+	p += 2;
+
+	p = usbip_get_varint(p, end, &v);
+	if (!p)
+		return -1;
+	pdu->base.seqnum = ud->compact_hdr.rx_seqnum + usbip_unzigzag(v);
+	ud->compact_hdr.rx_seqnum = pdu->base.seqnum;
+
+	for (i = 0; i < usbip_compact_hdr_layout[cmd].words; i++) {
+		if (!(present & (1 << i)))
+			continue;
+		p = usbip_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		if (usbip_compact_hdr_layout[cmd].seqnum & (1 << i))
+			v = pdu->base.seqnum - usbip_unzigzag(v);
+		else if (usbip_compact_hdr_layout[cmd].sign & (1 << i))
+			v = usbip_unzigzag(v);
+		word[i] = v;
+	}
+
+	if (present & USBIP_COMPACT_HDR_RAW) {
+		if (end - p < usbip_compact_hdr_layout[cmd].raw)
+			return -1;
+		memcpy(&word[usbip_compact_hdr_layout[cmd].words], p,
+		       usbip_compact_hdr_layout[cmd].raw);
+		p += usbip_compact_hdr_layout[cmd].raw;
+	}
+
+	return p == end ? 0 : -1;
+}
+
+/*
+ * Receives a header, compact or not, into host byte order. Returns
+ * sizeof(*pdu) once it is, or what usbip_recv() returned on an error.
+ */
+int usbip_recv_header(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	uint8_t buf[USBIP_COMPACT_HDR_MAX];
+	int ret;
+
+	if (!usbip_compact_hdr_enabled(ud)) {
+		ret = usbip_recv(ud, pdu, sizeof(*pdu));
+		if (ret == sizeof(*pdu))
+			usbip_header_correct_endian(pdu, 0);
+		return ret;
+	}
+
+	ret = usbip_recv(ud, buf, 1);
+	if (ret != 1)
+		return ret;
+
+	if (buf[0] < 3 || buf[0] >= sizeof(buf)) {
+		pr_err("invalid compact header size %u\n", buf[0]);
+		errno = EPROTO;
+		return -1;
+	}
+
+	ret = usbip_recv(ud, buf + 1, buf[0]);
+	if (ret != buf[0])
+		return ret < 0 ? ret : -1;
+
+	if (usbip_header_decode(ud, pdu, buf + 1, buf + 1 + buf[0])) {
+		pr_err("invalid compact header\n");
+		errno = EPROTO;
+		return -1;
+	}
+
+	return sizeof(*pdu);
+}
+
 static void usbip_iso_packet_correct_endian(
 		struct usbip_iso_packet_descriptor *iso, int send)
 {
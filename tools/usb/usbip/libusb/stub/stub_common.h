@@ -214,12 +214,19 @@ enum {
  *  - USBIP_RET_UNLINK: the result of USBIP_CMD_UNLINK
  *    (server to client)
  *
+ *  - USBIP_NOP: a heartbeat of USBIP_FEAT_HEARTBEAT
+ *    (client to server)
+ *
+ *  - USBIP_RET_NOP: the answer to USBIP_NOP
+ *    (server to client)
+ *
  */
 #define USBIP_NOP		0x0000
 #define USBIP_CMD_SUBMIT	0x0001
 #define USBIP_CMD_UNLINK	0x0002
 #define USBIP_RET_SUBMIT	0x0003
 #define USBIP_RET_UNLINK	0x0004
+#define USBIP_RET_NOP		0x0007
 
 #define USBIP_DIR_OUT	0x00
 #define USBIP_DIR_IN	0x01
@@ -300,6 +307,15 @@ struct usbip_header_ret_unlink {
 	uint32_t status;
 };
 
+/**
+ * struct usbip_header_nop - USBIP_NOP and USBIP_RET_NOP packet header
+ * @stamp: opaque to the server, echoed back as received
+ */
+#pragma pack(4)
+struct usbip_header_nop {
+	uint64_t stamp;
+};
+
 /**
  * struct usbip_header - common header for all usbip packets
  * @base: the basic header
@@ -314,9 +330,36 @@ struct usbip_header {
 		struct usbip_header_ret_submit	ret_submit;
 		struct usbip_header_cmd_unlink	cmd_unlink;
 		struct usbip_header_ret_unlink	ret_unlink;
+		struct usbip_header_nop		nop;
 	} u;
 };
 
+/*
+ * With USBIP_FEAT_COMPACT_HDR, struct usbip_header is sent as
+ *
+ *   uint8_t size      bytes of the header following this one
+ *   uint8_t type      command in bits 5-7, direction in bit 4, ep in 0-3
+ *   uint8_t present   bit n set when the n-th uint32_t of the union is not
+ *                     0, bit 7 when the trailing bytes are there
+ *   varint            seqnum, as the difference to the previous header
+ *                     sent on the connection in the same direction
+ *   varint[]          the uint32_t of the union which are present
+ *   uint8_t[8]        the setup packet of CMD_SUBMIT, or the stamp of NOP
+ *                     and RET_NOP, if present
+ *
+ * Varints are unsigned LEB128. Signed fields and the seqnum difference are
+ * zigzag encoded, the seqnum of CMD_UNLINK is sent as its difference to the
+ * seqnum of the header. devid is implied by the connection.
+ */
+#define USBIP_COMPACT_HDR_MAX	(3 + 5 + 5 * 5 + 8)
+
+/* USBIP_FEAT_COMPACT_HDR state of a connection */
+struct usbip_compact_hdr {
+	uint32_t devid;		/* of the headers received */
+	uint32_t tx_seqnum;	/* of the last header sent, by tx thread */
+	uint32_t rx_seqnum;	/* of the last header received, by rx thread */
+};
+
 /*
  * This is the same as usb_iso_packet_descriptor but packed for pdu.
  */
@@ -359,6 +402,9 @@ struct usbip_device {
 
 	struct usbip_sock *sock;
 
+	/* reset with the connection, see usbip_compact_hdr_init() */
+	struct usbip_compact_hdr compact_hdr;
+
 	unsigned long event;
 	pthread_t eh;
 	pthread_mutex_t eh_waitq;
@@ -385,6 +431,9 @@ void usbip_pack_ret_submit(struct usbip_header *pdu,
 void usbip_pack_ret_unlink(struct usbip_header *pdu,
 				struct stub_unlink *unlink);
 void usbip_header_correct_endian(struct usbip_header *pdu, int send);
+void usbip_compact_hdr_init(struct usbip_device *ud, uint32_t devid);
+int usbip_header_encode(struct usbip_device *ud, struct usbip_header *pdu);
+int usbip_recv_header(struct usbip_device *ud, struct usbip_header *pdu);
 
 struct usbip_iso_packet_descriptor*
 usbip_alloc_iso_desc_pdu(struct libusb_transfer *trx, ssize_t *bufflen);
@@ -121,6 +121,7 @@ static uint32_t get_device_speed(libusb_device *dev)
 	case LIBUSB_SPEED_HIGH:
 		return USB_SPEED_HIGH;
 	case LIBUSB_SPEED_SUPER:
+		return USB_SPEED_SUPER;
 	default:
 		dbg("unknown speed enum %d", speed);
 	}
@@ -219,7 +220,7 @@ static void fill_stub_endpoints(struct stub_endpoint *ep,
 		for (j = 0; j < intf->num_altsetting; j++) {
 			idesc = intf->altsetting + j;
 			for (k = 0; k < idesc->bNumEndpoints; k++) {
-				fill_stub_endpoint(ep + num,
+				fill_stub_endpoint(ep + num++,
 						   idesc->endpoint + k);
 			}
 		}
@@ -590,6 +591,9 @@ static void stub_shutdown(struct usbip_device *ud)
 	sdev->should_stop = 1;
 	usbip_stop_eh(&sdev->ud);
 	pthread_mutex_unlock(&sdev->tx_waitq);
+	pthread_mutex_lock(&sdev->priv_lock);
+	pthread_cond_signal(&sdev->tweak_cond);
+	pthread_mutex_unlock(&sdev->priv_lock);
 	/* rx will exit by disconnect */
 }
 
@@ -689,6 +693,8 @@ static struct stub_device *stub_device_new(struct usbip_exported_device *edev)
 	INIT_LIST_HEAD(&sdev->unlink_free);
 	pthread_mutex_init(&sdev->tx_waitq, NULL);
 	pthread_mutex_lock(&sdev->tx_waitq);
+	INIT_LIST_HEAD(&sdev->tweak_list);
+	pthread_cond_init(&sdev->tweak_cond, NULL);
 
 	return sdev;
 }
@@ -698,6 +704,7 @@ static void stub_device_delete(struct stub_device *sdev)
 	clear_usbip_device(&sdev->ud);
 	pthread_mutex_destroy(&sdev->priv_lock);
 	pthread_mutex_destroy(&sdev->tx_waitq);
+	pthread_cond_destroy(&sdev->tweak_cond);
 	free(sdev);
 }
 
@@ -800,6 +807,7 @@ static int stub_export_device(struct usbip_exported_device *edev,
 	}
 
 	sdev->ud.sock = sock;
+	usbip_compact_hdr_init(&sdev->ud, sdev->devid);
 
 	return 0;
 
@@ -835,6 +843,10 @@ static int stub_start(struct stub_device *sdev)
 		err("start send thread");
 		return -1;
 	}
+	if (pthread_create(&sdev->tweak, NULL, stub_tweak_loop, sdev)) {
+		err("start special request thread");
+		return -1;
+	}
 	pthread_mutex_lock(&sdev->ud.lock);
 	sdev->ud.status = SDEV_ST_USED;
 	pthread_mutex_unlock(&sdev->ud.lock);
@@ -850,6 +862,7 @@ static void stub_join(struct stub_device *sdev)
 	usbip_join_eh(&sdev->ud);
 	pthread_join(sdev->tx, NULL);
 	pthread_join(sdev->rx, NULL);
+	pthread_join(sdev->tweak, NULL);
 }
 
 static int stub_try_transfer(struct usbip_exported_device *edev,
@@ -889,13 +902,15 @@ struct usbip_host_driver host_driver = {
 		stub_list_devices,
 		stub_bind_device,
 		stub_unbind_device,
+		NULL, /* set_sched */
 		stub_export_device,
 		stub_try_transfer,
 		stub_has_transferred,
 		NULL, /* read_device */
 		NULL, /* read_interface */
 		NULL  /* is_my_device */
-	}
+	},
+	USBIP_FEAT_HEARTBEAT | USBIP_FEAT_COMPACT_HDR
 };
 
 struct usbip_host_driver *usbip_hdriver = &host_driver;
@@ -205,6 +205,223 @@ static void tweak_special_requests(struct libusb_transfer *trx)
 		usbip_dbg_stub_rx("no need to tweak\n");
 }
 
+static void masking_bogus_flags(struct libusb_transfer *trx)
+{
+	struct stub_priv *priv = (struct stub_priv *)trx->user_data;
+	struct stub_device *sdev = priv->sdev;
+	int is_out;
+	unsigned int allowed = 0;
+
+	if (!trx || !trx->callback) /* FIXME: omit hcpriv */
+		return;
+	/* FIXME: ignore dev->state */
+
+	if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup =
+			libusb_control_transfer_get_setup(trx);
+
+		if (!setup)
+			return;
+		is_out = !(setup->bmRequestType & USB_DIR_IN) ||
+			!setup->wLength;
+	} else {
+		is_out = stub_endpoint_dir_out(sdev, trx->endpoint);
+	}
+
+	/* enforce simple/standard policy */
+	switch (trx->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		if (is_out)
+			allowed |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+		/* FALLTHROUGH */
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		/*allowed |= URB_NO_FSBR; */ /* only affects UHCI */
+		/* FALLTHROUGH */
+	default:			/* all non-iso endpoints */
+		if (!is_out)
+			allowed |= LIBUSB_TRANSFER_SHORT_NOT_OK;
+		break;
+	}
+	trx->flags &= allowed;
+}
+
+static int is_special_request(struct libusb_transfer *trx)
+{
+	if (trx->type != LIBUSB_TRANSFER_TYPE_CONTROL)
+		return 0;
+
+	return is_clear_halt_cmd(trx) || is_set_interface_cmd(trx) ||
+	       is_set_configuration_cmd(trx) || is_reset_device_cmd(trx);
+}
+
+/*
+ * Special requests wait on the device. They are run by a thread of the
+ * device rather than stub_rx, one at a time and in order, so that the
+ * transfers of other endpoints keep being submitted meanwhile.
+ *
+ * A transfer to an endpoint which a queued special request changes is
+ * queued behind it, as well as any transfer to an endpoint already having
+ * transfers in the queue, so that the order on each endpoint is kept.
+ * Endpoints are bits of tweak_busy, OUT in the lower and IN in the upper
+ * half.
+ */
+static uint32_t stub_tweak_ep(uint8_t ep)
+{
+	return 1U << ((ep & 0x0f) + ((ep & USB_DIR_IN) ? 16 : 0));
+}
+
+static uint32_t stub_tweak_trx(struct libusb_transfer *trx)
+{
+	/* the control endpoint is one for both directions */
+	if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return stub_tweak_ep(trx->endpoint & 0x0f) |
+		       stub_tweak_ep(trx->endpoint | USB_DIR_IN);
+
+	return stub_tweak_ep(trx->endpoint);
+}
+
+/* endpoints held back by a special request */
+static uint32_t stub_tweak_mask(struct stub_device *sdev,
+				struct libusb_transfer *trx)
+{
+	struct libusb_control_setup *req =
+			libusb_control_transfer_get_setup(trx);
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface *intf;
+	const struct libusb_interface_descriptor *alt;
+	uint32_t mask = stub_tweak_trx(trx);
+	uint16_t index = libusb_le16_to_cpu(req->wIndex);
+	int i, j, k;
+
+	if (is_clear_halt_cmd(trx))
+		return mask | stub_tweak_ep(index);
+
+	if (!is_set_interface_cmd(trx) ||
+	    libusb_get_active_config_descriptor(sdev->dev, &config))
+		return ~0U;
+
+	/* the endpoints of any alternate setting of the interface */
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		intf = config->interface + i;
+		if (!intf->num_altsetting ||
+		    intf->altsetting[0].bInterfaceNumber != index)
+			continue;
+		for (j = 0; j < intf->num_altsetting; j++) {
+			alt = intf->altsetting + j;
+			for (k = 0; k < alt->bNumEndpoints; k++)
+				mask |= stub_tweak_ep(
+					alt->endpoint[k].bEndpointAddress);
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return mask;
+}
+
+/* with priv_lock held */
+static void stub_tweak_update(struct stub_device *sdev)
+{
+	struct list_head *pos;
+	uint32_t busy = 0;
+
+	if (sdev->tweak_cur)
+		busy = sdev->tweak_cur->tweak_mask;
+	list_for_each(pos, &sdev->tweak_list)
+		busy |= list_entry(pos, struct stub_priv,
+				   tweak_entry)->tweak_mask;
+
+	sdev->tweak_busy = busy;
+}
+
+/*
+ * Queues a special request or a transfer which has to wait for one.
+ * Returns non-zero in that case, otherwise the caller submits the transfer.
+ */
+static int stub_tweak_queue(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct libusb_transfer *trx = priv->trx;
+	uint32_t mask = 0;
+	int queued = 0;
+
+	if (is_special_request(trx))
+		mask = stub_tweak_mask(sdev, trx);
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	if (!mask && (sdev->tweak_busy & stub_tweak_trx(trx)))
+		mask = stub_tweak_trx(trx);
+	if (mask) {
+		priv->tweak_mask = mask;
+		priv->tweak_queued = 1;
+		list_add(&priv->tweak_entry, sdev->tweak_list.prev);
+		sdev->tweak_busy |= mask;
+		pthread_cond_signal(&sdev->tweak_cond);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	return queued;
+}
+
+static void stub_submit(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct libusb_transfer *trx = priv->trx;
+	unsigned long seqnum = priv->seqnum;
+	int ret;
+
+	masking_bogus_flags(trx);
+
+	/* urb is now ready to submit */
+	ret = libusb_submit_transfer(trx);
+
+	if (ret == 0)
+		usbip_dbg_stub_rx("submit %p ok, seqnum %lu\n", trx, seqnum);
+	else {
+		devh_err(sdev->dev_handle, "submit_urb error, %d\n", ret);
+		usbip_dump_trx(trx);
+		libusb_free_transfer(trx);
+
+		/*
+		 * Pessimistic.
+		 * This connection will be discarded.
+		 */
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_SUBMIT);
+	}
+}
+
+void *stub_tweak_loop(void *data)
+{
+	struct stub_device *sdev = (struct stub_device *)data;
+	struct stub_priv *priv;
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	while (!stub_should_stop(sdev)) {
+		if (sdev->tweak_list.next == &sdev->tweak_list) {
+			pthread_cond_wait(&sdev->tweak_cond, &sdev->priv_lock);
+			continue;
+		}
+		priv = list_entry(sdev->tweak_list.next, struct stub_priv,
+				  tweak_entry);
+		list_del(&priv->tweak_entry);
+		priv->tweak_queued = 0;
+		sdev->tweak_cur = priv;
+		pthread_mutex_unlock(&sdev->priv_lock);
+
+		if (is_special_request(priv->trx))
+			tweak_special_requests(priv->trx);
+
+		/* no need to submit an intercepted request, but harmless? */
+		stub_submit(sdev, priv);
+
+		pthread_mutex_lock(&sdev->priv_lock);
+		sdev->tweak_cur = NULL;
+		stub_tweak_update(sdev);
+	}
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	usbip_dbg_stub_rx("end of stub_tweak_loop\n");
+	return NULL;
+}
+
 /*
  * stub_recv_unlink() unlinks the URB by a call to usb_unlink_urb().
  * By unlinking the urb asynchronously, stub_rx can continuously
@@ -247,6 +464,18 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 */
 		priv->seqnum = pdu->base.seqnum;
 
+		/* a request queued for stub_tweak_loop() is not submitted */
+		if (priv->tweak_queued) {
+			list_del(&priv->tweak_entry);
+			priv->tweak_queued = 0;
+			stub_tweak_update(sdev);
+			pthread_mutex_unlock(&sdev->priv_lock);
+
+			priv->trx->status = LIBUSB_TRANSFER_CANCELLED;
+			stub_complete(priv->trx);
+			return 0;
+		}
+
 		pthread_mutex_unlock(&sdev->priv_lock);
 
 		/*
@@ -344,50 +573,9 @@ static struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
 	return priv;
 }
 
-static void masking_bogus_flags(struct libusb_transfer *trx)
-{
-	struct stub_priv *priv = (struct stub_priv *)trx->user_data;
-	struct stub_device *sdev = priv->sdev;
-	int is_out;
-	unsigned int allowed = 0;
-
-	if (!trx || !trx->callback) /* FIXME: omit hcpriv */
-		return;
-	/* FIXME: ignore dev->state */
-
-	if (trx->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-		struct libusb_control_setup *setup =
-			libusb_control_transfer_get_setup(trx);
-
-		if (!setup)
-			return;
-		is_out = !(setup->bmRequestType & USB_DIR_IN) ||
-			!setup->wLength;
-	} else {
-		is_out = stub_endpoint_dir_out(sdev, trx->endpoint);
-	}
-
-	/* enforce simple/standard policy */
-	switch (trx->type) {
-	case LIBUSB_TRANSFER_TYPE_BULK:
-		if (is_out)
-			allowed |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
-		/* FALLTHROUGH */
-	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		/*allowed |= URB_NO_FSBR; */ /* only affects UHCI */
-		/* FALLTHROUGH */
-	default:			/* all non-iso endpoints */
-		if (!is_out)
-			allowed |= LIBUSB_TRANSFER_SHORT_NOT_OK;
-		break;
-	}
-	trx->flags &= allowed;
-}
-
 static void stub_recv_cmd_submit(struct stub_device *sdev,
 				 struct usbip_header *pdu)
 {
-	int ret;
 	struct stub_priv *priv;
 	struct usbip_device *ud = &sdev->ud;
 	struct libusb_device_handle *dev_handle = sdev->dev_handle;
@@ -462,33 +650,25 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
 	if (usbip_recv_iso(ud, trx) < 0)
 		return;
 
-	/* no need to submit an intercepted request, but harmless? */
-	tweak_special_requests(trx);
-
-	masking_bogus_flags(trx);
-
-	/* urb is now ready to submit */
-	ret = libusb_submit_transfer(priv->trx);
+	/* special requests, and transfers behind them, go to stub_tweak_loop() */
+	if (stub_tweak_queue(sdev, priv))
+		return;
 
-	if (ret == 0)
-		usbip_dbg_stub_rx("submit %p ok, seqnum %u\n",
-				  trx, pdu->base.seqnum);
-	else {
-		devh_err(dev_handle, "submit_urb error, %d\n", ret);
-		usbip_dump_header(pdu);
-		usbip_dump_trx(trx);
-		libusb_free_transfer(trx);
-
-		/*
-		 * Pessimistic.
-		 * This connection will be discarded.
-		 */
-		usbip_event_add(ud, SDEV_EVENT_ERROR_SUBMIT);
-	}
+	stub_submit(sdev, priv);
 
 	usbip_dbg_stub_rx("Leave\n");
 }
 
+/* answered by stub_tx, only the last one if the previous is not yet */
+static void stub_recv_nop(struct stub_device *sdev, struct usbip_header *pdu)
+{
+	pthread_mutex_lock(&sdev->priv_lock);
+	sdev->nop_echo = 1;
+	sdev->nop_seqnum = pdu->base.seqnum;
+	sdev->nop_stamp = pdu->u.nop.stamp;
+	pthread_mutex_unlock(&sdev->priv_lock);
+}
+
 /* recv a pdu */
 static void stub_rx_pdu(struct usbip_device *ud)
 {
@@ -501,7 +681,7 @@ again:
 	memset(&pdu, 0, sizeof(pdu));
 
 	/* receive a pdu header */
-	ret = usbip_recv(ud, &pdu, sizeof(pdu));
+	ret = usbip_recv_header(ud, &pdu);
 
 	if (ret != sizeof(pdu)) {
 		devh_err(sdev->dev_handle, "recv a header, %d\n", ret);
@@ -509,13 +689,12 @@ again:
 		return;
 	}
 
-	usbip_header_correct_endian(&pdu, 0);
-
 	if (usbip_dbg_flag_stub_rx)
 		usbip_dump_header(&pdu);
 
 	if (pdu.base.command == USBIP_NOP) {
 		usbip_dbg_stub_rx("nop command\n");
+		stub_recv_nop(sdev, &pdu);
 		goto again;
 	}
 
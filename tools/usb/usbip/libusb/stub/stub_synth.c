@@ -0,0 +1,932 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Synthetic devices in place of libusb, configured with
+ * --with-synthetic-device to measure usbip without a USB device.
+ *
+ * Only the libusb calls of the stub are implemented. Each device looks like
+ * gadget zero (0525:a4a0) with the loopback and source/sink functions merged
+ * in one configuration:
+ *
+ *	interface 0	0x81 bulk source, 0x01 bulk sink,
+ *			0x82 interrupt IN returning the last 0x02 interrupt OUT
+ *	interface 1	alternate 1, 0x83 iso IN returning the packets of
+ *			0x03 iso OUT, and no endpoint in alternate 0
+ *	ep0		standard requests, 0x5b/0x5c vendor write/read
+ *
+ * A transfer completes when the device has moved its data at the bandwidth
+ * shared by all endpoints of the device, plus the latency. The devices are
+ * set with environment variables read by libusb_init():
+ *
+ *	USBIP_SYNTH_DEVICES	number of devices, 1 by default
+ *	USBIP_SYNTH_SPEED	full, high (default) or super
+ *	USBIP_SYNTH_LATENCY	microseconds added to each transfer, 0 default
+ *	USBIP_SYNTH_BANDWIDTH	MB/s of each device, 0 (default) unlimited
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "stub.h"
+
+#define SYNTH_VENDOR	0x0525
+#define SYNTH_PRODUCT	0xa4a0
+#define SYNTH_BUSNUM	1
+
+#define SYNTH_REQ_WRITE	0x5b
+#define SYNTH_REQ_READ	0x5c
+
+#define SYNTH_VENDOR_BUF	4096
+#define SYNTH_INT_BUF		1024
+#define SYNTH_ISO_SLOTS		64
+#define SYNTH_ISO_BUF		1024
+#define SYNTH_MAX_DEVICES	126
+
+#define SYNTH_CONFIG_BUF	128
+
+#define SYNTH_NUM(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+struct libusb_device {
+	struct libusb_context *ctx;
+	uint8_t address;
+	uint8_t config;
+	uint8_t alt[2];
+	uint64_t busy_until;
+
+	unsigned char vendor[SYNTH_VENDOR_BUF];
+	int vendor_len;
+
+	unsigned char intr[SYNTH_INT_BUF];
+	int intr_len;
+	int intr_valid;
+
+	unsigned char iso[SYNTH_ISO_SLOTS][SYNTH_ISO_BUF];
+	int iso_len[SYNTH_ISO_SLOTS];
+	int iso_head, iso_count;
+};
+
+struct libusb_device_handle {
+	struct libusb_device *dev;
+};
+
+struct libusb_context {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head pending;
+
+	int speed;
+	uint64_t latency;	/* us */
+	uint64_t bandwidth;	/* bytes per us */
+
+	int num_devs;
+	struct libusb_device *devs;
+};
+
+/* libusb_transfer ends with the iso descriptors, so it must be last */
+struct synth_transfer {
+	struct list_head list;
+	int queued;
+	int waiting;
+	uint64_t due;
+	struct libusb_transfer trx;
+};
+
+#define to_synth(t) container_of(t, struct synth_transfer, trx)
+
+static struct libusb_context synth_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct libusb_endpoint_descriptor synth_eps0[] = {
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x81,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK },
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x01,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK },
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x82,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT },
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x02,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT },
+};
+
+static struct libusb_endpoint_descriptor synth_eps1[] = {
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x83,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS },
+	{ .bLength = LIBUSB_DT_ENDPOINT_SIZE,
+	  .bDescriptorType = LIBUSB_DT_ENDPOINT,
+	  .bEndpointAddress = 0x03,
+	  .bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS },
+};
+
+static const struct libusb_interface_descriptor synth_intf0[] = {
+	{ .bLength = LIBUSB_DT_INTERFACE_SIZE,
+	  .bDescriptorType = LIBUSB_DT_INTERFACE,
+	  .bInterfaceNumber = 0,
+	  .bNumEndpoints = 4,
+	  .bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC,
+	  .endpoint = synth_eps0 },
+};
+
+static const struct libusb_interface_descriptor synth_intf1[] = {
+	{ .bLength = LIBUSB_DT_INTERFACE_SIZE,
+	  .bDescriptorType = LIBUSB_DT_INTERFACE,
+	  .bInterfaceNumber = 1,
+	  .bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC },
+	{ .bLength = LIBUSB_DT_INTERFACE_SIZE,
+	  .bDescriptorType = LIBUSB_DT_INTERFACE,
+	  .bInterfaceNumber = 1,
+	  .bAlternateSetting = 1,
+	  .bNumEndpoints = 2,
+	  .bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC,
+	  .endpoint = synth_eps1 },
+};
+
+static const struct libusb_interface synth_intfs[] = {
+	{ .altsetting = synth_intf0, .num_altsetting = 1 },
+	{ .altsetting = synth_intf1, .num_altsetting = 2 },
+};
+
+static struct libusb_config_descriptor synth_config = {
+	.bLength = LIBUSB_DT_CONFIG_SIZE,
+	.bDescriptorType = LIBUSB_DT_CONFIG,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0xc0,
+	.MaxPower = 1,
+	.interface = synth_intfs,
+};
+
+static struct libusb_device_descriptor synth_desc = {
+	.bLength = LIBUSB_DT_DEVICE_SIZE,
+	.bDescriptorType = LIBUSB_DT_DEVICE,
+	.bDeviceClass = LIBUSB_CLASS_VENDOR_SPEC,
+	.idVendor = SYNTH_VENDOR,
+	.idProduct = SYNTH_PRODUCT,
+	.bcdDevice = 0x0100,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 3,
+	.bNumConfigurations = 1,
+};
+
+static uint64_t synth_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static unsigned long synth_getenv(const char *name, unsigned long def)
+{
+	const char *s = getenv(name);
+
+	return (s && *s) ? strtoul(s, NULL, 0) : def;
+}
+
+static void synth_set_speed(struct libusb_context *ctx)
+{
+	const char *s = getenv("USBIP_SYNTH_SPEED");
+	uint16_t bulk, intr, iso;
+	uint8_t interval;
+	unsigned int i;
+
+	if (s && !strcmp(s, "full")) {
+		ctx->speed = LIBUSB_SPEED_FULL;
+		synth_desc.bcdUSB = 0x0110;
+		synth_desc.bMaxPacketSize0 = 64;
+		bulk = 64;
+		intr = 64;
+		iso = 1023;
+		interval = 1;
+	} else if (s && !strcmp(s, "super")) {
+		ctx->speed = LIBUSB_SPEED_SUPER;
+		synth_desc.bcdUSB = 0x0300;
+		synth_desc.bMaxPacketSize0 = 9;
+		bulk = 1024;
+		intr = 1024;
+		iso = 1024;
+		interval = 4;
+	} else {
+		ctx->speed = LIBUSB_SPEED_HIGH;
+		synth_desc.bcdUSB = 0x0200;
+		synth_desc.bMaxPacketSize0 = 64;
+		bulk = 512;
+		intr = 1024;
+		iso = 1024;
+		interval = 4;
+	}
+
+	for (i = 0; i < SYNTH_NUM(synth_eps0); i++) {
+		if (synth_eps0[i].bmAttributes == LIBUSB_TRANSFER_TYPE_BULK) {
+			synth_eps0[i].wMaxPacketSize = bulk;
+		} else {
+			synth_eps0[i].wMaxPacketSize = intr;
+			synth_eps0[i].bInterval = interval;
+		}
+	}
+	for (i = 0; i < SYNTH_NUM(synth_eps1); i++) {
+		synth_eps1[i].wMaxPacketSize = iso;
+		synth_eps1[i].bInterval = interval;
+	}
+}
+
+/* descriptors as the device returns them, companions at super speed */
+static int synth_raw_config(struct libusb_context *ctx, unsigned char *buf)
+{
+	const struct libusb_interface_descriptor *idesc;
+	const struct libusb_endpoint_descriptor *edesc;
+	unsigned char *p = buf;
+	int i, j, k;
+
+	*p++ = synth_config.bLength;
+	*p++ = synth_config.bDescriptorType;
+	p += 2; /* wTotalLength */
+	*p++ = synth_config.bNumInterfaces;
+	*p++ = synth_config.bConfigurationValue;
+	*p++ = synth_config.iConfiguration;
+	*p++ = synth_config.bmAttributes;
+	*p++ = synth_config.MaxPower;
+
+	for (i = 0; i < synth_config.bNumInterfaces; i++) {
+		for (j = 0; j < synth_intfs[i].num_altsetting; j++) {
+			idesc = synth_intfs[i].altsetting + j;
+			*p++ = idesc->bLength;
+			*p++ = idesc->bDescriptorType;
+			*p++ = idesc->bInterfaceNumber;
+			*p++ = idesc->bAlternateSetting;
+			*p++ = idesc->bNumEndpoints;
+			*p++ = idesc->bInterfaceClass;
+			*p++ = idesc->bInterfaceSubClass;
+			*p++ = idesc->bInterfaceProtocol;
+			*p++ = idesc->iInterface;
+			for (k = 0; k < idesc->bNumEndpoints; k++) {
+				edesc = idesc->endpoint + k;
+				*p++ = edesc->bLength;
+				*p++ = edesc->bDescriptorType;
+				*p++ = edesc->bEndpointAddress;
+				*p++ = edesc->bmAttributes;
+				*p++ = edesc->wMaxPacketSize & 0xff;
+				*p++ = edesc->wMaxPacketSize >> 8;
+				*p++ = edesc->bInterval;
+				if (ctx->speed != LIBUSB_SPEED_SUPER)
+					continue;
+				*p++ = LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE;
+				*p++ = LIBUSB_DT_SS_ENDPOINT_COMPANION;
+				*p++ = 0; /* bMaxBurst */
+				*p++ = 0; /* bmAttributes */
+				*p++ = 0; /* wBytesPerInterval */
+				*p++ = 0;
+			}
+		}
+	}
+
+	buf[2] = (p - buf) & 0xff;
+	buf[3] = (p - buf) >> 8;
+	return p - buf;
+}
+
+static int synth_raw_string(struct libusb_device *dev, int index,
+			    unsigned char *buf)
+{
+	char str[32];
+	int i, len;
+
+	switch (index) {
+	case 0:
+		buf[0] = 4;
+		buf[1] = LIBUSB_DT_STRING;
+		buf[2] = 0x09; /* en-US */
+		buf[3] = 0x04;
+		return 4;
+	case 1:
+		snprintf(str, sizeof(str), "usbip");
+		break;
+	case 2:
+		snprintf(str, sizeof(str), "Synthetic loopback");
+		break;
+	case 3:
+		snprintf(str, sizeof(str), "%04d", dev->address);
+		break;
+	default:
+		return -1;
+	}
+
+	len = strlen(str);
+	buf[0] = 2 + len * 2;
+	buf[1] = LIBUSB_DT_STRING;
+	for (i = 0; i < len; i++) {
+		buf[2 + i * 2] = str[i];
+		buf[3 + i * 2] = 0;
+	}
+	return buf[0];
+}
+
+static void synth_reset(struct libusb_device *dev)
+{
+	dev->config = 1;
+	dev->alt[0] = 0;
+	dev->alt[1] = 0;
+	dev->vendor_len = 0;
+	dev->intr_valid = 0;
+	dev->iso_head = 0;
+	dev->iso_count = 0;
+}
+
+/* the length moved, or -1 to stall */
+static int synth_control(struct libusb_device *dev,
+			 struct libusb_transfer *trx)
+{
+	struct libusb_control_setup *req =
+			libusb_control_transfer_get_setup(trx);
+	unsigned char *data = libusb_control_transfer_get_data(trx);
+	unsigned char raw[SYNTH_CONFIG_BUF];
+	uint16_t value = libusb_le16_to_cpu(req->wValue);
+	uint16_t index = libusb_le16_to_cpu(req->wIndex);
+	int len = libusb_le16_to_cpu(req->wLength);
+	int type = req->bmRequestType & (0x03 << 5);
+	int ret;
+
+	if (len > trx->length - LIBUSB_CONTROL_SETUP_SIZE)
+		len = trx->length - LIBUSB_CONTROL_SETUP_SIZE;
+
+	if (type == LIBUSB_REQUEST_TYPE_VENDOR) {
+		switch (req->bRequest) {
+		case SYNTH_REQ_WRITE:
+			if (len > SYNTH_VENDOR_BUF)
+				return -1;
+			memcpy(dev->vendor, data, len);
+			dev->vendor_len = len;
+			return len;
+		case SYNTH_REQ_READ:
+			if (len > dev->vendor_len)
+				len = dev->vendor_len;
+			memcpy(data, dev->vendor, len);
+			return len;
+		}
+		return -1;
+	}
+
+	if (type != LIBUSB_REQUEST_TYPE_STANDARD)
+		return -1;
+
+	switch (req->bRequest) {
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			raw[0] = synth_desc.bLength;
+			raw[1] = synth_desc.bDescriptorType;
+			raw[2] = synth_desc.bcdUSB & 0xff;
+			raw[3] = synth_desc.bcdUSB >> 8;
+			raw[4] = synth_desc.bDeviceClass;
+			raw[5] = synth_desc.bDeviceSubClass;
+			raw[6] = synth_desc.bDeviceProtocol;
+			raw[7] = synth_desc.bMaxPacketSize0;
+			raw[8] = synth_desc.idVendor & 0xff;
+			raw[9] = synth_desc.idVendor >> 8;
+			raw[10] = synth_desc.idProduct & 0xff;
+			raw[11] = synth_desc.idProduct >> 8;
+			raw[12] = synth_desc.bcdDevice & 0xff;
+			raw[13] = synth_desc.bcdDevice >> 8;
+			raw[14] = synth_desc.iManufacturer;
+			raw[15] = synth_desc.iProduct;
+			raw[16] = synth_desc.iSerialNumber;
+			raw[17] = synth_desc.bNumConfigurations;
+			ret = LIBUSB_DT_DEVICE_SIZE;
+			break;
+		case LIBUSB_DT_CONFIG:
+			ret = synth_raw_config(dev->ctx, raw);
+			break;
+		case LIBUSB_DT_STRING:
+			ret = synth_raw_string(dev, value & 0xff, raw);
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+		if (ret < 0)
+			return -1;
+		if (len > ret)
+			len = ret;
+		memcpy(data, raw, len);
+		return len;
+	case LIBUSB_REQUEST_GET_STATUS:
+		if (len > 2)
+			len = 2;
+		memset(data, 0, len);
+		return len;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (len < 1)
+			return -1;
+		data[0] = dev->config;
+		return 1;
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		if (value > 1)
+			return -1;
+		dev->config = value;
+		return 0;
+	case LIBUSB_REQUEST_GET_INTERFACE:
+		if (len < 1 || index > 1)
+			return -1;
+		data[0] = dev->alt[index];
+		return 1;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+		if (index > 1 || value >= synth_intfs[index].num_altsetting)
+			return -1;
+		dev->alt[index] = value;
+		return 0;
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+		return 0;
+	}
+	return -1;
+}
+
+static void synth_iso(struct libusb_device *dev, struct libusb_transfer *trx)
+{
+	unsigned char *buf = trx->buffer;
+	struct libusb_iso_packet_descriptor *desc;
+	int i, slot, len;
+
+	for (i = 0; i < trx->num_iso_packets; i++) {
+		desc = trx->iso_packet_desc + i;
+		len = desc->length;
+		desc->status = LIBUSB_TRANSFER_COMPLETED;
+
+		if (trx->endpoint & LIBUSB_ENDPOINT_IN) {
+			if (!dev->iso_count) {
+				len = 0;
+			} else {
+				slot = dev->iso_head;
+				if (len > dev->iso_len[slot])
+					len = dev->iso_len[slot];
+				memcpy(buf, dev->iso[slot], len);
+				dev->iso_head = (slot + 1) % SYNTH_ISO_SLOTS;
+				dev->iso_count--;
+			}
+		} else {
+			if (len > SYNTH_ISO_BUF)
+				len = SYNTH_ISO_BUF;
+			if (dev->iso_count == SYNTH_ISO_SLOTS) {
+				/* overrun, drop the oldest */
+				dev->iso_head = (dev->iso_head + 1) %
+						SYNTH_ISO_SLOTS;
+				dev->iso_count--;
+			}
+			slot = (dev->iso_head + dev->iso_count) %
+			       SYNTH_ISO_SLOTS;
+			memcpy(dev->iso[slot], buf, len);
+			dev->iso_len[slot] = len;
+			dev->iso_count++;
+		}
+
+		desc->actual_length = len;
+		trx->actual_length += len;
+		buf += desc->length;
+	}
+}
+
+/*
+ * Moves the data of a transfer and sets when it completes. Returns 0 if an
+ * interrupt IN has to wait for an interrupt OUT. In ctx->lock.
+ */
+static int synth_run(struct libusb_device *dev, struct synth_transfer *st,
+		     uint64_t now)
+{
+	struct libusb_context *ctx = dev->ctx;
+	struct libusb_transfer *trx = &st->trx;
+	int in = trx->endpoint & LIBUSB_ENDPOINT_IN;
+	uint64_t start;
+	int i, len;
+
+	trx->status = LIBUSB_TRANSFER_COMPLETED;
+	trx->actual_length = 0;
+
+	switch (trx->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		len = synth_control(dev, trx);
+		if (len < 0) {
+			trx->status = LIBUSB_TRANSFER_STALL;
+			len = 0;
+		}
+		trx->actual_length = len;
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		trx->actual_length = trx->length;
+		if (in)
+			for (i = 0; i < trx->length; i++)
+				trx->buffer[i] = i % 63;
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		len = trx->length;
+		if (in) {
+			if (!dev->intr_valid)
+				return 0;
+			if (len > dev->intr_len)
+				len = dev->intr_len;
+			memcpy(trx->buffer, dev->intr, len);
+			dev->intr_valid = 0;
+		} else {
+			if (len > SYNTH_INT_BUF)
+				len = SYNTH_INT_BUF;
+			memcpy(dev->intr, trx->buffer, len);
+			dev->intr_len = len;
+			dev->intr_valid = 1;
+			pthread_cond_broadcast(&ctx->cond);
+		}
+		trx->actual_length = len;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		synth_iso(dev, trx);
+		break;
+	default:
+		trx->status = LIBUSB_TRANSFER_ERROR;
+		break;
+	}
+
+	start = dev->busy_until > now ? dev->busy_until : now;
+	if (ctx->bandwidth)
+		start += trx->actual_length / ctx->bandwidth;
+	dev->busy_until = start;
+	st->due = start + ctx->latency;
+	return 1;
+}
+
+/*
+ * Moves the transfers due at now to done, waking up the waiting ones which
+ * can run. Returns the earliest due of those left, 0 if none.
+ */
+static uint64_t synth_collect(struct libusb_context *ctx, uint64_t now,
+			      struct list_head *done)
+{
+	struct list_head *pos, *tmp;
+	struct synth_transfer *st;
+	uint64_t next = 0;
+
+	list_for_each_safe(pos, tmp, &ctx->pending) {
+		st = list_entry(pos, struct synth_transfer, list);
+
+		if (st->waiting) {
+			if (!synth_run(st->trx.dev_handle->dev, st, now))
+				continue;
+			st->waiting = 0;
+		}
+
+		if (st->due <= now) {
+			list_del(&st->list);
+			st->queued = 0;
+			list_add(&st->list, done->prev);
+		} else if (!next || st->due < next) {
+			next = st->due;
+		}
+	}
+
+	return next;
+}
+
+int LIBUSB_CALL libusb_init(libusb_context **context)
+{
+	struct libusb_context *ctx = &synth_ctx;
+	int i;
+
+	INIT_LIST_HEAD(&ctx->pending);
+	synth_set_speed(ctx);
+	ctx->latency = synth_getenv("USBIP_SYNTH_LATENCY", 0);
+	ctx->bandwidth = synth_getenv("USBIP_SYNTH_BANDWIDTH", 0);
+
+	ctx->num_devs = synth_getenv("USBIP_SYNTH_DEVICES", 1);
+	if (ctx->num_devs > SYNTH_MAX_DEVICES)
+		ctx->num_devs = SYNTH_MAX_DEVICES;
+
+	ctx->devs = (struct libusb_device *)calloc(ctx->num_devs,
+						   sizeof(*ctx->devs));
+	if (!ctx->devs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < ctx->num_devs; i++) {
+		ctx->devs[i].ctx = ctx;
+		ctx->devs[i].address = i + 2;
+		synth_reset(ctx->devs + i);
+	}
+
+	info("%d synthetic devices, latency %llu us, bandwidth %llu MB/s",
+	     ctx->num_devs, (unsigned long long)ctx->latency,
+	     (unsigned long long)ctx->bandwidth);
+
+	if (context)
+		*context = ctx;
+	return 0;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+	if (!ctx)
+		ctx = &synth_ctx;
+	free(ctx->devs);
+	ctx->devs = NULL;
+	ctx->num_devs = 0;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
+					   libusb_device ***list)
+{
+	libusb_device **devs;
+	int i;
+
+	if (!ctx)
+		ctx = &synth_ctx;
+
+	devs = (libusb_device **)calloc(ctx->num_devs + 1, sizeof(*devs));
+	if (!devs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < ctx->num_devs; i++)
+		devs[i] = ctx->devs + i;
+
+	*list = devs;
+	return ctx->num_devs;
+}
+
+/* the devices live until libusb_exit() */
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
+					 int unref_devices)
+{
+	(void)unref_devices;
+	free(list);
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev,
+				struct libusb_device_descriptor *desc)
+{
+	(void)dev;
+	memcpy(desc, &synth_desc, sizeof(*desc));
+	return 0;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device *dev,
+				struct libusb_config_descriptor **config)
+{
+	unsigned char raw[SYNTH_CONFIG_BUF];
+
+	synth_config.wTotalLength = synth_raw_config(dev->ctx, raw);
+	*config = &synth_config;
+	return 0;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(
+				struct libusb_config_descriptor *config)
+{
+	(void)config;
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+	(void)dev;
+	return SYNTH_BUSNUM;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+	return dev->address;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device *dev)
+{
+	return dev->ctx->speed;
+}
+
+libusb_device * LIBUSB_CALL libusb_get_parent(libusb_device *dev)
+{
+	(void)dev;
+	return NULL;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev,
+			    libusb_device_handle **dev_handle)
+{
+	libusb_device_handle *h;
+
+	h = (libusb_device_handle *)calloc(1, sizeof(*h));
+	if (!h)
+		return LIBUSB_ERROR_NO_MEM;
+
+	h->dev = dev;
+	*dev_handle = h;
+	return 0;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+	free(dev_handle);
+}
+
+libusb_device * LIBUSB_CALL libusb_get_device(
+				libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle,
+				       int interface_number)
+{
+	(void)dev_handle;
+	return interface_number < synth_config.bNumInterfaces ?
+		0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle,
+					 int interface_number)
+{
+	return libusb_claim_interface(dev_handle, interface_number);
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
+					    int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
+					    int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(
+				libusb_device_handle *dev_handle,
+				int interface_number, int alternate_setting)
+{
+	struct libusb_device *dev = dev_handle->dev;
+
+	if (interface_number < 0 ||
+	    interface_number >= synth_config.bNumInterfaces ||
+	    alternate_setting < 0 || alternate_setting >=
+	    synth_intfs[interface_number].num_altsetting)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&dev->ctx->lock);
+	dev->alt[interface_number] = alternate_setting;
+	pthread_mutex_unlock(&dev->ctx->lock);
+	return 0;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev_handle,
+				  unsigned char endpoint)
+{
+	(void)dev_handle;
+	(void)endpoint;
+	return 0;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev_handle)
+{
+	struct libusb_device *dev = dev_handle->dev;
+
+	pthread_mutex_lock(&dev->ctx->lock);
+	synth_reset(dev);
+	pthread_mutex_unlock(&dev->ctx->lock);
+	return 0;
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+	struct synth_transfer *st;
+
+	st = (struct synth_transfer *)calloc(1, sizeof(*st) + iso_packets *
+				sizeof(struct libusb_iso_packet_descriptor));
+	if (!st)
+		return NULL;
+
+	return &st->trx;
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *trx)
+{
+	struct synth_transfer *st = to_synth(trx);
+	struct libusb_device *dev = trx->dev_handle->dev;
+	struct libusb_context *ctx = dev->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (st->queued) {
+		pthread_mutex_unlock(&ctx->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	st->waiting = !synth_run(dev, st, synth_now());
+	st->queued = 1;
+	list_add(&st->list, ctx->pending.prev);
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+
+/* completes at the next event handling with LIBUSB_TRANSFER_CANCELLED */
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *trx)
+{
+	struct synth_transfer *st = to_synth(trx);
+	struct libusb_context *ctx = trx->dev_handle->dev->ctx;
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (st->queued) {
+		trx->status = LIBUSB_TRANSFER_CANCELLED;
+		trx->actual_length = 0;
+		st->waiting = 0;
+		st->due = 0;
+		pthread_cond_broadcast(&ctx->cond);
+	} else {
+		ret = LIBUSB_ERROR_NOT_FOUND;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+/* also drops a transfer still queued, as after libusb_cancel_transfer() */
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *trx)
+{
+	struct synth_transfer *st;
+	struct libusb_context *ctx = &synth_ctx;
+
+	if (!trx)
+		return;
+
+	st = to_synth(trx);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (st->queued)
+		list_del(&st->list);
+	pthread_mutex_unlock(&ctx->lock);
+
+	free(st);
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx,
+					     struct timeval *tv)
+{
+	struct list_head done, *pos, *tmp;
+	struct synth_transfer *st;
+	struct timespec ts;
+	uint64_t now, next, deadline;
+
+	if (!ctx)
+		ctx = &synth_ctx;
+
+	INIT_LIST_HEAD(&done);
+	now = synth_now();
+	deadline = now + (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		next = synth_collect(ctx, now, &done);
+		if (done.next != &done || now >= deadline)
+			break;
+
+		if (!next || next > deadline)
+			next = deadline;
+		ts.tv_sec = next / 1000000;
+		ts.tv_nsec = (next % 1000000) * 1000;
+		pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+		now = synth_now();
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* a callback may free its transfer */
+	list_for_each_safe(pos, tmp, &done) {
+		st = list_entry(pos, struct synth_transfer, list);
+		list_del(&st->list);
+		st->trx.callback(&st->trx);
+	}
+
+	return 0;
+}
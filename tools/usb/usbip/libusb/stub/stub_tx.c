@@ -202,12 +202,11 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 		setup_ret_submit_pdu(&pdu_header, trx);
 		usbip_dbg_stub_tx("setup txdata seqnum: %d trx: %p actl: %d\n",
 			  pdu_header.base.seqnum, trx, trx->actual_length);
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[iovnum].iov_base = &pdu_header;
-		iov[iovnum].iov_len  = sizeof(pdu_header);
+		iov[iovnum].iov_len  = usbip_header_encode(&sdev->ud,
+							   &pdu_header);
+		txsize += iov[iovnum].iov_len;
 		iovnum++;
-		txsize += sizeof(pdu_header);
 
 		/* 2. setup transfer buffer */
 		if (priv->dir == USBIP_DIR_IN &&
@@ -239,13 +238,13 @@ static int stub_send_ret_submit(struct stub_device *sdev)
 				txsize += trx->iso_packet_desc[i].actual_length;
 			}
 
-			if (txsize != sizeof(pdu_header) + trx->actual_length) {
+			if (txsize != iov[0].iov_len + trx->actual_length) {
 				devh_err(sdev->dev_handle,
 					"actual length of urb %d does not ",
 					trx->actual_length);
 				devh_err(sdev->dev_handle,
 					"match iso packet sizes %zu\n",
-					txsize-sizeof(pdu_header));
+					txsize - iov[0].iov_len);
 				free(iov);
 				usbip_event_add(&sdev->ud,
 						SDEV_EVENT_ERROR_TCP);
@@ -339,11 +338,9 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 
 		/* 1. setup usbip_header */
 		setup_ret_unlink_pdu(&pdu_header, unlink);
-		usbip_header_correct_endian(&pdu_header, 1);
-
 		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+		iov[0].iov_len  = usbip_header_encode(&sdev->ud, &pdu_header);
+		txsize += iov[0].iov_len;
 
 		sent = usbip_sendmsg(&sdev->ud, iov, 1);
 		if (sent != txsize) {
@@ -371,6 +368,43 @@ static int stub_send_ret_unlink(struct stub_device *sdev)
 	return total_size;
 }
 
+static int stub_send_ret_nop(struct stub_device *sdev)
+{
+	struct usbip_header pdu_header;
+	struct kvec iov[1];
+	size_t txsize;
+	size_t sent;
+
+	memset(&pdu_header, 0, sizeof(pdu_header));
+
+	pthread_mutex_lock(&sdev->priv_lock);
+	if (!sdev->nop_echo) {
+		pthread_mutex_unlock(&sdev->priv_lock);
+		return 0;
+	}
+	setup_base_pdu(&pdu_header.base, USBIP_RET_NOP, sdev->nop_seqnum);
+	pdu_header.u.nop.stamp = sdev->nop_stamp;
+	sdev->nop_echo = 0;
+	pthread_mutex_unlock(&sdev->priv_lock);
+
+	usbip_dbg_stub_tx("setup ret nop %u\n", pdu_header.base.seqnum);
+	txsize = usbip_header_encode(&sdev->ud, &pdu_header);
+
+	iov[0].iov_base = &pdu_header;
+	iov[0].iov_len  = txsize;
+
+	sent = usbip_sendmsg(&sdev->ud, iov, 1);
+	if (sent != txsize) {
+		devh_err(sdev->dev_handle,
+			"sendmsg failed!, retval %zd for %zd\n",
+			sent, txsize);
+		usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
+		return -1;
+	}
+
+	return txsize;
+}
+
 static void poll_events_and_complete(struct stub_device *sdev)
 {
 	struct timeval tv = {0, 0};
@@ -414,6 +448,9 @@ void *stub_tx_loop(void *data)
 		if (ret_unlink < 0)
 			break;
 
+		if (stub_send_ret_nop(sdev) < 0)
+			break;
+
 	}
 	usbip_dbg_stub_tx("end of stub_tx_loop\n");
 	return NULL;
@@ -28,6 +28,9 @@
 #include <getopt.h>
 
 #include "usbip_common.h"
+#include "usbip_capture.h"
+#include "usbip_tls.h"
+#include "usbip_wan.h"
 #include "usbip_network.h"
 #include "usbip.h"
 
@@ -41,8 +44,9 @@ static const char usbip_usage_string[] =
 #ifdef USBIP_WITH_LIBUSB
 	" [--debug-flags HEX]"
 #endif
-	" [--log] [--tcp-port PORT] [version]\n"
-	"             [help] <command> <args>\n";
+	" [--log] [--tcp-port PORT]\n"
+	"             [--capture FILE] [--wan SPEC] [--tls SPEC] [version] [help]\n"
+	"             <command> <args>\n";
 
 static void usbip_usage(void)
 {
@@ -120,7 +124,25 @@ static const struct command cmds[] = {
 		"Show imported USB devices",
 		NULL
 	},
+	{
+		"ping",
+		usbip_ping,
+		"Show round trip times to an imported USB device",
+		usbip_ping_usage
+	},
 #endif
+	{
+		"bench",
+		usbip_bench,
+		"Measure a server with URBs made without " USBIP_VHCI_DRV_NAME,
+		usbip_bench_usage
+	},
+	{
+		"replay",
+		usbip_replay,
+		"Replay a connection captured with --capture to a server",
+		usbip_replay_usage
+	},
 	{ NULL, NULL, NULL, NULL }
 };
 
@@ -173,6 +195,9 @@ int main(int argc, char *argv[])
 #endif
 		{ "log",      no_argument,       NULL, 'l' },
 		{ "tcp-port", required_argument, NULL, 't' },
+		{ "capture",  required_argument, NULL, 'c' },
+		{ "wan",      required_argument, NULL, 'w' },
+		{ "tls",      required_argument, NULL, 's' },
 		{ NULL,       0,                 NULL,  0  }
 	};
 
@@ -187,7 +212,7 @@ int main(int argc, char *argv[])
 #ifdef USBIP_WITH_LIBUSB
 					      "f:"
 #endif
-					      "lt:", opts, NULL);
+					      "lt:c:w:s:", opts, NULL);
 		if (opt == -1)
 			break;
 
@@ -209,6 +234,18 @@ int main(int argc, char *argv[])
 		case 't':
 			usbip_setup_port_number(optarg);
 			break;
+		case 'c':
+			if (usbip_capture_open(optarg))
+				goto out;
+			break;
+		case 'w':
+			if (usbip_wan_setup(optarg))
+				goto out;
+			break;
+		case 's':
+			if (usbip_tls_setup(optarg, 0))
+				goto out;
+			break;
 		case '?':
 			printf("usbip: invalid option\n");
 		default:
@@ -226,6 +263,7 @@ int main(int argc, char *argv[])
 				optind = 0;
 				usbip_net_tcp_conn_init();
 				rc = run_command(&cmds[i], argc, argv);
+				usbip_capture_close();
 				goto out;
 			}
 	}
@@ -33,6 +33,9 @@ int usbip_unbind(int argc, char *argv[]);
 int usbip_port_show(int argc, char *argv[]);
 int usbip_connect(int argc, char *argv[]);
 int usbip_disconnect(int argc, char *argv[]);
+int usbip_ping(int argc, char *argv[]);
+int usbip_bench(int argc, char *argv[]);
+int usbip_replay(int argc, char *argv[]);
 
 void usbip_attach_usage(void);
 void usbip_detach_usage(void);
@@ -41,5 +44,8 @@ void usbip_bind_usage(void);
 void usbip_unbind_usage(void);
 void usbip_connect_usage(void);
 void usbip_disconnect_usage(void);
+void usbip_ping_usage(void);
+void usbip_bench_usage(void);
+void usbip_replay_usage(void);
 
 #endif /* __USBIP_H */
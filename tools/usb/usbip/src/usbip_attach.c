@@ -43,7 +43,13 @@ static const char usbip_attach_usage_string[] =
 	"usbip attach <args>\n"
 	"    -r, --remote=<host>      The machine with exported USB devices\n"
 	"    -b, --busid=<busid>    Busid of the device on <host>\n"
-	"    -d, --device=<devid>    Id of the virtual UDC on <host>\n";
+	"    -d, --device=<devid>    Id of the virtual UDC on <host>\n"
+	"    -c, --cpu=<cpu>          CPU of the transfer threads, auto or any\n"
+	"    -f, --fifo=<prio>        Run them SCHED_FIFO at <prio>\n"
+	"    -n, --nice=<nice>        Run them SCHED_OTHER at <nice>\n"
+	"    -i, --int-poll           Let the server poll interrupt IN endpoints\n"
+	"    -t, --timestamps         Ask the server to time each URB\n"
+	"    -z, --compress           Compress bulk data on the network\n";
 
 void usbip_attach_usage(void)
 {
@@ -51,6 +57,18 @@ void usbip_attach_usage(void)
 }
 #endif
 
+/* placement of the threads of vhci_hcd, empty to leave it as it is */
+static char attach_sched[32];
+
+/*
+ * Opt-in: USBIP_FEAT_INT_POLL reads interrupt IN endpoints ahead of the
+ * host, USBIP_FEAT_TIMESTAMPS adds 32 bytes to every answer for statistics,
+ * USBIP_FEAT_COMPRESS costs CPU and only pays on slow links.
+ */
+static uint32_t attach_features = USBIP_VHCI_FEATURES &
+				  ~(USBIP_FEAT_INT_POLL | USBIP_FEAT_TIMESTAMPS |
+				    USBIP_FEAT_COMPRESS);
+
 static int import_device(struct usbip_sock *sock,
 			 struct usbip_usb_device *udev,
 			 const char *host, const char *port, const char *busid)
@@ -65,14 +83,15 @@ static int import_device(struct usbip_sock *sock,
 	}
 
 	do {
-		port_nr = usbip_vhci_get_free_port();
+		port_nr = usbip_vhci_get_free_port(udev->speed);
 		if (port_nr < 0) {
 			err("no free port");
 			goto err_driver_close;
 		}
 
 		rc = usbip_vhci_attach_device(port_nr, sock->fd, udev->busnum,
-					      udev->devnum, udev->speed);
+					      udev->devnum, udev->speed,
+					      sock->features);
 		if (rc < 0 && errno != EBUSY) {
 			err("import device");
 			goto err_driver_close;
@@ -80,6 +99,14 @@ static int import_device(struct usbip_sock *sock,
 		}
 	} while (rc < 0);
 
+	if (attach_sched[0]) {
+		rc = usbip_vhci_set_sched(port_nr, attach_sched);
+		if (rc < 0) {
+			err("set sched %s", attach_sched);
+			goto err_detach_device;
+		}
+	}
+
 	rc = usbip_vhci_create_record(host, port, busid, port_nr);
 	if (rc < 0) {
 		err("record connection");
@@ -151,6 +178,88 @@ static int query_import_device(struct usbip_sock *sock,
 	return import_device(sock, &reply.udev, host, port, busid);
 }
 
+/*
+ * Returns 1 when the server rejects OP_REQ_IMPORT_EXT with ST_NA, answers
+ * it as an unknown request, or closes the connection before any byte of a
+ * reply, so that the caller can retry with OP_REQ_IMPORT on a new
+ * connection. A reply cut short or unreadable fails the attach.
+ */
+static int query_import_ext_device(struct usbip_sock *sock,
+				   const char *host, const char *port,
+				   const char *busid)
+{
+	int rc;
+	struct op_import_ext_request request;
+	struct op_import_ext_reply   reply;
+	uint16_t code;
+	uint32_t status;
+
+	memset(&request, 0, sizeof(request));
+	memset(&reply, 0, sizeof(reply));
+
+	/* send a request */
+	rc = usbip_net_send_op_common(sock, OP_REQ_IMPORT_EXT, 0);
+	if (rc < 0) {
+		err("send op_common");
+		return -1;
+	}
+
+	strncpy(request.busid, busid, SYSFS_BUS_ID_SIZE-1);
+	request.features = attach_features;
+
+	PACK_OP_IMPORT_EXT_REQUEST(1, &request);
+
+	rc = usbip_net_send(sock, (void *) &request, sizeof(request));
+	if (rc < 0) {
+		err("send op_import_ext_request");
+		return -1;
+	}
+
+	/* receive a reply */
+	rc = usbip_net_recv_op_reply(sock, &code, &status);
+	if (rc == -ECONNRESET) {
+		dbg("import_ext closed by server without reply");
+		return 1;
+	}
+	if (rc < 0) {
+		err("recv op_common for import_ext");
+		return -1;
+	}
+
+	if (status == ST_NA ||
+	    (code != OP_REP_IMPORT_EXT && status != ST_OK)) {
+		dbg("import_ext rejected: code %#0x status %u", code, status);
+		return 1;
+	}
+
+	if (code != OP_REP_IMPORT_EXT || status != ST_OK) {
+		err("recv import_ext reply: code %#0x status %u", code, status);
+		return -1;
+	}
+
+	rc = usbip_net_recv(sock, (void *) &reply, sizeof(reply));
+	if (rc < 0) {
+		err("recv op_import_ext_reply");
+		return -1;
+	}
+
+	PACK_OP_IMPORT_EXT_REPLY(0, &reply);
+
+	/* check the reply */
+	if (strncmp(reply.udev.busid, busid, SYSFS_BUS_ID_SIZE)) {
+		err("recv different busid %s", reply.udev.busid);
+		return -1;
+	}
+
+	if (reply.features & ~attach_features) {
+		err("recv unrequested features %x", reply.features);
+		return -1;
+	}
+	sock->features = reply.features;
+
+	return import_device(sock, &reply.udev, host, port, busid);
+}
+
 int usbip_attach_device(const char *host, const char *port, const char *busid)
 {
 	struct usbip_sock *sock;
@@ -162,7 +271,18 @@ int usbip_attach_device(const char *host, const char *port, const char *busid)
 		goto err_out;
 	}
 
-	rc = query_import_device(sock, host, port, busid);
+	rc = query_import_ext_device(sock, host, port, busid);
+	if (rc > 0) {
+		usbip_conn_close(sock);
+
+		sock = usbip_conn_open(host, usbip_port_string);
+		if (!sock) {
+			err("tcp connect");
+			goto err_out;
+		}
+
+		rc = query_import_device(sock, host, port, busid);
+	}
 	if (rc < 0) {
 		err("query");
 		goto err_tcp_close;
@@ -191,15 +311,24 @@ int usbip_attach(int argc, char *argv[])
 		{ "remote", required_argument, NULL, 'r' },
 		{ "busid",  required_argument, NULL, 'b' },
 		{ "device",  required_argument, NULL, 'd' },
+		{ "cpu",    required_argument, NULL, 'c' },
+		{ "fifo",   required_argument, NULL, 'f' },
+		{ "nice",   required_argument, NULL, 'n' },
+		{ "int-poll", no_argument,   NULL, 'i' },
+		{ "timestamps", no_argument, NULL, 't' },
+		{ "compress", no_argument,   NULL, 'z' },
 		{ NULL, 0,  NULL, 0 }
 	};
+	struct usbip_sched sched;
 	char *host = NULL;
 	char *busid = NULL;
 	int opt;
 	int ret = -1;
 
+	memset(&sched, 0, sizeof(sched));
+
 	for (;;) {
-		opt = getopt_long(argc, argv, "d:r:b:", opts, NULL);
+		opt = getopt_long(argc, argv, "d:r:b:c:f:n:itz", opts, NULL);
 
 		if (opt == -1)
 			break;
@@ -212,6 +341,21 @@ int usbip_attach(int argc, char *argv[])
 		case 'b':
 			busid = optarg;
 			break;
+		case 'c':
+		case 'f':
+		case 'n':
+			if (usbip_sched_parse(&sched, opt, optarg) < 0)
+				goto err_out;
+			break;
+		case 'i':
+			attach_features |= USBIP_FEAT_INT_POLL;
+			break;
+		case 't':
+			attach_features |= USBIP_FEAT_TIMESTAMPS;
+			break;
+		case 'z':
+			attach_features |= USBIP_FEAT_COMPRESS;
+			break;
 		default:
 			goto err_out;
 		}
@@ -220,6 +364,9 @@ int usbip_attach(int argc, char *argv[])
 	if (!host || !busid)
 		goto err_out;
 
+	if (sched.set)
+		usbip_sched_string(&sched, attach_sched, sizeof(attach_sched));
+
 	ret = usbip_attach_device(host, usbip_port_string, busid);
 	goto out;
 
@@ -0,0 +1,963 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for servers. Devices are imported by OP_REQ_IMPORT as
+ * attach does, but the URBs are made here and sent as CMD_SUBMIT on the
+ * connection, without vhci_hcd. Each device is driven by a thread keeping
+ * a number of URBs in flight on a mix of its endpoints, which are taken
+ * from the configuration descriptor read on ep0.
+ */
+
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "usbip.h"
+
+static const char usbip_bench_usage_string[] =
+	"usbip bench <args>\n"
+	"    -r, --remote=<host>      The machine with exported USB devices\n"
+	"    -b, --busid=<busid>      Busid of a device on <host>, repeat for\n"
+	"                             more devices\n"
+	"    -e, --endpoint=<ep>      <nr>in or <nr>out with :<weight>, repeat\n"
+	"                             for a mix, 1in by default\n"
+	"    -q, --depth=<n>          URBs in flight per device, 8 by default\n"
+	"    -s, --size=<min>[-<max>] bytes per URB, 16384 by default\n"
+	"    -u, --unlink=<n>         unlink n of 1000 URBs after submit\n"
+	"    -t, --time=<sec>         seconds to run, 10 by default\n"
+	"    -p, --parsable           Parsable result format\n";
+
+void usbip_bench_usage(void)
+{
+	printf("usage: %s", usbip_bench_usage_string);
+}
+
+/* wire format of the URB PDUs, see drivers/usb/usbip/usbip_common.h */
+#define BENCH_CMD_SUBMIT	0x0001
+#define BENCH_CMD_UNLINK	0x0002
+#define BENCH_RET_SUBMIT	0x0003
+#define BENCH_RET_UNLINK	0x0004
+
+#define BENCH_DIR_OUT		0
+#define BENCH_DIR_IN		1
+
+#define BENCH_URB_ISO_ASAP	0x0002
+#define BENCH_URB_DIR_IN	0x0200
+
+struct bench_header {
+	uint32_t command;
+	uint32_t seqnum;
+	uint32_t devid;
+	uint32_t direction;
+	uint32_t ep;
+	union {
+		struct {
+			uint32_t transfer_flags;
+			int32_t transfer_buffer_length;
+			int32_t start_frame;
+			int32_t number_of_packets;
+			int32_t interval;
+			unsigned char setup[8];
+		} cmd_submit;
+		struct {
+			int32_t status;
+			int32_t actual_length;
+			int32_t start_frame;
+			int32_t number_of_packets;
+			int32_t error_count;
+		} ret_submit;
+		struct {
+			uint32_t seqnum;
+		} cmd_unlink;
+		struct {
+			int32_t status;
+		} ret_unlink;
+		uint32_t raw[7];
+	} u;
+};
+
+struct bench_iso_desc {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t actual_length;
+	uint32_t status;
+};
+
+#define BENCH_EP_TYPE_CONTROL	0
+#define BENCH_EP_TYPE_ISO	1
+
+#define BENCH_MAX_DEVS		32
+#define BENCH_MAX_EPS		32
+#define BENCH_MAX_DEPTH		1024
+#define BENCH_MAX_ISO_PACKETS	1024
+
+/*
+ * Latency histogram in microseconds, exact below 128 and with 64 buckets
+ * for each power of 2 above, so within 1.6%.
+ */
+#define BENCH_LAT_SUB		64
+#define BENCH_LAT_BUCKETS	(BENCH_LAT_SUB * 40)
+
+struct bench_ep {
+	uint8_t nr;
+	uint8_t in;
+	uint8_t type;
+	uint8_t interval;
+	unsigned int maxp;
+	unsigned int weight;
+};
+
+struct bench_urb {
+	int in_use;
+	uint32_t seqnum;
+	uint32_t unlink_seqnum;
+	int returned;
+	int unlink_returned;
+	struct bench_ep *ep;
+	uint64_t sent;
+};
+
+struct bench_result {
+	uint64_t urbs;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t unlinks;
+	uint64_t unlinked;
+	uint64_t elapsed;
+	uint64_t lat_max;
+	uint64_t hist[BENCH_LAT_BUCKETS];
+};
+
+struct bench_dev {
+	const char *busid;
+	struct usbip_sock *sock;
+	uint32_t devid;
+	uint32_t seqnum;
+	unsigned int seed;
+
+	struct bench_ep eps[BENCH_MAX_EPS];
+	int num_eps;
+	/* the endpoints of the workload */
+	struct bench_ep *mix[BENCH_MAX_EPS];
+	int num_mix;
+	unsigned int total_weight;
+
+	struct bench_urb *urbs;
+	int inflight;
+	unsigned char *buf;
+	struct bench_iso_desc *iso;
+
+	pthread_t thread;
+	int failed;
+	struct bench_result res;
+};
+
+static struct bench_conf {
+	const char *host;
+	const char *busids[BENCH_MAX_DEVS];
+	int num_devs;
+	struct bench_ep eps[BENCH_MAX_EPS];
+	int num_eps;
+	int depth;
+	unsigned int size_min;
+	unsigned int size_max;
+	unsigned int buf_len;
+	unsigned int unlink;
+	unsigned int time;
+	int parsable;
+} conf;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_lat_bucket(uint64_t us)
+{
+	int shift = 0;
+
+	while ((us >> shift) >= 2 * BENCH_LAT_SUB)
+		shift++;
+	if (shift)
+		us = (shift + 1) * BENCH_LAT_SUB + (us >> shift) -
+		     BENCH_LAT_SUB;
+	return us < BENCH_LAT_BUCKETS ? us : BENCH_LAT_BUCKETS - 1;
+}
+
+static uint64_t bench_lat_value(int bucket)
+{
+	int shift;
+
+	if (bucket < 2 * BENCH_LAT_SUB)
+		return bucket;
+	shift = bucket / BENCH_LAT_SUB - 1;
+	return (uint64_t)(bucket % BENCH_LAT_SUB + BENCH_LAT_SUB) << shift;
+}
+
+static void bench_pack_header(struct bench_header *pdu)
+{
+	uint32_t *p = (uint32_t *)pdu;
+	unsigned int i;
+
+	/* the setup packet stays as it is */
+	for (i = 0; i < sizeof(*pdu) / sizeof(*p) - 2; i++)
+		p[i] = htonl(p[i]);
+}
+
+static void bench_unpack_header(struct bench_header *pdu)
+{
+	uint32_t *p = (uint32_t *)pdu;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*pdu) / sizeof(*p); i++)
+		p[i] = ntohl(p[i]);
+}
+
+static int bench_import(struct bench_dev *dev)
+{
+	struct op_import_request request;
+	struct op_import_reply reply;
+	uint16_t code = OP_REP_IMPORT;
+	int rc;
+
+	memset(&request, 0, sizeof(request));
+	memset(&reply, 0, sizeof(reply));
+
+	rc = usbip_net_send_op_common(dev->sock, OP_REQ_IMPORT, 0);
+	if (rc < 0) {
+		err("send op_common");
+		return -1;
+	}
+
+	strncpy(request.busid, dev->busid, SYSFS_BUS_ID_SIZE-1);
+
+	PACK_OP_IMPORT_REQUEST(0, &request);
+
+	rc = usbip_net_send(dev->sock, (void *) &request, sizeof(request));
+	if (rc < 0) {
+		err("send op_import_request");
+		return -1;
+	}
+
+	rc = usbip_net_recv_op_common(dev->sock, &code);
+	if (rc < 0) {
+		err("recv op_common");
+		return -1;
+	}
+
+	rc = usbip_net_recv(dev->sock, (void *) &reply, sizeof(reply));
+	if (rc < 0) {
+		err("recv op_import_reply");
+		return -1;
+	}
+
+	PACK_OP_IMPORT_REPLY(0, &reply);
+
+	if (strncmp(reply.udev.busid, dev->busid, SYSFS_BUS_ID_SIZE)) {
+		err("recv different busid %s", reply.udev.busid);
+		return -1;
+	}
+
+	dev->devid = (reply.udev.busnum << 16) | reply.udev.devnum;
+	return 0;
+}
+
+static int bench_send_submit(struct bench_dev *dev, struct bench_urb *urb,
+			     unsigned int len, const unsigned char *setup)
+{
+	struct bench_ep *ep = urb->ep;
+	struct bench_header pdu;
+	int i, packets = 0;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.command = BENCH_CMD_SUBMIT;
+	pdu.seqnum = urb->seqnum;
+	pdu.devid = dev->devid;
+	pdu.direction = ep->in ? BENCH_DIR_IN : BENCH_DIR_OUT;
+	pdu.ep = ep->nr;
+	pdu.u.cmd_submit.transfer_flags = ep->in ? BENCH_URB_DIR_IN : 0;
+	pdu.u.cmd_submit.transfer_buffer_length = len;
+	pdu.u.cmd_submit.interval = ep->interval;
+	if (ep->type == BENCH_EP_TYPE_ISO) {
+		packets = len / ep->maxp;
+		pdu.u.cmd_submit.transfer_flags |= BENCH_URB_ISO_ASAP;
+		pdu.u.cmd_submit.number_of_packets = packets;
+	}
+	bench_pack_header(&pdu);
+	if (setup)
+		memcpy(pdu.u.cmd_submit.setup, setup, 8);
+
+	urb->sent = bench_now();
+
+	if (usbip_net_send(dev->sock, &pdu, sizeof(pdu)) < 0)
+		return -1;
+
+	if (!ep->in && len && usbip_net_send(dev->sock, dev->buf, len) < 0)
+		return -1;
+
+	if (!packets)
+		return 0;
+
+	for (i = 0; i < packets; i++) {
+		dev->iso[i].offset = htonl(i * ep->maxp);
+		dev->iso[i].length = htonl(ep->maxp);
+		dev->iso[i].actual_length = 0;
+		dev->iso[i].status = 0;
+	}
+	return usbip_net_send(dev->sock, dev->iso,
+			      packets * sizeof(*dev->iso)) < 0 ? -1 : 0;
+}
+
+static int bench_send_unlink(struct bench_dev *dev, struct bench_urb *urb)
+{
+	struct bench_header pdu;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.command = BENCH_CMD_UNLINK;
+	pdu.seqnum = ++dev->seqnum;
+	pdu.devid = dev->devid;
+	pdu.u.cmd_unlink.seqnum = urb->seqnum;
+	bench_pack_header(&pdu);
+
+	urb->unlink_seqnum = dev->seqnum;
+	dev->res.unlinks++;
+
+	return usbip_net_send(dev->sock, &pdu, sizeof(pdu)) < 0 ? -1 : 0;
+}
+
+static struct bench_urb *bench_find_urb(struct bench_dev *dev,
+					uint32_t seqnum, int unlink)
+{
+	int i;
+
+	for (i = 0; i < conf.depth; i++) {
+		if (!dev->urbs[i].in_use)
+			continue;
+		if (unlink ? dev->urbs[i].unlink_seqnum == seqnum :
+			     dev->urbs[i].seqnum == seqnum)
+			return dev->urbs + i;
+	}
+	return NULL;
+}
+
+static void bench_put_urb(struct bench_dev *dev, struct bench_urb *urb)
+{
+	if (urb->returned && (!urb->unlink_seqnum || urb->unlink_returned)) {
+		urb->in_use = 0;
+		dev->inflight--;
+	}
+}
+
+static void bench_account(struct bench_dev *dev, struct bench_urb *urb,
+			  struct bench_header *pdu)
+{
+	struct bench_result *res = &dev->res;
+	uint64_t lat = bench_now() - urb->sent;
+
+	if (pdu->u.ret_submit.status) {
+		res->errors++;
+		return;
+	}
+
+	res->urbs++;
+	res->bytes += pdu->u.ret_submit.actual_length;
+	res->hist[bench_lat_bucket(lat)]++;
+	if (lat > res->lat_max)
+		res->lat_max = lat;
+}
+
+/* receive and account one PDU */
+static int bench_recv(struct bench_dev *dev)
+{
+	struct bench_header pdu;
+	struct bench_urb *urb;
+	int len;
+
+	if (usbip_net_recv(dev->sock, &pdu, sizeof(pdu)) < 0) {
+		err("recv pdu of %s", dev->busid);
+		return -1;
+	}
+	bench_unpack_header(&pdu);
+
+	switch (pdu.command) {
+	case BENCH_RET_SUBMIT:
+		urb = bench_find_urb(dev, pdu.seqnum, 0);
+		if (!urb || urb->returned) {
+			err("RET_SUBMIT of unknown seqnum %u", pdu.seqnum);
+			return -1;
+		}
+
+		len = pdu.u.ret_submit.actual_length;
+		if (len < 0 || len > (int)conf.buf_len ||
+		    pdu.u.ret_submit.number_of_packets >
+		    BENCH_MAX_ISO_PACKETS) {
+			err("bogus RET_SUBMIT of seqnum %u", pdu.seqnum);
+			return -1;
+		}
+		if (urb->ep->in && len &&
+		    usbip_net_recv(dev->sock, dev->buf, len) < 0)
+			return -1;
+		if (urb->ep->type == BENCH_EP_TYPE_ISO &&
+		    pdu.u.ret_submit.number_of_packets > 0 &&
+		    usbip_net_recv(dev->sock, dev->iso,
+				   pdu.u.ret_submit.number_of_packets *
+				   sizeof(*dev->iso)) < 0)
+			return -1;
+
+		bench_account(dev, urb, &pdu);
+		urb->returned = 1;
+		bench_put_urb(dev, urb);
+		break;
+	case BENCH_RET_UNLINK:
+		urb = bench_find_urb(dev, pdu.seqnum, 1);
+		if (!urb || urb->unlink_returned) {
+			err("RET_UNLINK of unknown seqnum %u", pdu.seqnum);
+			return -1;
+		}
+
+		/* non-zero if unlinked before completion, no RET_SUBMIT */
+		if (pdu.u.ret_unlink.status) {
+			urb->returned = 1;
+			dev->res.unlinked++;
+		}
+		urb->unlink_returned = 1;
+		bench_put_urb(dev, urb);
+		break;
+	default:
+		err("unexpected command %u", pdu.command);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct bench_urb *bench_get_urb(struct bench_dev *dev,
+				       struct bench_ep *ep)
+{
+	struct bench_urb *urb = NULL;
+	int i;
+
+	for (i = 0; i < conf.depth; i++) {
+		if (!dev->urbs[i].in_use) {
+			urb = dev->urbs + i;
+			break;
+		}
+	}
+	if (!urb)
+		return NULL;
+
+	memset(urb, 0, sizeof(*urb));
+	urb->in_use = 1;
+	urb->seqnum = ++dev->seqnum;
+	urb->ep = ep;
+	dev->inflight++;
+	return urb;
+}
+
+/* ep0 IN request waited for before the workload starts */
+static int bench_control_in(struct bench_dev *dev, uint8_t type,
+			    uint8_t index, unsigned int len)
+{
+	static struct bench_ep ep0 = { 0, 1, BENCH_EP_TYPE_CONTROL, 0, 64, 0 };
+	struct bench_urb *urb;
+	unsigned char setup[8];
+
+	setup[0] = 0x80; /* IN, standard, device */
+	setup[1] = 0x06; /* GET_DESCRIPTOR */
+	setup[2] = index;
+	setup[3] = type;
+	setup[4] = 0;
+	setup[5] = 0;
+	setup[6] = len & 0xff;
+	setup[7] = len >> 8;
+
+	urb = bench_get_urb(dev, &ep0);
+	if (!urb || bench_send_submit(dev, urb, len, setup) < 0)
+		return -1;
+
+	while (dev->inflight)
+		if (bench_recv(dev) < 0)
+			return -1;
+
+	return dev->res.errors ? -1 : 0;
+}
+
+static void bench_add_ep(struct bench_dev *dev, const unsigned char *desc)
+{
+	struct bench_ep *ep;
+	unsigned int maxp = desc[4] | (desc[5] << 8);
+	int i;
+
+	for (i = 0; i < dev->num_eps; i++)
+		if (dev->eps[i].nr == (desc[2] & 0x0f) &&
+		    dev->eps[i].in == !!(desc[2] & 0x80))
+			return;
+
+	if (dev->num_eps == BENCH_MAX_EPS)
+		return;
+
+	ep = dev->eps + dev->num_eps++;
+	ep->nr = desc[2] & 0x0f;
+	ep->in = !!(desc[2] & 0x80);
+	ep->type = desc[3] & 0x03;
+	ep->interval = desc[6];
+	/* high bandwidth endpoints of high speed */
+	ep->maxp = (maxp & 0x7ff) * (((maxp >> 11) & 0x3) + 1);
+}
+
+/* the endpoints of every alternate setting of the active configuration */
+static int bench_read_endpoints(struct bench_dev *dev)
+{
+	unsigned int total, i;
+
+	if (bench_control_in(dev, 0x02, 0, 9) < 0) {
+		err("get config descriptor of %s", dev->busid);
+		return -1;
+	}
+
+	total = dev->buf[2] | (dev->buf[3] << 8);
+	if (total > conf.buf_len)
+		total = conf.buf_len;
+
+	if (bench_control_in(dev, 0x02, 0, total) < 0) {
+		err("get config descriptor of %s", dev->busid);
+		return -1;
+	}
+
+	for (i = 0; i + 1 < total && dev->buf[i] >= 2; i += dev->buf[i]) {
+		if (dev->buf[i + 1] == 0x05 && dev->buf[i] >= 7 &&
+		    i + 7 <= total)
+			bench_add_ep(dev, dev->buf + i);
+	}
+
+	return 0;
+}
+
+static int bench_setup_mix(struct bench_dev *dev)
+{
+	struct bench_ep *spec, *ep;
+	int i, j;
+
+	for (i = 0; i < conf.num_eps; i++) {
+		spec = conf.eps + i;
+		ep = NULL;
+		for (j = 0; j < dev->num_eps; j++) {
+			if (dev->eps[j].nr == spec->nr &&
+			    dev->eps[j].in == spec->in) {
+				ep = dev->eps + j;
+				break;
+			}
+		}
+		if (!ep) {
+			err("no endpoint %d%s on %s", spec->nr,
+			    spec->in ? "in" : "out", dev->busid);
+			return -1;
+		}
+		if (ep->type == BENCH_EP_TYPE_CONTROL) {
+			err("endpoint %d%s of %s is a control one", ep->nr,
+			    ep->in ? "in" : "out", dev->busid);
+			return -1;
+		}
+		if (ep->type == BENCH_EP_TYPE_ISO && !ep->maxp) {
+			err("endpoint %d%s of %s has no bandwidth", ep->nr,
+			    ep->in ? "in" : "out", dev->busid);
+			return -1;
+		}
+		ep->weight = spec->weight;
+		dev->mix[dev->num_mix++] = ep;
+		dev->total_weight += ep->weight;
+	}
+
+	return 0;
+}
+
+static int bench_open(struct bench_dev *dev)
+{
+	dev->urbs = (struct bench_urb *)calloc(conf.depth, sizeof(*dev->urbs));
+	dev->buf = (unsigned char *)malloc(conf.buf_len);
+	dev->iso = (struct bench_iso_desc *)calloc(BENCH_MAX_ISO_PACKETS,
+						   sizeof(*dev->iso));
+	if (!dev->urbs || !dev->buf || !dev->iso) {
+		err("alloc for %s", dev->busid);
+		return -1;
+	}
+	memset(dev->buf, 0x5a, conf.buf_len);
+
+	dev->sock = usbip_conn_open(conf.host, usbip_port_string);
+	if (!dev->sock) {
+		err("tcp connect");
+		return -1;
+	}
+
+	if (bench_import(dev) < 0 || bench_read_endpoints(dev) < 0 ||
+	    bench_setup_mix(dev) < 0)
+		return -1;
+
+	dev->seed = (unsigned int)bench_now() ^ dev->devid;
+	return 0;
+}
+
+static void bench_close(struct bench_dev *dev)
+{
+	if (dev->sock)
+		usbip_conn_close(dev->sock);
+	free(dev->urbs);
+	free(dev->buf);
+	free(dev->iso);
+}
+
+static int bench_submit_one(struct bench_dev *dev)
+{
+	struct bench_ep *ep = dev->mix[0];
+	struct bench_urb *urb;
+	unsigned int len, w;
+	int i;
+
+	w = rand_r(&dev->seed) % dev->total_weight;
+	for (i = 0; i < dev->num_mix; i++) {
+		ep = dev->mix[i];
+		if (w < ep->weight)
+			break;
+		w -= ep->weight;
+	}
+
+	len = conf.size_min;
+	if (conf.size_max > conf.size_min)
+		len += rand_r(&dev->seed) % (conf.size_max - conf.size_min + 1);
+
+	if (ep->type == BENCH_EP_TYPE_ISO) {
+		if (len < ep->maxp)
+			len = ep->maxp;
+		if (len / ep->maxp > BENCH_MAX_ISO_PACKETS)
+			len = BENCH_MAX_ISO_PACKETS * ep->maxp;
+		len -= len % ep->maxp;
+	}
+
+	urb = bench_get_urb(dev, ep);
+	if (!urb || bench_send_submit(dev, urb, len, NULL) < 0)
+		return -1;
+
+	if (conf.unlink && (unsigned int)rand_r(&dev->seed) % 1000 <
+	    conf.unlink)
+		return bench_send_unlink(dev, urb);
+
+	return 0;
+}
+
+static void *bench_loop(void *data)
+{
+	struct bench_dev *dev = (struct bench_dev *)data;
+	uint64_t start, end;
+	int i;
+
+	memset(&dev->res, 0, sizeof(dev->res));
+
+	start = bench_now();
+	end = start + (uint64_t)conf.time * 1000000;
+
+	while (bench_now() < end) {
+		while (dev->inflight < conf.depth)
+			if (bench_submit_one(dev) < 0)
+				goto err;
+		if (bench_recv(dev) < 0)
+			goto err;
+	}
+
+	dev->res.elapsed = bench_now() - start;
+
+	/* interrupt IN may never complete, take back what is left */
+	for (i = 0; i < conf.depth; i++) {
+		if (dev->urbs[i].in_use && !dev->urbs[i].returned &&
+		    !dev->urbs[i].unlink_seqnum &&
+		    bench_send_unlink(dev, dev->urbs + i) < 0)
+			goto err;
+	}
+	while (dev->inflight)
+		if (bench_recv(dev) < 0)
+			goto err;
+
+	return NULL;
+err:
+	err("connection of %s lost", dev->busid);
+	dev->failed = 1;
+	return NULL;
+}
+
+static uint64_t bench_percentile(struct bench_result *res, unsigned int pm)
+{
+	uint64_t n = 0, target = (res->urbs * pm + 999) / 1000;
+	int i;
+
+	if (!res->urbs)
+		return 0;
+
+	for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+		n += res->hist[i];
+		if (n >= target)
+			return bench_lat_value(i);
+	}
+	return res->lat_max;
+}
+
+static void bench_print(const char *name, struct bench_result *res)
+{
+	double sec = res->elapsed ? res->elapsed / 1e6 : 1;
+
+	if (conf.parsable) {
+		printf("busid=%s#urbs=%llu#bytes=%llu#usec=%llu#"
+		       "errors=%llu#unlinks=%llu#unlinked=%llu#"
+		       "p50=%llu#p90=%llu#p99=%llu#p999=%llu#max=%llu#\n",
+		       name, (unsigned long long)res->urbs,
+		       (unsigned long long)res->bytes,
+		       (unsigned long long)res->elapsed,
+		       (unsigned long long)res->errors,
+		       (unsigned long long)res->unlinks,
+		       (unsigned long long)res->unlinked,
+		       (unsigned long long)bench_percentile(res, 500),
+		       (unsigned long long)bench_percentile(res, 900),
+		       (unsigned long long)bench_percentile(res, 990),
+		       (unsigned long long)bench_percentile(res, 999),
+		       (unsigned long long)res->lat_max);
+		return;
+	}
+
+	printf("%s: %llu URBs %.2f MB/s %.0f URB/s errors %llu "
+	       "unlinks %llu (%llu before completion)\n", name,
+	       (unsigned long long)res->urbs, res->bytes / sec / 1e6,
+	       res->urbs / sec, (unsigned long long)res->errors,
+	       (unsigned long long)res->unlinks,
+	       (unsigned long long)res->unlinked);
+	printf("    latency us: p50 %llu p90 %llu p99 %llu p99.9 %llu "
+	       "max %llu\n",
+	       (unsigned long long)bench_percentile(res, 500),
+	       (unsigned long long)bench_percentile(res, 900),
+	       (unsigned long long)bench_percentile(res, 990),
+	       (unsigned long long)bench_percentile(res, 999),
+	       (unsigned long long)res->lat_max);
+}
+
+static int bench_run(void)
+{
+	struct bench_dev *devs;
+	struct bench_result *total;
+	int i, j, ret = -1;
+
+	devs = (struct bench_dev *)calloc(conf.num_devs, sizeof(*devs));
+	total = (struct bench_result *)calloc(1, sizeof(*total));
+	if (!devs || !total) {
+		err("alloc");
+		goto out;
+	}
+
+	for (i = 0; i < conf.num_devs; i++) {
+		devs[i].busid = conf.busids[i];
+		if (bench_open(devs + i) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < conf.num_devs; i++) {
+		if (pthread_create(&devs[i].thread, NULL, bench_loop,
+				   devs + i)) {
+			err("create thread");
+			for (j = 0; j < i; j++)
+				pthread_join(devs[j].thread, NULL);
+			goto out;
+		}
+	}
+
+	ret = 0;
+	for (i = 0; i < conf.num_devs; i++) {
+		pthread_join(devs[i].thread, NULL);
+		if (devs[i].failed)
+			ret = -1;
+	}
+
+	for (i = 0; i < conf.num_devs; i++) {
+		struct bench_result *res = &devs[i].res;
+
+		bench_print(devs[i].busid, res);
+
+		total->urbs += res->urbs;
+		total->bytes += res->bytes;
+		total->errors += res->errors;
+		total->unlinks += res->unlinks;
+		total->unlinked += res->unlinked;
+		if (res->elapsed > total->elapsed)
+			total->elapsed = res->elapsed;
+		if (res->lat_max > total->lat_max)
+			total->lat_max = res->lat_max;
+		for (j = 0; j < BENCH_LAT_BUCKETS; j++)
+			total->hist[j] += res->hist[j];
+	}
+	if (conf.num_devs > 1)
+		bench_print("total", total);
+
+out:
+	if (devs)
+		for (i = 0; i < conf.num_devs; i++)
+			bench_close(devs + i);
+	free(devs);
+	free(total);
+	return ret;
+}
+
+/* <nr>in or <nr>out, optionally followed by :<weight> */
+static int bench_parse_ep(const char *arg, struct bench_ep *ep)
+{
+	char *end;
+	unsigned long nr;
+
+	nr = strtoul(arg, &end, 0);
+	if (end == arg || nr > 15)
+		return -1;
+
+	if (!strncmp(end, "in", 2)) {
+		ep->in = 1;
+		end += 2;
+	} else if (!strncmp(end, "out", 3)) {
+		ep->in = 0;
+		end += 3;
+	} else {
+		return -1;
+	}
+
+	ep->nr = nr;
+	ep->weight = 1;
+	if (*end == ':') {
+		ep->weight = strtoul(end + 1, &end, 0);
+		if (!ep->weight)
+			return -1;
+	}
+
+	return *end ? -1 : 0;
+}
+
+static int bench_parse_size(const char *arg)
+{
+	char *end;
+
+	conf.size_min = strtoul(arg, &end, 0);
+	conf.size_max = conf.size_min;
+	if (*end == '-')
+		conf.size_max = strtoul(end + 1, &end, 0);
+
+	return (*end || conf.size_max < conf.size_min) ? -1 : 0;
+}
+
+int usbip_bench(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "remote", required_argument, NULL, 'r' },
+		{ "busid", required_argument, NULL, 'b' },
+		{ "endpoint", required_argument, NULL, 'e' },
+		{ "depth", required_argument, NULL, 'q' },
+		{ "size", required_argument, NULL, 's' },
+		{ "unlink", required_argument, NULL, 'u' },
+		{ "time", required_argument, NULL, 't' },
+		{ "parsable", no_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.depth = 8;
+	conf.size_min = conf.size_max = 16384;
+	conf.time = 10;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "r:b:e:q:s:u:t:p", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'r':
+			conf.host = optarg;
+			break;
+		case 'b':
+			if (conf.num_devs == BENCH_MAX_DEVS) {
+				err("up to %d devices", BENCH_MAX_DEVS);
+				return -1;
+			}
+			conf.busids[conf.num_devs++] = optarg;
+			break;
+		case 'e':
+			if (conf.num_eps == BENCH_MAX_EPS ||
+			    bench_parse_ep(optarg, conf.eps + conf.num_eps)) {
+				err("invalid endpoint %s", optarg);
+				return -1;
+			}
+			conf.num_eps++;
+			break;
+		case 'q':
+			conf.depth = atoi(optarg);
+			break;
+		case 's':
+			if (bench_parse_size(optarg)) {
+				err("invalid size %s", optarg);
+				return -1;
+			}
+			break;
+		case 'u':
+			conf.unlink = atoi(optarg);
+			break;
+		case 't':
+			conf.time = atoi(optarg);
+			break;
+		case 'p':
+			conf.parsable = 1;
+			break;
+		default:
+			goto err_out;
+		}
+	}
+
+	if (!conf.host || !conf.num_devs || conf.depth < 1 ||
+	    conf.depth > BENCH_MAX_DEPTH || !conf.size_max ||
+	    conf.unlink > 1000 || !conf.time)
+		goto err_out;
+
+	/* room for the configuration descriptor */
+	conf.buf_len = conf.size_max < 4096 ? 4096 : conf.size_max;
+
+	if (!conf.num_eps) {
+		conf.eps[0].nr = 1;
+		conf.eps[0].in = 1;
+		conf.eps[0].weight = 1;
+		conf.num_eps = 1;
+	}
+
+	return bench_run();
+
+err_out:
+	usbip_bench_usage();
+	return -1;
+}
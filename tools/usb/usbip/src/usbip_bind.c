@@ -31,7 +31,13 @@
 static const char usbip_bind_usage_string[] =
 	"usbip bind <args>\n"
 	"    -b, --busid=<busid>    Bind " USBIP_HOST_DRV_NAME ".ko to device "
-	"on <busid>\n";
+	"on <busid>\n"
+#ifndef USBIP_WITH_LIBUSB
+	"    -c, --cpu=<cpu>        CPU of the transfer threads, auto or any\n"
+	"    -f, --fifo=<prio>      Run them SCHED_FIFO at <prio>\n"
+	"    -n, --nice=<nice>      Run them SCHED_OTHER at <nice>\n"
+#endif
+	;
 
 void usbip_bind_usage(void)
 {
@@ -42,27 +48,60 @@ int usbip_bind(int argc, char *argv[])
 {
 	static const struct option opts[] = {
 		{ "busid", required_argument, NULL, 'b' },
+#ifndef USBIP_WITH_LIBUSB
+		{ "cpu",   required_argument, NULL, 'c' },
+		{ "fifo",  required_argument, NULL, 'f' },
+		{ "nice",  required_argument, NULL, 'n' },
+#endif
 		{ NULL,    0,                 NULL,  0  }
 	};
-
+#ifndef USBIP_WITH_LIBUSB
+	struct usbip_sched sched;
+	char buf[32];
+#endif
+	char *busid = NULL;
 	int opt;
 	int ret = -1;
 
+#ifndef USBIP_WITH_LIBUSB
+	memset(&sched, 0, sizeof(sched));
+#endif
+
 	for (;;) {
-		opt = getopt_long(argc, argv, "b:", opts, NULL);
+		opt = getopt_long(argc, argv, "b:c:f:n:", opts, NULL);
 
 		if (opt == -1)
 			break;
 
 		switch (opt) {
 		case 'b':
-			ret = usbip_bind_device(optarg);
-			goto out;
+			busid = optarg;
+			break;
+#ifndef USBIP_WITH_LIBUSB
+		case 'c':
+		case 'f':
+		case 'n':
+			if (usbip_sched_parse(&sched, opt, optarg) < 0)
+				goto err_out;
+			break;
+#endif
 		default:
 			goto err_out;
 		}
 	}
 
+	if (!busid)
+		goto err_out;
+
+	ret = usbip_bind_device(busid);
+#ifndef USBIP_WITH_LIBUSB
+	if (!ret && sched.set) {
+		usbip_sched_string(&sched, buf, sizeof(buf));
+		ret = usbip_set_sched(busid, buf);
+	}
+#endif
+	goto out;
+
 err_out:
 	usbip_bind_usage();
 out:
@@ -30,6 +30,7 @@
 #include <netinet/tcp.h>
 #endif
 
+#include <errno.h>
 #include <string.h>
 
 #ifdef HAVE_LIBWRAP
@@ -37,6 +38,9 @@
 #endif
 
 #include "usbip_common.h"
+#include "usbip_capture.h"
+#include "usbip_tls.h"
+#include "usbip_wan.h"
 #include "usbip_network.h"
 
 int usbip_port = 3240;
@@ -135,11 +139,19 @@ static ssize_t usbip_net_xmit(struct usbip_sock *sock, void *buff,
 		}
 
 		if (nbytes <= 0) {
-			if (!sending && nbytes == 0)
+			if (!sending && nbytes == 0) {
 				dbg("received zero - broken connection?");
+				errno = ECONNRESET;
+			}
+			/* a reply cut short is malformed, not refused */
+			if (!sending && total > 0)
+				errno = EPROTO;
 			return -1;
 		}
 
+		usbip_capture(sock, sending ? USBIP_CAPTURE_SENT : 0, buff,
+			      nbytes);
+
 		buff	 = (void *)((intptr_t) buff + nbytes);
 		bufflen	-= nbytes;
 		total	+= nbytes;
@@ -205,7 +217,13 @@ static const char *op_common_strerror(uint32_t status)
 	return "unknown error";
 }
 
-int usbip_net_recv_op_common(struct usbip_sock *sock, uint16_t *code)
+/*
+ * Receives an op_common of our version and gives its code and status as
+ * they are. Fails only when the connection or the peer is broken, with
+ * -ECONNRESET if the peer closed or reset it before sending any byte.
+ */
+int usbip_net_recv_op_reply(struct usbip_sock *sock, uint16_t *code,
+			    uint32_t *status)
 {
 	struct op_common op_common;
 	int rc;
@@ -214,8 +232,9 @@ int usbip_net_recv_op_common(struct usbip_sock *sock, uint16_t *code)
 
 	rc = usbip_net_recv(sock, &op_common, sizeof(op_common));
 	if (rc < 0) {
+		rc = errno == ECONNRESET ? -ECONNRESET : -1;
 		dbg("usbip_net_recv failed: %d", rc);
-		goto err;
+		return rc;
 	}
 
 	PACK_OP_COMMON(0, &op_common);
@@ -223,27 +242,40 @@ int usbip_net_recv_op_common(struct usbip_sock *sock, uint16_t *code)
 	if (op_common.version != USBIP_VERSION) {
 		dbg("version mismatch: %d %d", op_common.version,
 		    USBIP_VERSION);
-		goto err;
+		return -1;
 	}
 
+	*code = op_common.code;
+	*status = op_common.status;
+
+	return 0;
+}
+
+int usbip_net_recv_op_common(struct usbip_sock *sock, uint16_t *code)
+{
+	uint16_t rcode;
+	uint32_t status;
+
+	if (usbip_net_recv_op_reply(sock, &rcode, &status) < 0)
+		goto err;
+
 	switch (*code) {
 	case OP_UNSPEC:
 		break;
 	default:
-		if (op_common.code != *code) {
-			dbg("unexpected pdu %#0x for %#0x", op_common.code,
-			    *code);
+		if (rcode != *code) {
+			dbg("unexpected pdu %#0x for %#0x", rcode, *code);
 			goto err;
 		}
 	}
 
-	if (op_common.status != ST_OK) {
+	if (status != ST_OK) {
 		dbg("request failed at peer: %s",
-			op_common_strerror(op_common.status));
+			op_common_strerror(status));
 		goto err;
 	}
 
-	*code = op_common.code;
+	*code = rcode;
 
 	return 0;
 err:
@@ -300,6 +332,45 @@ int usbip_net_set_v6only(int sockfd)
 }
 
 #ifndef USBIP_AS_LIBRARY
+/*
+ * With usbip_tls_setup(), a connection starts with OP_REQ_CRYPKEY, answered
+ * by OP_REP_CRYPKEY before the TLS handshake. The request follows over the
+ * socket the kernel encrypts, which is then handed to the driver.
+ */
+static int net_tcp_starttls(int sockfd, const char *hostname)
+{
+	struct usbip_sock sock;
+	uint16_t code = OP_REP_CRYPKEY;
+
+	usbip_sock_init(&sock, sockfd, NULL, NULL, NULL, NULL);
+
+	if (usbip_net_send_op_common(&sock, OP_REQ_CRYPKEY, 0) < 0 ||
+	    usbip_net_recv_op_common(&sock, &code) < 0) {
+		err("tls refused by %s", hostname);
+		return -1;
+	}
+
+	return usbip_tls_connect(sockfd, hostname);
+}
+
+int usbip_net_tls_accept(int sockfd)
+{
+	struct usbip_sock sock;
+	uint16_t code = OP_REQ_CRYPKEY;
+
+	usbip_sock_init(&sock, sockfd, NULL, NULL, NULL, NULL);
+
+	if (usbip_net_recv_op_common(&sock, &code) < 0) {
+		err("request without tls refused");
+		return -1;
+	}
+
+	if (usbip_net_send_op_common(&sock, OP_REP_CRYPKEY, ST_OK) < 0)
+		return -1;
+
+	return usbip_tls_accept(sockfd);
+}
+
 /*
  * IPv6 Ready
  */
@@ -308,7 +379,7 @@ static struct usbip_sock *net_tcp_open(const char *hostname,
 				       void *opt UNUSED)
 {
 	struct addrinfo hints, *res, *rp;
-	int sockfd;
+	int sockfd, wanfd;
 	struct usbip_sock *sock;
 	int ret;
 
@@ -349,6 +420,15 @@ static struct usbip_sock *net_tcp_open(const char *hostname,
 	if (!rp)
 		goto err_stop;
 
+	/* on the TCP socket, the emulated network relays the plaintext */
+	if (usbip_tls_enabled() && net_tcp_starttls(sockfd, hostname))
+		goto err_close;
+
+	wanfd = usbip_wan_wrap(sockfd);
+	if (wanfd < 0)
+		goto err_close;
+	sockfd = wanfd;
+
 	sock = (struct usbip_sock *)malloc(sizeof(struct usbip_sock));
 	if (!sock) {
 		dbg("Fail to malloc usbip_sock");
@@ -95,6 +95,39 @@ struct op_import_reply {
 	usbip_net_pack_usb_device(pack, &(reply)->udev);\
 } while (0)
 
+/* ---------------------------------------------------------------------- */
+/*
+ * Import a remote USB device, agreeing on protocol extensions.
+ * The request carries the extensions the client can handle. The reply
+ * carries the subset the server has enabled for the connection.
+ * Servers not knowing this code reply ST_NA, or close the connection
+ * without replying; the client then retries with OP_REQ_IMPORT.
+ */
+#define OP_IMPORT_EXT		0x08
+#define OP_REQ_IMPORT_EXT	(OP_REQUEST | OP_IMPORT_EXT)
+#define OP_REP_IMPORT_EXT	(OP_REPLY   | OP_IMPORT_EXT)
+
+PACK(
+struct op_import_ext_request {
+	char busid[SYSFS_BUS_ID_SIZE];
+	uint32_t features;
+});
+
+PACK(
+struct op_import_ext_reply {
+	struct usbip_usb_device udev;
+	uint32_t features;
+});
+
+#define PACK_OP_IMPORT_EXT_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->features);\
+} while (0)
+
+#define PACK_OP_IMPORT_EXT_REPLY(pack, reply)  do {\
+	usbip_net_pack_usb_device(pack, &(reply)->udev);\
+	usbip_net_pack_uint32_t(pack, &(reply)->features);\
+} while (0)
+
 /* ---------------------------------------------------------------------- */
 /* Export a USB device to a remote host. */
 #define OP_EXPORT	0x06
@@ -144,7 +177,10 @@ struct op_unexport_reply {
 } while (0)
 
 /* ---------------------------------------------------------------------- */
-/* Negotiate IPSec encryption key. (still not used) */
+/*
+ * Start TLS on the connection, see usbip_tls.c. Only op_common is sent both
+ * ways, the key structures below of the former IPSec plan are not used.
+ */
 #define OP_CRYPKEY	0x04
 #define OP_REQ_CRYPKEY	(OP_REQUEST | OP_CRYPKEY)
 #define OP_REP_CRYPKEY	(OP_REPLY   | OP_CRYPKEY)
@@ -201,12 +237,15 @@ ssize_t usbip_net_recv(struct usbip_sock *sock, void *buff, size_t bufflen);
 ssize_t usbip_net_send(struct usbip_sock *sock, void *buff, size_t bufflen);
 int usbip_net_send_op_common(struct usbip_sock *sock, uint32_t code,
 			     uint32_t status);
+int usbip_net_recv_op_reply(struct usbip_sock *sock, uint16_t *code,
+			    uint32_t *status);
 int usbip_net_recv_op_common(struct usbip_sock *sock, uint16_t *code);
 int usbip_net_set_reuseaddr(int sockfd);
 int usbip_net_set_nodelay(int sockfd);
 int usbip_net_set_keepalive(int sockfd);
 int usbip_net_set_v6only(int sockfd);
 void usbip_net_tcp_conn_init(void);
+int usbip_net_tls_accept(int sockfd);
 const char *usbip_net_gai_strerror(int errcode);
 
 #endif /* __USBIP_NETWORK_H */
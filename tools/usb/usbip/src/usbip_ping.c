@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "vhci_driver.h"
+#include "usbip_common.h"
+#include "usbip.h"
+
+static const char usbip_ping_usage_string[] =
+	"usbip ping <args>\n"
+	"    -p, --port=<port>    " USBIP_VHCI_DRV_NAME
+	" port the device is on\n"
+	"    -c, --count=<count>  stop after count lines\n";
+
+void usbip_ping_usage(void)
+{
+	printf("usage: %s", usbip_ping_usage_string);
+}
+
+static int ping_port(int port, int count)
+{
+	struct usbip_vhci_rtt rtt;
+	int i;
+
+	if (usbip_vhci_driver_open() < 0) {
+		err("open vhci_driver");
+		return -1;
+	}
+
+	for (i = 0; !count || i < count; i++) {
+		if (i)
+			sleep(1);
+
+		if (usbip_vhci_get_rtt(port, &rtt)) {
+			err("port %d is not in use or has no heartbeat", port);
+			usbip_vhci_driver_close();
+			return -1;
+		}
+
+		if (!rtt.srtt) {
+			printf("port %d: no answer yet, misses %u\n",
+			       port, rtt.misses);
+			continue;
+		}
+
+		printf("port %d: time %lld.%03lld ms srtt %lld.%03lld ms "
+		       "rttvar %lld.%03lld ms misses %u\n", port,
+		       rtt.last / 1000, rtt.last % 1000,
+		       rtt.srtt / 1000, rtt.srtt % 1000,
+		       rtt.rttvar / 1000, rtt.rttvar % 1000, rtt.misses);
+		fflush(stdout);
+	}
+
+	usbip_vhci_driver_close();
+
+	return 0;
+}
+
+int usbip_ping(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "port", required_argument, NULL, 'p' },
+		{ "count", required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *port = NULL;
+	int count = 0;
+	unsigned int i;
+	int opt;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "p:c:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		default:
+			goto err_out;
+		}
+	}
+
+	if (!port || !*port || count < 0)
+		goto err_out;
+
+	for (i = 0; i < strlen(port); i++)
+		if (!isdigit(port[i])) {
+			err("invalid port %s", port);
+			return -1;
+		}
+
+	return ping_port(atoi(port), count);
+
+err_out:
+	usbip_ping_usage();
+	return -1;
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2015-2016 Nobuo Iwata <nobuo.iwata@fujixerox.co.jp>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replay of a connection captured with --capture to a server.
+ *
+ * The side which sent the first bytes of the connection is the client, what
+ * it sent is sent again to the server, as fast as possible or at the
+ * captured times. What the server answers is received and counted by
+ * another thread, until as much as in the capture came back or the server
+ * is quiet for a while. The import in the capture is replayed as it is, so
+ * the busid must be exported by the server.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "usbip_common.h"
+#include "usbip_capture.h"
+#include "usbip_network.h"
+#include "usbip.h"
+
+static const char usbip_replay_usage_string[] =
+	"usbip replay <args>\n"
+	"    -i, --input=<file>       Capture written with --capture\n"
+	"    -l, --list               List the connections in <file>\n"
+	"    -r, --remote=<host>      The server to replay to\n"
+	"    -c, --conn=<conn>        Connection to replay, the first one by\n"
+	"                             default\n"
+	"    -R, --realtime           Keep the captured times rather than\n"
+	"                             sending as fast as possible\n";
+
+void usbip_replay_usage(void)
+{
+	printf("usage: %s", usbip_replay_usage_string);
+}
+
+#define REPLAY_MAX_CONNS	64
+#define REPLAY_IDLE		2 /* sec */
+#define REPLAY_BUF		65536
+
+struct replay_conn {
+	uint32_t conn;
+	/* USBIP_CAPTURE_SENT or 0, of the first record */
+	uint32_t client;
+	uint64_t records[2];
+	uint64_t bytes[2];
+	uint64_t first, last;
+};
+
+struct replay_drain {
+	struct usbip_sock *sock;
+	uint64_t expected;
+	uint64_t received;
+	uint64_t last;
+};
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int replay_scan(FILE *fp, struct replay_conn *conns)
+{
+	struct usbip_capture_record rec;
+	struct replay_conn *c;
+	int i, n = 0, ret;
+
+	while (!(ret = usbip_capture_read_record(fp, &rec))) {
+		for (i = 0; i < n; i++)
+			if (conns[i].conn == rec.conn)
+				break;
+		c = conns + i;
+		if (i == n) {
+			if (n == REPLAY_MAX_CONNS) {
+				err("more than %d connections",
+				    REPLAY_MAX_CONNS);
+				return -1;
+			}
+			memset(c, 0, sizeof(*c));
+			c->conn = rec.conn;
+			c->client = rec.flags & USBIP_CAPTURE_SENT;
+			c->first = rec.stamp;
+			n++;
+		}
+		i = (rec.flags & USBIP_CAPTURE_SENT) == c->client ? 0 : 1;
+		c->records[i]++;
+		c->bytes[i] += rec.len;
+		c->last = rec.stamp;
+
+		if (fseek(fp, rec.len, SEEK_CUR)) {
+			err("truncated capture");
+			return -1;
+		}
+	}
+	if (ret < 0) {
+		err("read capture");
+		return -1;
+	}
+
+	return n;
+}
+
+static void replay_list(struct replay_conn *conns, int n)
+{
+	int i;
+
+	printf("conn  captured by  to server            from server"
+	       "          msec\n");
+	for (i = 0; i < n; i++)
+		printf("%4u  %-11s  %6llu %12llu  %6llu %12llu  %8llu\n",
+		       conns[i].conn, conns[i].client ? "client" : "server",
+		       (unsigned long long)conns[i].records[0],
+		       (unsigned long long)conns[i].bytes[0],
+		       (unsigned long long)conns[i].records[1],
+		       (unsigned long long)conns[i].bytes[1],
+		       (unsigned long long)(conns[i].last - conns[i].first) /
+		       1000000);
+}
+
+static void *replay_drain(void *arg)
+{
+	struct replay_drain *d = (struct replay_drain *)arg;
+	struct timeval tv = { REPLAY_IDLE, 0 };
+	char buf[REPLAY_BUF];
+	ssize_t received;
+
+	setsockopt(d->sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (d->received < d->expected) {
+		if (d->sock->recv)
+			received = d->sock->recv(d->sock->arg, buf,
+						 sizeof(buf), 0);
+		else
+			received = recv(d->sock->fd, buf, sizeof(buf), 0);
+		if (received <= 0)
+			break;
+		d->received += received;
+		d->last = replay_now();
+	}
+
+	return NULL;
+}
+
+static void replay_sleep_until(uint64_t t)
+{
+	struct timespec ts;
+	uint64_t now = replay_now();
+
+	if (t <= now)
+		return;
+
+	ts.tv_sec = (t - now) / 1000000000;
+	ts.tv_nsec = (t - now) % 1000000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static int replay_send(FILE *fp, struct replay_conn *c,
+		       struct usbip_sock *sock, int realtime,
+		       uint64_t *sent)
+{
+	struct usbip_capture_record rec;
+	char *buf;
+	uint64_t start = replay_now();
+	int ret;
+
+	buf = (char *)malloc(REPLAY_BUF);
+	if (!buf) {
+		err("alloc");
+		return -1;
+	}
+
+	while (!(ret = usbip_capture_read_record(fp, &rec))) {
+		if (rec.conn != c->conn ||
+		    (rec.flags & USBIP_CAPTURE_SENT) != c->client) {
+			if (fseek(fp, rec.len, SEEK_CUR))
+				break;
+			continue;
+		}
+
+		if (rec.len > REPLAY_BUF) {
+			char *p = (char *)realloc(buf, rec.len);
+
+			if (!p) {
+				err("alloc");
+				break;
+			}
+			buf = p;
+		}
+		if (fread(buf, rec.len, 1, fp) != 1) {
+			err("truncated capture");
+			break;
+		}
+
+		if (realtime)
+			replay_sleep_until(start + rec.stamp - c->first);
+
+		if (usbip_net_send(sock, buf, rec.len) < 0) {
+			err("send to server");
+			break;
+		}
+		*sent += rec.len;
+	}
+
+	free(buf);
+	return ret > 0 ? 0 : -1;
+}
+
+static int replay_conn(FILE *fp, struct replay_conn *c, const char *host,
+		       int realtime)
+{
+	struct replay_drain drain;
+	struct usbip_sock *sock;
+	pthread_t thread;
+	uint64_t start, end, sent = 0;
+	double sec;
+	int ret;
+
+	sock = usbip_conn_open(host, usbip_port_string);
+	if (!sock) {
+		err("tcp connect");
+		return -1;
+	}
+
+	memset(&drain, 0, sizeof(drain));
+	drain.sock = sock;
+	drain.expected = c->bytes[1];
+
+	start = replay_now();
+	drain.last = start;
+
+	if (pthread_create(&thread, NULL, replay_drain, &drain)) {
+		err("create thread");
+		usbip_conn_close(sock);
+		return -1;
+	}
+
+	ret = replay_send(fp, c, sock, realtime, &sent);
+	end = replay_now();
+
+	pthread_join(thread, NULL);
+	usbip_conn_close(sock);
+
+	if (drain.last > end)
+		end = drain.last;
+	sec = (end - start) / 1e9;
+
+	printf("conn %u: sent %llu of %llu bytes, received %llu of %llu "
+	       "bytes in %.3f s (captured %.3f s), %.2f MB/s\n", c->conn,
+	       (unsigned long long)sent, (unsigned long long)c->bytes[0],
+	       (unsigned long long)drain.received,
+	       (unsigned long long)c->bytes[1], sec,
+	       (c->last - c->first) / 1e9,
+	       sec > 0 ? (sent + drain.received) / sec / 1e6 : 0);
+
+	if (drain.received < drain.expected)
+		info("the server answered less than in the capture");
+
+	return ret;
+}
+
+int usbip_replay(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "input", required_argument, NULL, 'i' },
+		{ "list", no_argument, NULL, 'l' },
+		{ "remote", required_argument, NULL, 'r' },
+		{ "conn", required_argument, NULL, 'c' },
+		{ "realtime", no_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct replay_conn *conns = NULL, *c;
+	const char *input = NULL, *host = NULL;
+	long conn = -1;
+	int list = 0, realtime = 0;
+	int opt, n, i, ret = -1;
+	FILE *fp = NULL;
+	long data;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "i:lr:c:R", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'r':
+			host = optarg;
+			break;
+		case 'c':
+			conn = atol(optarg);
+			break;
+		case 'R':
+			realtime = 1;
+			break;
+		default:
+			goto err_out;
+		}
+	}
+
+	if (!input || (!list && !host))
+		goto err_out;
+
+	fp = fopen(input, "rb");
+	if (!fp) {
+		err("open %s", input);
+		return -1;
+	}
+	if (usbip_capture_read_header(fp)) {
+		err("%s is not a capture", input);
+		goto out;
+	}
+	data = ftell(fp);
+
+	conns = (struct replay_conn *)calloc(REPLAY_MAX_CONNS,
+					     sizeof(*conns));
+	if (!conns) {
+		err("alloc");
+		goto out;
+	}
+
+	n = replay_scan(fp, conns);
+	if (n < 0)
+		goto out;
+
+	if (list) {
+		replay_list(conns, n);
+		ret = 0;
+		goto out;
+	}
+
+	c = NULL;
+	for (i = 0; i < n; i++) {
+		if (conn < 0 || conns[i].conn == conn) {
+			c = conns + i;
+			break;
+		}
+	}
+	if (!c) {
+		err("no connection %ld in %s", conn, input);
+		goto out;
+	}
+
+	if (fseek(fp, data, SEEK_SET)) {
+		err("seek %s", input);
+		goto out;
+	}
+
+	ret = replay_conn(fp, c, host, realtime);
+out:
+	free(conns);
+	fclose(fp);
+	return ret;
+
+err_out:
+	usbip_replay_usage();
+	return -1;
+}
@@ -55,6 +55,9 @@
 #endif
 
 #include "usbip_common.h"
+#include "usbip_capture.h"
+#include "usbip_tls.h"
+#include "usbip_wan.h"
 #include "usbip_network.h"
 #include "usbipd.h"
 #include "list.h"
@@ -99,6 +102,17 @@ static const char usbipd_help_string[] =
 	"	-tPORT, --tcp-port PORT\n"
 	"		Listen on TCP/IP port PORT.\n"
 	"\n"
+	"	-cFILE, --capture FILE\n"
+	"		Write the traffic of connections to FILE.PID.\n"
+	"\n"
+	"	-wSPEC, --wan SPEC\n"
+	"		Emulate a wide area network on connections,\n"
+	"		e.g. rtt=50,jitter=2,rate=100000,loss=0.1\n"
+	"\n"
+	"	-sSPEC, --tls SPEC\n"
+	"		Accept only connections encrypted by kernel TLS,\n"
+	"		e.g. cert=server.pem,key=server.key[,ca=clients.pem]\n"
+	"\n"
 	"	-h, --help\n"
 	"		Print this help.\n"
 	"\n"
@@ -139,6 +153,12 @@ static int __recv_pdu(struct usbip_sock *sock,
 	}
 
 	info("received request: %#0x(%d)", code, sock->fd);
+	if (code == OP_REQ_CRYPKEY) {
+		/* with --tls, it was taken before, see process_request() */
+		err("tls is not enabled");
+		usbip_net_send_op_common(sock, OP_REP_CRYPKEY, ST_NA);
+		return -1;
+	}
 	for (op = usbipd_recv_pdu_ops; op->code != OP_UNSPEC; op++) {
 		if (op->code == code) {
 			if (op->proc)
@@ -155,6 +175,10 @@ static int __recv_pdu(struct usbip_sock *sock,
 		err("received an unknown opcode: %#0x", code);
 		ret = -1;
 	}
+	if (op->code == OP_UNSPEC || !op->proc) {
+		/* tells a newer client to fall back, e.g. to OP_REQ_IMPORT */
+		usbip_net_send_op_common(sock, code & ~OP_REQUEST, ST_NA);
+	}
 
 	if (ret == 0)
 		info("request %#0x(%d): complete", code, sock->fd);
@@ -243,10 +267,18 @@ static void *__process_request(void *arg)
 {
 	struct request_data *data = (struct request_data *)arg;
 	struct usbip_sock sock;
+	int connfd;
 
-	usbip_sock_init(&sock, data->connfd, NULL, NULL, NULL, NULL);
-	usbipd_recv_pdu(&sock, data->host, data->port);
-	socket_close(data->connfd);
+	connfd = -1;
+	if (!usbip_tls_enabled() || !usbip_net_tls_accept(data->connfd))
+		connfd = usbip_wan_wrap(data->connfd);
+	if (connfd >= 0) {
+		usbip_sock_init(&sock, connfd, NULL, NULL, NULL, NULL);
+		usbipd_recv_pdu(&sock, data->host, data->port);
+		socket_close(connfd);
+	} else {
+		socket_close(data->connfd);
+	}
 	free(data);
 	pthread_exit();
 }
@@ -276,16 +308,27 @@ int process_request(int listenfd)
 int process_request(int listenfd)
 {
 	pid_t childpid;
-	int connfd;
+	int connfd, wanfd;
 	struct usbip_sock sock;
 	char host[NI_MAXHOST], port[NI_MAXSERV];
 
 	connfd = do_accept(listenfd, host, NI_MAXHOST, port, NI_MAXSERV);
 	if (connfd < 0)
 		return -1;
+	usbip_capture_flush();
 	childpid = fork();
 	if (childpid == 0) {
 		socket_close(listenfd);
+		if (usbip_tls_enabled() && usbip_net_tls_accept(connfd)) {
+			socket_close(connfd);
+			exit(1);
+		}
+		wanfd = usbip_wan_wrap(connfd);
+		if (wanfd < 0) {
+			socket_close(connfd);
+			exit(1);
+		}
+		connfd = wanfd;
 		usbip_sock_init(&sock, connfd, NULL, NULL, NULL, NULL);
 		usbipd_recv_pdu(&sock, host, port);
 		socket_close(connfd);
@@ -548,6 +591,9 @@ int main(int argc, char *argv[])
 #endif
 		{ "pid",      optional_argument, NULL, 'P' },
 		{ "tcp-port", required_argument, NULL, 't' },
+		{ "capture",  required_argument, NULL, 'c' },
+		{ "wan",      required_argument, NULL, 'w' },
+		{ "tls",      required_argument, NULL, 's' },
 		{ "help",     no_argument,       NULL, 'h' },
 		{ "version",  no_argument,       NULL, 'v' },
 		{ NULL,	      0,                 NULL,  0  }
@@ -559,6 +605,7 @@ int main(int argc, char *argv[])
 		cmd_version
 	} cmd;
 
+	const char *capture = NULL;
 	int daemonize = 0;
 	int ipv4 = 0, ipv6 = 0;
 	int opt, rc = -1;
@@ -583,7 +630,7 @@ int main(int argc, char *argv[])
 #ifndef USBIP_DAEMON_APP
 				  "e"
 #endif
-				  "P::t:hv", longopts, NULL);
+				  "P::t:c:w:s:hv", longopts, NULL);
 
 		if (opt == -1)
 			break;
@@ -615,6 +662,17 @@ int main(int argc, char *argv[])
 		case 't':
 			usbip_setup_port_number(optarg);
 			break;
+		case 'c':
+			capture = optarg;
+			break;
+		case 'w':
+			if (usbip_wan_setup(optarg))
+				goto err_out;
+			break;
+		case 's':
+			if (usbip_tls_setup(optarg, 1))
+				goto err_out;
+			break;
 		case 'v':
 			cmd = cmd_version;
 			break;
@@ -635,8 +693,11 @@ int main(int argc, char *argv[])
 
 	switch (cmd) {
 	case cmd_standalone_mode:
+		if (capture && usbip_capture_open(capture))
+			break;
 		rc = do_standalone_mode(daemonize, ipv4, ipv6);
 		remove_pid_file();
+		usbip_capture_close();
 		break;
 	case cmd_version:
 		printf("%s (%s)\n", usbip_progname, usbip_version_string);
@@ -67,7 +67,7 @@ static int import_device(struct usbip_sock *sock,
 	dump_usb_device(udev);
 
 	do {
-		port_nr = usbip_vhci_get_free_port();
+		port_nr = usbip_vhci_get_free_port(udev->speed);
 		if (port_nr < 0) {
 			err("no free port");
 			*status = ST_NO_FREE_PORT;
@@ -75,7 +75,8 @@ static int import_device(struct usbip_sock *sock,
 		}
 
 		rc = usbip_vhci_attach_device(port_nr, sock->fd, udev->busnum,
-					      udev->devnum, udev->speed);
+					      udev->devnum, udev->speed,
+					      sock->features);
 		if (rc < 0 && errno != EBUSY) {
 			err("import device");
 			*status = ST_NA;
@@ -56,60 +56,48 @@ struct usbipd_driver_ops usbipd_driver_ops = {
 	driver_close,
 };
 
-static int recv_request_import(struct usbip_sock *sock,
-			       const char *host, const char *port)
+static int export_device(struct usbip_sock *sock, const char *busid,
+			 uint32_t features, int ext)
 {
 	struct usbip_exported_devices edevs;
 	struct usbip_exported_device *edev;
-	struct op_import_request req;
 	struct usbip_usb_device pdu_udev;
+	uint16_t code = ext ? OP_REP_IMPORT_EXT : OP_REP_IMPORT;
 	int found = 0;
 	int error = 0;
 	int rc;
 
-	(void)host;
-	(void)port;
-
 	rc = usbip_refresh_device_list(&edevs);
 	if (rc < 0) {
 		dbg("could not refresh device list: %d", rc);
 		goto err_out;
 	}
 
-	memset(&req, 0, sizeof(req));
-
-	rc = usbip_net_recv(sock, &req, sizeof(req));
-	if (rc < 0) {
-		dbg("usbip_net_recv failed: import request");
-		goto err_free_edevs;
-	}
-	PACK_OP_IMPORT_REQUEST(0, &req);
-
-	edev = usbip_get_device(&edevs, req.busid);
+	edev = usbip_get_device(&edevs, busid);
 	if (edev) {
-		info("found requested device: %s", req.busid);
+		info("found requested device: %s", busid);
 		found = 1;
 	}
 
 	if (found) {
 		/* export device needs a TCP/IP socket descriptor */
+		sock->features = features & usbip_hdriver->features;
 		rc = usbip_export_device(edev, sock);
 		if (rc < 0)
 			error = 1;
 	} else {
-		info("requested device not found: %s", req.busid);
+		info("requested device not found: %s", busid);
 		error = 1;
 	}
 
-	rc = usbip_net_send_op_common(sock, OP_REP_IMPORT,
-				      (!error ? ST_OK : ST_NA));
+	rc = usbip_net_send_op_common(sock, code, (!error ? ST_OK : ST_NA));
 	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
+		dbg("usbip_net_send_op_common failed: %#0x", code);
 		goto err_free_edevs;
 	}
 
 	if (error) {
-		dbg("import request busid %s: failed", req.busid);
+		dbg("import request busid %s: failed", busid);
 		goto err_free_edevs;
 	}
 
@@ -122,7 +110,19 @@ static int recv_request_import(struct usbip_sock *sock,
 		goto err_free_edevs;
 	}
 
-	dbg("import request busid %s: complete", req.busid);
+	if (ext) {
+		uint32_t pdu_features = sock->features;
+
+		usbip_net_pack_uint32_t(1, &pdu_features);
+		rc = usbip_net_send(sock, &pdu_features,
+				    sizeof(pdu_features));
+		if (rc < 0) {
+			dbg("usbip_net_send failed: features");
+			goto err_free_edevs;
+		}
+	}
+
+	dbg("import request busid %s: complete", busid);
 
 	rc = usbip_try_transfer(edev, sock);
 	if (rc < 0) {
@@ -139,6 +139,51 @@ err_out:
 	return -1;
 }
 
+static int recv_request_import(struct usbip_sock *sock,
+			       const char *host, const char *port)
+{
+	struct op_import_request req;
+	int rc;
+
+	(void)host;
+	(void)port;
+
+	memset(&req, 0, sizeof(req));
+
+	rc = usbip_net_recv(sock, &req, sizeof(req));
+	if (rc < 0) {
+		dbg("usbip_net_recv failed: import request");
+		return -1;
+	}
+	PACK_OP_IMPORT_REQUEST(0, &req);
+
+	return export_device(sock, req.busid, 0, 0);
+}
+
+static int recv_request_import_ext(struct usbip_sock *sock,
+				   const char *host, const char *port)
+{
+	struct op_import_ext_request req;
+	int rc;
+
+	(void)host;
+	(void)port;
+
+	memset(&req, 0, sizeof(req));
+
+	rc = usbip_net_recv(sock, &req, sizeof(req));
+	if (rc < 0) {
+		dbg("usbip_net_recv failed: import_ext request");
+		return -1;
+	}
+	PACK_OP_IMPORT_EXT_REQUEST(0, &req);
+
+	dbg("import_ext request busid %s features %x",
+	    req.busid, req.features);
+
+	return export_device(sock, req.busid, req.features, 1);
+}
+
 static int send_reply_devlist(struct usbip_sock *sock)
 {
 	struct usbip_exported_devices edevs;
@@ -226,6 +271,7 @@ static int recv_request_devlist(struct usbip_sock *sock,
 struct usbipd_recv_pdu_op usbipd_recv_pdu_ops[] = {
 	{OP_REQ_DEVLIST, recv_request_devlist},
 	{OP_REQ_IMPORT, recv_request_import},
+	{OP_REQ_IMPORT_EXT, recv_request_import_ext},
 	{OP_REQ_DEVINFO, NULL},
 	{OP_REQ_CRYPKEY, NULL},
 	{OP_UNSPEC, NULL}